@@ -221,10 +221,14 @@ def rename_cpp_cu(cpp_files):
 def get_extensions():
     extensions_dir = os.path.join("xformers", "csrc")
 
-    sources = glob.glob(os.path.join(extensions_dir, "attention", "*.cpp"), recursive=False)
+    sources = glob.glob(os.path.join(extensions_dir, "*.cpp"), recursive=False)
+    sources += glob.glob(os.path.join(extensions_dir, "attention", "*.cpp"), recursive=False)
     sources += glob.glob(os.path.join(extensions_dir, "attention", "autograd", "**", "*.cpp"), recursive=True)
     sources += glob.glob(os.path.join(extensions_dir, "attention", "cpu", "**", "*.cpp"), recursive=True)
+    sources += glob.glob(os.path.join(extensions_dir, "distributed", "**", "*.cpp"), recursive=True)
+    sources += glob.glob(os.path.join(extensions_dir, "fused", "**", "*.cpp"), recursive=True)
     sources += glob.glob(os.path.join(extensions_dir, "indexing", "**", "*.cpp"), recursive=True)
+    sources += glob.glob(os.path.join(extensions_dir, "moe", "**", "*.cpp"), recursive=True)
     sources += glob.glob(os.path.join(extensions_dir, "swiglu", "**", "*.cpp"), recursive=True)
     
     ## avoid the temporary .cu file under xformers/csrc/attention/hip_fmha are included
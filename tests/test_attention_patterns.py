@@ -16,6 +16,7 @@ from xformers.components.attention.sparsity_config import (
     FixedSparsityConfig,
     VariableSparsityConfig,
 )
+from xformers.sparse.utils import _nonzero_mask_to_sparse_csr_indices
 
 
 # baseline implementations
@@ -178,6 +179,65 @@ def test_dilated_2d_pattern(H, W, k):
             assert torch.all(~d[h, w][ii::k, jj::k])
 
 
+def _assert_csr_equal(csr, mask):
+    _, row_offsets, column_indices = _nonzero_mask_to_sparse_csr_indices(
+        mask, mask.device
+    )
+    assert torch.equal(csr[0], row_offsets)
+    assert torch.equal(csr[1], column_indices)
+
+
+@pytest.mark.skipif(
+    not AP.LocalNdPatternCSROp.is_available(), reason="requires xformers C++ ops"
+)
+@pytest.mark.parametrize("p", [0, 1, 2, 2.5, float("inf")])
+@pytest.mark.parametrize("distance", [1, 2, 3.5])
+@pytest.mark.parametrize("sizes", [(37,), (8, 15), (4, 5, 6)])
+def test_local_nd_pattern_csr(sizes, distance, p):
+    _assert_csr_equal(
+        AP.local_nd_pattern_csr(*sizes, distance=distance, p=p),
+        AP.local_nd_pattern(*sizes, distance=distance, p=p),
+    )
+    _assert_csr_equal(AP.axial_nd_pattern_csr(*sizes), AP.axial_nd_pattern(*sizes))
+
+
+@pytest.mark.skipif(
+    not AP.SwinPatternCSROp.is_available(), reason="requires xformers C++ ops"
+)
+def test_pattern_csr():
+    _assert_csr_equal(AP.local_1d_pattern_csr(33, 5), AP.local_1d_pattern(33, 5))
+    _assert_csr_equal(AP.causal_1d_pattern_csr(33), AP.causal_1d_pattern(33))
+    _assert_csr_equal(
+        AP.dilated_2d_pattern_csr(8, 15, 3), AP.dilated_2d_pattern(8, 15, 3)
+    )
+    for shift_size in [0, 2]:
+        _assert_csr_equal(
+            AP.swin_attention_pattern_csr(8, 16, 4, shift_size),
+            AP.swin_attention_pattern(8, 16, 4, shift_size),
+        )
+    query_mask = torch.rand(33) > 0.8
+    _assert_csr_equal(
+        AP.global_token_pattern_csr(query_mask), AP.global_token_pattern(query_mask)
+    )
+
+
+def test_random_pattern_csr():
+    torch.manual_seed(0)
+    mask = AP.random_pattern(67, 0.7)
+    torch.manual_seed(0)
+    csr = AP.random_pattern_csr(67, 0.7, rows_per_chunk=16)
+    _assert_csr_equal(csr, mask)
+
+
+def test_csr_pattern_to_layout():
+    mask = AP.local_1d_pattern(64, 9)
+    _, row_offsets, column_indices = _nonzero_mask_to_sparse_csr_indices(
+        mask, mask.device
+    )
+    layout = AP.csr_pattern_to_layout(row_offsets, column_indices, (64, 64), 16)
+    assert torch.equal(layout, AP.pattern_to_layout(mask, 16))
+
+
 def test_pattern_to_layout():
     BLOCK = 16
     SIZE = 128
@@ -21,6 +21,9 @@ from xformers.components.attention import (
     ATTENTION_REGISTRY,
     build_attention,
 )
+from xformers.components.attention.blocksparse import (
+    _is_blocksparse_available as _is_triton_blocksparse_available,
+)
 
 DEVICES = (
     [torch.device("cpu")] if not torch.cuda.is_available() else [torch.device("cuda")]
@@ -38,6 +41,15 @@ assert ATTENTION_REGISTRY.keys(), "Attention layers should have been registered"
 _non_order_invariant_attentions = ["visual", "pooling"]
 
 
+def _skip_if_not_supported(attention_name: str, device: torch.device):
+    # Blocksparse is also registered with only its CPU kernels, which are
+    # tested in test_sparse_tensors (the layouts here don't fit the CPU sizes)
+    if attention_name == "blocksparse" and (
+        device.type != "cuda" or not _is_triton_blocksparse_available
+    ):
+        pytest.skip("Blocksparse is only tested on GPU here")
+
+
 def _get_multihead(
     attention_name,
     attn_dropout,
@@ -108,6 +120,7 @@ def test_order_invariance(
     device: torch.device,
 ):
 
+    _skip_if_not_supported(attention_name, device)
     torch.manual_seed(42)
     torch.cuda.manual_seed_all(42)
 
@@ -340,6 +353,7 @@ def test_different_kq_dimensions(
     device: torch.device,
 ):
 
+    _skip_if_not_supported(attention_name, device)
     multi_head = _get_multihead(attention_name, 0.0, 0.0, False, heads, device)
 
     if multi_head.attention.requires_same_k_q_dimensions:
@@ -376,6 +390,7 @@ def test_broadcast_batch_dimension(
     batch_sizes: Tuple[int, int, int],
 ):
     Q_BATCH, K_BATCH, V_BATCH = batch_sizes
+    _skip_if_not_supported(attention_name, device)
     multi_head = _get_multihead(attention_name, 0.0, 0.0, False, heads, device)
 
     if (
@@ -468,6 +483,7 @@ def test_torch_script_ability(
 
     device = torch.device("cpu")
 
+    _skip_if_not_supported(attention_name, device)
     multi_head = _get_multihead(attention_name, attn_dropout, 0.0, False, heads, device)
 
     if (
@@ -502,4 +518,28 @@ def test_torch_script_ability(
     assert torch.allclose(res, res_traced)
 
 
+@pytest.mark.parametrize("causal", [False, True])
+def test_local_attention_banded_kernel(causal: bool):
+    from xformers.components.attention.local import LocalAttention
+
+    attention = LocalAttention(causal=causal, window_size=7)
+    q, k, v = (torch.rand(BATCH, SEQ, MODEL, requires_grad=True) for _ in range(3))
+    if not attention._can_use_banded_kernel(q, None):
+        pytest.skip("The banded kernel is not available")
+
+    res = attention(q, k, v)
+    res.sum().backward()
+    grads = [x.grad for x in (q, k, v)]
+    for x in (q, k, v):
+        x.grad = None
+
+    # Same as the dense masked attention
+    attention._can_use_banded_kernel = lambda *args: False
+    res_ref = attention(q, k, v)
+    res_ref.sum().backward()
+    assert torch.allclose(res, res_ref, atol=1e-5)
+    for grad, x in zip(grads, (q, k, v)):
+        assert torch.allclose(grad, x.grad, atol=1e-5)
+
+
 # TODO: way more unit tests..
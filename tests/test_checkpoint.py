@@ -11,7 +11,12 @@ import torch
 from torch import nn
 
 import xformers.ops
-from xformers import checkpoint, list_operators
+from xformers import checkpoint, get_optimal_checkpoint_policy, list_operators
+from xformers.checkpoint import (
+    ActivationCompression,
+    _auto_policy_cache,
+    _solve_knapsack,
+)
 
 cuda_only = pytest.mark.skipif(not torch.cuda.is_available(), reason="requires CUDA")
 _devices = ["cpu"]
@@ -93,6 +98,139 @@ def test_checkpoint_with_grad(policy_fn, input_requires_grad, grad_mode):
     assert torch.allclose(out, out_copy)
 
 
+def test_solve_knapsack():
+    output_bytes = {"a": 600, "b": 500, "c": 500, "d": 0}
+    runtime = {"a": 3.0, "b": 2.0, "c": 2.0, "d": 1.0}
+    assert _solve_knapsack(output_bytes, runtime, 1000) == {"b", "c", "d"}
+    assert _solve_knapsack(output_bytes, runtime, 700) == {"a", "d"}
+    assert _solve_knapsack(output_bytes, runtime, 0) == {"d"}
+    assert _solve_knapsack(output_bytes, runtime, 10**9) == {"a", "b", "c", "d"}
+
+
+@pytest.mark.parametrize("memory_budget", [0, 32 * 10 * 4, 2**30])
+def test_checkpoint_memory_budget(memory_budget):
+    module = nn.Sequential(
+        nn.Linear(10, 10),
+        nn.ReLU(),
+        nn.Linear(10, 10),
+        nn.ReLU(),
+    )
+    module_copy = deepcopy(module)
+
+    inputs = torch.rand(32, 10, requires_grad=True)
+    policy = get_optimal_checkpoint_policy(
+        module, inputs, memory_budget=memory_budget
+    )
+    # Cached per signature, identical modules and inputs are not profiled again
+    num_cached = len(_auto_policy_cache)
+    get_optimal_checkpoint_policy(
+        deepcopy(module), inputs.clone(), memory_budget=memory_budget
+    )
+    assert len(_auto_policy_cache) == num_cached
+    if memory_budget == 2**30:
+        assert policy(torch.ops.aten.addmm.default)
+
+    out = inputs
+    out_copy = inputs.detach().clone().requires_grad_()
+    for i in range(4):
+        out = checkpoint(module, out, memory_budget=memory_budget)
+        out_copy = module_copy(out_copy)
+
+    assert torch.allclose(out, out_copy)
+    out.sum().backward()
+    out_copy.sum().backward()
+    for p, p_copy in zip(module.parameters(), module_copy.parameters()):
+        assert torch.allclose(p.grad, p_copy.grad)
+
+
+def test_checkpoint_policy_bound_methods():
+    inputs = torch.rand(16, 10)
+    num_cached = len(_auto_policy_cache)
+    for out_features in [10, 20, 20]:
+        module = nn.Linear(10, out_features)
+        get_optimal_checkpoint_policy(module.forward, inputs, memory_budget=321)
+    # The methods of modules with different parameters don't share their policy
+    assert len(_auto_policy_cache) == num_cached + 2
+
+
+def test_checkpoint_policy_preserves_state():
+    module = nn.Sequential(nn.Linear(10, 10), nn.BatchNorm1d(10), nn.Dropout(0.5))
+    module.train()
+    buffers = deepcopy(dict(module.named_buffers()))
+    rng_state = torch.get_rng_state()
+
+    # The profiling forward neither updates the running stats, nor the RNG
+    get_optimal_checkpoint_policy(module, torch.rand(16, 10), memory_budget=123)
+    for name, buffer in module.named_buffers():
+        assert torch.equal(buffer, buffers[name]), name
+    assert torch.equal(torch.get_rng_state(), rng_state)
+
+
+@pytest.mark.parametrize("mode", ["bf16", "int8"])
+def test_activation_compression(mode):
+    compression = ActivationCompression(mode, min_numel=1)
+    x = torch.randn(37, 129)
+    mask = torch.rand(37, 129) > 0.5
+    y = torch.randn(37, 64, dtype=torch.float16)
+
+    packed = compression.compress(torch.ops.aten.relu.default, (x, mask, y))
+    x_, mask_, y_ = compression.decompress(packed)
+    assert torch.equal(mask, mask_)
+    assert x_.dtype == x.dtype and y_.dtype == y.dtype
+    torch.testing.assert_close(x_, x, rtol=2e-2, atol=3e-2)
+    torch.testing.assert_close(y_, y, rtol=2e-2, atol=3e-2)
+    # The mask is 8x smaller, x is at least 2x smaller
+    saved = compression.bytes_saved[str(torch.ops.aten.relu.default)]
+    min_saved = x.numel() * 2 + mask.numel() * 7 // 8
+    assert saved >= min_saved
+
+
+@pytest.mark.parametrize("mode", ["bf16", "int8"])
+def test_checkpoint_compression(mode):
+    module = nn.Sequential(
+        nn.Linear(64, 64),
+        nn.ReLU(),
+        nn.Dropout(0.2),
+        nn.Linear(64, 64),
+        nn.ReLU(),
+    )
+    module_copy = deepcopy(module)
+    compression = ActivationCompression(mode)
+
+    inputs = torch.rand(32, 64, requires_grad=True)
+    inputs_copy = inputs.detach().clone().requires_grad_()
+    torch.manual_seed(0)
+    out = checkpoint(module, inputs, policy_fn=_all_policy, compression=compression)
+    torch.manual_seed(0)
+    out_copy = module_copy(inputs_copy)
+
+    assert torch.allclose(out, out_copy)
+    out.sum().backward()
+    out_copy.sum().backward()
+    for p, p_copy in zip(module.parameters(), module_copy.parameters()):
+        torch.testing.assert_close(p.grad, p_copy.grad, rtol=0.1, atol=0.1)
+    assert sum(compression.bytes_saved.values()) > 0
+
+
+@pytest.mark.parametrize("mode", ["bf16", "int8"])
+def test_checkpoint_compression_views(mode):
+    # With a 3D input, nn.Linear also stores views of the input, the weight and
+    # the output, which must not be compressed into new tensors
+    module = nn.Linear(64, 64)
+    compression = ActivationCompression(mode)
+    inputs = torch.rand(4, 8, 64, requires_grad=True)
+    out = checkpoint(module, inputs, policy_fn=_all_policy, compression=compression)
+    out.sum().backward()
+
+    # Only the output of the matmul owns its memory
+    numel, rows = out.numel(), out.numel() // out.shape[-1]
+    if mode == "bf16":
+        expected = numel * 2
+    else:
+        expected = numel * 3 - rows * 4
+    assert sum(compression.bytes_saved.values()) == expected
+
+
 @cuda_only
 @pytest.mark.parametrize("policy_fn", [None, [], _relu_policy, _all_policy])
 @pytest.mark.parametrize("input_requires_grad", [True, False])
@@ -10,6 +10,7 @@ import torch
 import xformers  # noqa: F401
 import xformers.components.attention.core
 from xformers.components.attention._sputnik_sparse import _csr_to_coo
+from xformers.components.attention.attention_patterns import global_token_pattern
 from xformers.components.attention.core import (
     _broadcast_batch,
     _create_random_sparsity,
@@ -380,6 +381,43 @@ def test_spmm_sputnik_backward(device):
     assert torch.allclose(grad_b, b.grad, atol=1e-7)
 
 
+def test_sputnik_cpu_skewed_rows():
+    # A few global tokens attend to everything: their rows are split across
+    # threads, and need to be reduced
+    B, L, K = 2, 1024, 32
+    device = "cpu"
+    is_global = torch.zeros(L, dtype=torch.bool)
+    is_global[::32] = True
+    mask = global_token_pattern(is_global)[None].expand(B, L, L)
+    a = torch.rand(B, L, L, device=device) * mask
+    mask_csr = xformers.components.attention.core.SparseCS(mask, device)
+    a_csr = xformers.components.attention.core.SparseCS(a, device)
+    a_sparse = a.to_sparse()
+
+    q = torch.rand(B, L, K, device=device)
+    k = torch.rand(B, K, L, device=device)
+    res = xformers.components.attention.core._matmul_with_mask(q, k, mask_csr)
+    assert torch.allclose(res.to_dense(), (q @ k) * mask, atol=1e-5)
+
+    b = torch.rand(B, L, K, device=device)
+    bmm = xformers.components.attention.core.bmm
+    assert torch.allclose(bmm(a_csr, b), bmm(a_sparse, b), atol=1e-4)
+
+    softmax = xformers.components.attention.core._softmax
+    a_csr.values.requires_grad_(True)
+    res = softmax(a_csr)
+    res.values.sum().backward()
+    a_sparse.requires_grad_(True)
+    res_gt = softmax(a_sparse)
+    res_gt.coalesce().values().sum().backward()
+    assert torch.allclose(res.to_dense(), res_gt.to_dense(), atol=1e-6)
+    assert torch.allclose(
+        a_csr.values.grad,
+        a_sparse.grad.coalesce().values().reshape_as(a_csr.values.grad),
+        atol=1e-6,
+    )
+
+
 @cuda_only
 def test_csr_transpose():
     B, L, K = 8, 30, 40
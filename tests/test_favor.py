@@ -9,6 +9,11 @@ import pytest
 import torch
 
 from xformers.components.attention import FavorAttention, ScaledDotProduct
+from xformers.components.attention.favor import (
+    CausalLinearAttentionOp,
+    _linear_scan_torch,
+    causal_linear_attention,
+)
 from xformers.components.attention.feature_maps import (
     FeatureMapType,
     NormDistribution,
@@ -163,5 +168,42 @@ def test_favor_approximation_accuracy(feature, causal, normalize_inputs, device)
         torch.sum(approx_attention_result).backward()
 
 
+@pytest.mark.parametrize("chunk_size", [1, 16, 100])
+@pytest.mark.parametrize("device", [_device])
+def test_causal_linear_attention(chunk_size, device):
+    torch.random.manual_seed(0)
+    B, N, F, E = 3, 70, 12, 9
+    q = torch.rand(B, N, F, device=device, requires_grad=True)
+    k = torch.rand(B, N, F, device=device, requires_grad=True)
+    v = torch.randn(B, N, E, device=device, requires_grad=True)
+    grad = torch.randn(B, N, E, device=device)
+
+    out = causal_linear_attention(q, k, v, chunk_size)
+    out.backward(grad)
+    grads = [x.grad for x in (q, k, v)]
+    for x in (q, k, v):
+        x.grad = None
+
+    ref = (q @ k.transpose(1, 2)).tril() @ v
+    ref.backward(grad)
+    assert torch.allclose(out, ref, atol=1e-4)
+    for g, x in zip(grads, (q, k, v)):
+        assert torch.allclose(g, x.grad, atol=1e-4)
+
+    # Backwards in time, as used for the gradients of the key and value
+    q, k, v = (x.detach() for x in (q, k, v))
+    out = _linear_scan_torch(q, k, v, chunk_size, reverse=True)
+    ref = (q @ k.transpose(1, 2)).triu() @ v
+    assert torch.allclose(out, ref, atol=1e-4)
+
+    # The C++ kernel and the pytorch fallback agree
+    if CausalLinearAttentionOp.is_available():
+        q, k, v = (x.cpu() for x in (q, k, v))
+        assert torch.allclose(
+            CausalLinearAttentionOp.OPERATOR(q, k, v, chunk_size),
+            _linear_scan_torch(q, k, v, chunk_size, reverse=False),
+            atol=1e-4,
+        )
+
 if __name__ == "__main__":
     _plot_distribution(SMOrf)
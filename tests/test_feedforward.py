@@ -64,7 +64,8 @@ def get_expert():
 @pytest.mark.parametrize("gate", [g.value for g in GateConfig])
 @pytest.mark.parametrize("number_of_local_experts", [None, 4])
 @pytest.mark.parametrize("expert_constructor", [None, get_expert])
-def test_moe(gate, number_of_local_experts, expert_constructor):
+@pytest.mark.parametrize("grouped_experts", [False, True])
+def test_moe(gate, number_of_local_experts, expert_constructor, grouped_experts):
     test_config = {
         "name": "MixtureOfExperts",
         "dim_model": LATENT,
@@ -75,6 +76,7 @@ def test_moe(gate, number_of_local_experts, expert_constructor):
         "number_of_local_experts": number_of_local_experts,
         "gate": gate,
         "expert_constructor": expert_constructor,
+        "grouped_experts": grouped_experts,
     }
 
     init_torch_distributed_local()
@@ -82,9 +84,52 @@ def test_moe(gate, number_of_local_experts, expert_constructor):
     # dummy, just check construction and dimensions in the FW pass
     ffw = build_feedforward(test_config)
 
+    # The per-expert layout of the state dict is kept unless asked otherwise
+    if not grouped_experts:
+        assert any(k.startswith("moe.experts.0.") for k in ffw.state_dict())
+
     inputs = torch.rand(BATCH, SEQ, LATENT, device=torch.device("cuda"))
     ffw = ffw.to(torch.device("cuda"))
 
     outputs = ffw(inputs)
     loss = torch.sum(outputs)
     loss.backward()
+
+
+@pytest.mark.parametrize("gate", [g.value for g in GateConfig])
+def test_moe_compact_dispatch(gate, monkeypatch):
+    from fairscale.nn.moe import moe_layer, top2gate
+
+    # Without noise, and on a single process where the all-to-all is the identity,
+    # the compact routing matches FairScale's MOELayer
+    monkeypatch.setattr(
+        top2gate,
+        "gumbel_rsample",
+        lambda shape, device: torch.zeros(shape, device=device),
+    )
+    monkeypatch.setattr(
+        moe_layer._AllToAll, "apply", staticmethod(lambda group, x: x)
+    )
+    init_torch_distributed_local()
+    torch.manual_seed(0)
+
+    test_config = {
+        "name": "MixtureOfExperts",
+        "dim_model": EMBD,
+        "dropout": 0.0,
+        "activation": Activation.GeLU,
+        "number_of_experts": 4,
+        "gate": gate,
+    }
+    ffw = build_feedforward(test_config).eval()
+    ffw_compact = build_feedforward({**test_config, "compact_dispatch": True}).eval()
+    assert not ffw.compact_dispatch and ffw_compact.compact_dispatch
+    ffw_compact.load_state_dict(ffw.state_dict())
+
+    inputs = torch.rand(BATCH, 16, EMBD)
+    outputs = ffw(inputs)
+    torch.testing.assert_close(ffw_compact(inputs), outputs)
+    torch.testing.assert_close(
+        torch.as_tensor(ffw_compact.l_aux, dtype=torch.float),
+        torch.as_tensor(ffw.moe.l_aux, dtype=torch.float),
+    )
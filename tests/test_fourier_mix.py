@@ -0,0 +1,60 @@
+# Copyright (c) Facebook, Inc. and its affiliates. All rights reserved.
+#
+# This source code is licensed under the BSD license found in the
+# LICENSE file in the root directory of this source tree.
+
+import pytest
+import torch
+
+from xformers.components.attention.fourier_mix import (
+    FourierMix,
+    FourierMixBwOp,
+    FourierMixOp,
+    _real_fft2_torch,
+)
+
+
+@pytest.mark.parametrize("shape", [(2, 16, 32), (3, 7, 9)])
+def test_real_fft2(shape):
+    torch.random.manual_seed(0)
+    x = torch.randn(shape)
+    assert torch.allclose(_real_fft2_torch(x), torch.fft.fft2(x).real, atol=1e-4)
+
+
+@pytest.mark.skipif(
+    not (FourierMixOp.is_available() and FourierMixBwOp.is_available()),
+    reason="xformers::fourier_mix is not available",
+)
+@pytest.mark.parametrize("dtype", [torch.float64, torch.float32, torch.bfloat16])
+@pytest.mark.parametrize("shape", [(2, 16, 32), (3, 7, 9)])
+def test_fourier_mix_cpu(shape, dtype):
+    torch.random.manual_seed(0)
+    x = torch.randn(shape)
+    atol = 1e-3 if dtype == torch.float32 else 0.5
+
+    # Without dropout, this is the real part of the 2D FFT
+    y = FourierMixOp.OPERATOR(x.to(dtype), 0.0, 0)
+    assert y.dtype == dtype
+    assert torch.allclose(y.float(), torch.fft.fft2(x).real, atol=atol, rtol=1e-2)
+    if dtype == torch.float64:
+        # Computed in double precision, not in float
+        x64 = x.double()
+        assert torch.allclose(y, torch.fft.fft2(x64).real, atol=1e-10, rtol=1e-10)
+
+    # With dropout, the backward applies the same mask to the gradient and is
+    # the transpose of the forward: <mix(x), g> == <x, mix^T(g)>
+    p, seed = 0.3, 1234
+    y = FourierMixOp.OPERATOR(x, p, seed)
+    dropped = (y == 0).float().mean().item()
+    assert 0.2 < dropped < 0.4
+    g = torch.randn(shape)
+    grad_x = FourierMixBwOp.OPERATOR(g, p, seed)
+    assert torch.allclose((y * g).sum(), (x * grad_x).sum(), rtol=1e-3)
+
+    # The module goes through the kernel, with a gradient
+    mix = FourierMix(dropout=0.0)
+    x_ = x.clone().requires_grad_()
+    mix(x_).sum().backward()
+    x_ref = x.clone().requires_grad_()
+    torch.fft.fft2(x_ref).real.sum().backward()
+    assert torch.allclose(x_.grad, x_ref.grad, atol=1e-3, rtol=1e-2)
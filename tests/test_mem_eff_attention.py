@@ -3,8 +3,10 @@
 # This source code is licensed under the BSD license found in the
 # LICENSE file in the root directory of this source tree.
 
+import json
 import math
 import random
+import time
 from functools import partial
 from typing import List, Optional, Sequence, Tuple, Type, TypeVar
 
@@ -2318,4 +2320,200 @@ def test_cutlassB_iter_order(
         assert num_parallel_blocks == num_actual
 
 
+@pytest.mark.skipif(
+    not fmha.blocksparse.FwOp.is_available(), reason="requires the CPU kernels"
+)
+@pytest.mark.parametrize("layout_heads", [1, 3])
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("Mq,Mkv", [(64, 64), (50, 70)])
+def test_blocksparse_attention(Mq, Mkv, causal, layout_heads) -> None:
+    torch.manual_seed(0)
+    B, H, K, Kv, block_size = 2, 3, 16, 24, 16
+    op = fmha.MemoryEfficientAttentionBlockSparseOp
+    q = torch.randn([B, Mq, H, K], requires_grad=True)
+    k = torch.randn([B, Mkv, H, K], requires_grad=True)
+    v = torch.randn([B, Mkv, H, Kv], requires_grad=True)
+    layout = torch.rand(
+        [layout_heads, math.ceil(Mq / block_size), math.ceil(Mkv / block_size)]
+    )
+    layout = layout > 0.5
+    # Some query blocks attend nothing
+    layout[:, -1] = False
+    layout[:, 0, 0] = True
+    attn_bias = fmha.attn_bias.BlockSparseMask(layout, block_size, causal=causal)
+
+    out = xformers.ops.memory_efficient_attention(q, k, v, attn_bias, op=op)
+    grad_out = torch.randn_like(out)
+    out.backward(grad_out)
+    grads = [x.grad for x in (q, k, v)]
+    for x in (q, k, v):
+        x.grad = None
+
+    # Fully masked rows have a zero output, and don't contribute to the grads
+    dense_bias = attn_bias.materialize((B, H, Mq, Mkv))
+    visible = (dense_bias != -math.inf).any(-1).transpose(1, 2)[..., None]
+    ref = ref_attention_bmhk(q, k, v, dense_bias.nan_to_num(neginf=-1e9))
+    ref = ref * visible
+    ref.backward(grad_out)
+    assert_allclose(out, ref, "out", atol=op[0].ERROR_ATOL[torch.float])
+    for name, grad, x in zip("qkv", grads, (q, k, v)):
+        assert_allclose(
+            grad, x.grad, f"grad_{name}", atol=op[1].ERROR_ATOL[torch.float]
+        )
+
+
+def test_attn_bias_blocksparse() -> None:
+    m = -math.inf
+    layout = torch.tensor([[1, 0], [1, 1]])
+    attn_bias = fmha.attn_bias.BlockSparseMask(layout, block_size=1, causal=True)
+    expected = torch.tensor([[0, m], [0, 0]])
+    assert_allclose(attn_bias.materialize((2, 2)), expected, "blocksparse")
+    attn_bias = fmha.attn_bias.BlockSparseMask(layout, block_size=2)
+    assert attn_bias.materialize((3, 1, 3, 4)).shape == (3, 1, 3, 4)
+
+
+@pytest.mark.skipif(
+    not fmha.sliding_window.FwOp.is_available(), reason="requires the CPU kernels"
+)
+@pytest.mark.parametrize(
+    "attn_bias",
+    [
+        fmha.attn_bias.LocalAttentionFromBottomRightMask(window_left=5, window_right=5),
+        fmha.attn_bias.LocalAttentionFromBottomRightMask(window_left=70, window_right=0),
+        fmha.attn_bias.LocalAttentionFromBottomRightMask(window_left=0, window_right=3),
+        fmha.attn_bias.LowerTriangularFromBottomRightLocalAttentionMask(17),
+    ],
+    ids=["symmetric", "causal", "right", "causal_local"],
+)
+@pytest.mark.parametrize("Mq,Mkv", [(150, 150), (50, 130), (130, 50)])
+def test_sliding_window_attention(Mq, Mkv, attn_bias) -> None:
+    torch.manual_seed(0)
+    B, H, K, Kv = 2, 3, 16, 24
+    op = fmha.MemoryEfficientAttentionSlidingWindowOp
+    q = torch.randn([B, Mq, H, K], requires_grad=True)
+    k = torch.randn([B, Mkv, H, K], requires_grad=True)
+    v = torch.randn([B, Mkv, H, Kv], requires_grad=True)
+
+    out = xformers.ops.memory_efficient_attention(q, k, v, attn_bias, op=op)
+    grad_out = torch.randn_like(out)
+    out.backward(grad_out)
+    grads = [x.grad for x in (q, k, v)]
+    for x in (q, k, v):
+        x.grad = None
+
+    # Queries outside of the band have a zero output
+    dense_bias = attn_bias.materialize((B, H, Mq, Mkv))
+    visible = (dense_bias != -math.inf).any(-1).transpose(1, 2)[..., None]
+    ref = ref_attention_bmhk(q, k, v, dense_bias.nan_to_num(neginf=-1e9))
+    ref = ref * visible
+    ref.backward(grad_out)
+    assert_allclose(out, ref, "out", atol=op[0].ERROR_ATOL[torch.float])
+    for name, grad, x in zip("qkv", grads, (q, k, v)):
+        assert_allclose(
+            grad, x.grad, f"grad_{name}", atol=op[1].ERROR_ATOL[torch.float]
+        )
+
+
+@pytest.mark.skipif(
+    not fmha.blocksparse.FwOp.is_available(), reason="requires the CPU kernels"
+)
+def test_dispatch_autotune(monkeypatch, tmp_path) -> None:
+    from xformers.ops.fmha import dispatch
+
+    class SlowFwOp(fmha.blocksparse.FwOp):
+        NAME = "blocksparseF_slow"
+
+        @classmethod
+        def apply(cls, inp, needs_gradient):
+            time.sleep(0.01)
+            return super().apply(inp, needs_gradient)
+
+    cache_path = tmp_path / "autotune.json"
+    monkeypatch.setenv("XFORMERS_FMHA_AUTOTUNE", "1")
+    monkeypatch.setenv("XFORMERS_FMHA_AUTOTUNE_CACHE", str(cache_path))
+    monkeypatch.setattr(dispatch, "_autotune_caches", {})
+    monkeypatch.setattr(
+        dispatch,
+        "_dispatch_fw_priority_list",
+        lambda inp, needs_gradient: [SlowFwOp, fmha.blocksparse.FwOp],
+    )
+    timed = []
+    time_op = dispatch._time_op
+
+    def count_time_op(run, device):
+        t = time_op(run, device)
+        timed.append(device)
+        return t
+
+    monkeypatch.setattr(dispatch, "_time_op", count_time_op)
+
+    torch.manual_seed(0)
+    B, M, H, K, block_size = 1, 64, 2, 16, 16
+    q, k, v = (torch.randn([B, M, H, K]) for _ in range(3))
+    layout = torch.ones([1, M // block_size, M // block_size], dtype=torch.bool)
+    attn_bias = fmha.attn_bias.BlockSparseMask(layout, block_size)
+    inp = fmha.Inputs(query=q, key=k, value=v, attn_bias=attn_bias)
+
+    # The first call of a bucket times both operators and persists the fastest
+    assert dispatch._dispatch_fw(inp, False) is fmha.blocksparse.FwOp
+    assert len(timed) == 2
+    cache = json.loads(cache_path.read_text())
+    assert list(cache.values()) == ["blocksparseF"]
+
+    # A new process, and another shape of the same bucket, reuse it
+    monkeypatch.setattr(dispatch, "_autotune_caches", {})
+    inp = fmha.Inputs(query=q[:, :60], key=k, value=v, attn_bias=attn_bias)
+    assert dispatch._dispatch_fw(inp, False) is fmha.blocksparse.FwOp
+    assert len(timed) == 2
+
+    # Without autotuning, this is the priority list
+    monkeypatch.setenv("XFORMERS_FMHA_AUTOTUNE", "0")
+    assert dispatch._dispatch_fw(inp, False) is SlowFwOp
+
+    # With a gradient, each backward is timed with the context of its forward,
+    # and the backward of the fastest pair is used by the autograd function
+    class RequiresSlowBwOp(fmha.blocksparse.FwOp):
+        NAME = "blocksparseF_requires_slow"
+
+        @classmethod
+        def apply(cls, inp, needs_gradient):
+            out, ctx = super().apply(inp, needs_gradient)
+            if ctx is not None:
+                ctx.op_bw = SlowBwOp
+            return out, ctx
+
+    class SlowBwOp(fmha.blocksparse.BwOp):
+        NAME = "blocksparseB_slow"
+
+        @classmethod
+        def apply(cls, ctx, inp, grad):
+            time.sleep(0.01)
+            return super().apply(ctx, inp, grad)
+
+    monkeypatch.setenv("XFORMERS_FMHA_AUTOTUNE", "1")
+    monkeypatch.setattr(
+        dispatch,
+        "_dispatch_fw_priority_list",
+        lambda inp, needs_gradient: [RequiresSlowBwOp, fmha.blocksparse.FwOp],
+    )
+    monkeypatch.setattr(
+        dispatch,
+        "_dispatch_bw_priority_list",
+        lambda inp: [SlowBwOp, fmha.blocksparse.BwOp],
+    )
+    del timed[:]
+    assert dispatch._dispatch_fw(inp, True) is fmha.blocksparse.FwOp
+    # RequiresSlowBwOp can't run with blocksparseB, so this pair isn't timed
+    assert len(timed) == 3
+    cache = json.loads(cache_path.read_text())
+    assert "blocksparseF,blocksparseB" in cache.values()
+    assert dispatch._autotuned_bw(inp, fmha.blocksparse.FwOp) is fmha.blocksparse.BwOp
+    assert dispatch._autotuned_bw(inp, RequiresSlowBwOp) is None
+
+    q, k, v = (x[:, :60].requires_grad_() for x in (q, k, v))
+    out = fmha.memory_efficient_attention(q, k, v, attn_bias=attn_bias)
+    out.backward(torch.ones_like(out))
+    assert len(timed) == 3
+
+
 # end of file
@@ -0,0 +1,163 @@
+# Copyright (c) Facebook, Inc. and its affiliates. All rights reserved.
+#
+# This source code is licensed under the BSD license found in the
+# LICENSE file in the root directory of this source tree.
+
+import pytest
+import torch
+
+import xformers.ops.moe as xmoe
+
+from .utils import assert_allclose
+
+cpu_kernels_only = pytest.mark.skipif(
+    not xmoe.MoETopkRouteOp.is_available(), reason="requires the MoE CPU kernels"
+)
+
+
+def _dense_routing(logits: torch.Tensor, k: int, capacity: int) -> torch.Tensor:
+    """Reference: [S, E, capacity] dispatch mask, GShard style"""
+    S, E = logits.shape
+    experts = logits.topk(k, dim=1).indices
+    dispatch = torch.zeros([S, E, capacity], dtype=torch.bool)
+    fill = [0] * E
+    for j in range(k):
+        for s in range(S):
+            e = int(experts[s, j])
+            if fill[e] < capacity:
+                dispatch[s, e, fill[e]] = True
+            fill[e] += 1
+    return dispatch
+
+
+def _routing_to_dense(routing: xmoe.MoERouting, capacity: int) -> torch.Tensor:
+    S, k = routing.positions.shape
+    dispatch = torch.zeros([S, routing.num_experts, capacity], dtype=torch.bool)
+    for s in range(S):
+        for j in range(k):
+            p = int(routing.positions[s, j])
+            if p < 0:
+                continue
+            e = int(routing.experts[s, j])
+            dispatch[s, e, p - int(routing.expert_offsets[e])] = True
+    return dispatch
+
+
+@cpu_kernels_only
+@pytest.mark.parametrize("k", [1, 2])
+@pytest.mark.parametrize("capacity", [4, 16, 100])
+@pytest.mark.parametrize("S", [1, 37, 3000])
+def test_topk_route(S: int, capacity: int, k: int) -> None:
+    torch.manual_seed(0)
+    E = 8
+    logits = torch.randn([S, E])
+    routing = xmoe.topk_route(logits, k, capacity)
+    ref_experts, ref_positions, ref_offsets = xmoe._topk_route_torch(
+        logits, k, capacity
+    )
+    assert torch.equal(routing.experts, ref_experts)
+    assert torch.equal(routing.positions, ref_positions)
+    assert torch.equal(routing.expert_offsets, ref_offsets)
+    if S < 100:
+        assert torch.equal(
+            _routing_to_dense(routing, capacity), _dense_routing(logits, k, capacity)
+        )
+
+
+@cpu_kernels_only
+@pytest.mark.parametrize("dtype", [torch.float, torch.bfloat16])
+def test_permute_unpermute(dtype) -> None:
+    torch.manual_seed(0)
+    S, E, D, k, capacity = 129, 4, 24, 2, 40
+    logits = torch.randn([S, E])
+    routing = xmoe.topk_route(logits, k, capacity)
+    x = torch.randn([S, D], dtype=dtype, requires_grad=True)
+    gates = torch.rand([S, k], dtype=dtype, requires_grad=True)
+    w = torch.randn([routing.num_rows, D], dtype=dtype)
+
+    out = xmoe.unpermute_tokens(xmoe.permute_tokens(x, routing) * w, routing, gates)
+    grad = torch.randn_like(out)
+    out.backward(grad)
+
+    # Reference with the pure pytorch implementation
+    x_ref = x.detach().float().requires_grad_()
+    gates_ref = gates.detach().float().requires_grad_()
+    positions = routing.positions.masked_fill(routing.positions < 0, routing.num_rows)
+    dispatched = torch.cat([w.float(), torch.zeros([1, D])])[positions] * x_ref.unsqueeze(1)
+    out_ref = (dispatched * gates_ref.unsqueeze(-1)).sum(1)
+    out_ref.backward(grad.float())
+
+    atol, rtol = (1e-5, 1e-5) if dtype == torch.float else (3e-2, 2e-2)
+    assert_allclose(out.float(), out_ref, "out", atol=atol, rtol=rtol)
+    assert_allclose(x.grad.float(), x_ref.grad, "grad_x", atol=atol, rtol=rtol)
+    assert_allclose(
+        gates.grad.float(), gates_ref.grad, "grad_gates", atol=atol, rtol=rtol
+    )
+
+
+def _grouped_linear_ref(x, w, b, expert_offsets):
+    offsets = expert_offsets.tolist()
+    return torch.cat(
+        [
+            torch.nn.functional.linear(
+                x[offsets[e] : offsets[e + 1]], w[e], None if b is None else b[e]
+            )
+            for e in range(w.shape[0])
+        ]
+    )
+
+
+@pytest.mark.skipif(
+    not xmoe.GroupedGemmOp.is_available(), reason="requires the MoE CPU kernels"
+)
+@pytest.mark.parametrize("bias", [False, True])
+@pytest.mark.parametrize("dtype", [torch.float, torch.bfloat16])
+@pytest.mark.parametrize(
+    "tokens_per_expert", [[5, 0, 200, 1], [0, 0, 0, 0], [64, 64, 128, 300]]
+)
+def test_grouped_linear(tokens_per_expert, dtype, bias: bool) -> None:
+    torch.manual_seed(0)
+    E, K, M = len(tokens_per_expert), 48, 40
+    expert_offsets = torch.nn.functional.pad(
+        torch.cumsum(torch.tensor(tokens_per_expert), 0), (1, 0)
+    )
+    N = int(expert_offsets[-1])
+    x = torch.randn([N, K], dtype=dtype, requires_grad=True)
+    w = torch.randn([E, M, K], dtype=dtype, requires_grad=True)
+    b = torch.randn([E, M], dtype=dtype, requires_grad=True) if bias else None
+
+    out = xmoe.grouped_linear(x, w, b, expert_offsets)
+    grad = torch.randn_like(out)
+    out.backward(grad)
+
+    x_ref = x.detach().float().requires_grad_()
+    w_ref = w.detach().float().requires_grad_()
+    b_ref = b.detach().float().requires_grad_() if b is not None else None
+    out_ref = _grouped_linear_ref(x_ref, w_ref, b_ref, expert_offsets)
+    out_ref.backward(grad.float())
+
+    atol, rtol = (1e-4, 1e-4) if dtype == torch.float else (2e-1, 3e-2)
+    assert_allclose(out.float(), out_ref, "out", atol=atol, rtol=rtol)
+    assert_allclose(x.grad.float(), x_ref.grad, "grad_x", atol=atol, rtol=rtol)
+    assert_allclose(w.grad.float(), w_ref.grad, "grad_w", atol=atol, rtol=rtol)
+    if b is not None:
+        assert_allclose(b.grad.float(), b_ref.grad, "grad_b", atol=atol, rtol=rtol)
+
+
+@pytest.mark.skipif(
+    not xmoe.GroupedGemmOp.is_available(), reason="requires the MoE CPU kernels"
+)
+def test_grouped_swiglu() -> None:
+    torch.manual_seed(0)
+    E, D, H = 3, 32, 24
+    expert_offsets = torch.tensor([0, 17, 17, 90])
+    x = torch.randn([90, D])
+    w12, b12 = torch.randn([E, 2 * H, D]), torch.randn([E, 2 * H])
+    w3, b3 = torch.randn([E, D, H]), torch.randn([E, D])
+
+    out = xmoe.grouped_swiglu(x, expert_offsets, w12, b12, w3, b3)
+    x1, x2 = _grouped_linear_ref(x, w12, b12, expert_offsets).chunk(2, dim=-1)
+    out_ref = _grouped_linear_ref(
+        torch.nn.functional.silu(x1) * x2, w3, b3, expert_offsets
+    )
+    assert_allclose(out, out_ref, "out", atol=1e-3, rtol=1e-4)
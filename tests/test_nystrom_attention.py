@@ -8,6 +8,7 @@ import pytest
 import torch
 
 from xformers.components.attention import NystromAttention, ScaledDotProduct
+from xformers.components.attention.nystrom import NystromAttentionOp
 from xformers.components.attention.utils import maybe_merge_masks
 
 
@@ -150,3 +151,29 @@ def test_nystrom_attention(
 
     test_att_mask_ignored()
     test_masking()
+
+
+@pytest.mark.skipif(
+    not NystromAttentionOp.is_available(), reason="requires the CPU kernel"
+)
+@pytest.mark.parametrize("pinverse_original_init", [True, False])
+@pytest.mark.parametrize("num_landmarks", [16, 33])
+def test_nystrom_attention_fused(pinverse_original_init: bool, num_landmarks: int):
+    torch.random.manual_seed(0)
+    b, s, d, e = 4, 600, 32, 24
+    q, k = torch.rand(b, s, d), torch.rand(b, s, d)
+    v = torch.rand(b, s, e)
+    attention = NystromAttention(
+        dropout=0.0,
+        num_heads=2,
+        num_landmarks=num_landmarks,
+        pinverse_original_init=pinverse_original_init,
+    )
+
+    with torch.no_grad():
+        assert attention._can_use_fused_kernel(q, k, v, None)
+        r_fused = attention(q, k, v)
+        attention._can_use_fused_kernel = lambda *args: False
+        r_eager = attention(q, k, v)
+
+    assert torch.allclose(r_fused, r_eager, rtol=1e-3, atol=1e-3)
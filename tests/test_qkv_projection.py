@@ -0,0 +1,63 @@
+# Copyright (c) Facebook, Inc. and its affiliates. All rights reserved.
+#
+# This source code is licensed under the BSD license found in the
+# LICENSE file in the root directory of this source tree.
+
+import pytest
+import torch
+
+import xformers.ops
+from xformers.ops.qkv_projection import QKVProjectionOp
+
+
+@pytest.mark.parametrize("bias", [True, False])
+@pytest.mark.parametrize("num_heads,num_kv_heads", [(4, 4), (8, 2), (4, 1)])
+@pytest.mark.parametrize("device", ["cpu", "cuda"])
+def test_qkv_projection(device: str, num_heads: int, num_kv_heads: int, bias: bool):
+    if device == "cuda" and not torch.cuda.is_available():
+        pytest.skip("CUDA is not available")
+    if device == "cpu" and not QKVProjectionOp.is_available():
+        pytest.skip("The CPU kernel is not available")
+    torch.random.manual_seed(0)
+    B, M, D, K = 2, 67, 96, 40
+    total_heads = num_heads + 2 * num_kv_heads
+    x = torch.randn([B, M, D], device=device, requires_grad=True)
+    w = torch.randn([total_heads * K, D], device=device, requires_grad=True)
+    b = None
+    if bias:
+        b = torch.randn([total_heads * K], device=device, requires_grad=True)
+
+    q, k, v = xformers.ops.qkv_projection(x, w, b, num_heads, num_kv_heads)
+
+    # Reference: packed linear, split, then per-head layout
+    x_ref = x.detach().clone().requires_grad_()
+    w_ref = w.detach().clone().requires_grad_()
+    b_ref = b.detach().clone().requires_grad_() if bias else None
+    q_ref, k_ref, v_ref = torch.nn.functional.linear(x_ref, w_ref, b_ref).split(
+        [num_heads * K, num_kv_heads * K, num_kv_heads * K], dim=-1
+    )
+    q_ref = q_ref.reshape(B, M, num_heads, K)
+    k_ref = k_ref.reshape(B, M, num_kv_heads, K)
+    v_ref = v_ref.reshape(B, M, num_kv_heads, K)
+    if num_kv_heads != num_heads:
+        G = num_kv_heads
+        q_ref = q_ref.reshape(B, M, G, num_heads // G, K)
+        k_ref = k_ref.unsqueeze(3).expand(q_ref.shape)
+        v_ref = v_ref.unsqueeze(3).expand(q_ref.shape)
+
+    for out, ref in zip((q, k, v), (q_ref, k_ref, v_ref)):
+        assert out.shape == ref.shape
+        assert out.stride(-1) == 1
+        torch.testing.assert_close(out, ref, rtol=1e-4, atol=1e-4)
+    if device == "cpu":
+        # Separate buffers, and no copy for the grouped layout
+        assert q.is_contiguous()
+        assert k.stride(3) == 0 or num_kv_heads == num_heads
+
+    grads = [torch.randn_like(t) for t in (q, k, v)]
+    torch.autograd.backward((q, k, v), grads)
+    torch.autograd.backward((q_ref, k_ref, v_ref), grads)
+    torch.testing.assert_close(x.grad, x_ref.grad, rtol=1e-4, atol=1e-3)
+    torch.testing.assert_close(w.grad, w_ref.grad, rtol=1e-4, atol=1e-3)
+    if bias:
+        torch.testing.assert_close(b.grad, b_ref.grad, rtol=1e-4, atol=1e-3)
@@ -8,6 +8,7 @@ import random
 import pytest
 import torch
 
+from xformers.components.reversible import ReversibleSequence
 from xformers.factory.model_factory import xFormer, xFormerConfig
 
 BATCH = 2
@@ -222,3 +223,49 @@ def test_reversible_train(config, device):
         assert train_ratio_rev > 1
         assert train_ratio_non_rev > 1
         assert train_ratio_rev > train_ratio_non_rev
+
+
+@pytest.mark.parametrize(
+    "device",
+    [
+        torch.device("cpu"),
+        pytest.param(
+            torch.device("cuda"),
+            marks=pytest.mark.skipif(
+                not torch.cuda.is_available(), reason="requires CUDA"
+            ),
+        ),
+    ],
+)
+def test_reversible_pipelined_backward(device):
+    torch.manual_seed(0)
+
+    def blocks():
+        return torch.nn.ModuleList(
+            [
+                torch.nn.ModuleList(
+                    [
+                        torch.nn.Sequential(
+                            torch.nn.Linear(EMB // 2, EMB // 2), torch.nn.Dropout(0.1)
+                        ),
+                        torch.nn.Sequential(torch.nn.Linear(EMB // 2, EMB // 2)),
+                    ]
+                )
+                for _ in range(4)
+            ]
+        )
+
+    serial = ReversibleSequence(blocks()).to(device)
+    pipelined = ReversibleSequence(blocks(), pipeline_backward=True).to(device)
+    pipelined.load_state_dict(serial.state_dict())
+
+    inputs = torch.rand((BATCH, SEQ, EMB), device=device)
+    grads = []
+    for model in (serial, pipelined):
+        x = inputs.clone().requires_grad_()
+        torch.manual_seed(0)
+        model(x).sum().backward()
+        grads.append([x.grad] + [p.grad for p in model.parameters()])
+
+    for g_serial, g_pipelined in zip(*grads):
+        assert torch.allclose(g_serial, g_pipelined, atol=1e-5)
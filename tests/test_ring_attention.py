@@ -0,0 +1,66 @@
+# Copyright (c) Facebook, Inc. and its affiliates. All rights reserved.
+#
+# This source code is licensed under the BSD license found in the
+# LICENSE file in the root directory of this source tree.
+
+import pytest
+import torch
+
+import xformers.ops as xops
+from xformers.helpers.test_utils import spawn_gloo_workers
+from xformers.ops.ring_attention import RingAttentionFwOp
+
+from .utils import assert_allclose
+
+requires_ring_attention = pytest.mark.skipif(
+    not RingAttentionFwOp.is_available() or not torch.distributed.is_available(),
+    reason="requires the ring attention operator and torch.distributed",
+)
+
+
+def _ref_attention(q, k, v, causal: bool):
+    q, k, v = [x.transpose(1, 2) for x in (q, k, v)]
+    attn = (q * q.shape[-1] ** -0.5) @ k.transpose(-2, -1)
+    if causal:
+        mask = torch.ones(attn.shape[-2:], dtype=torch.bool).triu(1)
+        attn = attn.masked_fill(mask, float("-inf"))
+    return (attn.softmax(-1) @ v).transpose(1, 2)
+
+
+def _check_ring_attention(world_size: int, causal: bool, B, M, H, K) -> None:
+    rank = torch.distributed.get_rank()
+    torch.manual_seed(0)
+    q, k, v = [
+        torch.randn([B, M * world_size, H, K], requires_grad=True) for _ in range(3)
+    ]
+    grad_out = torch.randn([B, M * world_size, H, K])
+
+    ref = _ref_attention(q, k, v, causal)
+    ref.backward(grad_out)
+
+    local = [
+        x.detach().chunk(world_size, dim=1)[rank].clone().requires_grad_()
+        for x in (q, k, v)
+    ]
+    out = xops.ring_attention(
+        *local, process_group=torch.distributed.group.WORLD, causal=causal
+    )
+    out.backward(grad_out.chunk(world_size, dim=1)[rank])
+
+    assert_allclose(out, ref.chunk(world_size, dim=1)[rank], "out", atol=1e-5)
+    for name, x, x_local in zip("qkv", (q, k, v), local):
+        assert_allclose(
+            x_local.grad,
+            x.grad.chunk(world_size, dim=1)[rank],
+            f"grad_{name}",
+            atol=1e-4,
+        )
+
+
+@requires_ring_attention
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("world_size", [1, 2, 3])
+def test_ring_attention(world_size: int, causal: bool) -> None:
+    spawn_gloo_workers(
+        _check_ring_attention, world_size, world_size, causal, 2, 17, 3, 16
+    )
@@ -8,7 +8,11 @@ import torch
 
 from xformers.components.positional_embedding import RotaryEmbedding
 from xformers.components.positional_embedding.rotary import (
+    RotaryEmbeddingOp,
+    _RotaryEmbeddingCPU,
     apply_rotary_pos_emb,
+    apply_rotary_pos_emb_,
+    get_cos_sin_tables,
     rotate_half,
 )
 
@@ -89,3 +93,80 @@ def test_rotary_embeddings(device, dtype):
 
     # Test that different sequence lengths is ok
     _, _ = rotary(q[:, :, :-16, :], k)
+
+
+def test_rotary_tables_cache():
+    cos, sin = get_cos_sin_tables(EMB, 10000.0, SEQ, torch.device("cpu"), torch.float32)
+    assert cos.shape[-2] >= SEQ
+
+    # Shorter sequences and other modules reuse the same tables
+    cos_short, _ = get_cos_sin_tables(EMB, 10000, 3, torch.device("cpu"), torch.float32)
+    assert cos_short is cos
+    r_1, r_2 = RotaryEmbedding(EMB), RotaryEmbedding(EMB)
+    q = torch.randn((BATCH, HEADS, SEQ, EMB))
+    r_1(q, q)
+    r_2(q, q)
+    assert r_1._cos_cached is r_2._cos_cached
+
+    # Longer sequences grow the tables geometrically
+    cos_long, sin_long = get_cos_sin_tables(
+        EMB, 10000.0, cos.shape[-2] + 1, torch.device("cpu"), torch.float32
+    )
+    assert cos_long.shape[-2] >= 2 * cos.shape[-2]
+    torch.testing.assert_close(cos_long[:, :, : cos.shape[-2]], cos)
+    torch.testing.assert_close(sin_long[:, :, : sin.shape[-2]], sin)
+
+
+@pytest.mark.skipif(
+    not RotaryEmbeddingOp.is_available(), reason="The CPU kernel is not available"
+)
+@pytest.mark.parametrize("offset", [0, 5])
+@pytest.mark.parametrize("dtype", [torch.bfloat16, torch.float32])
+def test_rotary_embeddings_cpu_kernel(offset, dtype):
+    torch.random.manual_seed(0)
+    rotary = RotaryEmbedding(EMB)
+    q = torch.randn((BATCH, HEADS, SEQ, EMB), dtype=dtype, requires_grad=True)
+    k = torch.randn((BATCH, HEADS, SEQ, EMB), dtype=dtype, requires_grad=True)
+
+    q_rot, k_rot = rotary(q, k, offset=offset)
+
+    cos, sin = get_cos_sin_tables(EMB, 10000.0, SEQ + offset, q.device, dtype)
+    cos, sin = cos[:, :, offset:], sin[:, :, offset:]
+    q_ref = apply_rotary_pos_emb(q.detach().float(), cos.float(), sin.float())
+    k_ref = apply_rotary_pos_emb(k.detach().float(), cos.float(), sin.float())
+    tol = 1e-2 if dtype == torch.bfloat16 else 1e-5
+    torch.testing.assert_close(q_rot.float(), q_ref, rtol=tol, atol=tol)
+    torch.testing.assert_close(k_rot.float(), k_ref, rtol=tol, atol=tol)
+
+    # The rotation preserves the norms, the gradient is the inverse rotation
+    grad = torch.randn_like(q_rot)
+    q_rot.backward(grad)
+    assert torch.allclose(q.grad.float().norm(), grad.float().norm(), rtol=tol)
+    q_back = apply_rotary_pos_emb(q_rot.detach().float(), cos.float(), -sin.float())
+    torch.testing.assert_close(q_back, q.detach().float(), rtol=tol, atol=tol)
+
+    # In-place version
+    q_inplace = q.detach().clone()
+    out = apply_rotary_pos_emb_(q_inplace, cos.contiguous(), sin.contiguous())
+    assert out.data_ptr() == q_inplace.data_ptr()
+    torch.testing.assert_close(q_inplace, q_rot.detach(), rtol=tol, atol=tol)
+
+
+@pytest.mark.skipif(
+    not RotaryEmbeddingOp.is_available(), reason="The CPU kernel is not available"
+)
+def test_rotary_embeddings_cpu_kernel_any_tables():
+    # The halves of the tables don't need to be identical
+    torch.random.manual_seed(0)
+    q = torch.randn((BATCH, HEADS, SEQ, EMB), requires_grad=True)
+    cos, sin = (torch.rand((1, 1, SEQ, EMB)) for _ in range(2))
+
+    out = _RotaryEmbeddingCPU.apply(q, cos, sin, 0)
+    q_ref = q.detach().clone().requires_grad_()
+    ref = apply_rotary_pos_emb(q_ref, cos, sin)
+    torch.testing.assert_close(out, ref)
+
+    grad = torch.randn_like(out)
+    out.backward(grad)
+    ref.backward(grad)
+    torch.testing.assert_close(q.grad, q_ref.grad)
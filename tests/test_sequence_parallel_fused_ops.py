@@ -0,0 +1,80 @@
+# Copyright (c) Facebook, Inc. and its affiliates. All rights reserved.
+#
+# This source code is licensed under the BSD license found in the
+# LICENSE file in the root directory of this source tree.
+
+import pytest
+import torch
+
+from xformers.helpers.test_utils import spawn_gloo_workers
+from xformers.ops.sequence_parallel_fused_ops import (
+    FusedAllGatherAndLinearOp,
+    fused_allgather_and_linear,
+    fused_linear_and_reducescatter,
+)
+
+from .utils import assert_allclose
+
+requires_fused_ops = pytest.mark.skipif(
+    not FusedAllGatherAndLinearOp.is_available()
+    or not torch.distributed.is_available(),
+    reason="requires the fused collective-matmul operators and torch.distributed",
+)
+
+
+def _check_allgather_and_linear(world_size: int, M: int, B: int, K: int) -> None:
+    rank = torch.distributed.get_rank()
+    torch.manual_seed(0)
+    gathered_input = torch.randn([world_size * M, B, K])
+    weights = [torch.randn([N, K]) for N in (8, 24)]
+
+    outputs, stats = fused_allgather_and_linear(
+        gathered_input.chunk(world_size)[rank],
+        weights,
+        process_group=torch.distributed.group.WORLD,
+        return_stats=True,
+    )
+    for w, out in zip(weights, outputs):
+        assert_allclose(out, gathered_input @ w.t(), atol=1e-4, rtol=1e-4)
+    assert 0.0 <= stats.hidden_fraction <= 1.0
+
+    single = fused_allgather_and_linear(
+        gathered_input.chunk(world_size)[rank],
+        weights[0],
+        process_group=torch.distributed.group.WORLD,
+    )
+    assert_allclose(single, outputs[0])
+
+
+def _check_linear_and_reducescatter(
+    world_size: int, M: int, B: int, K: int
+) -> None:
+    rank = torch.distributed.get_rank()
+    # Each rank holds a different input, summed by the reduce-scatter
+    torch.manual_seed(0)
+    inputs = [torch.randn([world_size * M, B, K]) for _ in range(world_size)]
+    weight = torch.randn([16, K])
+
+    out, stats = fused_linear_and_reducescatter(
+        inputs[rank],
+        weight,
+        process_group=torch.distributed.group.WORLD,
+        return_stats=True,
+    )
+    ref = sum(x @ weight.t() for x in inputs).chunk(world_size)[rank]
+    assert_allclose(out, ref, atol=1e-4, rtol=1e-4)
+    assert 0.0 <= stats.hidden_fraction <= 1.0
+
+
+@requires_fused_ops
+@pytest.mark.parametrize("world_size", [1, 2, 4])
+def test_fused_allgather_and_linear(world_size: int) -> None:
+    spawn_gloo_workers(_check_allgather_and_linear, world_size, world_size, 5, 3, 32)
+
+
+@requires_fused_ops
+@pytest.mark.parametrize("world_size", [1, 2, 4])
+def test_fused_linear_and_reducescatter(world_size: int) -> None:
+    spawn_gloo_workers(
+        _check_linear_and_reducescatter, world_size, world_size, 5, 3, 32
+    )
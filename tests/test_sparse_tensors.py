@@ -9,7 +9,14 @@ import torch
 # needed to register custom ops
 import xformers  # noqa: F401
 from xformers.ops import masked_matmul
-from xformers.sparse import BlockSparseTensor, SparseCSRTensor
+from xformers.sparse import (
+    BlockSparseTensor,
+    SparseCSRTensor,
+    _blocksparse_ops,
+    load_sparse,
+    save_sparse,
+)
+from xformers.sparse import utils as sparse_utils
 
 cuda_only = pytest.mark.skipif(not torch.cuda.is_available(), reason="requires CUDA")
 _devices = ["cpu", "cuda:0"] if torch.cuda.is_available() else ["cpu"]
@@ -101,6 +108,77 @@ def test_sparse_binary_ops(func, device):
     assert torch.allclose(res, res_gt)
 
 
+@pytest.mark.parametrize("device", _devices)
+@pytest.mark.parametrize(
+    "func", [torch.add, torch.sub, torch.mul, torch.logical_and, torch.where]
+)
+def test_sparse_binary_ops_different_patterns(func, device):
+    _seed()
+    N, H, W = 4, 37, 53
+    shape = (N, H, W)
+    dtype = torch.bool if func is torch.logical_and else torch.float32
+    a_sparse, b_sparse = [
+        _create_tensor(SparseCSRTensor, device, dtype=dtype, shape=shape, sparsity=s)
+        for s in [0.5, 0.9]
+    ]
+    a, b = a_sparse.to_dense(), b_sparse.to_dense()
+    if func is torch.where:
+        cond_sparse = _create_tensor(
+            SparseCSRTensor, device, dtype=torch.bool, shape=shape, sparsity=0.3
+        )
+        res = func(cond_sparse, a_sparse, b_sparse)
+        res_gt = func(cond_sparse.to_dense(), a, b)
+    else:
+        res = func(a_sparse, b_sparse)
+        res_gt = func(a, b)
+    assert isinstance(res, SparseCSRTensor)
+    assert torch.equal(res.to_dense(), res_gt)
+
+    # The result only has the nonzeros of the union / intersection
+    mask_a, mask_b = a[0] != 0, b[0] != 0
+    if func in [torch.mul, torch.logical_and]:
+        mask = mask_a & mask_b
+    else:
+        mask = mask_a | mask_b
+    assert res._csr_column_indices.shape[0] == mask.sum()
+
+    # Dense operands are only sampled on the sparse pattern
+    if func is torch.mul:
+        assert torch.equal(func(a_sparse, b).to_dense(), a * b)
+
+    # The positions where a dense mask is False leave the pattern
+    if func is torch.logical_and:
+        res = func(a_sparse, b)
+        assert torch.equal(res.to_dense(), res_gt)
+        assert res._csr_column_indices.shape[0] == mask.sum()
+
+
+@pytest.mark.parametrize("mode", [0, 1, 2])
+def test_csr_merge(mode):
+    _seed()
+    m, n = 37, 53
+    masks = [torch.rand(m, n) > 0.7, torch.rand(m, n) > 0.5]
+    masks[1][3] = False
+    structures = [
+        sparse_utils._nonzero_mask_to_sparse_csr_indices(mask, "cpu")[1:]
+        for mask in masks
+    ]
+    row_offsets, column_indices, index_a, index_b = sparse_utils._csr_merge(
+        m, n, *structures[0], *structures[1], mode
+    )
+    mask = [masks[0] | masks[1], masks[0] & masks[1], masks[0]][mode]
+    _, row_offsets_ref, column_indices_ref = (
+        sparse_utils._nonzero_mask_to_sparse_csr_indices(mask, "cpu")
+    )
+    assert torch.equal(row_offsets, row_offsets_ref)
+    assert torch.equal(column_indices, column_indices_ref)
+    for m_in, index in zip(masks, [index_a, index_b]):
+        # Position of each nonzero of the result in the input, or -1
+        positions = torch.full((m, n), -1, dtype=torch.long)
+        positions[m_in] = torch.arange(int(m_in.sum()))
+        assert torch.equal(index, positions[mask])
+
+
 @pytest.mark.parametrize("tensor_type", _tensor_types)
 @pytest.mark.parametrize("device", _devices)
 def test_masked_matmul(tensor_type, device):
@@ -268,6 +346,30 @@ def test_deepcopy(tensor_type, device):
     assert torch.equal(a_sparse, b_sparse)
 
 
+@pytest.mark.parametrize("mmap", [False, True])
+@pytest.mark.parametrize("tensor_type", _tensor_types)
+@pytest.mark.parametrize("device", _devices)
+def test_serialization(tensor_type, device, mmap, tmp_path):
+    N, C, H, W = 8, 2, 64, 64
+    shape0 = (N, C, H, W)
+    if tensor_type != BlockSparseTensor:
+        shape0 = shape0[1:]
+
+    a_sparse = _create_tensor(
+        tensor_type, device, dtype=torch.float16, shape=shape0, sparsity=0.8
+    )
+    path = tmp_path / "mask.xfsparse"
+    save_sparse(path, a_sparse)
+    b_sparse = load_sparse(path, device=device, mmap=mmap)
+    assert type(b_sparse) is tensor_type
+    assert b_sparse.shape == a_sparse.shape
+    assert torch.equal(a_sparse, b_sparse)
+    if tensor_type == SparseCSRTensor:
+        assert torch.equal(a_sparse._csr_row_indices, b_sparse._csr_row_indices)
+        for t_a, t_b in zip(a_sparse._csr_transp_info, b_sparse._csr_transp_info):
+            assert torch.equal(t_a, t_b)
+
+
 @pytest.mark.parametrize("tensor_type", _tensor_types)
 @pytest.mark.parametrize("device", _devices)
 def test_module_buffer(tensor_type, device):
@@ -303,3 +405,128 @@ def test_module_buffer(tensor_type, device):
 
     module.load_state_dict({"a_sparse": b_sparse})
     assert torch.equal(module.a_sparse, b_sparse.to(device))
+
+
+@pytest.mark.skipif(
+    not _blocksparse_ops._has_cpu_kernels(), reason="requires the CPU kernels"
+)
+@pytest.mark.parametrize("causal", [False, True])
+def test_blocksparse_attention_cpu(causal):
+    from xformers.components.attention import build_attention
+    from xformers.components.attention.blocksparse import BlockSparseAttention
+
+    torch.manual_seed(0)
+    B, H, block_size, blocks, K = 2, 3, 16, 4, 24
+    layout = torch.randint(2, (H, blocks, blocks))
+    # Every row needs at least one element
+    layout |= torch.eye(blocks, dtype=layout.dtype)
+    q, k, v = [
+        torch.randn(B, H, blocks * block_size, K, requires_grad=True)
+        for _ in range(3)
+    ]
+    attention = BlockSparseAttention(
+        layout=layout, block_size=block_size, num_heads=H, causal=causal
+    )
+    out = attention(q, k, v, scale=0.7)
+    grad = torch.randn_like(out)
+    grads = torch.autograd.grad(out, (q, k, v), grad)
+
+    mask = layout.bool().repeat_interleave(block_size, 1)
+    mask = mask.repeat_interleave(block_size, 2)
+    if causal:
+        mask = mask & torch.ones_like(mask).tril()
+    att = (q / K**0.5) @ k.transpose(-2, -1) * 0.7
+    att = att.masked_fill(~mask, float("-inf")).softmax(-1)
+    out_ref = att @ v
+    grads_ref = torch.autograd.grad(out_ref, (q, k, v), grad)
+
+    assert torch.allclose(out, out_ref, atol=1e-5)
+    for g, g_ref in zip(grads, grads_ref):
+        assert torch.allclose(g, g_ref, atol=1e-4)
+
+    # Also registered without Triton, to be built from a config
+    config = {
+        "name": "blocksparse",
+        "layout": layout,
+        "block_size": block_size,
+        "num_heads": H,
+        "causal": causal,
+        "dropout": 0.0,
+    }
+    assert torch.allclose(build_attention(config)(q, k, v, scale=0.7), out)
+
+    # The block-CSR structure is built once per layout, and rebuilt if the
+    # layout changes
+    info = _blocksparse_ops._layout_info(layout)
+    assert _blocksparse_ops._layout_info(layout) is info
+    layout[0, 0, 0] = 1 - layout[0, 0, 0]
+    assert _blocksparse_ops._layout_info(layout) is not info
+
+
+@pytest.mark.parametrize("device", _devices)
+def test_sparse_csr_transpose_twice(device):
+    # The transpose info is cached per structure: using it again must hit the
+    # cache, and give the same results
+    torch.manual_seed(0)
+    mask = torch.rand(32, 32, device=device) > 0.5
+    dense = torch.rand(2, 32, 32, device=device) * mask
+    a = SparseCSRTensor.from_dense(dense)
+    for _ in range(2):
+        assert torch.equal(a.transpose(-2, -1).to_dense(), dense.transpose(-2, -1))
+
+    b = torch.rand(2, 32, 16, device=device)
+    a.requires_grad_(True)
+    grads = []
+    for _ in range(2):
+        (a @ b).sum().backward()
+        grads.append(a.grad.to_dense().clone())
+    assert torch.allclose(grads[1], 2 * grads[0])
+
+
+@pytest.mark.skipif(
+    not sparse_utils.CSRTransposeInfoOp.is_available(),
+    reason="requires the CPU kernels",
+)
+@pytest.mark.parametrize("shape", [(1, 1), (37, 53), (512, 300)])
+@pytest.mark.parametrize("density", [0.0, 0.1, 0.9])
+def test_csr_structure_kernels(shape, density):
+    torch.manual_seed(0)
+    m, n = shape
+    mask = torch.rand(shape) < density
+    _, row_offsets, column_indices = sparse_utils._nonzero_mask_to_sparse_csr_indices(
+        mask, "cpu"
+    )
+
+    rows = torch.where(mask)[0].int()
+    row_coo, _ = sparse_utils._csr_to_coo(m, n, row_offsets, column_indices)
+    assert torch.equal(row_coo, rows)
+    row_offsets_2, _ = sparse_utils._coo_to_csr(m, n, rows, column_indices)
+    assert torch.equal(row_offsets_2, row_offsets)
+
+    row_indices_t, row_offsets_t, column_indices_t, perm = (
+        sparse_utils._get_transpose_info(m, n, None, row_offsets, column_indices)
+    )
+    _, row_offsets_ref, column_indices_ref = (
+        sparse_utils._nonzero_mask_to_sparse_csr_indices(mask.t(), "cpu")
+    )
+    assert torch.equal(row_offsets_t, row_offsets_ref)
+    assert torch.equal(column_indices_t, column_indices_ref)
+    values = torch.randn(1, column_indices.shape[0])
+    dense = torch.zeros(shape)
+    dense[mask] = values[0]
+    assert torch.equal(values[0, perm], dense.t()[mask.t()])
+    # Longest rows first, ties in row order
+    lengths = row_offsets_t.diff()[row_indices_t.long()]
+    assert (lengths[:-1] >= lengths[1:]).all()
+    assert torch.equal(
+        row_indices_t.long(),
+        torch.sort(-row_offsets_t.diff().long(), stable=True).indices,
+    )
+
+    # Cached for the same structure, recomputed once it changes
+    info = sparse_utils._get_transpose_info(m, n, None, row_offsets, column_indices)
+    assert info[3] is perm
+    if column_indices.numel():
+        column_indices.add_(0)
+        info = sparse_utils._get_transpose_info(m, n, None, row_offsets, column_indices)
+        assert info[3] is not perm
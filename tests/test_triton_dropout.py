@@ -21,7 +21,7 @@ if _triton_available:
         import triton  # noqa: F401
 
         from xformers.triton import dropout as triton_dropout
-        from xformers.triton.dropout import FusedDropoutBias
+        from xformers.triton.dropout import DropoutBiasActOp, FusedDropoutBias
         from xformers.triton.utils import gpu_capabilities_older_than_70
 
         _triton_available = True
@@ -60,6 +60,50 @@ def test_dropout_cpu():
     assert y.count_nonzero() != y.numel()
 
 
+@pytest.mark.skipif(
+    not _triton_available or not DropoutBiasActOp.is_available(),
+    reason="The CPU dropout kernel is not available",
+)
+@pytest.mark.parametrize("shape", [(384, 512), (4, 16, 385)])
+@pytest.mark.parametrize("bias", [False, True])
+@pytest.mark.parametrize("activation", [None] + [a.value for a in Activation])
+def test_dropout_cpu_kernel(shape, bias, activation):
+    """
+    Check the fused CPU kernel against pytorch, using the mask which it applied
+    """
+    torch.random.manual_seed(0)
+    p = 0.3
+    x = torch.normal(0, 1, size=shape, requires_grad=True)
+    b = torch.normal(0, 1, size=(shape[-1],), requires_grad=True) if bias else None
+
+    y = triton_dropout.dropout(x, p=p, bias=b, activation=activation)
+
+    # The dropped values are the zeros which pytorch wouldn't have
+    x_ref = x.detach().clone().requires_grad_()
+    b_ref = b.detach().clone().requires_grad_() if bias else None
+    y_ref = build_activation(activation)(x_ref + b_ref if bias else x_ref)
+    keep = (y != 0) | (y_ref == 0)
+    drop_p = 1.0 - keep.float().mean().item()
+    assert abs(drop_p - p) < 0.02
+    y_ref = y_ref * keep / (1 - p)
+    torch.testing.assert_close(y, y_ref, rtol=1e-4, atol=1e-4)
+
+    # The backward regenerates the same mask
+    grad = torch.randn_like(y)
+    y.backward(grad)
+    y_ref.backward(grad)
+    torch.testing.assert_close(x.grad, x_ref.grad, rtol=1e-4, atol=1e-4)
+    if bias:
+        torch.testing.assert_close(b.grad, b_ref.grad, rtol=1e-4, atol=1e-3)
+
+    # Same seed, same mask
+    torch.random.manual_seed(1)
+    y_1 = triton_dropout.dropout(x, p=p, bias=b, activation=activation)
+    torch.random.manual_seed(1)
+    y_2 = triton_dropout.dropout(x, p=p, bias=b, activation=activation)
+    torch.testing.assert_close(y_1, y_2)
+
+
 @pytest.mark.skipif(not _gpu_available, reason="GPU is not available")
 @pytest.mark.skipif(not _triton_available, reason="Triton is not available")
 @pytest.mark.skipif(
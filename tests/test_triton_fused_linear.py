@@ -18,6 +18,7 @@ if _triton_available:
         import triton  # noqa: F401
 
         from xformers.triton import FusedLinear
+        from xformers.triton.fused_linear_layer import FusedLinearActOp
         from xformers.triton.k_activations import get_triton_activation_index
         from xformers.triton.k_fused_matmul_fw import fused_matmul
         from xformers.triton.utils import gpu_capabilities_older_than_70
@@ -31,6 +32,46 @@ if _triton_available:
 SHAPES = [(128, 256), (8, 384, 128), (8, 784, 512)]
 
 
+@pytest.mark.skipif(not _triton_available, reason="Triton is not available")
+@pytest.mark.skipif(
+    not _triton_available or not FusedLinearActOp.is_available(),
+    reason="The CPU fused linear kernel is not available",
+)
+@pytest.mark.parametrize("shape", [(128, 256), (8, 67, 300)])
+@pytest.mark.parametrize("bias", [True, False])
+@pytest.mark.parametrize("activation", [None] + [a.value for a in Activation])
+def test_fused_linear_cpu(shape, bias, activation):
+    """Check the CPU kernel and its backward against Pytorch"""
+    torch.random.manual_seed(0)
+    out_features = 300
+
+    x = torch.randn(shape, requires_grad=True)
+    x_ref = x.detach().clone().requires_grad_()
+    fused = FusedLinear(shape[-1], out_features, bias=bias, activation=activation)
+    torch_linear = torch.nn.Linear(shape[-1], out_features, bias=bias)
+    with torch.no_grad():
+        torch_linear.weight.copy_(fused.weight)
+        if bias:
+            torch_linear.bias.copy_(fused.bias)
+    torch_activation = build_activation(activation)
+
+    y = fused(x)
+    y_ref = torch_activation(torch_linear(x_ref))
+    torch.testing.assert_close(y, y_ref, rtol=1e-4, atol=1e-4)
+
+    grad = torch.randn_like(y)
+    y.backward(grad)
+    y_ref.backward(grad)
+    torch.testing.assert_close(x.grad, x_ref.grad, rtol=1e-4, atol=1e-4)
+    torch.testing.assert_close(
+        fused.weight.grad, torch_linear.weight.grad, rtol=1e-4, atol=1e-3
+    )
+    if bias:
+        torch.testing.assert_close(
+            fused.bias.grad, torch_linear.bias.grad, rtol=1e-4, atol=1e-3
+        )
+
+
 @pytest.mark.skipif(not _triton_available, reason="Triton is not available")
 @pytest.mark.skipif(
     not _triton_available or gpu_capabilities_older_than_70(),
@@ -14,6 +14,7 @@ import xformers
 
 try:
     from xformers.triton import FusedLayerNorm
+    from xformers.triton.layer_norm import LayerNormFwOp
     from xformers.triton.utils import gpu_capabilities_older_than_70
 
     _triton_available = xformers._is_triton_available()
@@ -35,6 +36,52 @@ SHAPES = [
 ]
 
 
+@pytest.mark.skipif(not _triton_available, reason="Triton is not available")
+@pytest.mark.skipif(
+    not _triton_available or not LayerNormFwOp.is_available(),
+    reason="The CPU layernorm kernel is not available",
+)
+@pytest.mark.parametrize("shape", SHAPES[:3] + [(4, 67, 1000)])
+@pytest.mark.parametrize("affine", [True, False])
+def test_layernorm_cpu(shape, affine):
+    """Check the CPU kernels against PyTorch, including the weight and bias gradients"""
+    torch.random.manual_seed(0)
+    X = torch.normal(3, 2, size=shape, requires_grad=True)
+    X_ = X.detach().clone().requires_grad_()
+    eps = 1e-5
+
+    torch_layernorm = torch.nn.LayerNorm(shape[-1], eps=eps, elementwise_affine=affine)
+    fused_layernorm = FusedLayerNorm(shape[-1], affine=affine, eps=eps)
+    if affine:
+        with torch.no_grad():
+            torch_layernorm.weight.normal_()
+            torch_layernorm.bias.normal_()
+            fused_layernorm.weight.copy_(torch_layernorm.weight)
+            fused_layernorm.bias.copy_(torch_layernorm.bias)
+
+    y_torch = torch_layernorm(X)
+    y_fused = fused_layernorm(X_)
+    torch.testing.assert_close(y_torch, y_fused, rtol=1e-4, atol=1e-4)
+
+    grad = torch.randn_like(y_torch)
+    y_torch.backward(grad)
+    y_fused.backward(grad)
+    torch.testing.assert_close(X.grad, X_.grad, rtol=1e-4, atol=1e-4)
+    if affine:
+        torch.testing.assert_close(
+            torch_layernorm.weight.grad,
+            fused_layernorm.weight.grad,
+            rtol=1e-4,
+            atol=1e-3,
+        )
+        torch.testing.assert_close(
+            torch_layernorm.bias.grad,
+            fused_layernorm.bias.grad,
+            rtol=1e-4,
+            atol=1e-3,
+        )
+
+
 @pytest.mark.skipif(not _triton_available, reason="Triton is not available")
 @pytest.mark.skipif(
     not _triton_available or gpu_capabilities_older_than_70(),
@@ -14,6 +14,7 @@ import xformers
 try:
     from xformers.triton import log_softmax as triton_log_softmax
     from xformers.triton import softmax as triton_softmax
+    from xformers.triton.softmax import FusedSoftmaxOp
 
     _triton_available = xformers._is_triton_available()
 except ImportError as e:
@@ -159,3 +160,48 @@ def test_softmax_parity_fallback(log, masking, causal, contiguous, device):
     assert torch.allclose(
         torch.norm(X.grad), torch.norm(X_.grad), equal_nan=True, atol=1e-5
     ), f"{torch.norm(X.grad)}, {torch.norm(X_.grad)}"
+
+
+@pytest.mark.skipif(not _triton_available, reason="Triton is not available")
+@pytest.mark.skipif(
+    not _triton_available or not FusedSoftmaxOp.is_available(),
+    reason="The CPU softmax kernel is not available",
+)
+@pytest.mark.parametrize("log", [False, True])
+@pytest.mark.parametrize("masking", [True, False])
+@pytest.mark.parametrize("causal", [True, False])
+@pytest.mark.parametrize("shape", [(384, 384), (2, 3, 67, 67), (2, 48, 96)])
+def test_softmax_cpu(log, masking, causal, shape):
+    """Check the CPU kernel and its backward against PyTorch"""
+    torch.random.manual_seed(0)
+    X = torch.normal(0, 1, size=shape, requires_grad=True)
+    X_ = X.detach().clone().requires_grad_()
+
+    # A mask which never masks a whole row
+    mask = torch.zeros(shape[-2:])
+    if masking:
+        mask[torch.rand(shape[-2:]) > 0.8] = -float("inf")
+        mask[:, 0] = 0.0
+
+    mask_causal = torch.zeros_like(mask)
+    if causal:
+        mask_causal[~torch.tril(torch.ones_like(mask)).bool()] = -float("inf")
+
+    y_torch = (
+        torch.log_softmax(X + mask + mask_causal, dim=-1)
+        if log
+        else torch.softmax(X + mask + mask_causal, dim=-1)
+    )
+    y_fused = (
+        triton_log_softmax(X_, mask if masking else None, causal)
+        if log
+        else triton_softmax(X_, mask if masking else None, causal)
+    )
+    torch.testing.assert_close(y_torch, y_fused, rtol=1e-5, atol=1e-5)
+
+    # Only backpropagate through the values which were not masked
+    kept = torch.isfinite(mask + mask_causal).expand_as(y_torch)
+    grad = torch.randn_like(y_torch) * kept
+    y_torch.backward(grad)
+    y_fused.backward(grad)
+    torch.testing.assert_close(X.grad * kept, X_.grad * kept, rtol=1e-4, atol=1e-5)
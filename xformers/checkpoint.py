@@ -4,16 +4,32 @@
 # LICENSE file in the root directory of this source tree.
 
 
+import math
+import time
 import weakref
 from collections import defaultdict
 from contextlib import nullcontext
-from typing import Any, ContextManager, Dict, List
+from typing import (
+    Any,
+    Callable,
+    ContextManager,
+    Dict,
+    Hashable,
+    List,
+    Optional,
+    Set,
+    Union,
+)
 
 import torch
 from torch.utils._python_dispatch import TorchDispatchMode
-from torch.utils._pytree import tree_map
+from torch.multiprocessing.reductions import StorageWeakRef
+from torch.utils._pytree import tree_flatten, tree_map
 from torch.utils.checkpoint import get_device_states, set_device_states
 
+# pre-2.0, `untyped_storage` didn't exist
+_get_storage = getattr(torch.Tensor, "untyped_storage", torch.Tensor.storage)
+
 
 def _detach(x):
     if isinstance(x, torch.Tensor):
@@ -21,10 +37,172 @@ def _detach(x):
     return x
 
 
+class _PackedBool:
+    """A bool tensor stored with 8 values per byte"""
+
+    def __init__(self, x: torch.Tensor) -> None:
+        self.shape = x.shape
+        flat = x.flatten()
+        padding = (-flat.numel()) % 8
+        if padding:
+            flat = torch.cat([flat, flat.new_zeros(padding)])
+        bits = flat.view(-1, 8).to(torch.uint8)
+        self.data = (bits << self._shifts(x.device)).sum(-1, dtype=torch.uint8)
+
+    @staticmethod
+    def _shifts(device) -> torch.Tensor:
+        return torch.arange(8, dtype=torch.uint8, device=device)
+
+    def nbytes(self) -> int:
+        return self.data.numel()
+
+    def decompress(self) -> torch.Tensor:
+        bits = (self.data.unsqueeze(-1) >> self._shifts(self.data.device)) & 1
+        return bits.flatten()[: self.shape.numel()].view(self.shape).bool()
+
+
+class _Int8Rows:
+    """A float tensor stored in int8, with a scale per row (last dimension)"""
+
+    def __init__(self, x: torch.Tensor) -> None:
+        self.dtype = x.dtype
+        rows = x.reshape(-1, x.shape[-1]).float()
+        self.scale = (rows.abs().amax(-1, keepdim=True) / 127.0).clamp_min(1e-30)
+        self.data = (rows / self.scale).round_().clamp_(-127, 127).to(torch.int8)
+        self.shape = x.shape
+
+    def nbytes(self) -> int:
+        return self.data.numel() + self.scale.numel() * self.scale.element_size()
+
+    def decompress(self) -> torch.Tensor:
+        return (self.data.float() * self.scale).to(self.dtype).view(self.shape)
+
+
+class _BFloat16:
+    """A float32 tensor stored in bfloat16"""
+
+    def __init__(self, x: torch.Tensor) -> None:
+        self.dtype = x.dtype
+        self.data = x.to(torch.bfloat16)
+
+    def nbytes(self) -> int:
+        return self.data.numel() * self.data.element_size()
+
+    def decompress(self) -> torch.Tensor:
+        return self.data.to(self.dtype)
+
+
+class _Alias:
+    """An output which shares the memory of a compressed one"""
+
+    def __init__(self, base, x: torch.Tensor) -> None:
+        self.base = base
+        self.shape = x.shape
+        self.stride = x.stride()
+        self.offset = x.storage_offset()
+
+    def nbytes(self) -> int:
+        return 0
+
+    def decompress(self) -> torch.Tensor:
+        return self.base.decompress().as_strided(self.shape, self.stride, self.offset)
+
+
+_COMPRESSED_TYPES = (_PackedBool, _Int8Rows, _BFloat16, _Alias)
+
+
+class ActivationCompression:
+    """
+    Compression of the outputs stored by :func:`checkpoint`, trading some
+    accuracy in the backward for memory:
+
+    - ``"bf16"``: float32 outputs are stored in bfloat16 (2x smaller)
+    - ``"int8"``: float outputs are stored in int8 with a float32 scale per
+      row, ie per vector of the last dimension (2x to 4x smaller)
+
+    In both modes, bool outputs (eg masks) are bit-packed (8x smaller).
+    The outputs are decompressed when they are read back, during the
+    recomputation of the forward. `bytes_saved` reports, per operator, the
+    number of bytes which compression saved.
+    """
+
+    MODES = ("bf16", "int8")
+
+    def __init__(self, mode: str = "bf16", min_numel: int = 1024) -> None:
+        assert mode in self.MODES, f"Unknown compression mode: {mode}"
+        self.mode = mode
+        # Small tensors are not worth it
+        self.min_numel = min_numel
+        self.bytes_saved: Dict[str, int] = defaultdict(int)
+
+    def _compress_tensor(self, x: torch.Tensor):
+        # Only tensors which own their memory, views (eg of a parameter) would be
+        # copied while the memory they share is kept anyway
+        storage = _get_storage(x)
+        if (
+            x.numel() < self.min_numel
+            or not x.is_contiguous()
+            or x.storage_offset() != 0
+            or storage.nbytes() != x.numel() * x.element_size()
+        ):
+            return x
+        if x.dtype == torch.bool:
+            return _PackedBool(x)
+        if self.mode == "int8" and x.is_floating_point() and x.ndim >= 1:
+            return _Int8Rows(x)
+        if self.mode == "bf16" and x.dtype == torch.float32:
+            return _BFloat16(x)
+        return x
+
+    def compress(self, func, out, args=(), compressed=None):
+        """
+        Compresses the outputs `out` of `func(*args)`. The outputs which alias
+        an input (eg `view`, `_unsafe_view`, `t`...) are kept as they are, or
+        refer to the input if it was compressed: `compressed` maps the storages
+        of the previous outputs to their compressed version.
+        """
+        if compressed is None:
+            compressed = {}
+        inputs = {
+            StorageWeakRef(_get_storage(x))
+            for x in tree_flatten(args)[0]
+            if isinstance(x, torch.Tensor)
+        }
+
+        def _compress(x):
+            if not isinstance(x, torch.Tensor):
+                return x
+            storage = StorageWeakRef(_get_storage(x))
+            if storage in compressed:
+                base, dtype = compressed[storage]
+                return _Alias(base, x) if x.dtype == dtype else x
+            if storage in inputs:
+                return x
+            packed = self._compress_tensor(x)
+            if packed is not x:
+                compressed[storage] = (packed, x.dtype)
+                self.bytes_saved[str(func)] += (
+                    x.numel() * x.element_size() - packed.nbytes()
+                )
+            return packed
+
+        return tree_map(_compress, out)
+
+    @staticmethod
+    def decompress(out):
+        return tree_map(
+            lambda x: x.decompress() if isinstance(x, _COMPRESSED_TYPES) else x,
+            out,
+        )
+
+
 class CachingTorchDispatchMode(TorchDispatchMode):
-    def __init__(self, policy_fn, storage):
+    def __init__(self, policy_fn, storage, compression=None):
         self.policy_fn = policy_fn
         self.storage = storage
+        self.compression = compression
+        # Storages of the outputs compressed during this forward
+        self.compressed: Dict[StorageWeakRef, Any] = {}
 
     def __torch_dispatch__(self, func, types, args=(), kwargs=None):
         if kwargs is None:
@@ -32,15 +210,20 @@ class CachingTorchDispatchMode(TorchDispatchMode):
         if self.policy_fn(func, *args, **kwargs):
             out = func(*args, **kwargs)
             out_detached = tree_map(_detach, out)
+            if self.compression is not None:
+                out_detached = self.compression.compress(
+                    func, out_detached, (args, kwargs), self.compressed
+                )
             self.storage[func].append(out_detached)
             return out
         return func(*args, **kwargs)
 
 
 class CachedTorchDispatchMode(TorchDispatchMode):
-    def __init__(self, policy_fn, storage):
+    def __init__(self, policy_fn, storage, compression=None):
         self.policy_fn = policy_fn
         self.storage = storage
+        self.compression = compression
 
     def __torch_dispatch__(self, func, types, args=(), kwargs=None):
         if kwargs is None:
@@ -52,6 +235,8 @@ class CachedTorchDispatchMode(TorchDispatchMode):
             # policy is too loose
             if self.storage[func]:
                 out = self.storage[func].pop(0)
+                if self.compression is not None:
+                    out = self.compression.decompress(out)
                 return out
         return func(*args, **kwargs)
 
@@ -94,8 +279,163 @@ def list_operators(function, *args, **kwargs):
     return verbose_mode.operators
 
 
+def _tensors_bytes(x) -> int:
+    return sum(
+        t.numel() * t.element_size()
+        for t in tree_flatten(x)[0]
+        if isinstance(t, torch.Tensor)
+    )
+
+
+def _synchronize(x) -> None:
+    if any(isinstance(t, torch.Tensor) and t.is_cuda for t in tree_flatten(x)[0]):
+        torch.cuda.synchronize()
+
+
+class ProfileOperatorsTorchDispatchMode(TorchDispatchMode):
+    """
+    Records, for every operator, the total size of its outputs and
+    the time it took to compute them, ie what storing them would cost
+    and what it would save on recomputation
+    """
+
+    def __init__(self):
+        self.output_bytes: Dict[Any, int] = defaultdict(int)
+        self.runtime: Dict[Any, float] = defaultdict(float)
+
+    def __torch_dispatch__(self, func, types, args=(), kwargs=None):
+        if kwargs is None:
+            kwargs = {}
+        _synchronize(args)
+        start = time.perf_counter()
+        out = func(*args, **kwargs)
+        _synchronize(out)
+        self.runtime[func] += time.perf_counter() - start
+        self.output_bytes[func] += _tensors_bytes(out)
+        return out
+
+
+def _solve_knapsack(
+    output_bytes: Dict[Any, int], runtime: Dict[Any, float], memory_budget: int
+) -> Set[Any]:
+    """
+    Picks the operators to store, so that their total output size fits in
+    `memory_budget` bytes while saving as much recomputation time as possible.
+    This is a 0/1 knapsack, solved by dynamic programming over the budget
+    discretized in (at most) 1024 steps, the sizes being rounded up.
+    """
+    ops = [op for op in output_bytes if runtime[op] > 0]
+    step = max(1, math.ceil(memory_budget / 1024))
+    capacity = max(0, memory_budget) // step
+    weights = [math.ceil(output_bytes[op] / step) for op in ops]
+
+    # best[c]: the best runtime saved with at most `c` steps of memory
+    best = [0.0] * (capacity + 1)
+    taken = [[False] * (capacity + 1) for _ in ops]
+    for i, op in enumerate(ops):
+        for c in range(capacity, weights[i] - 1, -1):
+            value = best[c - weights[i]] + runtime[op]
+            if value > best[c]:
+                best[c] = value
+                taken[i][c] = True
+
+    selected = set()
+    c = capacity
+    for i in reversed(range(len(ops))):
+        if taken[i][c]:
+            selected.add(ops[i])
+            c -= weights[i]
+    return selected
+
+
+_auto_policy_cache: Dict[Hashable, Set[Any]] = {}
+
+
+def _signature(x) -> Hashable:
+    if isinstance(x, torch.Tensor):
+        return ("tensor", tuple(x.shape), x.dtype, x.device.type, x.requires_grad)
+    if isinstance(x, torch.nn.Module):
+        return (
+            type(x).__qualname__,
+            x.training,
+            tuple((n, tuple(p.shape), p.dtype) for n, p in x.named_parameters()),
+        )
+    if x is None or isinstance(x, (bool, int, float, str)):
+        return x
+    if isinstance(x, (list, tuple)):
+        return tuple(_signature(y) for y in x)
+    if hasattr(x, "__self__") and hasattr(x, "__func__"):
+        # Bound methods (eg `block.forward`) forward `__code__`, but depend on
+        # their object
+        return (_signature(x.__self__), x.__func__.__code__)
+    if hasattr(x, "__code__"):
+        # Functions and lambdas, which could share a name
+        return x.__code__
+    return getattr(x, "__qualname__", type(x).__qualname__)
+
+
+def _module_buffers(function) -> List[torch.Tensor]:
+    # `function` is either a module, a method of a module, or a function
+    module = getattr(function, "__self__", function)
+    if not isinstance(module, torch.nn.Module):
+        return []
+    return list(module.buffers())
+
+
+def get_optimal_checkpoint_policy(
+    function, *args, memory_budget: int, **kwargs
+) -> Callable[..., bool]:
+    """
+    Returns a policy for :func:`checkpoint` which stores the outputs of the
+    operators of `function` that save the most recomputation time, while
+    keeping the stored outputs under `memory_budget` bytes.
+
+    The policy is found by running `function` once under a profiling mode,
+    and is cached per signature: type and parameters of the module (or
+    function), shapes and dtypes of the inputs, and memory budget. All the
+    identical blocks of a model hence share the same profiling run.
+    """
+    key = (
+        _signature(function),
+        memory_budget,
+        _signature(args),
+        _signature(tuple(sorted(kwargs.items()))),
+        torch.is_autocast_enabled(),
+        torch.is_autocast_cpu_enabled(),
+    )
+    selected = _auto_policy_cache.get(key)
+    if selected is None:
+        rng_devices = []
+        if torch.cuda.is_initialized():
+            rng_devices = get_device_states(*args)[0]
+        profile_mode = ProfileOperatorsTorchDispatchMode()
+        # The profiling run must not change the state seen by the actual forward:
+        # the RNG, and the buffers updated in place (eg BatchNorm running stats)
+        with torch.random.fork_rng(devices=rng_devices), torch.no_grad():
+            buffers = [(b, b.clone()) for b in _module_buffers(function)]
+            with profile_mode:
+                function(*args, **kwargs)
+            for buffer, saved in buffers:
+                buffer.copy_(saved)
+        selected = _solve_knapsack(
+            profile_mode.output_bytes, profile_mode.runtime, memory_budget
+        )
+        _auto_policy_cache[key] = selected
+
+    def _auto_policy(func, *args, **kwargs):
+        return func in selected
+
+    return _auto_policy
+
+
 def checkpoint(
-    function, *args, preserve_rng_state=True, policy_fn=None, **kwargs
+    function,
+    *args,
+    preserve_rng_state=True,
+    policy_fn=None,
+    memory_budget: Optional[int] = None,
+    compression: Optional[Union[str, ActivationCompression]] = None,
+    **kwargs,
 ) -> Any:
     """Checkpointining with custom policy function for selectively deciding
     what to store and what to recompute
@@ -115,6 +455,14 @@ def checkpoint(
             Additionally, a list[Op] is also supported for easier cases.
             The op should be in the format `torch.ops.***`, where the `***`
             names of operators can be obtained with `list_operators`.
+        memory_budget(int, optional): when no `policy_fn` is given, the number
+            of bytes which can be used to store the outputs of the operators.
+            The policy is then found automatically, see
+            :func:`get_optimal_checkpoint_policy`.
+        compression(Union[str, ActivationCompression], optional): compresses
+            the stored outputs, ``"bf16"`` or ``"int8"``, see
+            :class:`ActivationCompression`. Pass an instance to read the
+            number of bytes saved per operator.
         *args: Arguments to pass in to the given ``function``.
         **kwargs: Keyword arguments to pass into the given ``function``.
     """
@@ -122,6 +470,11 @@ def checkpoint(
     # Requires PyTorch 1.13 at least
     from torch.utils.checkpoint import _get_autocast_kwargs
 
+    if policy_fn is None and memory_budget is not None and torch.is_grad_enabled():
+        policy_fn = get_optimal_checkpoint_policy(
+            function, *args, memory_budget=memory_budget, **kwargs
+        )
+
     # Accommodates the (remote) possibility that autocast is enabled for cpu AND gpu.
     gpu_autocast_kwargs, cpu_autocast_kwargs = _get_autocast_kwargs()
 
@@ -156,14 +509,17 @@ def checkpoint(
     else:
         assert callable(policy_fn), "policy_fn should be None, list or a callable"
 
+    if isinstance(compression, str):
+        compression = ActivationCompression(compression)
+
     temp_storage: Dict[Any, List[Any]] = defaultdict(list)
     # assumption: grad_mode doesn't change inside function
     caching_mode: ContextManager[None]
     if torch.is_grad_enabled():
-        caching_mode = CachingTorchDispatchMode(policy_fn, temp_storage)
+        caching_mode = CachingTorchDispatchMode(policy_fn, temp_storage, compression)
     else:
         caching_mode = nullcontext()
-    cached_mode = CachedTorchDispatchMode(policy_fn, temp_storage)
+    cached_mode = CachedTorchDispatchMode(policy_fn, temp_storage, compression)
 
     def pack(x):
         # TODO(varal7): Instead of returning abstract object, we can return things metadata (such as
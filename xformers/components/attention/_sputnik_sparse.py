@@ -7,7 +7,7 @@
 import torch
 
 from xformers.ops import masked_matmul
-from xformers.sparse import SparseCSRTensor
+from xformers.sparse import SparseCSRTensor, load_sparse, save_sparse
 
 # TODO: this is here for BC
 from xformers.sparse.utils import _csr_to_coo, _dense_to_sparse  # noqa: F401
@@ -81,6 +81,17 @@ class SparseCS:
         matrix._mat = csr_matrix
         return matrix
 
+    def save(self, path):
+        """
+        Saves the mask, with its precomputed structures, see
+        :func:`xformers.sparse.save_sparse`
+        """
+        save_sparse(path, self._mat)
+
+    @classmethod
+    def load(cls, path, device=None, mmap=True):
+        return cls._wrap(load_sparse(path, device=device, mmap=mmap))
+
     def __mul__(self, other):
         assert isinstance(other, (int, float))
         return type(self)._wrap(self._mat * other)
@@ -113,7 +124,8 @@ class SparseCS:
         return self._mat.to_dense()
 
     def logical_and(self, other: torch.Tensor):
-        assert not isinstance(other, SparseCS)
+        if isinstance(other, SparseCS):
+            raise NotImplementedError("logical_and of two SparseCS masks")
         out = torch.logical_and(self._mat, other)
         return type(self)._wrap(out)
 
@@ -5,7 +5,7 @@
 
 
 import math
-from typing import List
+from typing import List, Optional, Sequence, Tuple
 
 import numpy as np
 import torch
@@ -16,6 +16,8 @@ from xformers.components.attention.sparsity_config import (
     FixedSparsityConfig,
     VariableSparsityConfig,
 )
+from xformers.ops.common import BaseOperator, get_xformers_operator, register_operator
+from xformers.sparse.utils import _csr_to_coo, _nonzero_mask_to_sparse_csr_indices
 
 
 # generic nd cases
@@ -293,3 +295,154 @@ def layout_to_pattern(layout: torch.Tensor, block_size: int):
     layout of shape [heads, seq/block_size, seq/block_size]
     """
     return torch.kron(layout, torch.ones(block_size, block_size))
+
+
+# CSR generators
+# Same patterns as above, returned as the ``(row_offsets, column_indices)`` (int32)
+# of their CSR structure, without building the dense [N, N] mask.
+# They are generated in O(nnz) time and memory by native kernels when available,
+# and match the dense patterns exactly.
+
+CSRPattern = Tuple[torch.Tensor, torch.Tensor]
+
+
+@register_operator
+class LocalNdPatternCSROp(BaseOperator):
+    OPERATOR = get_xformers_operator("local_nd_pattern_csr")
+    OPERATOR_CATEGORY = "sparse"
+    NAME = "local_nd_pattern_csr"
+
+
+@register_operator
+class SwinPatternCSROp(BaseOperator):
+    OPERATOR = get_xformers_operator("swin_pattern_csr")
+    OPERATOR_CATEGORY = "sparse"
+    NAME = "swin_pattern_csr"
+
+
+@register_operator
+class Dilated2dPatternCSROp(BaseOperator):
+    OPERATOR = get_xformers_operator("dilated_2d_pattern_csr")
+    OPERATOR_CATEGORY = "sparse"
+    NAME = "dilated_2d_pattern_csr"
+
+
+@register_operator
+class Causal1dPatternCSROp(BaseOperator):
+    OPERATOR = get_xformers_operator("causal_1d_pattern_csr")
+    OPERATOR_CATEGORY = "sparse"
+    NAME = "causal_1d_pattern_csr"
+
+
+@register_operator
+class GlobalTokenPatternCSROp(BaseOperator):
+    OPERATOR = get_xformers_operator("global_token_pattern_csr")
+    OPERATOR_CATEGORY = "sparse"
+    NAME = "global_token_pattern_csr"
+
+
+def _mask_to_csr(mask: torch.Tensor) -> CSRPattern:
+    _, row_offsets, column_indices = _nonzero_mask_to_sparse_csr_indices(
+        mask, mask.device
+    )
+    return row_offsets, column_indices
+
+
+def local_nd_pattern_csr(
+    *sizes, distance, p=2.0, weights: Optional[Sequence[float]] = None
+) -> CSRPattern:
+    if weights is None:
+        weights = (1,) * len(sizes)
+    if not LocalNdPatternCSROp.is_available():
+        return _mask_to_csr(
+            local_nd_distance(*sizes, p=p, weights=weights) < distance
+        )
+    return LocalNdPatternCSROp.OPERATOR(
+        list(sizes), [float(w) for w in weights], float(distance), float(p)
+    )
+
+
+def axial_nd_pattern_csr(*sizes) -> CSRPattern:
+    return local_nd_pattern_csr(*sizes, distance=2, p=0)
+
+
+def local_1d_pattern_csr(attn_size: int, window_size: int) -> CSRPattern:
+    assert (
+        window_size % 2 == 1
+    ), "The window size is assumed to be odd (counts self-attention + 2 wings)"
+    h_win_size = window_size // 2 + 1
+    return local_nd_pattern_csr(attn_size, distance=h_win_size, p=1.0)
+
+
+def causal_1d_pattern_csr(attn_size: int) -> CSRPattern:
+    if not Causal1dPatternCSROp.is_available():
+        return _mask_to_csr(causal_1d_pattern(attn_size))
+    return Causal1dPatternCSROp.OPERATOR(attn_size)
+
+
+def local_2d_pattern_csr(H, W, distance, p=2.0) -> CSRPattern:
+    return local_nd_pattern_csr(H, W, distance=distance, p=p)
+
+
+def axial_2d_pattern_csr(H, W) -> CSRPattern:
+    return axial_nd_pattern_csr(H, W)
+
+
+def swin_attention_pattern_csr(H, W, window_size, shift_size=0) -> CSRPattern:
+    if not SwinPatternCSROp.is_available():
+        return _mask_to_csr(swin_attention_pattern(H, W, window_size, shift_size))
+    return SwinPatternCSROp.OPERATOR(H, W, window_size, shift_size)
+
+
+def dilated_2d_pattern_csr(H, W, k=2) -> CSRPattern:
+    if not Dilated2dPatternCSROp.is_available():
+        return _mask_to_csr(dilated_2d_pattern(H, W, k))
+    return Dilated2dPatternCSROp.OPERATOR(H, W, k)
+
+
+def global_token_pattern_csr(attention_query_mask: torch.Tensor) -> CSRPattern:
+    if not GlobalTokenPatternCSROp.is_available():
+        return _mask_to_csr(global_token_pattern(attention_query_mask))
+    return GlobalTokenPatternCSROp.OPERATOR(attention_query_mask)
+
+
+def random_pattern_csr(
+    attn_size: int, sparsity: float, rows_per_chunk: int = 1024
+) -> CSRPattern:
+    """
+    Same as :attr:`random_pattern`, drawing the same random numbers, but only
+    ``rows_per_chunk`` rows of the mask are materialized at once
+    """
+    assert 0 < sparsity < 1
+    row_offsets = [torch.zeros([1], dtype=torch.int32)]
+    column_indices = []
+    nnz = 0
+    for start in range(0, attn_size, rows_per_chunk):
+        rows = min(rows_per_chunk, attn_size - start)
+        mask = torch.rand(rows, attn_size) > sparsity
+        row_lengths = mask.sum(dim=1, dtype=torch.int32)
+        row_offsets.append(row_lengths.cumsum(0, dtype=torch.int32) + nnz)
+        column_indices.append(torch.where(mask)[1].to(torch.int32))
+        nnz += int(row_lengths.sum())
+    return torch.cat(row_offsets), torch.cat(column_indices)
+
+
+def csr_pattern_to_layout(
+    row_offsets: torch.Tensor,
+    column_indices: torch.Tensor,
+    shape: Tuple[int, int],
+    block_size: int,
+) -> torch.Tensor:
+    """
+    Same as :attr:`pattern_to_layout`, for a pattern given in CSR form
+    """
+    m, n = shape
+    assert (
+        m % block_size == 0 and n % block_size == 0
+    ), "We're only handling masks divisible by block_size"
+    rows, _ = _csr_to_coo(m, n, row_offsets, column_indices)
+    layout = torch.zeros(
+        [m // block_size, n // block_size], dtype=torch.long, device=rows.device
+    )
+    layout[rows.long() // block_size, column_indices.long() // block_size] = 1
+    return layout
@@ -12,6 +12,7 @@ import torch
 
 from xformers import _is_triton_available
 from xformers.components.attention import Attention, AttentionConfig, register_attention
+from xformers.sparse import _blocksparse_ops
 
 logger = logging.getLogger("xformers")
 
@@ -32,8 +33,11 @@ if _is_blocksparse_available:
         )
         _is_blocksparse_available = False
 
+# Native kernels, used for CPU tensors
+_is_blocksparse_cpu_available = _blocksparse_ops._has_cpu_kernels()
 
-if _is_blocksparse_available:
+
+if _is_blocksparse_available or _is_blocksparse_cpu_available:
 
     @dataclass
     class BlockSparseAttentionConfig(AttentionConfig):
@@ -42,10 +46,10 @@ if _is_blocksparse_available:
         dropout: float
         num_heads: int
 
-    @register_attention("blocksparse", BlockSparseAttentionConfig)
     class BlockSparseAttention(Attention):
         r"""
         Thin wrap over the Triton blocksparse computations. The sparsity pattern is determined through the layout.
+        CPU tensors are handled by native kernels (see :attr:`xformers.sparse.BlockSparseTensor`).
 
         .. warning: the layout is assumed to have the dimensions [heads, seq, seq].
             If some dimensions are missing, we assume that the same layout is to be used across heads.
@@ -150,11 +154,6 @@ if _is_blocksparse_available:
             .. note: Per element attention mask is not supported, but you can specify causality
             """
 
-            # Delayed triton init, to make sure that we get the right device
-            # Infer device from query
-            if not hasattr(self, "sparse_dot_sdd"):
-                self.create_triton_kernels(q.device)
-
             assert (
                 q.shape[-2] == k.shape[-2]
             ), "Blocksparse requires the same dimensions for K and Q for now"
@@ -176,6 +175,14 @@ if _is_blocksparse_available:
             # When the computations are block sparse, the matrix types change along the way:
             # - (sparse) attention matrix = (dense) Kt * (dense) Q
             q = q / math.sqrt(q.size(-1))
+            if q.device.type == "cpu":
+                return self._cpu_forward(q, k, v, scale)
+
+            # Delayed triton init, to make sure that we get the right device
+            # Infer device from query
+            if not hasattr(self, "sparse_dot_sdd"):
+                self.create_triton_kernels(q.device)
+
             sparse_att_mat = self.sparse_dot_sdd(q, k)
 
             # - softmax on the sparse attention matrix
@@ -188,3 +195,19 @@ if _is_blocksparse_available:
             # - then (dense) attention is (sparse) attention matrix * dense (value)
             a = self.sparse_dot_dsd(sparse_att_mat, v)
             return a
+
+        def _cpu_forward(
+            self, q: torch.Tensor, k: torch.Tensor, v: torch.Tensor, scale: float
+        ) -> torch.Tensor:
+            assert (
+                _is_blocksparse_cpu_available
+            ), "Blocksparse on CPU requires the xFormers C++ extensions"
+            layout = self.layout.to(q.device)
+            sparse_att_mat = _blocksparse_ops.blocksparse_sddmm(q, k, layout)
+            sparse_att_mat = _blocksparse_ops.blocksparse_softmax(
+                sparse_att_mat, layout, scale=scale, causal=self.causal
+            )
+            sparse_att_mat = self.attn_drop(sparse_att_mat)
+            return _blocksparse_ops.blocksparse_spmm(sparse_att_mat, layout, v)
+
+    register_attention("blocksparse", BlockSparseAttentionConfig)(BlockSparseAttention)
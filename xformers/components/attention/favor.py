@@ -20,10 +20,89 @@ from xformers.components.attention.feature_maps import (
     SMOrf,
     SMReg,
 )
+from xformers.ops.common import BaseOperator, get_xformers_operator, register_operator
 
 logger = logging.getLogger("xformers")
 
 
+@register_operator
+class CausalLinearAttentionOp(BaseOperator):
+    OPERATOR = get_xformers_operator("causal_linear_attention")
+    OPERATOR_CATEGORY = "favor"
+    NAME = "causal_linear_attention"
+
+
+@register_operator
+class CausalLinearAttentionBwOp(BaseOperator):
+    OPERATOR = get_xformers_operator("causal_linear_attention_backward")
+    OPERATOR_CATEGORY = "favor"
+    NAME = "causal_linear_attention_backward"
+
+
+def _linear_scan_torch(
+    a: torch.Tensor, b: torch.Tensor, c: torch.Tensor, chunk_size: int, reverse: bool
+) -> torch.Tensor:
+    """
+    ``out[:, i] = sum <a[:, i], b[:, j]> c[:, j]`` over the ``j <= i``, or the
+    ``j >= i`` with ``reverse``, scanning the sequence by chunks with a running
+    ``[B, F, E]`` state
+    """
+    out = torch.empty(a.shape[:2] + c.shape[2:], dtype=c.dtype, device=c.device)
+    state = c.new_zeros(a.shape[0], a.shape[2], c.shape[2])
+    starts = list(range(0, a.shape[1], chunk_size))
+    for start in reversed(starts) if reverse else starts:
+        chunk = slice(start, start + chunk_size)
+        scores = a[:, chunk] @ b[:, chunk].transpose(1, 2)
+        scores = scores.triu() if reverse else scores.tril()
+        out[:, chunk] = scores @ c[:, chunk] + a[:, chunk] @ state
+        state = state + b[:, chunk].transpose(1, 2) @ c[:, chunk]
+    return out
+
+
+def _use_cpu_kernel(op, *tensors: torch.Tensor) -> bool:
+    return op.is_available() and all(t.device.type == "cpu" for t in tensors)
+
+
+class _CausalLinearAttention(torch.autograd.Function):
+    @staticmethod
+    # type: ignore
+    def forward(ctx, q, k, v, chunk_size):
+        ctx.save_for_backward(q, k, v)
+        ctx.chunk_size = chunk_size
+        if _use_cpu_kernel(CausalLinearAttentionOp, q, k, v):
+            return CausalLinearAttentionOp.OPERATOR(q, k, v, chunk_size)
+        return _linear_scan_torch(q, k, v, chunk_size, reverse=False)
+
+    @staticmethod
+    # type: ignore
+    def backward(ctx, grad):
+        q, k, v = ctx.saved_tensors
+        chunk_size = ctx.chunk_size
+        if _use_cpu_kernel(CausalLinearAttentionBwOp, q, k, v):
+            dq, dk, dv = CausalLinearAttentionBwOp.OPERATOR(
+                grad.contiguous(), q, k, v, chunk_size
+            )
+        else:
+            dq = _linear_scan_torch(grad, v, k, chunk_size, reverse=False)
+            dk = _linear_scan_torch(v, grad, q, chunk_size, reverse=True)
+            dv = _linear_scan_torch(k, q, grad, chunk_size, reverse=True)
+        return dq, dk, dv, None
+
+
+def causal_linear_attention(
+    q: torch.Tensor, k: torch.Tensor, v: torch.Tensor, chunk_size: int = 128
+) -> torch.Tensor:
+    """
+    Computes ``out[:, i] = sum_{j <= i} <q[:, i], k[:, j]> v[:, j]`` for
+    ``q``, ``k`` of shape ``[B, N, F]`` and ``v`` of shape ``[B, N, E]``.
+
+    The sequence is processed by chunks of ``chunk_size``, with dense matmuls
+    within a chunk and a running ``[F, E]`` state between chunks, so that the
+    memory is ``O(B * F * E)`` instead of ``O(B * N * F * E)``.
+    """
+    return _CausalLinearAttention.apply(q, k, v, chunk_size)
+
+
 @dataclass
 class FavorAttentionConfig(AttentionConfig):
     causal: Optional[bool]
@@ -119,19 +198,10 @@ class FavorAttention(Attention):
     def _causal_attention(
         k_prime: torch.Tensor, q_prime: torch.Tensor, v: torch.Tensor
     ) -> Tuple[torch.Tensor, torch.Tensor]:
-        # Algorithm 1 in the paper
-        ref_v = torch.ones_like(v.unsqueeze(2))  # BATCH x SEQ x 1 x EMB
-        Gps = k_prime.unsqueeze(3) * v.unsqueeze(2)
-        Grenorm = k_prime.unsqueeze(3) * ref_v
-
-        # Consolidate against the feature dimension
-        att_raw = torch.einsum("bcfe,bcf->bce", Gps, q_prime)
-        att_norm = torch.einsum("bcfe,bcf->bce", Grenorm, q_prime)
-
-        # Cumulative sum over the sequence
-        att_raw = att_raw.cumsum(2)
-        att_norm = att_norm.cumsum(2)
-
+        # Algorithm 1 in the paper, without materializing the prefix sums of
+        # k_prime (x) v: see `causal_linear_attention`
+        att_raw = causal_linear_attention(q_prime, k_prime, v)
+        att_norm = (q_prime * k_prime.cumsum(1)).sum(-1, keepdim=True)
         return att_raw, att_norm
 
     def forward(
@@ -7,6 +7,60 @@ import torch
 from torch.cuda.amp import autocast
 
 from xformers.components.attention import Attention, AttentionConfig, register_attention
+from xformers.ops.common import BaseOperator, get_xformers_operator, register_operator
+
+
+@register_operator
+class FourierMixOp(BaseOperator):
+    OPERATOR = get_xformers_operator("fourier_mix")
+    OPERATOR_CATEGORY = "fourier_mix"
+    NAME = "fourier_mix"
+
+
+@register_operator
+class FourierMixBwOp(BaseOperator):
+    OPERATOR = get_xformers_operator("fourier_mix_backward")
+    OPERATOR_CATEGORY = "fourier_mix"
+    NAME = "fourier_mix_backward"
+
+
+def _use_cpu_kernel(x: torch.Tensor) -> bool:
+    return (
+        x.device.type == "cpu"
+        and FourierMixOp.is_available()
+        and FourierMixBwOp.is_available()
+    )
+
+
+def _real_fft2_torch(x: torch.Tensor) -> torch.Tensor:
+    """
+    ``torch.fft.fft2(x).real`` for a real ``x`` of shape ``[..., S, H]``.
+    The spectrum is Hermitian, so only the first ``H // 2 + 1`` frequencies of
+    the hidden dimension are computed, and the others are mirrored from them:
+    ``Re(Z[s, h]) = Re(Z[-s % S, H - h])``
+    """
+    H = x.shape[-1]
+    half = torch.fft.fft(torch.fft.rfft(x, dim=-1), dim=-2).real
+    mirror = torch.roll(half.flip(-2), 1, dims=-2)
+    mirror = mirror[..., 1 : H - half.shape[-1] + 1].flip(-1)
+    return torch.cat([half, mirror], dim=-1)
+
+
+# Re(fft2) is symmetric, the backward is the same transform of the gradient,
+# after the dropout mask which is regenerated from the seed
+class _FourierMixCPU(torch.autograd.Function):
+    @staticmethod
+    # type: ignore
+    def forward(ctx, x, p):
+        seed = int(torch.randint(2**62, (1,)).item())
+        ctx.seed = seed
+        ctx.p = p
+        return FourierMixOp.OPERATOR(x, p, seed)
+
+    @staticmethod
+    # type: ignore
+    def backward(ctx, grad_out):
+        return FourierMixBwOp.OPERATOR(grad_out, ctx.p, ctx.seed), None
 
 
 @register_attention("fourier_mix", AttentionConfig)
@@ -26,9 +80,17 @@ class FourierMix(Attention):
         self.requires_input_projection = False
 
     def forward(self, q: torch.Tensor, *_, **__):
+        p = self.attn_drop.p if self.training else 0.0
+        if _use_cpu_kernel(q):
+            # Half precision inputs are converted to float tile by tile
+            return _FourierMixCPU.apply(q, p)
+
         # Guard against autocast / fp16, not supported by torch.fft.fft2
         with autocast(enabled=False):
-            att = torch.fft.fft2(q).real
+            if q.dtype in (torch.float16, torch.bfloat16):
+                att = _real_fft2_torch(q.float()).to(q.dtype)
+            else:
+                att = _real_fft2_torch(q)
 
         att = self.attn_drop(att)
 
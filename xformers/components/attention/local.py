@@ -23,6 +23,7 @@ from xformers.components.attention.attention_patterns import (
     local_1d_pattern,
 )
 from xformers.components.attention.core import scaled_dot_product_attention
+from xformers.ops import fmha
 
 
 @dataclass
@@ -93,6 +94,26 @@ class LocalAttention(Attention):
 
         return mask
 
+    def _get_local_bias(self) -> fmha.attn_bias.LocalAttentionFromBottomRightMask:
+        # Same band as `_get_local_mask`, queries and keys having the same length
+        if self.causal:
+            return fmha.attn_bias.LocalAttentionFromBottomRightMask(
+                window_left=self.window_size, window_right=0
+            )
+        return fmha.attn_bias.LocalAttentionFromBottomRightMask(
+            window_left=self.window_size // 2, window_right=self.window_size // 2
+        )
+
+    def _can_use_banded_kernel(self, q: torch.Tensor, att_mask) -> bool:
+        return (
+            att_mask is None
+            and not self.force_sparsity
+            and (self.attn_drop.p == 0.0 or not self.training)
+            and q.device.type == "cpu"
+            and q.dtype in fmha.sliding_window.FwOp.SUPPORTED_DTYPES
+            and fmha.sliding_window.FwOp.is_available()
+        )
+
     def forward(
         self,
         q: torch.Tensor,
@@ -102,6 +123,17 @@ class LocalAttention(Attention):
         *args,
         **kwargs,
     ):
+        # The band is hardcoded in the kernel: only the keys within the window of
+        # each query are visited, and no mask is built
+        if self._can_use_banded_kernel(q, att_mask):
+            return fmha.memory_efficient_attention(
+                q,
+                k,
+                v,
+                attn_bias=self._get_local_bias(),
+                op=fmha.MemoryEfficientAttentionSlidingWindowOp,
+            )
+
         # Local window attention masking
         if self.attention_mask is None or self.attention_mask.shape[1] != q.shape[1]:
             self.attention_mask = self._get_local_mask(q.shape).to(q.device)
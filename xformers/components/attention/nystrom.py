@@ -21,10 +21,18 @@ from xformers.components.attention.utils import (
     iterative_pinv,
     reshape_key_padding_mask,
 )
+from xformers.ops.common import BaseOperator, get_xformers_operator, register_operator
 
 logger = logging.getLogger("xformers")
 
 
+@register_operator
+class NystromAttentionOp(BaseOperator):
+    OPERATOR = get_xformers_operator("nystrom_attention")
+    OPERATOR_CATEGORY = "nystrom"
+    NAME = "nystrom_attention"
+
+
 @dataclass
 class NystromSelfAttentionConfig(AttentionConfig):
     """
@@ -225,6 +233,17 @@ class NystromAttention(Attention):
 
             x = scaled_dot_product_attention(q=q, k=k, v=v, att_mask=mask)
 
+        elif self._can_use_fused_kernel(q, k, v, key_padding_mask):
+            # Same computations as below, without the [N, m] intermediates
+            x = NystromAttentionOp.OPERATOR(
+                q,
+                k,
+                v,
+                self.num_landmarks,
+                self.inv_iterations,
+                self.pinverse_original_init,
+            )
+
         else:
             q_landmarks = self.landmark_pooling(q)
             k_landmarks = self.landmark_pooling(k)
@@ -283,6 +302,29 @@ class NystromAttention(Attention):
         x = self.attn_drop(x)
         return x
 
+    def _can_use_fused_kernel(
+        self,
+        q: torch.Tensor,
+        k: torch.Tensor,
+        v: torch.Tensor,
+        key_padding_mask: Optional[torch.Tensor],
+    ) -> bool:
+        # The fused kernel has no backward, and only covers the default options
+        needs_grad = torch.is_grad_enabled() and any(
+            x.requires_grad for x in (q, k, v)
+        )
+        return (
+            not needs_grad
+            and not self.causal
+            and key_padding_mask is None
+            and self.use_razavi_pinverse
+            and type(self.landmark_pooling) is AvgPool
+            and self.landmark_pooling.n == self.num_landmarks
+            and all(x.device.type == "cpu" for x in (q, k, v))
+            and q.dtype == k.dtype == v.dtype
+            and NystromAttentionOp.is_available()
+        )
+
     def _triu_mask(self, dim_1: int, dim_2: int, dim_3: int, **kwargs) -> torch.Tensor:
         device = kwargs["device"]
         dtype = kwargs["dtype"]
@@ -5,13 +5,14 @@
 
 
 import logging
+import math
 from dataclasses import dataclass
 from enum import Enum
-from typing import Any, Callable, Optional, Union
+from typing import Any, Callable, Optional, Tuple, Union
 
 import torch
 
-from xformers.components import Activation
+from xformers.components import Activation, build_activation
 from xformers.components.feedforward import (
     Feedforward,
     FeedforwardConfig,
@@ -26,8 +27,17 @@ _is_fairscale_available = True
 try:
     import torch.distributed as dist
     from fairscale.nn import MOELayer, Top2Gate  # type: ignore
+    from fairscale.nn.moe import top2gate  # type: ignore
 
     from xformers.components.feedforward import MLP
+    from xformers.ops.moe import (
+        MoERouting,
+        grouped_linear,
+        grouped_swiglu,
+        permute_tokens,
+        topk_route,
+        unpermute_tokens,
+    )
 
 except ImportError:
     logger.warning(
@@ -53,10 +63,123 @@ if _is_fairscale_available:
             output = torch.zeros(
                 s, self.num_experts, capacity, dtype=input.dtype, device=input.device
             )
-            for i in range(s):
-                output[i, i % self.num_experts, i // self.num_experts] = 1.0
+            tokens = torch.arange(s, device=input.device)
+            output[tokens, tokens % self.num_experts, tokens // self.num_experts] = 1.0
             return 0.0, output, output.bool()
 
+        def route(self, input) -> Tuple[float, MoERouting, torch.Tensor]:
+            """Same assignment as `forward`, as a compact routing"""
+            s = input.shape[0]
+            assert s % self.num_experts == 0, f"{s} % {self.num_experts} != 0"
+            tokens_per_expert = s // self.num_experts
+            tokens = torch.arange(s, device=input.device)
+            experts = tokens % self.num_experts
+            routing = MoERouting(
+                experts=experts.unsqueeze(1),
+                positions=(
+                    experts * tokens_per_expert + tokens // self.num_experts
+                ).unsqueeze(1),
+                expert_offsets=torch.arange(
+                    self.num_experts + 1, device=input.device
+                )
+                * tokens_per_expert,
+            )
+            gates = torch.ones([s, 1], dtype=input.dtype, device=input.device)
+            return 0.0, routing, gates
+
+    def _top2_route(
+        gate: Top2Gate, input: torch.Tensor
+    ) -> Tuple[torch.Tensor, MoERouting, torch.Tensor]:
+        """
+        Compact version of FairScale's top-2 gating, reusing the weights of ``gate``.
+        The choices, capacity and load balancing loss are the ones of ``top2gating``:
+        the second expert is selected with Gumbel noise.
+        """
+        logits = gate.wg(input)
+        num_tokens, num_experts = logits.shape
+        gates = torch.softmax(logits, dim=1, dtype=torch.float)
+        capacity = 2 * math.ceil(num_tokens / num_experts)
+
+        # The best expert first, then the best one of the noisy logits
+        first = torch.argmax(gates, dim=1, keepdim=True)
+        noise = top2gate.gumbel_rsample(logits.shape, device=logits.device)
+        route_logits = (logits.detach() + noise).scatter(1, first, math.inf)
+        routing = topk_route(route_logits, k=2, capacity=capacity)
+
+        # Load balancing loss, computed on the first choices
+        me = torch.mean(gates, dim=0)
+        ce = (
+            torch.bincount(routing.experts[:, 0], minlength=num_experts).float()
+            / num_tokens
+        )
+        l_aux = torch.mean(me * ce).to(logits.dtype)
+
+        # Dropped tokens do not contribute, the others are normalized
+        topk_gates = gates.gather(1, routing.experts) * (routing.positions >= 0)
+        topk_gates = topk_gates / topk_gates.sum(dim=1, keepdim=True).clamp(
+            min=torch.finfo(gates.dtype).eps
+        )
+        return l_aux, routing, topk_gates.to(input.dtype)
+
+    def _init_stacked_linear(
+        num_experts: int, out_features: int, in_features: int
+    ) -> Tuple[torch.nn.Parameter, torch.nn.Parameter]:
+        """Weights of ``num_experts`` linear layers, initialized like ``nn.Linear``"""
+        bound = 1 / math.sqrt(in_features)
+        w = torch.empty([num_experts, out_features, in_features])
+        b = torch.empty([num_experts, out_features])
+        torch.nn.init.uniform_(w, -bound, bound)
+        torch.nn.init.uniform_(b, -bound, bound)
+        return torch.nn.Parameter(w), torch.nn.Parameter(b)
+
+    class GroupedMLPExperts(torch.nn.Module):
+        """
+        The MLPs of all the experts, with their weights stacked so that they
+        all run in one grouped GEMM per layer (see :attr:`xformers.ops.moe.grouped_linear`)
+        """
+
+        def __init__(
+            self,
+            num_experts: int,
+            dim_model: int,
+            dim_mlp: int,
+            dropout: float,
+            activation: Activation,
+        ):
+            super().__init__()
+            self.w1, self.b1 = _init_stacked_linear(num_experts, dim_mlp, dim_model)
+            self.w2, self.b2 = _init_stacked_linear(num_experts, dim_model, dim_mlp)
+            self.activation = build_activation(activation)
+            self.dropout = torch.nn.Dropout(dropout)
+
+        def forward(
+            self, dispatched: torch.Tensor, expert_offsets: torch.Tensor
+        ) -> torch.Tensor:
+            hidden = grouped_linear(dispatched, self.w1, self.b1, expert_offsets)
+            hidden = self.dropout(self.activation(hidden))
+            out = grouped_linear(hidden, self.w2, self.b2, expert_offsets)
+            return self.dropout(out)
+
+    class GroupedSwiGLUExperts(torch.nn.Module):
+        """
+        The SwiGLUs of all the experts, with their weights stacked
+        (see :attr:`xformers.ops.moe.grouped_swiglu`)
+        """
+
+        def __init__(self, num_experts: int, dim_model: int, dim_hidden: int):
+            super().__init__()
+            self.w12, self.b12 = _init_stacked_linear(
+                num_experts, 2 * dim_hidden, dim_model
+            )
+            self.w3, self.b3 = _init_stacked_linear(num_experts, dim_model, dim_hidden)
+
+        def forward(
+            self, dispatched: torch.Tensor, expert_offsets: torch.Tensor
+        ) -> torch.Tensor:
+            return grouped_swiglu(
+                dispatched, expert_offsets, self.w12, self.b12, self.w3, self.b3
+            )
+
     class GateConfig(str, Enum):
         RoundRobin = "round_robin"
         Top2 = "top_2"
@@ -70,6 +193,9 @@ if _is_fairscale_available:
         expert_constructor: Optional[Any] = None
         hidden_layer_multiplier: Optional[int] = None
         group: Optional[Any] = None
+        swiglu_experts: bool = False
+        compact_dispatch: bool = False
+        grouped_experts: bool = False
 
     @register_feedforward("MixtureOfExperts", MoEConfig)
     class MixtureOfExperts(Feedforward):
@@ -79,6 +205,17 @@ if _is_fairscale_available:
 
         .. warning: Please note that most of the benefits of MoE are present in a distributed training environmentt
 
+        With ``compact_dispatch``, when all the experts are local and the gate is a
+        round robin or top-2 one, tokens are dispatched with a compact routing
+        (see :attr:`xformers.ops.moe.topk_route`) instead of dense ``[S, E, capacity]`` masks.
+        The gating is the same as FairScale's, Gumbel noise on the second choices of the
+        top-2 gate included.
+        With ``grouped_experts``, which implies ``compact_dispatch``, the default experts
+        then have their weights stacked, and all run in a single grouped GEMM per layer.
+        This changes the keys of the state dict (``grouped_experts.w1``... instead of
+        ``moe.experts.N...``), so it is opt-in.
+        Setting ``swiglu_experts`` uses SwiGLU experts instead of MLPs.
+
         .. _Gshard: https://arxiv.org/pdf/2006.16668.pdf
         .. _FairScale: https://github.com/facebookresearch/fairscale/
         """
@@ -94,6 +231,9 @@ if _is_fairscale_available:
             expert_constructor: Optional[Callable[[], torch.nn.Module]] = None,
             hidden_layer_multiplier: Optional[int] = None,
             group: Optional[Any] = None,
+            swiglu_experts: bool = False,
+            compact_dispatch: bool = False,
+            grouped_experts: bool = False,
             *_,
             **__,
         ):
@@ -125,17 +265,52 @@ if _is_fairscale_available:
             else:
                 self.gate = gate
 
+            # Without expert parallelism, tokens don't need to be exchanged, and they
+            # are dispatched with a compact routing instead of the dense einsums.
+            self.compact_dispatch = (
+                (compact_dispatch or grouped_experts)
+                and number_of_local_experts == number_of_experts
+                and dist.get_world_size(group) == 1
+                and isinstance(self.gate, (RoundRobinGate, Top2Gate))
+            )
+            self.requires_cuda = not self.compact_dispatch
+            self.l_aux: Union[float, torch.Tensor] = 0.0
+
+            multiplier = (
+                hidden_layer_multiplier if hidden_layer_multiplier is not None else 4
+            )
+
+            # The default experts can be run together with grouped GEMMs
+            self.grouped_experts: Optional[torch.nn.Module] = None
+            if grouped_experts and self.compact_dispatch and expert_constructor is None:
+                if swiglu_experts:
+                    self.grouped_experts = GroupedSwiGLUExperts(
+                        number_of_experts, dim_model, multiplier * dim_model
+                    )
+                else:
+                    self.grouped_experts = GroupedMLPExperts(
+                        number_of_experts,
+                        dim_model,
+                        multiplier * dim_model,
+                        dropout,
+                        activation,
+                    )
+                # No FairScale layer, the load balancing loss is in `self.l_aux`
+                self.moe = None
+                return
+
             # Programatically handle the experts
             if expert_constructor is None:
+                if swiglu_experts:
+                    from xformers.ops import SwiGLU
 
-                multiplier = (
-                    hidden_layer_multiplier
-                    if hidden_layer_multiplier is not None
-                    else 4
-                )
+                    def expert_constructor() -> torch.nn.Module:
+                        return SwiGLU(dim_model, multiplier * dim_model, dim_model)
+
+                else:
 
-                def expert_constructor() -> torch.nn.Module:
-                    return MLP(dim_model, dropout, activation, multiplier)
+                    def expert_constructor() -> torch.nn.Module:
+                        return MLP(dim_model, dropout, activation, multiplier)
 
                 assert expert_constructor is not None
 
@@ -145,9 +320,36 @@ if _is_fairscale_available:
 
             self.moe = MOELayer(gate=self.gate, experts=local_experts, group=group)
 
-            self.requires_cuda = True
+        def _compact_forward(self, inputs: torch.Tensor) -> torch.Tensor:
+            tokens = inputs.reshape(-1, inputs.shape[-1])
+            if isinstance(self.gate, RoundRobinGate):
+                l_aux, routing, gates = self.gate.route(tokens)
+            else:
+                l_aux, routing, gates = _top2_route(self.gate, tokens)
+            self.l_aux = l_aux
+
+            dispatched = permute_tokens(tokens, routing)
+            if self.grouped_experts is not None:
+                expert_outputs = self.grouped_experts(
+                    dispatched, routing.expert_offsets
+                )
+            else:
+                self.moe.l_aux = l_aux
+                offsets = routing.expert_offsets.tolist()
+                expert_outputs = torch.cat(
+                    [
+                        expert(dispatched[offsets[e] : offsets[e + 1]])
+                        for e, expert in enumerate(self.moe.experts)
+                    ]
+                )
+            return unpermute_tokens(expert_outputs, routing, gates).reshape(
+                inputs.shape
+            )
 
         def forward(self, inputs: torch.Tensor) -> torch.Tensor:
+            if self.compact_dispatch:
+                return self._compact_forward(inputs)
+
             # FairScale MoE assumes that the dimensions are [S, B, E]
             # xFormers assumes [B, S, E]
             return self.moe(inputs.movedim(0, 1)).movedim(0, 1)
@@ -7,10 +7,55 @@
 # CREDITS: This implementation is inspired by GPT-NeoX https://github.com/EleutherAI/gpt-neox
 # NOTE: Almost the same right now, moving parts to Triton is the next step
 
-from typing import Tuple
+import threading
+from typing import Dict, Tuple
 
 import torch
 
+from xformers.ops.common import BaseOperator, get_xformers_operator, register_operator
+
+
+@register_operator
+class RotaryEmbeddingOp(BaseOperator):
+    OPERATOR = get_xformers_operator("rotary_embedding")
+    OPERATOR_CATEGORY = "positional_embedding"
+    NAME = "rotary_embedding"
+
+
+# Process-wide cos/sin tables, shared by all the embeddings with the same dimension and base.
+# They only grow, geometrically, so that incremental decoding doesn't recompute them at every step.
+_TablesKey = Tuple[int, float, torch.device, torch.dtype]
+_cos_sin_tables: Dict[_TablesKey, Tuple[torch.Tensor, torch.Tensor]] = {}
+_cos_sin_tables_lock = threading.Lock()
+
+
+def get_cos_sin_tables(
+    dim: int, base: float, seq_len: int, device: torch.device, dtype: torch.dtype
+) -> Tuple[torch.Tensor, torch.Tensor]:
+    """
+    Returns the cos and sin tables [1, 1, L, dim] of the rotary embeddings,
+    for L >= seq_len positions
+    """
+    key = (dim, float(base), torch.device(device), dtype)
+    with _cos_sin_tables_lock:
+        tables = _cos_sin_tables.get(key)
+        if tables is not None and tables[0].shape[-2] >= seq_len:
+            return tables
+
+        capacity = max(seq_len, 2 * tables[0].shape[-2] if tables is not None else 0)
+        inv_freq = 1.0 / (
+            base ** (torch.arange(0, dim, 2, device=device).float() / dim)
+        )
+        t = torch.arange(capacity, device=device, dtype=torch.float32)
+        freqs = torch.einsum("i,j->ij", t, inv_freq)
+        emb = torch.cat((freqs, freqs), dim=-1)
+        tables = (
+            emb.cos()[None, None, :, :].to(dtype),
+            emb.sin()[None, None, :, :].to(dtype),
+        )
+        _cos_sin_tables[key] = tables
+        return tables
+
 
 def rotate_half(x):
     x1, x2 = x.chunk(2, dim=-1)
@@ -28,6 +73,54 @@ def apply_rotary_pos_emb(x, cos, sin):
     return (x * cos) + (rotate_half(x) * sin)
 
 
+def _use_cpu_kernel(x: torch.Tensor, cos: torch.Tensor) -> bool:
+    return (
+        x.device.type == "cpu"
+        and x.is_contiguous()
+        and x.ndim >= 2
+        and x.dtype == cos.dtype
+        and RotaryEmbeddingOp.is_available()
+    )
+
+
+class _RotaryEmbeddingCPU(torch.autograd.Function):
+    @staticmethod
+    # type: ignore
+    def forward(ctx, x, cos, sin, offset):
+        ctx.save_for_backward(cos, sin)
+        ctx.offset = offset
+        return RotaryEmbeddingOp.OPERATOR(
+            x, cos, sin, offset, False, out=torch.empty_like(x)
+        )
+
+    @staticmethod
+    # type: ignore
+    def backward(ctx, grad_out):
+        cos, sin = ctx.saved_tensors
+        grad_out = grad_out.contiguous()
+        # The transpose of the rotation, the inverse one with the usual tables
+        grad_in = RotaryEmbeddingOp.OPERATOR(
+            grad_out, cos, sin, ctx.offset, True, out=torch.empty_like(grad_out)
+        )
+        return grad_in, None, None, None
+
+
+def apply_rotary_pos_emb_(
+    x: torch.Tensor, cos: torch.Tensor, sin: torch.Tensor, offset: int = 0
+) -> torch.Tensor:
+    """
+    Rotates x [..., S, D] in place, with the positions offset + [0, S) of the
+    cos/sin tables [..., L, D]. This does not allocate any temporary on CPU.
+    """
+    if _use_cpu_kernel(x, cos):
+        return RotaryEmbeddingOp.OPERATOR(x, cos, sin, offset, False, out=x)
+
+    x_rot = apply_rotary_pos_emb(
+        x, cos[:, :, offset:, :].to(x.dtype), sin[:, :, offset:, :].to(x.dtype)
+    )
+    return x.copy_(x_rot)
+
+
 class RotaryEmbedding(torch.nn.Module):
     """
     The rotary position embeddings from RoFormer_ (Su et. al).
@@ -44,48 +137,62 @@ class RotaryEmbedding(torch.nn.Module):
 
     .. warning: Please note that this embedding is not registered on purpose, as it is transformative
         (it does not create the embedding dimension) and will likely be picked up (imported) on a ad-hoc basis
+
+    The cos/sin tables are shared by all the embeddings with the same dimension and base,
+    see :func:`get_cos_sin_tables`.
     """
 
-    def __init__(self, dim_model: int, *_, **__):
+    def __init__(self, dim_model: int, *_, base: float = 10000.0, **__):
         super().__init__()
         # Generate and save the inverse frequency buffer (non trainable)
-        inv_freq = 1.0 / (10000 ** (torch.arange(0, dim_model, 2).float() / dim_model))
+        inv_freq = 1.0 / (base ** (torch.arange(0, dim_model, 2).float() / dim_model))
         self.register_buffer("inv_freq", inv_freq)
+        self.dim_model = dim_model
+        self.base = base
 
         self._seq_len_cached = None
         self._cos_cached = None
         self._sin_cached = None
 
-    def _update_cos_sin_tables(self, x, seq_dimension=1):
-        seq_len = x.shape[seq_dimension]
+    def _update_cos_sin_tables(self, x, seq_dimension=1, offset: int = 0):
+        seq_len = x.shape[seq_dimension] + offset
 
-        # Reset the tables if the sequence length has changed,
+        # The tables only change when they are too short,
         # or if we're on a new device (possibly due to tracing for instance)
         if (
-            seq_len != self._seq_len_cached
+            self._seq_len_cached is None
+            or seq_len > self._seq_len_cached
             or self._cos_cached.device != x.device
             or self._cos_cached.dtype != x.dtype
         ):
-            self._seq_len_cached = seq_len
-            t = torch.arange(
-                x.shape[seq_dimension], device=x.device, dtype=torch.float32
+            self._cos_cached, self._sin_cached = get_cos_sin_tables(
+                self.dim_model, self.base, seq_len, x.device, x.dtype
             )
-            freqs = torch.einsum("i,j->ij", t, self.inv_freq.to(x.dtype))
-            emb = torch.cat((freqs, freqs), dim=-1).to(x.device)
-
-            self._cos_cached = emb.cos()[None, None, :, :].to(x.dtype)
-            self._sin_cached = emb.sin()[None, None, :, :].to(x.dtype)
+            self._seq_len_cached = self._cos_cached.shape[-2]
 
         return self._cos_cached, self._sin_cached
 
+    def _apply(self, x: torch.Tensor, offset: int) -> torch.Tensor:
+        if _use_cpu_kernel(x, self._cos_cached):
+            return _RotaryEmbeddingCPU.apply(
+                x, self._cos_cached, self._sin_cached, offset
+            )
+
+        return apply_rotary_pos_emb(
+            x,
+            self._cos_cached[:, :, offset:, :],
+            self._sin_cached[:, :, offset:, :],
+        )
+
     def forward(
-        self, q: torch.Tensor, k: torch.Tensor
+        self, q: torch.Tensor, k: torch.Tensor, offset: int = 0
     ) -> Tuple[torch.Tensor, torch.Tensor]:
+        """
+        Rotates q and k [..., S, D], the first element of the sequences being at position `offset`,
+        for instance the number of tokens which were already decoded
+        """
         self._cos_cached, self._sin_cached = self._update_cos_sin_tables(
-            k, seq_dimension=-2
+            k, seq_dimension=-2, offset=offset
         )
 
-        return (
-            apply_rotary_pos_emb(q, self._cos_cached, self._sin_cached),
-            apply_rotary_pos_emb(k, self._cos_cached, self._sin_cached),
-        )
+        return self._apply(q, offset), self._apply(k, offset)
@@ -4,7 +4,9 @@
 # LICENSE file in the root directory of this source tree.
 
 
-from typing import List
+from concurrent.futures import ThreadPoolExecutor
+from dataclasses import dataclass
+from typing import List, Optional
 
 import torch
 import torch.nn as nn
@@ -64,6 +66,20 @@ class Deterministic(nn.Module):
                     return self.net(*args, **kwargs)
 
 
+@dataclass
+class _Recomputed:
+    """
+    The inputs of a block, reconstructed from its outputs, and the graphs of
+    its functions which are pending for the gradient pass
+    """
+
+    x: torch.Tensor
+    y1: torch.Tensor
+    gy1: torch.Tensor
+    x2: torch.Tensor
+    fx2: torch.Tensor
+
+
 class ReversibleBlock(nn.Module):
     def __init__(self, f: nn.Module, g: nn.Module, split_dim: int = -1):
         super().__init__()
@@ -121,15 +137,138 @@ class ReversibleBlock(nn.Module):
 
         return x, dx
 
+    def recompute_pass(
+        self, y: torch.Tensor, f_args={}, g_args={}
+    ) -> _Recomputed:  # pragma: no cover  # called in the backward pass
+        """
+        First half of `backward_pass`: reconstructs the inputs of the block,
+        and runs its functions with autograd for the gradient pass.
+        This does not need the gradient, so that it can run ahead.
+        """
+        y1, y2 = torch.chunk(y, 2, dim=self.split_dim)
+
+        with torch.enable_grad():
+            y1 = y1.detach().requires_grad_()
+            gy1 = self.g(y1, set_rng=True, **g_args)
+
+        with torch.no_grad():
+            x2 = y2 - gy1
+
+        with torch.enable_grad():
+            x2.requires_grad = True
+            fx2 = self.f(x2, set_rng=True, **f_args)
+
+        with torch.no_grad():
+            x = torch.cat([y1 - fx2, x2.detach()], dim=self.split_dim)
+
+        return _Recomputed(x=x, y1=y1, gy1=gy1, x2=x2, fx2=fx2)
+
+    def gradient_pass(
+        self, recomputed: _Recomputed, dy: torch.Tensor
+    ) -> torch.Tensor:  # pragma: no cover  # called in the backward pass
+        """
+        Second half of `backward_pass`, the gradients given the outputs of
+        `recompute_pass`. `dy` is overwritten with the gradient of the inputs,
+        the parameters' gradients are accumulated in place by autograd.
+        """
+        dy1, dy2 = torch.chunk(dy, 2, dim=self.split_dim)
+
+        torch.autograd.backward(recomputed.gy1, dy2)
+        with torch.no_grad():
+            dx1 = dy1.add_(recomputed.y1.grad)
+        recomputed.y1.grad = None
+
+        torch.autograd.backward(recomputed.fx2, dx1)
+        with torch.no_grad():
+            dy2.add_(recomputed.x2.grad)
+        recomputed.x2.grad = None
+
+        return dy
+
+
+def _pipelined_backward(
+    blocks, y: torch.Tensor, dy: torch.Tensor, kwargs
+) -> torch.Tensor:  # pragma: no cover  # called in the backward pass
+    """
+    The recomputation of block i - 1 only depends on the inputs of block i,
+    which are known before the gradients of block i. It runs on a worker
+    thread (and CUDA stream) while the main thread computes these gradients.
+
+    On CUDA, the tensors of a recomputation are allocated on the side stream
+    but read by the gradient pass on the main stream. They are only released
+    once the side stream has waited for that gradient pass, so that the
+    caching allocator can't hand their memory to a later recomputation while
+    the main stream still reads it.
+
+    The recomputation restores the RNG state of the forward pass
+    (`Deterministic`), which is process-wide: nothing else should draw random
+    numbers while it runs, which autograd doesn't do in the gradient pass.
+    """
+    side_stream: Optional[torch.cuda.Stream] = None
+    if y.is_cuda:
+        side_stream = torch.cuda.Stream(device=y.device)
+    main_stream = torch.cuda.current_stream(y.device) if y.is_cuda else None
+
+    def release(retired):
+        # The gradient pass which read them is done from the side stream's
+        # point of view, so their memory can be reused there
+        if retired is not None:
+            side_stream.wait_event(retired[1])
+            retired.clear()
+
+    def recompute(block, y, retired):
+        if side_stream is None:
+            return block.recompute_pass(y, **kwargs)
+        side_stream.wait_stream(main_stream)
+        release(retired)
+        with torch.cuda.stream(side_stream):
+            recomputed = block.recompute_pass(y, **kwargs)
+            done = torch.cuda.current_stream().record_event()
+        return recomputed, done
+
+    def wait(future):
+        result = future.result()
+        if side_stream is None:
+            return result
+        recomputed, done = result
+        main_stream.wait_event(done)
+        return recomputed
+
+    # The gradients are accumulated in place, in a buffer which we own
+    dx = dy.clone(memory_format=torch.contiguous_format)
+    blocks = list(blocks)[::-1]
+    # The last recomputation used by the gradient pass, and the event which
+    # marks the end of this pass on the main stream
+    retired: Optional[list] = None
+    with ThreadPoolExecutor(max_workers=1) as worker:
+        pending = worker.submit(recompute, blocks[0], y, None)
+        for i, block in enumerate(blocks):
+            recomputed = wait(pending)
+            if i + 1 < len(blocks):
+                pending = worker.submit(
+                    recompute, blocks[i + 1], recomputed.x, retired
+                )
+            elif side_stream is not None:
+                release(retired)
+            retired = None
+            dx = block.gradient_pass(recomputed, dx)
+            if side_stream is not None:
+                retired = [recomputed, main_stream.record_event()]
+            del recomputed
+        if side_stream is not None:
+            release(retired)
+    return dx
+
 
 class _ReversibleFunction(Function):
     @staticmethod
-    def forward(ctx, x, blocks, kwargs):
+    def forward(ctx, x, blocks, kwargs, pipeline_backward=False):
         ctx.kwargs = kwargs
         for block in blocks:
             x = block(x, **kwargs)
         ctx.y = x.detach()
         ctx.blocks = blocks
+        ctx.pipeline_backward = pipeline_backward
         return x
 
     @staticmethod
@@ -138,20 +277,37 @@ class _ReversibleFunction(Function):
     ):  # pragma: no cover # this is covered, but called directly from C++
         y = ctx.y
         kwargs = ctx.kwargs
+        if ctx.pipeline_backward and len(ctx.blocks) > 0:
+            return _pipelined_backward(ctx.blocks, y, dy, kwargs), None, None, None
+
         for block in ctx.blocks[::-1]:
             y, dy = block.backward_pass(y, dy, **kwargs)
-        return dy, None, None
+        return dy, None, None, None
 
 
 class ReversibleSequence(nn.Module):
-    def __init__(self, blocks: nn.ModuleList):
+    """
+    A sequence of reversible blocks, whose activations are reconstructed in
+    the backward pass instead of being stored.
+
+    With `pipeline_backward`, the reconstruction of each block overlaps with
+    the gradient computation of the next one, on a worker thread (and CUDA
+    stream). This keeps the graphs of two blocks alive at the same time.
+    The reconstruction swaps the process-wide RNG state to replay the forward
+    pass, so other threads should not draw random numbers during the backward.
+    """
+
+    def __init__(self, blocks: nn.ModuleList, pipeline_backward: bool = False):
         super().__init__()
 
         # pyre-fixme[23]: Unable to unpack `torch.nn.Module` into 2 values.
         self.blocks = nn.ModuleList([ReversibleBlock(f, g) for f, g in blocks])
+        self.pipeline_backward = pipeline_backward
 
     def forward(self, x, arg_route=(True, False), **kwargs):
         f_args, g_args = map(lambda route: kwargs if route else {}, arg_route)
         block_kwargs = {"f_args": f_args, "g_args": g_args}
 
-        return _ReversibleFunction.apply(x, self.blocks, block_kwargs)
+        return _ReversibleFunction.apply(
+            x, self.blocks, block_kwargs, self.pipeline_backward
+        )
@@ -0,0 +1,22 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <torch/types.h>
+
+TORCH_LIBRARY_FRAGMENT(xformers, m) {
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::blocksparse_layout_info(Tensor layout) -> Tensor[]"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::blocksparse_sddmm(Tensor a, Tensor b, Tensor layout, Tensor[] layout_info) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::blocksparse_spmm(Tensor values, Tensor layout, Tensor[] layout_info, Tensor b, bool transpose) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::blocksparse_softmax(Tensor values, Tensor layout, Tensor[] layout_info, float scale, bool causal) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::blocksparse_softmax_backward(Tensor out, Tensor grad, Tensor layout, Tensor[] layout_info, float scale) -> Tensor"));
+}
@@ -0,0 +1,16 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <torch/types.h>
+
+TORCH_LIBRARY_FRAGMENT(xformers, m) {
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::causal_linear_attention(Tensor query, Tensor key, Tensor value, int chunk_size) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::causal_linear_attention_backward(Tensor grad_out, Tensor query, Tensor key, Tensor value, int chunk_size) -> (Tensor, Tensor, Tensor)"));
+}
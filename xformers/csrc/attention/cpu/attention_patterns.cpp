@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <ATen/Parallel.h>
+#include <torch/library.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+/*
+ * Generators for the patterns of
+ * `xformers/components/attention/attention_patterns.py`, which directly
+ * produce the CSR structure (int32 `row_offsets` and `column_indices`) of
+ * the mask, without materializing the dense [N, N] matrix.
+ * Each row is generated independently, in two passes: one to count its
+ * nonzeros, and one to write them once the offsets are known.
+ */
+
+namespace {
+
+/*
+ * `visit(row, emit)` must call `emit(column)` for every nonzero of the row,
+ * by increasing column
+ */
+template <typename Visit>
+std::tuple<at::Tensor, at::Tensor> build_csr(int64_t num_rows, Visit visit) {
+  std::vector<int64_t> offsets(num_rows + 1, 0);
+  at::parallel_for(0, num_rows, 64, [&](int64_t start, int64_t end) {
+    for (int64_t row = start; row < end; ++row) {
+      int64_t count = 0;
+      visit(row, [&](int64_t) { ++count; });
+      offsets[row + 1] = count;
+    }
+  });
+  for (int64_t row = 0; row < num_rows; ++row) {
+    offsets[row + 1] += offsets[row];
+  }
+  TORCH_CHECK(
+      offsets[num_rows] <= std::numeric_limits<int32_t>::max(),
+      "Too many nonzeros for int32 indices");
+
+  at::Tensor row_offsets = at::empty({num_rows + 1}, at::kInt);
+  at::Tensor column_indices = at::empty({offsets[num_rows]}, at::kInt);
+  int32_t* row_offsets_ = row_offsets.data_ptr<int32_t>();
+  int32_t* column_indices_ = column_indices.data_ptr<int32_t>();
+  std::copy(offsets.begin(), offsets.end(), row_offsets_);
+  at::parallel_for(0, num_rows, 64, [&](int64_t start, int64_t end) {
+    for (int64_t row = start; row < end; ++row) {
+      int32_t* out = column_indices_ + offsets[row];
+      visit(row, [&](int64_t column) { *out++ = int32_t(column); });
+    }
+  });
+  return std::make_tuple(row_offsets, column_indices);
+}
+
+/*
+ * `local_nd_pattern`: positions on a grid of shape `sizes`, with the
+ * coordinates scaled by `weights`, attend to the positions closer than
+ * `distance` with the `p`-norm. The distance is computed like in
+ * `torch.cdist` in float32, so the masks match exactly, but only the
+ * positions that can be close enough are visited.
+ */
+struct LocalPattern {
+  std::vector<int64_t> sizes;
+  std::vector<float> weights;
+  float distance;
+  double p;
+
+  float coordinate(int64_t dim, int64_t index) const {
+    return float(index) * weights[dim];
+  }
+
+  float norm(const std::vector<int64_t>& a, const std::vector<int64_t>& b)
+      const {
+    float acc = 0;
+    for (size_t dim = 0; dim < sizes.size(); ++dim) {
+      const float diff =
+          std::abs(coordinate(dim, a[dim]) - coordinate(dim, b[dim]));
+      if (p == 0) {
+        acc += diff != 0;
+      } else if (std::isinf(p)) {
+        acc = std::max(acc, diff);
+      } else if (p == 1) {
+        acc += diff;
+      } else if (p == 2) {
+        acc += diff * diff;
+      } else {
+        acc += std::pow(diff, float(p));
+      }
+    }
+    if (p == 2) {
+      return std::sqrt(acc);
+    }
+    if (p != 0 && p != 1 && !std::isinf(p)) {
+      return std::pow(acc, float(1.0 / p));
+    }
+    return acc;
+  }
+
+  // Range of the indices along `dim` which can be within `distance`
+  std::pair<int64_t, int64_t> candidates(
+      int64_t dim,
+      int64_t center,
+      int64_t differing) const {
+    if (weights[dim] == 0) {
+      return {0, sizes[dim]};
+    }
+    if (p == 0) {
+      // Each differing coordinate counts for 1
+      if (differing + 1 < distance) {
+        return {0, sizes[dim]};
+      }
+      return {center, center + 1};
+    }
+    // Any norm is at least the largest coordinate difference. The margin
+    // covers the rounding, the exact check is done on each position.
+    const double reach = std::floor(distance / std::abs(weights[dim])) + 1;
+    const int64_t radius = int64_t(std::min<double>(reach, sizes[dim]));
+    return {
+        std::max<int64_t>(0, center - radius),
+        std::min<int64_t>(sizes[dim], center + radius + 1)};
+  }
+
+  template <typename Emit>
+  void visit_dim(
+      int64_t dim,
+      int64_t index,
+      int64_t differing,
+      const std::vector<int64_t>& center,
+      std::vector<int64_t>& position,
+      Emit& emit) const {
+    if (dim == int64_t(sizes.size())) {
+      if (norm(center, position) < distance) {
+        emit(index);
+      }
+      return;
+    }
+    const auto range = candidates(dim, center[dim], differing);
+    for (int64_t i = range.first; i < range.second; ++i) {
+      position[dim] = i;
+      visit_dim(
+          dim + 1,
+          index * sizes[dim] + i,
+          differing + (i != center[dim] && weights[dim] != 0),
+          center,
+          position,
+          emit);
+    }
+  }
+
+  template <typename Emit>
+  void operator()(int64_t row, Emit emit) const {
+    const int64_t ndim = sizes.size();
+    std::vector<int64_t> center(ndim), position(ndim);
+    for (int64_t dim = ndim - 1; dim >= 0; --dim) {
+      center[dim] = row % sizes[dim];
+      row /= sizes[dim];
+    }
+    visit_dim(0, 0, 0, center, position, emit);
+  }
+};
+
+std::tuple<at::Tensor, at::Tensor> local_nd_pattern_csr(
+    at::IntArrayRef sizes,
+    at::ArrayRef<double> weights,
+    double distance,
+    double p) {
+  TORCH_CHECK(sizes.size() == weights.size(), "sizes and weights must match");
+  TORCH_CHECK(p >= 0, "p must be positive");
+  LocalPattern pattern;
+  pattern.sizes = sizes.vec();
+  for (double w : weights) {
+    pattern.weights.push_back(float(w));
+  }
+  // `d < distance` compares in float32
+  pattern.distance = float(distance);
+  pattern.p = p;
+  int64_t num_rows = 1;
+  for (int64_t s : sizes) {
+    num_rows *= s;
+  }
+  return build_csr(num_rows, pattern);
+}
+
+// Index of the anchor closest to each position along an axis of the
+// `swin_attention_pattern` (the first one on ties, like `argmin`)
+std::vector<int64_t> swin_anchors(
+    int64_t size,
+    int64_t window_size,
+    int64_t num_anchors,
+    double offset) {
+  std::vector<int64_t> anchors(size);
+  for (int64_t i = 0; i < size; ++i) {
+    double best = std::numeric_limits<double>::infinity();
+    for (int64_t a = 0; a < num_anchors; ++a) {
+      const double d = std::abs(i + 0.5 - (a * window_size + offset));
+      if (d < best) {
+        best = d;
+        anchors[i] = a;
+      }
+    }
+  }
+  return anchors;
+}
+
+std::tuple<at::Tensor, at::Tensor> swin_pattern_csr(
+    int64_t H,
+    int64_t W,
+    int64_t window_size,
+    int64_t shift_size) {
+  TORCH_CHECK(H % window_size == 0 && W % window_size == 0);
+  TORCH_CHECK(
+      0 <= shift_size && shift_size < window_size,
+      "shift_size must in 0-window_size");
+  const int64_t extra = shift_size % window_size != 0;
+  const int64_t s = (window_size - shift_size % window_size) % window_size;
+  const double offset = window_size / 2.0 - s;
+  // The anchor is the nearest one along each axis, and the positions of an
+  // anchor form a rectangle, since the anchor index grows along each axis
+  const auto anchors_h =
+      swin_anchors(H, window_size, H / window_size + extra, offset);
+  const auto anchors_w =
+      swin_anchors(W, window_size, W / window_size + extra, offset);
+  auto ranges = [](const std::vector<int64_t>& anchors) {
+    std::vector<int64_t> begin(anchors.size()), end(anchors.size());
+    for (int64_t i = 0; i < int64_t(anchors.size()); ++i) {
+      begin[i] = (i > 0 && anchors[i - 1] == anchors[i]) ? begin[i - 1] : i;
+    }
+    for (int64_t i = anchors.size() - 1; i >= 0; --i) {
+      end[i] = (i + 1 < int64_t(anchors.size()) && anchors[i + 1] == anchors[i])
+          ? end[i + 1]
+          : i + 1;
+    }
+    return std::make_pair(begin, end);
+  };
+  const auto rows = ranges(anchors_h);
+  const auto cols = ranges(anchors_w);
+  return build_csr(H * W, [&](int64_t row, auto emit) {
+    const int64_t i = row / W, j = row % W;
+    for (int64_t y = rows.first[i]; y < rows.second[i]; ++y) {
+      for (int64_t x = cols.first[j]; x < cols.second[j]; ++x) {
+        emit(y * W + x);
+      }
+    }
+  });
+}
+
+std::tuple<at::Tensor, at::Tensor> dilated_2d_pattern_csr(
+    int64_t H,
+    int64_t W,
+    int64_t k) {
+  TORCH_CHECK(k > 0, "k must be positive");
+  return build_csr(H * W, [&](int64_t row, auto emit) {
+    const int64_t i = row / W, j = row % W;
+    for (int64_t y = i % k; y < H; y += k) {
+      for (int64_t x = j % k; x < W; x += k) {
+        emit(y * W + x);
+      }
+    }
+  });
+}
+
+std::tuple<at::Tensor, at::Tensor> causal_1d_pattern_csr(int64_t attn_size) {
+  return build_csr(attn_size, [&](int64_t row, auto emit) {
+    for (int64_t col = 0; col <= row; ++col) {
+      emit(col);
+    }
+  });
+}
+
+std::tuple<at::Tensor, at::Tensor> global_token_pattern_csr(
+    const at::Tensor& attention_query_mask) {
+  TORCH_CHECK(attention_query_mask.dim() == 1);
+  TORCH_CHECK(attention_query_mask.scalar_type() == at::kBool);
+  const auto mask = attention_query_mask.cpu().contiguous();
+  const bool* is_global = mask.data_ptr<bool>();
+  const int64_t n = mask.size(0);
+  std::vector<int64_t> global_tokens;
+  for (int64_t i = 0; i < n; ++i) {
+    if (is_global[i]) {
+      global_tokens.push_back(i);
+    }
+  }
+  // Global tokens attend to everything, the others to the global tokens
+  return build_csr(n, [&](int64_t row, auto emit) {
+    if (is_global[row]) {
+      for (int64_t col = 0; col < n; ++col) {
+        emit(col);
+      }
+    } else {
+      for (int64_t col : global_tokens) {
+        emit(col);
+      }
+    }
+  });
+}
+
+} // namespace
+
+// Most of these ops don't take any tensor to dispatch on: they are
+// registered for all the backends, and always return CPU tensors
+TORCH_LIBRARY_FRAGMENT(xformers, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::local_nd_pattern_csr"),
+      TORCH_FN(local_nd_pattern_csr));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::swin_pattern_csr"),
+      TORCH_FN(swin_pattern_csr));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::dilated_2d_pattern_csr"),
+      TORCH_FN(dilated_2d_pattern_csr));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::causal_1d_pattern_csr"),
+      TORCH_FN(causal_1d_pattern_csr));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::global_token_pattern_csr"),
+      TORCH_FN(global_token_pattern_csr));
+}
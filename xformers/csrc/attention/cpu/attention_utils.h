@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#pragma once
+
+#include <ATen/ATen.h>
+
+#include <cstdint>
+#include <limits>
+
+// Helpers shared by the CPU attention kernels
+
+namespace xformers {
+namespace cpu {
+
+constexpr float kNegInf = -std::numeric_limits<float>::infinity();
+
+// A [B, M, H, K] tensor, with any strides
+template <typename scalar_t>
+struct BMHK {
+  scalar_t* data;
+  int64_t stride_b, stride_m, stride_h, stride_k;
+  int64_t dim;
+
+  explicit BMHK(const at::Tensor& t)
+      : data(t.data_ptr<scalar_t>()),
+        stride_b(t.stride(0)),
+        stride_m(t.stride(1)),
+        stride_h(t.stride(2)),
+        stride_k(t.stride(3)),
+        dim(t.size(3)) {}
+
+  scalar_t* row(int64_t b, int64_t m, int64_t h) const {
+    return data + b * stride_b + m * stride_m + h * stride_h;
+  }
+
+  // Copies the rows [begin, begin + count) to `out` [count, dim], as floats
+  void load(int64_t b, int64_t h, int64_t begin, int64_t count, float* out)
+      const {
+    for (int64_t i = 0; i < count; ++i) {
+      const scalar_t* src = row(b, begin + i, h);
+      for (int64_t d = 0; d < dim; ++d) {
+        out[i * dim + d] = float(src[d * stride_k]);
+      }
+    }
+  }
+
+  void store(
+      int64_t b,
+      int64_t h,
+      int64_t begin,
+      int64_t count,
+      const float* in) const {
+    for (int64_t i = 0; i < count; ++i) {
+      scalar_t* dst = row(b, begin + i, h);
+      for (int64_t d = 0; d < dim; ++d) {
+        dst[d * stride_k] = scalar_t(in[i * dim + d]);
+      }
+    }
+  }
+};
+
+inline float dot(const float* a, const float* b, int64_t n) {
+  float acc = 0;
+  for (int64_t i = 0; i < n; ++i) {
+    acc += a[i] * b[i];
+  }
+  return acc;
+}
+
+inline void axpy(float alpha, const float* x, float* y, int64_t n) {
+  for (int64_t i = 0; i < n; ++i) {
+    y[i] += alpha * x[i];
+  }
+}
+
+} // namespace cpu
+} // namespace xformers
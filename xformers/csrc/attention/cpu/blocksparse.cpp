@@ -0,0 +1,474 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <ATen/Dispatch.h>
+#include <ATen/OpMathType.h>
+#include <ATen/Parallel.h>
+#include <torch/library.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+/*
+ * CPU kernels for `xformers.sparse.BlockSparseTensor`.
+ *
+ * A block-sparse matrix of shape [B, H, M, N] is described by a `layout`
+ * [H, M / block_size, N / block_size] and `values` [B, nnz, bs, bs], where
+ * the nonzero blocks are stored in the order of `layout.nonzero()`: head by
+ * head, then block-row by block-row, which is a block-CSR order.
+ *
+ * The block-CSR structure of the layout is built once by
+ * `blocksparse_layout_info`, and cached by the caller for its layout. The
+ * products run one dense GEMM per block-row (or block-column) of the
+ * layout: the blocks of the dense operand which it touches are gathered, so
+ * that the GEMM sees all of them at once. The gathered operands (and the
+ * GEMM outputs) go to scratch buffers allocated once per thread, sized for
+ * the longest block-row, and reused by all the block-rows of the thread.
+ */
+
+namespace {
+
+// The tensors returned by `blocksparse_layout_info`, in this order
+constexpr size_t kLayoutInfoSize = 6;
+
+struct BlockLayout {
+  int64_t heads;
+  int64_t block_rows;
+  int64_t block_cols;
+  // Blocks of the block-row `h * block_rows + r` are
+  // `row_offsets[h * block_rows + r]:row_offsets[h * block_rows + r + 1]`,
+  // and `row_indices` is the block-row `h * block_rows + r` of each block
+  at::Tensor row_offsets;
+  at::Tensor column_indices;
+  at::Tensor row_indices;
+  // Same thing per block-column, for the transposed products:
+  // `col_blocks` lists the blocks of each block-column, by block-row, and
+  // `col_rows` is their block-row `r`
+  at::Tensor col_offsets;
+  at::Tensor col_blocks;
+  at::Tensor col_rows;
+
+  int64_t nnz() const {
+    return column_indices.size(0);
+  }
+};
+
+std::vector<at::Tensor> blocksparse_layout_info(const at::Tensor& layout) {
+  TORCH_CHECK(layout.dim() == 3, "layout must be [H, M / bs, N / bs]");
+  TORCH_CHECK(!layout.is_cuda(), "layout must be a CPU tensor");
+  const auto mask = layout.ne(0).contiguous();
+  const bool* data = mask.data_ptr<bool>();
+  const int64_t heads = layout.size(0);
+  const int64_t block_rows = layout.size(1);
+  const int64_t block_cols = layout.size(2);
+
+  const int64_t num_rows = heads * block_rows;
+  std::vector<int64_t> row_offsets = {0};
+  std::vector<int64_t> column_indices;
+  std::vector<int64_t> row_indices;
+  row_offsets.reserve(num_rows + 1);
+  for (int64_t row = 0; row < num_rows; ++row) {
+    for (int64_t c = 0; c < block_cols; ++c) {
+      if (data[row * block_cols + c]) {
+        column_indices.push_back(c);
+        row_indices.push_back(row);
+      }
+    }
+    row_offsets.push_back(column_indices.size());
+  }
+
+  // Counting sort of the blocks by (head, block-column)
+  const int64_t nnz = column_indices.size();
+  const int64_t num_cols = heads * block_cols;
+  std::vector<int64_t> col_offsets(num_cols + 1, 0);
+  for (int64_t i = 0; i < nnz; ++i) {
+    const int64_t h = row_indices[i] / block_rows;
+    col_offsets[h * block_cols + column_indices[i] + 1]++;
+  }
+  for (int64_t c = 0; c < num_cols; ++c) {
+    col_offsets[c + 1] += col_offsets[c];
+  }
+  std::vector<int64_t> fill(col_offsets.begin(), col_offsets.end());
+  std::vector<int64_t> col_blocks(nnz);
+  std::vector<int64_t> col_rows(nnz);
+  for (int64_t i = 0; i < nnz; ++i) {
+    const int64_t h = row_indices[i] / block_rows;
+    const int64_t p = fill[h * block_cols + column_indices[i]]++;
+    col_blocks[p] = i;
+    col_rows[p] = row_indices[i] % block_rows;
+  }
+
+  auto to_tensor = [](const std::vector<int64_t>& v) {
+    return at::tensor(v, at::TensorOptions().dtype(at::kLong));
+  };
+  return {
+      to_tensor(row_offsets),
+      to_tensor(column_indices),
+      to_tensor(row_indices),
+      to_tensor(col_offsets),
+      to_tensor(col_blocks),
+      to_tensor(col_rows)};
+}
+
+BlockLayout unpack_layout(const at::Tensor& layout, at::TensorList info) {
+  TORCH_CHECK(layout.dim() == 3, "layout must be [H, M / bs, N / bs]");
+  TORCH_CHECK(
+      info.size() == kLayoutInfoSize,
+      "layout_info must come from blocksparse_layout_info");
+  for (const auto& t : info) {
+    TORCH_CHECK(
+        t.dim() == 1 && t.scalar_type() == at::kLong && !t.is_cuda() &&
+            t.is_contiguous(),
+        "layout_info must come from blocksparse_layout_info");
+  }
+  BlockLayout out{
+      layout.size(0),
+      layout.size(1),
+      layout.size(2),
+      info[0],
+      info[1],
+      info[2],
+      info[3],
+      info[4],
+      info[5]};
+  TORCH_CHECK(
+      out.row_offsets.size(0) == out.heads * out.block_rows + 1 &&
+          out.col_offsets.size(0) == out.heads * out.block_cols + 1,
+      "layout_info doesn't match the layout");
+  return out;
+}
+
+// The largest number of blocks of a block-row (or block-column)
+int64_t max_line_blocks(const int64_t* offsets, int64_t num_lines) {
+  int64_t max_blocks = 0;
+  for (int64_t line = 0; line < num_lines; ++line) {
+    max_blocks = std::max(max_blocks, offsets[line + 1] - offsets[line]);
+  }
+  return max_blocks;
+}
+
+void check_values(const at::Tensor& values, const BlockLayout& layout) {
+  TORCH_CHECK(values.dim() == 4, "values must be [B, nnz, bs, bs]");
+  TORCH_CHECK(values.size(2) == values.size(3), "blocks must be square");
+  TORCH_CHECK(
+      values.size(1) == layout.nnz(),
+      "values has ",
+      values.size(1),
+      " blocks but the layout has ",
+      layout.nnz());
+  TORCH_CHECK(!values.is_cuda(), "values must be a CPU tensor");
+}
+
+void check_dense(
+    const at::Tensor& x,
+    const char* name,
+    int64_t batch,
+    int64_t heads,
+    int64_t seqlen) {
+  TORCH_CHECK(x.dim() == 4, name, " must be [B, H, S, D]");
+  TORCH_CHECK(!x.is_cuda(), name, " must be a CPU tensor");
+  TORCH_CHECK(x.size(0) == batch, name, " has the wrong batch size");
+  TORCH_CHECK(x.size(1) == heads, name, " and the layout have different H");
+  TORCH_CHECK(
+      x.size(2) == seqlen, name, " and the layout have different lengths");
+}
+
+/*
+ * out[b, i] = a[b, h, rows of r] @ b[b, h, rows of c].T for each nonzero
+ * block i = (h, r, c) of the layout.
+ * For each block-row r, this is a single GEMM of the rows of r by the
+ * gathered rows of all its block-columns: [bs, K] @ [K, blocks * bs]
+ */
+at::Tensor blocksparse_sddmm(
+    const at::Tensor& a_,
+    const at::Tensor& b_,
+    const at::Tensor& layout_,
+    at::TensorList layout_info) {
+  const auto layout = unpack_layout(layout_, layout_info);
+  TORCH_CHECK(a_.dim() == 4 && b_.dim() == 4, "a and b must be [B, H, S, K]");
+  TORCH_CHECK(a_.size(2) % layout.block_rows == 0);
+  const int64_t bs = a_.size(2) / layout.block_rows;
+  check_dense(a_, "a", a_.size(0), layout.heads, layout.block_rows * bs);
+  check_dense(b_, "b", a_.size(0), layout.heads, layout.block_cols * bs);
+  TORCH_CHECK(a_.size(3) == b_.size(3), "a and b have different K");
+  TORCH_CHECK(a_.scalar_type() == b_.scalar_type());
+
+  const int64_t B = a_.size(0), K = a_.size(3);
+  const int64_t nnz = layout.nnz();
+  const auto a = a_.contiguous().view({B * layout.heads, -1, K});
+  const auto b =
+      b_.contiguous().view({B * layout.heads, layout.block_cols, bs, K});
+  at::Tensor out = at::empty({B, nnz, bs, bs}, a.options());
+  const int64_t* row_offsets = layout.row_offsets.data_ptr<int64_t>();
+  const int64_t num_lines = layout.heads * layout.block_rows;
+  const int64_t max_blocks = max_line_blocks(row_offsets, num_lines);
+
+  at::parallel_for(0, B * num_lines, 1, [&](int64_t start, int64_t end) {
+    auto b_scratch = at::empty({max_blocks * bs * K}, a.options());
+    auto prod_scratch = at::empty({max_blocks * bs * bs}, a.options());
+    for (int64_t job = start; job < end; ++job) {
+      const int64_t batch = job / num_lines, line = job % num_lines;
+      const int64_t h = line / layout.block_rows;
+      const int64_t r = line % layout.block_rows;
+      const int64_t begin = row_offsets[line];
+      const int64_t blocks = row_offsets[line + 1] - begin;
+      if (blocks == 0) {
+        continue;
+      }
+      const int64_t bh = batch * layout.heads + h;
+      const auto columns = layout.column_indices.narrow(0, begin, blocks);
+      auto b_rows =
+          b_scratch.narrow(0, 0, blocks * bs * K).view({blocks, bs, K});
+      at::index_select_out(b_rows, b.select(0, bh), 0, columns);
+      const auto a_rows = a.select(0, bh).narrow(0, r * bs, bs);
+      auto prod =
+          prod_scratch.narrow(0, 0, blocks * bs * bs).view({bs, blocks * bs});
+      at::mm_out(prod, a_rows, b_rows.view({blocks * bs, K}).t());
+      out.select(0, batch)
+          .narrow(0, begin, blocks)
+          .copy_(prod.view({bs, blocks, bs}).transpose(0, 1));
+    }
+  });
+  return out;
+}
+
+/*
+ * out[b, h, rows of r] = sum over the blocks i = (h, r, c) of the
+ * block-row r of values[b, i] @ x[b, h, rows of c]
+ *
+ * With `transpose`, multiplies by the transposed matrix instead:
+ * out[b, h, rows of c] = sum over the blocks i = (h, r, c) of the
+ * block-column c of values[b, i].T @ x[b, h, rows of r]
+ *
+ * Each block-row of the output is a single GEMM of its blocks, side by
+ * side, by the gathered rows of x: [bs, blocks * bs] @ [blocks * bs, D]
+ */
+at::Tensor blocksparse_spmm(
+    const at::Tensor& values_,
+    const at::Tensor& layout_,
+    at::TensorList layout_info,
+    const at::Tensor& x_,
+    bool transpose) {
+  const auto layout = unpack_layout(layout_, layout_info);
+  check_values(values_, layout);
+  const int64_t bs = values_.size(2);
+  const int64_t B = values_.size(0);
+  const int64_t in_blocks = transpose ? layout.block_rows : layout.block_cols;
+  const int64_t out_blocks = transpose ? layout.block_cols : layout.block_rows;
+  check_dense(x_, "x", B, layout.heads, in_blocks * bs);
+  TORCH_CHECK(values_.scalar_type() == x_.scalar_type());
+
+  const auto values = values_.contiguous();
+  const int64_t D = x_.size(3);
+  const auto x = x_.contiguous().view({B * layout.heads, in_blocks, bs, D});
+  at::Tensor out =
+      at::empty({B * layout.heads, out_blocks * bs, D}, x.options());
+  const int64_t* offsets = transpose ? layout.col_offsets.data_ptr<int64_t>()
+                                     : layout.row_offsets.data_ptr<int64_t>();
+  const int64_t num_lines = layout.heads * out_blocks;
+  const int64_t max_blocks = max_line_blocks(offsets, num_lines);
+  const int64_t* col_blocks = layout.col_blocks.data_ptr<int64_t>();
+
+  at::parallel_for(0, B * num_lines, 1, [&](int64_t start, int64_t end) {
+    auto v_scratch = at::empty({max_blocks * bs * bs}, values.options());
+    auto x_scratch = at::empty({max_blocks * bs * D}, x.options());
+    for (int64_t job = start; job < end; ++job) {
+      const int64_t batch = job / num_lines, line = job % num_lines;
+      const int64_t bh = batch * layout.heads + line / out_blocks;
+      auto out_rows =
+          out.select(0, bh).narrow(0, (line % out_blocks) * bs, bs);
+      const int64_t begin = offsets[line];
+      const int64_t blocks = offsets[line + 1] - begin;
+      if (blocks == 0) {
+        out_rows.zero_();
+        continue;
+      }
+      // [bs, blocks, bs], the blocks which multiply the rows of the output,
+      // side by side
+      auto v = v_scratch.narrow(0, 0, blocks * bs * bs).view({bs, blocks, bs});
+      const auto batch_values = values.select(0, batch);
+      at::Tensor in_indices;
+      if (transpose) {
+        for (int64_t k = 0; k < blocks; ++k) {
+          v.select(1, k).copy_(batch_values[col_blocks[begin + k]].t());
+        }
+        in_indices = layout.col_rows.narrow(0, begin, blocks);
+      } else {
+        v.copy_(batch_values.narrow(0, begin, blocks).permute({1, 0, 2}));
+        in_indices = layout.column_indices.narrow(0, begin, blocks);
+      }
+      auto x_rows =
+          x_scratch.narrow(0, 0, blocks * bs * D).view({blocks, bs, D});
+      at::index_select_out(x_rows, x.select(0, bh), 0, in_indices);
+      at::mm_out(
+          out_rows,
+          v.view({bs, blocks * bs}),
+          x_rows.view({blocks * bs, D}));
+    }
+  });
+  return out.view({B, layout.heads, out_blocks * bs, D});
+}
+
+/*
+ * Softmax along the rows of the block-sparse matrix `values * scale`: each
+ * row spans the blocks of its block-row. With `causal`, the elements above
+ * the diagonal of the full matrix are excluded, and get a zero probability.
+ */
+at::Tensor blocksparse_softmax(
+    const at::Tensor& values_,
+    const at::Tensor& layout_,
+    at::TensorList layout_info,
+    double scale,
+    bool causal) {
+  const auto layout = unpack_layout(layout_, layout_info);
+  const int64_t* row_offsets = layout.row_offsets.data_ptr<int64_t>();
+  const int64_t* column_indices = layout.column_indices.data_ptr<int64_t>();
+  check_values(values_, layout);
+  const auto values = values_.contiguous();
+  const int64_t B = values.size(0), bs = values.size(2);
+  const int64_t nnz = layout.nnz();
+  at::Tensor out = at::empty_like(values);
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      values.scalar_type(),
+      "blocksparse_softmax",
+      [&] {
+        using acc_t = at::opmath_type<scalar_t>;
+        const scalar_t* v_data = values.data_ptr<scalar_t>();
+        scalar_t* out_data = out.data_ptr<scalar_t>();
+        const int64_t num_lines = layout.heads * layout.block_rows;
+        const acc_t scale_ = acc_t(scale);
+        at::parallel_for(0, B * num_lines, 1, [&](int64_t start, int64_t end) {
+          for (int64_t job = start; job < end; ++job) {
+            const int64_t batch = job / num_lines, line = job % num_lines;
+            const int64_t r = line % layout.block_rows;
+            const int64_t begin = row_offsets[line];
+            const int64_t stop = row_offsets[line + 1];
+            for (int64_t i = 0; i < bs; ++i) {
+              const int64_t row = r * bs + i;
+              auto masked = [&](int64_t p, int64_t j) {
+                return causal && column_indices[p] * bs + j > row;
+              };
+              auto idx = [&](int64_t p, int64_t j) -> int64_t {
+                return ((batch * nnz + p) * bs + i) * bs + j;
+              };
+              acc_t max = -std::numeric_limits<acc_t>::infinity();
+              for (int64_t p = begin; p < stop; ++p) {
+                for (int64_t j = 0; j < bs; ++j) {
+                  if (!masked(p, j)) {
+                    max = std::max(max, acc_t(v_data[idx(p, j)]) * scale_);
+                  }
+                }
+              }
+              // The exponentials are recomputed rather than stored, so that
+              // they are rounded to `scalar_t` only once normalized
+              auto exp = [&](int64_t p, int64_t j) -> acc_t {
+                return masked(p, j)
+                    ? acc_t(0)
+                    : std::exp(acc_t(v_data[idx(p, j)]) * scale_ - max);
+              };
+              acc_t sum = 0;
+              for (int64_t p = begin; p < stop; ++p) {
+                for (int64_t j = 0; j < bs; ++j) {
+                  sum += exp(p, j);
+                }
+              }
+              // Rows without any element (fully masked) are left to zero
+              const acc_t inv_sum = sum > 0 ? acc_t(1) / sum : acc_t(0);
+              for (int64_t p = begin; p < stop; ++p) {
+                for (int64_t j = 0; j < bs; ++j) {
+                  out_data[idx(p, j)] = scalar_t(exp(p, j) * inv_sum);
+                }
+              }
+            }
+          }
+        });
+      });
+  return out;
+}
+
+at::Tensor blocksparse_softmax_backward(
+    const at::Tensor& out_,
+    const at::Tensor& grad_,
+    const at::Tensor& layout_,
+    at::TensorList layout_info,
+    double scale) {
+  const auto layout = unpack_layout(layout_, layout_info);
+  const int64_t* row_offsets = layout.row_offsets.data_ptr<int64_t>();
+  check_values(out_, layout);
+  TORCH_CHECK(out_.sizes() == grad_.sizes(), "out and grad must match");
+  const auto out = out_.contiguous();
+  const auto grad = grad_.to(out.scalar_type()).contiguous();
+  const int64_t B = out.size(0), bs = out.size(2);
+  const int64_t nnz = layout.nnz();
+  at::Tensor grad_in = at::empty_like(out);
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      out.scalar_type(),
+      "blocksparse_softmax_backward",
+      [&] {
+        using acc_t = at::opmath_type<scalar_t>;
+        const scalar_t* y = out.data_ptr<scalar_t>();
+        const scalar_t* g = grad.data_ptr<scalar_t>();
+        scalar_t* dx = grad_in.data_ptr<scalar_t>();
+        const int64_t num_lines = layout.heads * layout.block_rows;
+        const acc_t scale_ = acc_t(scale);
+        at::parallel_for(0, B * num_lines, 1, [&](int64_t start, int64_t end) {
+          for (int64_t job = start; job < end; ++job) {
+            const int64_t batch = job / num_lines, line = job % num_lines;
+            const int64_t begin = row_offsets[line];
+            const int64_t stop = row_offsets[line + 1];
+            for (int64_t i = 0; i < bs; ++i) {
+              auto idx = [&](int64_t p, int64_t j) -> int64_t {
+                return ((batch * nnz + p) * bs + i) * bs + j;
+              };
+              acc_t dot = 0;
+              for (int64_t p = begin; p < stop; ++p) {
+                for (int64_t j = 0; j < bs; ++j) {
+                  dot += acc_t(y[idx(p, j)]) * acc_t(g[idx(p, j)]);
+                }
+              }
+              for (int64_t p = begin; p < stop; ++p) {
+                for (int64_t j = 0; j < bs; ++j) {
+                  const acc_t y_ = y[idx(p, j)];
+                  dx[idx(p, j)] =
+                      scalar_t(scale_ * y_ * (acc_t(g[idx(p, j)]) - dot));
+                }
+              }
+            }
+          }
+        });
+      });
+  return grad_in;
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::blocksparse_layout_info"),
+      TORCH_FN(blocksparse_layout_info));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::blocksparse_sddmm"),
+      TORCH_FN(blocksparse_sddmm));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::blocksparse_spmm"),
+      TORCH_FN(blocksparse_spmm));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::blocksparse_softmax"),
+      TORCH_FN(blocksparse_softmax));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::blocksparse_softmax_backward"),
+      TORCH_FN(blocksparse_softmax_backward));
+}
@@ -0,0 +1,435 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <ATen/Dispatch.h>
+#include <ATen/Parallel.h>
+#include <torch/library.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "attention_utils.h"
+
+/*
+ * Memory-efficient attention with a block-sparse mask
+ * (`xformers.ops.fmha.attn_bias.BlockSparseMask`), on CPU.
+ *
+ * Inputs are in BMHK format. The queries are processed by blocks of
+ * `block_size`, and each query block only visits the key blocks present in
+ * its row of the layout, keeping a running max / sum of the softmax (online
+ * softmax), so that the [Mq, Mkv] attention matrix is never materialized
+ * and masked blocks cost nothing.
+ */
+
+namespace {
+
+using xformers::cpu::axpy;
+using xformers::cpu::BMHK;
+using xformers::cpu::dot;
+using xformers::cpu::kNegInf;
+
+// Nonzero blocks of each row of a [heads, rows, cols] layout
+struct LayoutRows {
+  int64_t heads;
+  int64_t rows;
+  std::vector<int64_t> offsets;
+  std::vector<int64_t> indices;
+
+  const int64_t* begin(int64_t h, int64_t r) const {
+    return indices.data() + offsets[h * rows + r];
+  }
+  const int64_t* end(int64_t h, int64_t r) const {
+    return indices.data() + offsets[h * rows + r + 1];
+  }
+};
+
+// With `transpose`, lists the query blocks of each key block instead
+LayoutRows layout_rows(const at::Tensor& layout, bool transpose) {
+  auto mask = layout.ne(0);
+  if (transpose) {
+    mask = mask.transpose(1, 2);
+  }
+  mask = mask.contiguous();
+  const bool* data = mask.data_ptr<bool>();
+  LayoutRows out;
+  out.heads = mask.size(0);
+  out.rows = mask.size(1);
+  const int64_t cols = mask.size(2);
+  out.offsets.push_back(0);
+  for (int64_t row = 0; row < out.heads * out.rows; ++row) {
+    for (int64_t c = 0; c < cols; ++c) {
+      if (data[row * cols + c]) {
+        out.indices.push_back(c);
+      }
+    }
+    out.offsets.push_back(out.indices.size());
+  }
+  return out;
+}
+
+// Number of keys of the block starting at `key_begin` that the query `query`
+// can attend, among the `count` keys of the block
+inline int64_t visible_keys(
+    bool causal,
+    int64_t query,
+    int64_t key_begin,
+    int64_t count) {
+  if (!causal) {
+    return count;
+  }
+  return std::max<int64_t>(0, std::min<int64_t>(count, query - key_begin + 1));
+}
+
+struct Problem {
+  int64_t B, Mq, Mkv, H, K, Kv;
+  int64_t block_size;
+  int64_t q_blocks, kv_blocks;
+};
+
+Problem check_inputs(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const at::Tensor& layout,
+    int64_t block_size) {
+  TORCH_CHECK(query.dim() == 4, "query must be [B, Mq, H, K]");
+  TORCH_CHECK(key.dim() == 4, "key must be [B, Mkv, H, K]");
+  TORCH_CHECK(value.dim() == 4, "value must be [B, Mkv, H, Kv]");
+  TORCH_CHECK(!query.is_cuda() && !key.is_cuda() && !value.is_cuda());
+  TORCH_CHECK(
+      key.scalar_type() == query.scalar_type() &&
+      value.scalar_type() == query.scalar_type());
+  Problem p;
+  p.B = query.size(0);
+  p.Mq = query.size(1);
+  p.H = query.size(2);
+  p.K = query.size(3);
+  p.Mkv = key.size(1);
+  p.Kv = value.size(3);
+  TORCH_CHECK(
+      key.size(0) == p.B && key.size(2) == p.H && key.size(3) == p.K,
+      "query and key don't match");
+  TORCH_CHECK(
+      value.size(0) == p.B && value.size(1) == p.Mkv && value.size(2) == p.H,
+      "key and value don't match");
+  TORCH_CHECK(block_size > 0, "block_size must be positive");
+  p.block_size = block_size;
+  p.q_blocks = (p.Mq + block_size - 1) / block_size;
+  p.kv_blocks = (p.Mkv + block_size - 1) / block_size;
+  TORCH_CHECK(layout.dim() == 3, "layout must be [H, Mq_blocks, Mkv_blocks]");
+  TORCH_CHECK(!layout.is_cuda(), "layout must be a CPU tensor");
+  TORCH_CHECK(
+      layout.size(0) == 1 || layout.size(0) == p.H,
+      "layout must have 1 or H heads");
+  TORCH_CHECK(
+      layout.size(1) == p.q_blocks && layout.size(2) == p.kv_blocks,
+      "layout doesn't match the number of query / key blocks");
+  return p;
+}
+
+std::tuple<at::Tensor, at::Tensor> blocksparse_attention_forward(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const at::Tensor& layout,
+    int64_t block_size,
+    bool causal,
+    double scale,
+    bool compute_logsumexp) {
+  const Problem p = check_inputs(query, key, value, layout, block_size);
+  const LayoutRows rows = layout_rows(layout, false);
+  const int64_t bs = block_size;
+
+  at::Tensor out = at::empty({p.B, p.Mq, p.H, p.Kv}, query.options());
+  at::Tensor lse =
+      at::empty({p.B, p.H, p.Mq}, query.options().dtype(at::kFloat));
+  float* lse_ = lse.data_ptr<float>();
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      query.scalar_type(),
+      "blocksparse_attention_forward",
+      [&] {
+        const BMHK<scalar_t> q_(query), k_(key), v_(value), o_(out);
+        at::parallel_for(
+            0, p.B * p.H * p.q_blocks, 1, [&](int64_t start, int64_t end) {
+              std::vector<float> q(bs * p.K), k(bs * p.K), v(bs * p.Kv);
+              std::vector<float> acc(bs * p.Kv), s(bs), m(bs), l(bs);
+              for (int64_t task = start; task < end; ++task) {
+                const int64_t qb = task % p.q_blocks;
+                const int64_t h = (task / p.q_blocks) % p.H;
+                const int64_t b = task / (p.q_blocks * p.H);
+                const int64_t q0 = qb * bs;
+                const int64_t qn = std::min(bs, p.Mq - q0);
+                q_.load(b, h, q0, qn, q.data());
+                for (auto& x : q) {
+                  x *= float(scale);
+                }
+                std::fill(acc.begin(), acc.end(), 0.f);
+                std::fill(m.begin(), m.end(), kNegInf);
+                std::fill(l.begin(), l.end(), 0.f);
+
+                const int64_t hl = rows.heads == 1 ? 0 : h;
+                for (const int64_t* kb = rows.begin(hl, qb);
+                     kb != rows.end(hl, qb);
+                     ++kb) {
+                  const int64_t k0 = *kb * bs;
+                  const int64_t kn = std::min(bs, p.Mkv - k0);
+                  if (visible_keys(causal, q0 + qn - 1, k0, kn) == 0) {
+                    continue;
+                  }
+                  k_.load(b, h, k0, kn, k.data());
+                  v_.load(b, h, k0, kn, v.data());
+                  for (int64_t i = 0; i < qn; ++i) {
+                    const int64_t kmax = visible_keys(causal, q0 + i, k0, kn);
+                    if (kmax == 0) {
+                      continue;
+                    }
+                    float block_max = kNegInf;
+                    for (int64_t j = 0; j < kmax; ++j) {
+                      s[j] = dot(&q[i * p.K], &k[j * p.K], p.K);
+                      block_max = std::max(block_max, s[j]);
+                    }
+                    // Rescale what was accumulated with the previous max
+                    const float new_max = std::max(m[i], block_max);
+                    const float alpha = std::exp(m[i] - new_max);
+                    float* acc_i = &acc[i * p.Kv];
+                    l[i] *= alpha;
+                    for (int64_t d = 0; d < p.Kv; ++d) {
+                      acc_i[d] *= alpha;
+                    }
+                    for (int64_t j = 0; j < kmax; ++j) {
+                      const float prob = std::exp(s[j] - new_max);
+                      l[i] += prob;
+                      axpy(prob, &v[j * p.Kv], acc_i, p.Kv);
+                    }
+                    m[i] = new_max;
+                  }
+                }
+
+                // Queries which can't attend any key get a zero output
+                for (int64_t i = 0; i < qn; ++i) {
+                  const float inv = l[i] > 0 ? 1.f / l[i] : 0.f;
+                  for (int64_t d = 0; d < p.Kv; ++d) {
+                    acc[i * p.Kv + d] *= inv;
+                  }
+                  lse_[(b * p.H + h) * p.Mq + q0 + i] =
+                      l[i] > 0 ? m[i] + std::log(l[i]) : kNegInf;
+                }
+                o_.store(b, h, q0, qn, acc.data());
+              }
+            });
+      });
+  if (!compute_logsumexp) {
+    lse = at::empty({0}, lse.options());
+  }
+  return std::make_tuple(out, lse);
+}
+
+/*
+ * The gradient of the queries is computed per query block like the forward,
+ * and the gradients of the keys / values per key block, visiting the query
+ * blocks of its column in the layout. The probabilities are recomputed from
+ * the logsumexp in both passes, so that no thread needs to reduce into the
+ * output of another one.
+ */
+std::tuple<at::Tensor, at::Tensor, at::Tensor> blocksparse_attention_backward(
+    const at::Tensor& grad_out,
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const at::Tensor& out,
+    const at::Tensor& lse,
+    const at::Tensor& layout,
+    int64_t block_size,
+    bool causal,
+    double scale) {
+  const Problem p = check_inputs(query, key, value, layout, block_size);
+  TORCH_CHECK(grad_out.sizes() == out.sizes(), "grad_out and out don't match");
+  TORCH_CHECK(
+      out.size(0) == p.B && out.size(1) == p.Mq && out.size(2) == p.H &&
+          out.size(3) == p.Kv,
+      "out must be [B, Mq, H, Kv]");
+  TORCH_CHECK(
+      lse.dim() == 3 && lse.size(0) == p.B && lse.size(1) == p.H &&
+          lse.size(2) >= p.Mq,
+      "lse must be [B, H, Mq]");
+  const LayoutRows rows = layout_rows(layout, false);
+  const LayoutRows cols = layout_rows(layout, true);
+  const int64_t bs = block_size;
+
+  at::Tensor grad_q = at::empty({p.B, p.Mq, p.H, p.K}, query.options());
+  at::Tensor grad_k = at::empty({p.B, p.Mkv, p.H, p.K}, query.options());
+  at::Tensor grad_v = at::empty({p.B, p.Mkv, p.H, p.Kv}, query.options());
+  const auto lse_f = lse.to(at::kFloat).narrow(2, 0, p.Mq).contiguous();
+  const float* lse_ = lse_f.data_ptr<float>();
+  // delta[b, h, i] = <grad_out[b, i, h], out[b, i, h]>
+  at::Tensor delta = at::empty({p.B, p.H, p.Mq}, lse_f.options());
+  float* delta_ = delta.data_ptr<float>();
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      query.scalar_type(),
+      "blocksparse_attention_backward",
+      [&] {
+        const auto out_t = out.to(query.scalar_type());
+        const auto grad_out_t = grad_out.to(query.scalar_type());
+        const BMHK<scalar_t> q_(query), k_(key), v_(value);
+        const BMHK<scalar_t> o_(out_t), do_(grad_out_t);
+        const BMHK<scalar_t> dq_(grad_q), dk_(grad_k), dv_(grad_v);
+        const int64_t num_tasks = p.B * p.H * p.q_blocks;
+
+        at::parallel_for(0, num_tasks, 1, [&](int64_t start, int64_t end) {
+          std::vector<float> o(bs * p.Kv), d_o(bs * p.Kv);
+          for (int64_t task = start; task < end; ++task) {
+            const int64_t qb = task % p.q_blocks;
+            const int64_t bh = task / p.q_blocks;
+            const int64_t q0 = qb * bs;
+            const int64_t qn = std::min(bs, p.Mq - q0);
+            o_.load(bh / p.H, bh % p.H, q0, qn, o.data());
+            do_.load(bh / p.H, bh % p.H, q0, qn, d_o.data());
+            for (int64_t i = 0; i < qn; ++i) {
+              delta_[bh * p.Mq + q0 + i] =
+                  dot(&o[i * p.Kv], &d_o[i * p.Kv], p.Kv);
+            }
+          }
+        });
+
+        // Calls `fn(i, j, prob, grad_score)` for every visible pair of the
+        // query block `qb` and the key block `kb`
+        auto for_each_score = [&](int64_t b,
+                                  int64_t h,
+                                  int64_t qb,
+                                  int64_t kb,
+                                  const float* q,
+                                  const float* k,
+                                  const float* v,
+                                  const float* d_o,
+                                  auto&& fn) {
+          const int64_t q0 = qb * bs, qn = std::min(bs, p.Mq - q0);
+          const int64_t k0 = kb * bs, kn = std::min(bs, p.Mkv - k0);
+          for (int64_t i = 0; i < qn; ++i) {
+            const float row_lse = lse_[(b * p.H + h) * p.Mq + q0 + i];
+            if (row_lse == kNegInf) {
+              continue;
+            }
+            const float row_delta = delta_[(b * p.H + h) * p.Mq + q0 + i];
+            const int64_t kmax = visible_keys(causal, q0 + i, k0, kn);
+            for (int64_t j = 0; j < kmax; ++j) {
+              const float score =
+                  float(scale) * dot(&q[i * p.K], &k[j * p.K], p.K);
+              const float prob = std::exp(score - row_lse);
+              const float grad_prob = dot(&d_o[i * p.Kv], &v[j * p.Kv], p.Kv);
+              fn(i, j, prob, prob * (grad_prob - row_delta));
+            }
+          }
+        };
+
+        // dQ, per query block
+        at::parallel_for(0, num_tasks, 1, [&](int64_t start, int64_t end) {
+          std::vector<float> q(bs * p.K), k(bs * p.K), v(bs * p.Kv);
+          std::vector<float> d_o(bs * p.Kv), dq(bs * p.K);
+          for (int64_t task = start; task < end; ++task) {
+            const int64_t qb = task % p.q_blocks;
+            const int64_t h = (task / p.q_blocks) % p.H;
+            const int64_t b = task / (p.q_blocks * p.H);
+            const int64_t q0 = qb * bs, qn = std::min(bs, p.Mq - q0);
+            q_.load(b, h, q0, qn, q.data());
+            do_.load(b, h, q0, qn, d_o.data());
+            std::fill(dq.begin(), dq.end(), 0.f);
+            const int64_t hl = rows.heads == 1 ? 0 : h;
+            for (const int64_t* kb = rows.begin(hl, qb); kb != rows.end(hl, qb);
+                 ++kb) {
+              const int64_t k0 = *kb * bs, kn = std::min(bs, p.Mkv - k0);
+              if (visible_keys(causal, q0 + qn - 1, k0, kn) == 0) {
+                continue;
+              }
+              k_.load(b, h, k0, kn, k.data());
+              v_.load(b, h, k0, kn, v.data());
+              for_each_score(
+                  b,
+                  h,
+                  qb,
+                  *kb,
+                  q.data(),
+                  k.data(),
+                  v.data(),
+                  d_o.data(),
+                  [&](int64_t i, int64_t j, float, float grad_score) {
+                    axpy(grad_score, &k[j * p.K], &dq[i * p.K], p.K);
+                  });
+            }
+            for (auto& x : dq) {
+              x *= float(scale);
+            }
+            dq_.store(b, h, q0, qn, dq.data());
+          }
+        });
+
+        // dK and dV, per key block
+        at::parallel_for(
+            0, p.B * p.H * p.kv_blocks, 1, [&](int64_t start, int64_t end) {
+              std::vector<float> q(bs * p.K), k(bs * p.K), v(bs * p.Kv);
+              std::vector<float> d_o(bs * p.Kv), dk(bs * p.K), dv(bs * p.Kv);
+              for (int64_t task = start; task < end; ++task) {
+                const int64_t kb = task % p.kv_blocks;
+                const int64_t h = (task / p.kv_blocks) % p.H;
+                const int64_t b = task / (p.kv_blocks * p.H);
+                const int64_t k0 = kb * bs, kn = std::min(bs, p.Mkv - k0);
+                k_.load(b, h, k0, kn, k.data());
+                v_.load(b, h, k0, kn, v.data());
+                std::fill(dk.begin(), dk.end(), 0.f);
+                std::fill(dv.begin(), dv.end(), 0.f);
+                const int64_t hl = cols.heads == 1 ? 0 : h;
+                for (const int64_t* qb = cols.begin(hl, kb);
+                     qb != cols.end(hl, kb);
+                     ++qb) {
+                  const int64_t q0 = *qb * bs, qn = std::min(bs, p.Mq - q0);
+                  if (visible_keys(causal, q0 + qn - 1, k0, kn) == 0) {
+                    continue;
+                  }
+                  q_.load(b, h, q0, qn, q.data());
+                  do_.load(b, h, q0, qn, d_o.data());
+                  for_each_score(
+                      b,
+                      h,
+                      *qb,
+                      kb,
+                      q.data(),
+                      k.data(),
+                      v.data(),
+                      d_o.data(),
+                      [&](int64_t i, int64_t j, float prob, float grad_score) {
+                        axpy(prob, &d_o[i * p.Kv], &dv[j * p.Kv], p.Kv);
+                        axpy(grad_score, &q[i * p.K], &dk[j * p.K], p.K);
+                      });
+                }
+                for (auto& x : dk) {
+                  x *= float(scale);
+                }
+                dk_.store(b, h, k0, kn, dk.data());
+                dv_.store(b, h, k0, kn, dv.data());
+              }
+            });
+      });
+  return std::make_tuple(grad_q, grad_k, grad_v);
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::blocksparse_attention_forward"),
+      TORCH_FN(blocksparse_attention_forward));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::blocksparse_attention_backward"),
+      TORCH_FN(blocksparse_attention_backward));
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <ATen/Parallel.h>
+#include <torch/library.h>
+
+#include <algorithm>
+
+/*
+ * Causal linear attention (eg FAVOR), on CPU:
+ *   out[b, i] = sum_{j <= i} <query[b, i], key[b, j]> value[b, j]
+ * with `query` / `key` [B, N, F] and `value` [B, N, E].
+ *
+ * Instead of materializing the [B, N, F, E] prefix sums of
+ * `key (x) value`, the sequence is scanned by chunks, keeping a running
+ * [F, E] state per batch element. Within a chunk, everything is dense
+ * matmuls:
+ *   out[chunk] = query[chunk] @ state
+ *                + tril(query[chunk] @ key[chunk].T) @ value[chunk]
+ *   state += key[chunk].T @ value[chunk]
+ */
+
+namespace {
+
+void check_inputs(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    int64_t chunk_size) {
+  TORCH_CHECK(query.dim() == 3, "query must be [B, N, F]");
+  TORCH_CHECK(key.sizes() == query.sizes(), "query and key don't match");
+  TORCH_CHECK(value.dim() == 3, "value must be [B, N, E]");
+  TORCH_CHECK(
+      value.size(0) == query.size(0) && value.size(1) == query.size(1),
+      "key and value don't match");
+  TORCH_CHECK(
+      key.scalar_type() == query.scalar_type() &&
+      value.scalar_type() == query.scalar_type());
+  TORCH_CHECK(!query.is_cuda() && !key.is_cuda() && !value.is_cuda());
+  TORCH_CHECK(chunk_size > 0, "chunk_size must be positive");
+}
+
+/*
+ * out[i] = sum <a[i], b[j]> c[j], over the j <= i, or the j >= i with
+ * `reverse`. The forward is a causal scan, and so are the gradients, with
+ * the operands swapped (backwards in time for the key and the value)
+ */
+at::Tensor linear_scan(
+    const at::Tensor& a,
+    const at::Tensor& b,
+    const at::Tensor& c,
+    int64_t chunk_size,
+    bool reverse) {
+  const int64_t B = a.size(0), N = a.size(1), E = c.size(2);
+  at::Tensor out = at::empty({B, N, E}, c.options());
+  // With fewer batch elements than threads, each matmul is parallelized
+  // instead
+  const int64_t grain = B < at::get_num_threads() ? B : 1;
+  at::parallel_for(0, B, grain, [&](int64_t start, int64_t end) {
+    for (int64_t batch = start; batch < end; ++batch) {
+      const auto a_ = a[batch], b_ = b[batch], c_ = c[batch];
+      const auto out_ = out[batch];
+      at::Tensor state = at::zeros({a.size(2), E}, c.options());
+      const int64_t num_chunks = (N + chunk_size - 1) / chunk_size;
+      for (int64_t n = 0; n < num_chunks; ++n) {
+        const int64_t chunk = reverse ? num_chunks - 1 - n : n;
+        const int64_t begin = chunk * chunk_size;
+        const int64_t count = std::min(chunk_size, N - begin);
+        const auto a_chunk = a_.narrow(0, begin, count);
+        const auto b_chunk = b_.narrow(0, begin, count);
+        const auto c_chunk = c_.narrow(0, begin, count);
+        auto scores = at::mm(a_chunk, b_chunk.t());
+        if (reverse) {
+          scores.triu_();
+        } else {
+          scores.tril_();
+        }
+        auto out_chunk = out_.narrow(0, begin, count);
+        at::mm_out(out_chunk, scores, c_chunk);
+        out_chunk.addmm_(a_chunk, state);
+        state.addmm_(b_chunk.t(), c_chunk);
+      }
+    }
+  });
+  return out;
+}
+
+at::Tensor causal_linear_attention(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    int64_t chunk_size) {
+  check_inputs(query, key, value, chunk_size);
+  return linear_scan(query, key, value, chunk_size, false);
+}
+
+/*
+ * grad_query[i] = sum_{j <= i} <grad_out[i], value[j]> key[j]
+ * grad_key[j] = sum_{i >= j} <value[j], grad_out[i]> query[i]
+ * grad_value[j] = sum_{i >= j} <key[j], query[i]> grad_out[i]
+ */
+std::tuple<at::Tensor, at::Tensor, at::Tensor> causal_linear_attention_backward(
+    const at::Tensor& grad_out,
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    int64_t chunk_size) {
+  check_inputs(query, key, value, chunk_size);
+  TORCH_CHECK(grad_out.sizes() == value.sizes(), "grad_out must be [B, N, E]");
+  const auto grad_out_ = grad_out.to(value.scalar_type());
+  return std::make_tuple(
+      linear_scan(grad_out_, value, key, chunk_size, false),
+      linear_scan(value, grad_out_, query, chunk_size, true),
+      linear_scan(key, query, grad_out_, chunk_size, true));
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::causal_linear_attention"),
+      TORCH_FN(causal_linear_attention));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::causal_linear_attention_backward"),
+      TORCH_FN(causal_linear_attention_backward));
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#pragma once
+
+#include <ATen/Parallel.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace xformers {
+namespace cpu {
+
+/*
+ * Splits the nonzeros of a CSR matrix into chunks of the same size, to be
+ * processed in parallel by the sputnik CPU kernels.
+ *
+ * The chunks are cut on the nonzeros rather than on the rows, so that the
+ * work is balanced whatever the distribution of the row lengths (eg a few
+ * global tokens attending to everything): a row longer than a chunk is
+ * split across several chunks. Each chunk visits, in order:
+ * - the "head" of the row which started in a previous chunk, if any. The
+ *   kernels which reduce over a row store the result of the head in a
+ *   per-chunk buffer, and reduce it in the row with `for_each_head` once
+ *   all the chunks are done.
+ * - the rows which start in the chunk, including the empty ones. The last
+ *   of them might continue in the next chunks.
+ */
+class CsrPartition {
+ public:
+  // Work below which a chunk isn't worth a task, in multiply-adds
+  static constexpr int64_t kMinChunkWork = 16384;
+
+  CsrPartition(
+      const int* row_offsets,
+      int64_t m,
+      int64_t batch,
+      int64_t work_per_nonzero)
+      : row_offsets_(row_offsets), m_(m) {
+    const int64_t nonzeros = row_offsets[m];
+    // Enough chunks to keep all the threads busy with the batch, but not so
+    // many that the chunks are too small
+    const int64_t tasks = 4 * at::get_num_threads();
+    const int64_t max_chunks = std::max<int64_t>(
+        1,
+        std::min<int64_t>(
+            nonzeros,
+            nonzeros * std::max<int64_t>(work_per_nonzero, 1) /
+                kMinChunkWork));
+    const int64_t num_chunks = std::min<int64_t>(
+        max_chunks, (tasks + batch - 1) / std::max<int64_t>(batch, 1));
+    for (int64_t c = 0; c <= num_chunks; ++c) {
+      nnz_begin_.push_back(nonzeros * c / num_chunks);
+      // The first row which starts in the chunk
+      row_begin_.push_back(
+          c == num_chunks ? m
+                          : std::lower_bound(
+                                row_offsets, row_offsets + m, nnz_begin_[c]) -
+                  row_offsets);
+    }
+  }
+
+  int64_t num_chunks() const {
+    return int64_t(nnz_begin_.size()) - 1;
+  }
+
+  // The row split at the start of `chunk`, or -1
+  int64_t head_row(int64_t chunk) const {
+    const int64_t row = row_begin_[chunk];
+    if (row == m_ || row_offsets_[row] != nnz_begin_[chunk]) {
+      return row - 1;
+    }
+    return -1;
+  }
+
+  /*
+   * Calls `fn(row, begin, end, is_head)` for every segment [begin, end) of
+   * a row in `chunk`
+   */
+  template <typename Fn>
+  void for_each_segment(int64_t chunk, Fn fn) const {
+    const int64_t begin = nnz_begin_[chunk];
+    const int64_t end = nnz_begin_[chunk + 1];
+    const int64_t head = head_row(chunk);
+    if (head >= 0) {
+      fn(head, begin, std::min<int64_t>(row_offsets_[head + 1], end), true);
+    }
+    for (int64_t row = row_begin_[chunk]; row < row_begin_[chunk + 1];
+         ++row) {
+      fn(row,
+         int64_t(row_offsets_[row]),
+         std::min<int64_t>(row_offsets_[row + 1], end),
+         false);
+    }
+  }
+
+  // Calls `fn(b, chunk)` in parallel for every chunk of every batch element
+  template <typename Fn>
+  void parallel_for(int64_t batch, Fn fn) const {
+    const int64_t num_chunks = this->num_chunks();
+    at::parallel_for(
+        0, batch * num_chunks, 1, [&](int64_t start, int64_t end) {
+          for (int64_t task = start; task < end; ++task) {
+            fn(task / num_chunks, task % num_chunks);
+          }
+        });
+  }
+
+  // Calls `fn(b, chunk, row)`, serially, for every chunk which has a head
+  template <typename Fn>
+  void for_each_head(int64_t batch, Fn fn) const {
+    for (int64_t b = 0; b < batch; ++b) {
+      for (int64_t c = 0; c < num_chunks(); ++c) {
+        const int64_t row = head_row(c);
+        if (row >= 0) {
+          fn(b, c, row);
+        }
+      }
+    }
+  }
+
+ private:
+  const int* row_offsets_;
+  int64_t m_;
+  std::vector<int64_t> nnz_begin_;
+  std::vector<int64_t> row_begin_;
+};
+
+} // namespace cpu
+} // namespace xformers
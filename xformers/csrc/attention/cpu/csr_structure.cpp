@@ -0,0 +1,372 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <ATen/Dispatch.h>
+#include <ATen/Parallel.h>
+#include <torch/library.h>
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+/*
+ * Structure-only kernels for the CSR matrices of `xformers.sparse`:
+ * they work on `row_offsets` / `column_indices` and never look at the values.
+ */
+
+namespace {
+
+// Below this number of nonzeros per thread, threading doesn't pay off
+constexpr int64_t kGrainSize = 32768;
+
+void check_index(const at::Tensor& t, const char* name) {
+  TORCH_CHECK(t.dim() == 1, name, " must be a 1D tensor");
+  TORCH_CHECK(!t.is_cuda(), name, " must be a CPU tensor");
+  TORCH_CHECK(t.is_contiguous(), name, " must be a contiguous tensor");
+  TORCH_CHECK(
+      t.scalar_type() == at::kInt || t.scalar_type() == at::kLong,
+      name,
+      " must be int32 or int64");
+}
+
+/*
+ * Order of the rows by decreasing number of nonzeros, which the sputnik
+ * kernels use to schedule the longest rows first (`row_indices`).
+ * This is a counting sort on the row lengths, so ties keep the row order.
+ */
+template <typename index_t>
+void rows_by_length(const index_t* row_offsets, int64_t m, int64_t* out) {
+  int64_t max_length = 0;
+  for (int64_t r = 0; r < m; ++r) {
+    max_length =
+        std::max<int64_t>(max_length, row_offsets[r + 1] - row_offsets[r]);
+  }
+  // start[l] is the first output slot for the rows of length `l`,
+  // the longest rows coming first
+  std::vector<int64_t> start(max_length + 2, 0);
+  for (int64_t r = 0; r < m; ++r) {
+    start[max_length - (row_offsets[r + 1] - row_offsets[r]) + 1]++;
+  }
+  for (int64_t l = 0; l <= max_length; ++l) {
+    start[l + 1] += start[l];
+  }
+  for (int64_t r = 0; r < m; ++r) {
+    out[start[max_length - (row_offsets[r + 1] - row_offsets[r])]++] = r;
+  }
+}
+
+at::Tensor csr_rows_by_length(const at::Tensor& row_offsets) {
+  check_index(row_offsets, "row_offsets");
+  const int64_t m = row_offsets.size(0) - 1;
+  at::Tensor out = at::empty({m}, row_offsets.options().dtype(at::kLong));
+  AT_DISPATCH_INDEX_TYPES(row_offsets.scalar_type(), "csr_rows_by_length", [&] {
+    rows_by_length(row_offsets.data_ptr<index_t>(), m, out.data_ptr<int64_t>());
+  });
+  return out;
+}
+
+/*
+ * Builds the structure of the transposed [n, m] matrix, and the permutation
+ * to apply to the values: `values_t = values[:, perm]`.
+ *
+ * This is a parallel counting sort of the nonzeros by column: each thread
+ * counts the columns of a contiguous range of rows, which gives every
+ * (column, thread) pair its own output range. The threads then scatter their
+ * rows in order, so that the rows of each transposed row are sorted, in
+ * O(nnz + threads * n) time.
+ */
+std::tuple<at::Tensor, at::Tensor, at::Tensor, at::Tensor> csr_transpose_info(
+    int64_t m,
+    int64_t n,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices) {
+  check_index(row_offsets, "row_offsets");
+  check_index(column_indices, "column_indices");
+  TORCH_CHECK(row_offsets.size(0) == m + 1, "row_offsets must be [m + 1]");
+  TORCH_CHECK(
+      row_offsets.scalar_type() == column_indices.scalar_type(),
+      "row_offsets and column_indices must have the same dtype");
+  const int64_t nnz = column_indices.size(0);
+
+  at::Tensor row_offsets_t = at::empty({n + 1}, row_offsets.options());
+  at::Tensor column_indices_t = at::empty({nnz}, row_offsets.options());
+  at::Tensor perm = at::empty({nnz}, row_offsets.options().dtype(at::kLong));
+  at::Tensor row_indices_t =
+      at::empty({n}, row_offsets.options().dtype(at::kLong));
+
+  AT_DISPATCH_INDEX_TYPES(row_offsets.scalar_type(), "csr_transpose_info", [&] {
+    const index_t* offsets = row_offsets.data_ptr<index_t>();
+    const index_t* columns = column_indices.data_ptr<index_t>();
+    index_t* offsets_t = row_offsets_t.data_ptr<index_t>();
+    index_t* columns_t = column_indices_t.data_ptr<index_t>();
+    int64_t* perm_ = perm.data_ptr<int64_t>();
+    TORCH_CHECK(offsets[m] == nnz, "row_offsets[-1] must be nnz");
+
+    // Rows of each part, with about the same number of nonzeros
+    const int64_t num_parts = std::max<int64_t>(
+        1, std::min<int64_t>(at::get_num_threads(), nnz / kGrainSize));
+    std::vector<int64_t> part_rows(num_parts + 1, m);
+    part_rows[0] = 0;
+    for (int64_t p = 1; p < num_parts; ++p) {
+      const index_t target = nnz * p / num_parts;
+      part_rows[p] = std::lower_bound(offsets, offsets + m, target) - offsets;
+    }
+
+    // counts[p * n + c]: number of nonzeros of the column `c` in part `p`,
+    // which then becomes the next output slot of this part for this column
+    std::vector<int64_t> counts(num_parts * n, 0);
+    at::parallel_for(0, num_parts, 1, [&](int64_t start, int64_t end) {
+      for (int64_t p = start; p < end; ++p) {
+        int64_t* part_counts = counts.data() + p * n;
+        for (int64_t j = offsets[part_rows[p]]; j < offsets[part_rows[p + 1]];
+             ++j) {
+          TORCH_CHECK(
+              columns[j] >= 0 && columns[j] < n, "column index out of range");
+          part_counts[columns[j]]++;
+        }
+      }
+    });
+    offsets_t[0] = 0;
+    for (int64_t c = 0; c < n; ++c) {
+      int64_t next = offsets_t[c];
+      for (int64_t p = 0; p < num_parts; ++p) {
+        const int64_t count = counts[p * n + c];
+        counts[p * n + c] = next;
+        next += count;
+      }
+      offsets_t[c + 1] = next;
+    }
+    at::parallel_for(0, num_parts, 1, [&](int64_t start, int64_t end) {
+      for (int64_t p = start; p < end; ++p) {
+        int64_t* slots = counts.data() + p * n;
+        for (int64_t r = part_rows[p]; r < part_rows[p + 1]; ++r) {
+          for (int64_t j = offsets[r]; j < offsets[r + 1]; ++j) {
+            const int64_t dst = slots[columns[j]]++;
+            columns_t[dst] = r;
+            perm_[dst] = j;
+          }
+        }
+      }
+    });
+
+    rows_by_length(offsets_t, n, row_indices_t.data_ptr<int64_t>());
+  });
+  return std::make_tuple(
+      row_indices_t.to(at::kInt), row_offsets_t, column_indices_t, perm);
+}
+
+// Row of each nonzero (uncompressed rows)
+at::Tensor csr_to_coo_rows(const at::Tensor& row_offsets) {
+  check_index(row_offsets, "row_offsets");
+  const int64_t m = row_offsets.size(0) - 1;
+  at::Tensor rows;
+  AT_DISPATCH_INDEX_TYPES(row_offsets.scalar_type(), "csr_to_coo_rows", [&] {
+    const index_t* offsets = row_offsets.data_ptr<index_t>();
+    rows = at::empty({int64_t(offsets[m])}, row_offsets.options());
+    index_t* rows_ = rows.data_ptr<index_t>();
+    // About `kGrainSize` nonzeros per task
+    const int64_t grain =
+        std::max<int64_t>(1, kGrainSize * m / (offsets[m] + 1));
+    at::parallel_for(0, m, grain, [&](int64_t start, int64_t end) {
+      for (int64_t r = start; r < end; ++r) {
+        std::fill(rows_ + offsets[r], rows_ + offsets[r + 1], index_t(r));
+      }
+    });
+  });
+  return rows;
+}
+
+/*
+ * Compresses sorted row indices: `row_offsets[r]` is the first nonzero
+ * whose row is at least `r`. Each nonzero fills the offsets of the rows
+ * between its own row and the previous one, independently of the others.
+ */
+at::Tensor coo_rows_to_csr(const at::Tensor& row_indices, int64_t m) {
+  check_index(row_indices, "row_indices");
+  const int64_t nnz = row_indices.size(0);
+  at::Tensor row_offsets = at::empty({m + 1}, row_indices.options());
+  AT_DISPATCH_INDEX_TYPES(row_indices.scalar_type(), "coo_rows_to_csr", [&] {
+    const index_t* rows = row_indices.data_ptr<index_t>();
+    index_t* offsets = row_offsets.data_ptr<index_t>();
+    at::parallel_for(0, nnz + 1, kGrainSize, [&](int64_t start, int64_t end) {
+      for (int64_t i = start; i < end; ++i) {
+        const int64_t prev = i == 0 ? -1 : int64_t(rows[i - 1]);
+        const int64_t row = i == nnz ? m : int64_t(rows[i]);
+        TORCH_CHECK(row >= prev, "row_indices must be sorted");
+        TORCH_CHECK(row <= m, "row index out of range");
+        for (int64_t r = prev + 1; r <= row; ++r) {
+          offsets[r] = index_t(i);
+        }
+      }
+    });
+  });
+  return row_offsets;
+}
+
+// Structure of the result of `csr_merge`
+enum MergeMode : int64_t {
+  // Nonzeros of either matrix (eg for add, sub)
+  kUnion = 0,
+  // Nonzeros of both matrices (eg for mul, logical_and)
+  kIntersection = 1,
+  // Nonzeros of the first matrix
+  kLeft = 2,
+};
+
+/*
+ * Merges the (sorted) columns of a row of `a` and `b`, calling
+ * `emit(column, index_a, index_b)` for each nonzero of the result, where
+ * `index_a` is the position of the nonzero in `a` (-1 if not in `a`).
+ */
+template <typename index_t, typename Emit>
+void merge_row(
+    const index_t* columns_a,
+    int64_t begin_a,
+    int64_t end_a,
+    const index_t* columns_b,
+    int64_t begin_b,
+    int64_t end_b,
+    int64_t mode,
+    Emit&& emit) {
+  int64_t i = begin_a, j = begin_b;
+  while (i < end_a && j < end_b) {
+    if (columns_a[i] == columns_b[j]) {
+      emit(columns_a[i], i, j);
+      ++i;
+      ++j;
+    } else if (columns_a[i] < columns_b[j]) {
+      if (mode != kIntersection) {
+        emit(columns_a[i], i, -1);
+      }
+      ++i;
+    } else {
+      if (mode == kUnion) {
+        emit(columns_b[j], -1, j);
+      }
+      ++j;
+    }
+  }
+  for (; i < end_a && mode != kIntersection; ++i) {
+    emit(columns_a[i], i, -1);
+  }
+  for (; j < end_b && mode == kUnion; ++j) {
+    emit(columns_b[j], -1, j);
+  }
+}
+
+/*
+ * Structure of an elementwise operation between two [m, n] CSR matrices
+ * with different sparsity patterns: returns the `row_offsets` and
+ * `column_indices` of the union / intersection of the two patterns, and
+ * for each of its nonzeros the index of the value to read in `a` and in `b`
+ * (or -1 where the matrix has an implicit zero).
+ * The rows are merged independently with two pointers, in two passes (one
+ * to count the nonzeros of each row, one to write them).
+ */
+std::tuple<at::Tensor, at::Tensor, at::Tensor, at::Tensor> csr_merge(
+    const at::Tensor& row_offsets_a,
+    const at::Tensor& column_indices_a,
+    const at::Tensor& row_offsets_b,
+    const at::Tensor& column_indices_b,
+    int64_t mode) {
+  check_index(row_offsets_a, "row_offsets_a");
+  check_index(column_indices_a, "column_indices_a");
+  check_index(row_offsets_b, "row_offsets_b");
+  check_index(column_indices_b, "column_indices_b");
+  TORCH_CHECK(
+      row_offsets_a.size(0) == row_offsets_b.size(0),
+      "a and b must have the same number of rows");
+  TORCH_CHECK(
+      row_offsets_a.scalar_type() == column_indices_a.scalar_type() &&
+          row_offsets_a.scalar_type() == row_offsets_b.scalar_type() &&
+          row_offsets_a.scalar_type() == column_indices_b.scalar_type(),
+      "The indices of a and b must have the same dtype");
+  TORCH_CHECK(
+      mode == kUnion || mode == kIntersection || mode == kLeft,
+      "Unknown merge mode ",
+      mode);
+  const int64_t m = row_offsets_a.size(0) - 1;
+
+  at::Tensor row_offsets = at::empty({m + 1}, row_offsets_a.options());
+  at::Tensor column_indices, index_a, index_b;
+  AT_DISPATCH_INDEX_TYPES(row_offsets_a.scalar_type(), "csr_merge", [&] {
+    const index_t* offsets_a = row_offsets_a.data_ptr<index_t>();
+    const index_t* offsets_b = row_offsets_b.data_ptr<index_t>();
+    const index_t* columns_a = column_indices_a.data_ptr<index_t>();
+    const index_t* columns_b = column_indices_b.data_ptr<index_t>();
+    index_t* offsets = row_offsets.data_ptr<index_t>();
+    // About `kGrainSize` input nonzeros per task
+    const int64_t grain = std::max<int64_t>(
+        1, kGrainSize * m / (offsets_a[m] + offsets_b[m] + 1));
+    auto merge = [&](int64_t r, auto&& emit) {
+      merge_row(
+          columns_a,
+          offsets_a[r],
+          offsets_a[r + 1],
+          columns_b,
+          offsets_b[r],
+          offsets_b[r + 1],
+          mode,
+          emit);
+    };
+
+    offsets[0] = 0;
+    at::parallel_for(0, m, grain, [&](int64_t start, int64_t end) {
+      for (int64_t r = start; r < end; ++r) {
+        int64_t count = 0;
+        merge(r, [&](index_t, int64_t, int64_t) { ++count; });
+        offsets[r + 1] = index_t(count);
+      }
+    });
+    int64_t nnz = 0;
+    for (int64_t r = 0; r < m; ++r) {
+      nnz += offsets[r + 1];
+      TORCH_CHECK(
+          nnz <= std::numeric_limits<index_t>::max(),
+          "Too many nonzeros for the index dtype");
+      offsets[r + 1] = index_t(nnz);
+    }
+
+    column_indices = at::empty({nnz}, row_offsets_a.options());
+    index_a = at::empty({nnz}, row_offsets_a.options().dtype(at::kLong));
+    index_b = at::empty({nnz}, row_offsets_a.options().dtype(at::kLong));
+    index_t* columns = column_indices.data_ptr<index_t>();
+    int64_t* index_a_ = index_a.data_ptr<int64_t>();
+    int64_t* index_b_ = index_b.data_ptr<int64_t>();
+    at::parallel_for(0, m, grain, [&](int64_t start, int64_t end) {
+      for (int64_t r = start; r < end; ++r) {
+        int64_t k = offsets[r];
+        merge(r, [&](index_t column, int64_t i, int64_t j) {
+          columns[k] = column;
+          index_a_[k] = i;
+          index_b_[k] = j;
+          ++k;
+        });
+      }
+    });
+  });
+  return std::make_tuple(row_offsets, column_indices, index_a, index_b);
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::csr_transpose_info"),
+      TORCH_FN(csr_transpose_info));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::csr_rows_by_length"),
+      TORCH_FN(csr_rows_by_length));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::csr_to_coo_rows"),
+      TORCH_FN(csr_to_coo_rows));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::coo_rows_to_csr"),
+      TORCH_FN(coo_rows_to_csr));
+  m.impl(TORCH_SELECTIVE_NAME("xformers::csr_merge"), TORCH_FN(csr_merge));
+}
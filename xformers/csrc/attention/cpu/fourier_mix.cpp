@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <ATen/Dispatch.h>
+#include <ATen/OpMathType.h>
+#include <ATen/Parallel.h>
+#include <torch/library.h>
+
+#include <algorithm>
+
+#include "../../fused/cpu/philox.h"
+
+/*
+ * FNet token mixing on CPU, for `x` [..., S, H]:
+ *   y = dropout(Re(fft2(x)))
+ *
+ * `x` is real, so its spectrum is Hermitian: only the first H / 2 + 1
+ * frequencies of the hidden dimension are computed (real-to-complex FFT),
+ * followed by a complex FFT over the sequence. The other frequencies are
+ * mirrored from these while writing the real part to the output:
+ *   Re(Z[s, h]) = Re(Z[-s mod S, H - h])
+ * and the dropout is applied in the same pass. The batch is processed by
+ * tiles, converted to float one at a time, so that half precision inputs
+ * don't need a full float copy (double inputs stay in double).
+ *
+ * Re(fft2) is symmetric (cos(a + b) = cos a cos b - sin a sin b, and both
+ * products are symmetric), so the backward is the same transform of the
+ * gradient, after the dropout mask regenerated from the seed.
+ */
+
+namespace {
+
+using xformers::cpu::for_each_keep;
+using xformers::cpu::Philox;
+
+// Elements in a tile of the batch, the tile and its spectrum stay in L2/L3
+constexpr int64_t kTileElements = 1 << 20;
+
+// Rows per task, so that a task has some work even when the rows are short
+inline int64_t row_grain(int64_t N) {
+  return std::max<int64_t>(1, 32768 / std::max<int64_t>(N, 1));
+}
+
+/*
+ * out = Re(fft2(dropout(in))) with `dropout_input`, and
+ * out = dropout(Re(fft2(in))) otherwise, for `in` / `out` [B, S, H]
+ */
+template <typename scalar_t>
+void fourier_mix_kernel(
+    const at::Tensor& in,
+    at::Tensor& out,
+    float p,
+    const Philox& rng,
+    bool dropout_input) {
+  using acc_t = at::opmath_type<scalar_t>;
+  const int64_t B = in.size(0);
+  const int64_t S = in.size(1);
+  const int64_t H = in.size(2);
+  const int64_t H_half = H / 2 + 1;
+  const int64_t tile_b =
+      std::max<int64_t>(1, kTileElements / std::max<int64_t>(S * H, 1));
+  const acc_t scale = acc_t(1) / (acc_t(1) - acc_t(p));
+  const scalar_t* in_data = in.data_ptr<scalar_t>();
+  scalar_t* out_data = out.data_ptr<scalar_t>();
+
+  for (int64_t b_begin = 0; b_begin < B; b_begin += tile_b) {
+    const int64_t b_end = std::min(B, b_begin + tile_b);
+    const int64_t row_begin = b_begin * S;
+    at::Tensor tile = at::empty(
+        {b_end - b_begin, S, H},
+        in.options().dtype(c10::CppTypeToScalarType<acc_t>::value));
+    acc_t* tile_data = tile.data_ptr<acc_t>();
+
+    at::parallel_for(
+        row_begin, b_end * S, row_grain(H), [&](int64_t start, int64_t end) {
+          for (int64_t row = start; row < end; ++row) {
+            const scalar_t* in_row = in_data + row * H;
+            acc_t* tile_row = tile_data + (row - row_begin) * H;
+            if (!dropout_input || p == 0.f) {
+              for (int64_t col = 0; col < H; ++col) {
+                tile_row[col] = acc_t(in_row[col]);
+              }
+              continue;
+            }
+            for_each_keep(rng, row, H, p, [&](int64_t col, bool keep) {
+              tile_row[col] = keep ? acc_t(in_row[col]) * scale : acc_t(0);
+            });
+          }
+        });
+
+    // [tile_b, S, H / 2 + 1] complex, as interleaved reals
+    const at::Tensor spectrum = at::view_as_real(at::fft_fft(
+        at::fft_rfft(tile, c10::nullopt, -1, c10::nullopt),
+        c10::nullopt,
+        1,
+        c10::nullopt)).contiguous();
+    const acc_t* spec_data = spectrum.data_ptr<acc_t>();
+
+    at::parallel_for(
+        row_begin, b_end * S, row_grain(H), [&](int64_t start, int64_t end) {
+          for (int64_t row = start; row < end; ++row) {
+            const int64_t b = (row - row_begin) / S;
+            const int64_t s = row % S;
+            const acc_t* spec_row = spec_data + (b * S + s) * H_half * 2;
+            const acc_t* mirror_row =
+                spec_data + (b * S + (S - s) % S) * H_half * 2;
+            auto mixed = [&](int64_t col) {
+              return col < H_half ? spec_row[2 * col]
+                                  : mirror_row[2 * (H - col)];
+            };
+            scalar_t* out_row = out_data + row * H;
+            if (dropout_input || p == 0.f) {
+              for (int64_t col = 0; col < H; ++col) {
+                out_row[col] = scalar_t(mixed(col));
+              }
+              continue;
+            }
+            for_each_keep(rng, row, H, p, [&](int64_t col, bool keep) {
+              out_row[col] = scalar_t(keep ? mixed(col) * scale : acc_t(0));
+            });
+          }
+        });
+  }
+}
+
+at::Tensor fourier_mix_impl(
+    const at::Tensor& x,
+    double p,
+    int64_t seed,
+    bool dropout_input) {
+  TORCH_CHECK(!x.is_cuda(), "x must be a CPU tensor");
+  TORCH_CHECK(x.dim() >= 2, "x must be [..., S, H]");
+  TORCH_CHECK(0 <= p && p < 1, "p must be in [0, 1)");
+  const int64_t S = x.size(-2);
+  const int64_t H = x.size(-1);
+  const auto x_ = x.contiguous().view({-1, S, H});
+  at::Tensor out = at::empty_like(x_);
+  if (x_.numel() == 0) {
+    return out.view(x.sizes());
+  }
+  const Philox rng(seed);
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      x.scalar_type(),
+      "fourier_mix",
+      [&] {
+        fourier_mix_kernel<scalar_t>(x_, out, float(p), rng, dropout_input);
+      });
+  return out.view(x.sizes());
+}
+
+at::Tensor fourier_mix(const at::Tensor& x, double p, int64_t seed) {
+  return fourier_mix_impl(x, p, seed, /*dropout_input=*/false);
+}
+
+at::Tensor fourier_mix_backward(
+    const at::Tensor& grad_out,
+    double p,
+    int64_t seed) {
+  return fourier_mix_impl(grad_out, p, seed, /*dropout_input=*/true);
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::fourier_mix"), TORCH_FN(fourier_mix));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::fourier_mix_backward"),
+      TORCH_FN(fourier_mix_backward));
+}
@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <ATen/Parallel.h>
+#include <torch/library.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+
+/*
+ * Fused forward of `NystromAttention` (non-causal, without padding mask), on
+ * CPU, for queries / keys [B, N, D] and values [B, N, E]:
+ *
+ *   x = softmax(Q Kl^T) @ pinv(softmax(Ql Kl^T)) @ softmax(Ql K^T) @ V
+ *
+ * with the landmarks Ql / Kl [m, D] averaged over segments of the sequence
+ * (like `AvgPool`), the softmax scaled by 1 / sqrt(D), and the
+ * pseudo-inverse approximated with the Newton-Schulz iterations of
+ * `iterative_pinv`.
+ * The [m, m] products reuse a few preallocated buffers, and the [N, m] /
+ * [m, N] kernels are streamed over tiles of the sequence: only one
+ * [kTile, m] tile is live at a time, and the rest of the work is GEMMs.
+ */
+
+namespace {
+
+constexpr int64_t kTile = 256;
+
+// Same segments as `AvgPool`: the last ones are one row longer when `m`
+// doesn't divide the sequence length
+at::Tensor pool_landmarks(const at::Tensor& x, int64_t m) {
+  const int64_t N = x.size(0), D = x.size(1);
+  const int64_t segments = N / m;
+  if (N % m == 0) {
+    return x.reshape({m, segments, D}).mean(1);
+  }
+  const int64_t n_round = m - N % m;
+  return at::cat(
+      {x.narrow(0, 0, n_round * segments)
+           .reshape({n_round, segments, D})
+           .mean(1),
+       x.narrow(0, n_round * segments, N - n_round * segments)
+           .reshape({m - n_round, segments + 1, D})
+           .mean(1)});
+}
+
+/*
+ * Newton-Schulz iterations of `iterative_pinv`, for a single [m, m] kernel:
+ *   V <- 0.25 V (13 I - KV (15 I - KV (7 I - KV)))
+ * starting from `coef * K^T`
+ */
+at::Tensor iterative_pinv(const at::Tensor& k, double coef, int64_t n_iter) {
+  at::Tensor v = k.t().mul(coef);
+  at::Tensor v_next = at::empty_like(v);
+  at::Tensor kv = at::empty_like(v);
+  at::Tensor t1 = at::empty_like(v);
+  at::Tensor t2 = at::empty_like(v);
+  for (int64_t it = 0; it < n_iter; ++it) {
+    at::mm_out(kv, k, v);
+    t1.copy_(kv).neg_();
+    t1.diagonal().add_(7);
+    at::mm_out(t2, kv, t1);
+    t2.neg_();
+    t2.diagonal().add_(15);
+    at::mm_out(t1, kv, t2);
+    t1.neg_();
+    t1.diagonal().add_(13);
+    at::mm_out(v_next, v, t1);
+    v_next.mul_(0.25);
+    std::swap(v, v_next);
+  }
+  return v;
+}
+
+at::Tensor nystrom_attention(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    int64_t num_landmarks,
+    int64_t inv_iterations,
+    bool pinverse_original_init) {
+  TORCH_CHECK(query.dim() == 3, "query must be [B, N, D]");
+  TORCH_CHECK(key.sizes() == query.sizes(), "query and key don't match");
+  TORCH_CHECK(value.dim() == 3, "value must be [B, N, E]");
+  TORCH_CHECK(
+      value.size(0) == query.size(0) && value.size(1) == query.size(1),
+      "key and value don't match");
+  TORCH_CHECK(!query.is_cuda() && !key.is_cuda() && !value.is_cuda());
+  TORCH_CHECK(
+      key.scalar_type() == query.scalar_type() &&
+      value.scalar_type() == query.scalar_type());
+  TORCH_CHECK(at::isFloatingType(query.scalar_type()));
+  const int64_t B = query.size(0), N = query.size(1), D = query.size(2);
+  const int64_t E = value.size(2), m = num_landmarks;
+  TORCH_CHECK(
+      0 < m && m <= N,
+      "num_landmarks should be smaller than the sequence length");
+  const double scale = 1.0 / std::sqrt(double(D));
+  if (B == 0) {
+    return at::empty({0, N, E}, value.options());
+  }
+
+  // Landmarks and [m, m] kernel of each batch element. They are all needed
+  // before the pseudo-inverses, whose original initialization depends on
+  // the whole batch.
+  at::Tensor q_landmarks = at::empty({B, m, D}, query.options());
+  at::Tensor k_landmarks = at::empty({B, m, D}, query.options());
+  at::Tensor kernel_2 = at::empty({B, m, m}, query.options());
+  at::parallel_for(0, B, 1, [&](int64_t start, int64_t end) {
+    for (int64_t b = start; b < end; ++b) {
+      q_landmarks[b].copy_(pool_landmarks(query[b], m).mul_(scale));
+      k_landmarks[b].copy_(pool_landmarks(key[b], m));
+      kernel_2[b].copy_(
+          at::mm(q_landmarks[b], k_landmarks[b].t()).softmax(-1));
+    }
+  });
+  // 1 / ||K||_1, per batch element or over the whole batch
+  const at::Tensor norm_1 =
+      kernel_2.sum(-2).amax(-1).to(at::kDouble).contiguous();
+  const double* norm_1_ = norm_1.data_ptr<double>();
+  const double global_norm_1 = *std::max_element(norm_1_, norm_1_ + B);
+
+  at::Tensor out = at::empty({B, N, E}, value.options());
+  at::parallel_for(0, B, 1, [&](int64_t start, int64_t end) {
+    for (int64_t b = start; b < end; ++b) {
+      const auto q_ = query[b], k_ = key[b], v_ = value[b];
+      const auto ql = q_landmarks[b], kl = k_landmarks[b];
+      const double coef =
+          1.0 / (pinverse_original_init ? global_norm_1 : norm_1_[b]);
+      const at::Tensor kernel_2_inv =
+          iterative_pinv(kernel_2[b], coef, inv_iterations);
+
+      // softmax(Ql K^T) @ V, with an online softmax over the key tiles
+      at::Tensor acc = at::zeros({m, E}, value.options());
+      at::Tensor row_max = at::full(
+          {m, 1}, -std::numeric_limits<double>::infinity(), query.options());
+      at::Tensor row_sum = at::zeros({m, 1}, query.options());
+      for (int64_t begin = 0; begin < N; begin += kTile) {
+        const int64_t count = std::min(kTile, N - begin);
+        at::Tensor scores = at::mm(ql, k_.narrow(0, begin, count).t());
+        const at::Tensor new_max = at::maximum(row_max, scores.amax(1, true));
+        const at::Tensor alpha = (row_max - new_max).exp_();
+        scores.sub_(new_max).exp_();
+        row_sum.mul_(alpha).add_(scores.sum(1, true));
+        acc.mul_(alpha).addmm_(scores, v_.narrow(0, begin, count));
+        row_max = new_max;
+      }
+      acc.div_(row_sum);
+
+      // softmax(Q Kl^T) @ (pinv @ kernel_3), tile by tile over the queries
+      const at::Tensor w = at::mm(kernel_2_inv, acc);
+      const auto out_ = out[b];
+      for (int64_t begin = 0; begin < N; begin += kTile) {
+        const int64_t count = std::min(kTile, N - begin);
+        const at::Tensor kernel_1 =
+            at::mm(q_.narrow(0, begin, count), kl.t()).mul_(scale).softmax(-1);
+        auto out_tile = out_.narrow(0, begin, count);
+        at::mm_out(out_tile, kernel_1, w);
+      }
+    }
+  });
+  return out;
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::nystrom_attention"),
+      TORCH_FN(nystrom_attention));
+}
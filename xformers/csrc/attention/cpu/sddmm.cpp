@@ -1,12 +1,16 @@
 #include <ATen/ATen.h>
 #include <torch/types.h>
 
+#include "csr_partition.h"
+
 namespace {
 
 // taken from
 // https://github.com/google-research/google-research/blob/master/sgk/sparse/ops/cc/sddmm_launcher.cc
-// with modifications to add batch support
-// Simple CPU kernel launcher.
+// with modifications to add batch support, and to run in parallel over
+// chunks of nonzeros of the same size (see `CsrPartition`). Each nonzero is
+// computed independently, so rows split across chunks don't need any
+// reduction.
 void LaunchSddmm(
     int m,
     int k,
@@ -19,19 +23,21 @@ void LaunchSddmm(
     const float* rhs_matrix,
     float* output_values,
     int batch_size) {
-  for (int b = 0; b < batch_size; b++) {
-    for (int i = 0; i < m; ++i) {
-      for (int j = row_offsets[i]; j < row_offsets[i + 1]; ++j) {
-        int idx_n = column_indices[j];
-        float accumulator = 0.0f;
-        for (int l = 0; l < k; ++l) {
-          accumulator += lhs_matrix[b * m * k + i * k + l] *
-              rhs_matrix[b * n * k + idx_n * k + l];
-        }
-        output_values[b * nonzeros + j] = accumulator;
-      }
-    }
-  }
+  const xformers::cpu::CsrPartition partition(row_offsets, m, batch_size, k);
+  partition.parallel_for(batch_size, [&](int64_t b, int64_t chunk) {
+    partition.for_each_segment(
+        chunk, [&](int64_t i, int64_t begin, int64_t end, bool) {
+          const float* lhs = lhs_matrix + b * m * k + i * k;
+          for (int64_t j = begin; j < end; ++j) {
+            const float* rhs = rhs_matrix + b * n * k + column_indices[j] * k;
+            float accumulator = 0.0f;
+            for (int l = 0; l < k; ++l) {
+              accumulator += lhs[l] * rhs[l];
+            }
+            output_values[b * nonzeros + j] = accumulator;
+          }
+        });
+  });
 }
 
 at::Tensor sddmm_sputnik(
@@ -0,0 +1,404 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <ATen/Dispatch.h>
+#include <ATen/Parallel.h>
+#include <torch/library.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "attention_utils.h"
+
+/*
+ * Memory-efficient attention with a band mask, on CPU: the query `i` attends
+ * the keys `j` with `i - window_left <= j - shift <= i + window_right`, and
+ * `shift = Mkv - Mq` (aligned on the bottom-right, like
+ * `xformers.ops.fmha.attn_bias.LocalAttentionFromBottomRightMask`).
+ *
+ * Inputs are in BMHK format. The queries are processed by blocks, and each
+ * block only visits the tiles of keys covered by the windows of its queries,
+ * with an online softmax: the cost is O(M * window) instead of O(M^2), and
+ * no mask is ever materialized.
+ */
+
+namespace {
+
+using xformers::cpu::axpy;
+using xformers::cpu::BMHK;
+using xformers::cpu::dot;
+using xformers::cpu::kNegInf;
+
+constexpr int64_t kBlock = 64;
+
+struct Window {
+  int64_t left, right, shift;
+  int64_t Mq, Mkv;
+
+  // Keys [begin, end) visible from the query `i`
+  int64_t key_begin(int64_t i) const {
+    return std::clamp<int64_t>(i + shift - left, 0, Mkv);
+  }
+  int64_t key_end(int64_t i) const {
+    return std::clamp<int64_t>(i + shift + right + 1, 0, Mkv);
+  }
+  // Queries [begin, end) which see the key `j`
+  int64_t query_begin(int64_t j) const {
+    return std::clamp<int64_t>(j - shift - right, 0, Mq);
+  }
+  int64_t query_end(int64_t j) const {
+    return std::clamp<int64_t>(j - shift + left + 1, 0, Mq);
+  }
+};
+
+struct Problem {
+  int64_t B, Mq, Mkv, H, K, Kv;
+  int64_t q_blocks, kv_blocks;
+  Window window;
+};
+
+Problem check_inputs(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    int64_t window_left,
+    int64_t window_right) {
+  TORCH_CHECK(query.dim() == 4, "query must be [B, Mq, H, K]");
+  TORCH_CHECK(key.dim() == 4, "key must be [B, Mkv, H, K]");
+  TORCH_CHECK(value.dim() == 4, "value must be [B, Mkv, H, Kv]");
+  TORCH_CHECK(!query.is_cuda() && !key.is_cuda() && !value.is_cuda());
+  TORCH_CHECK(
+      key.scalar_type() == query.scalar_type() &&
+      value.scalar_type() == query.scalar_type());
+  TORCH_CHECK(
+      window_left >= 0 && window_right >= 0, "windows must be non-negative");
+  Problem p;
+  p.B = query.size(0);
+  p.Mq = query.size(1);
+  p.H = query.size(2);
+  p.K = query.size(3);
+  p.Mkv = key.size(1);
+  p.Kv = value.size(3);
+  TORCH_CHECK(
+      key.size(0) == p.B && key.size(2) == p.H && key.size(3) == p.K,
+      "query and key don't match");
+  TORCH_CHECK(
+      value.size(0) == p.B && value.size(1) == p.Mkv && value.size(2) == p.H,
+      "key and value don't match");
+  p.q_blocks = (p.Mq + kBlock - 1) / kBlock;
+  p.kv_blocks = (p.Mkv + kBlock - 1) / kBlock;
+  // Larger windows than the sequences are the same as unbounded ones
+  p.window.left = std::min(window_left, p.Mq + p.Mkv);
+  p.window.right = std::min(window_right, p.Mq + p.Mkv);
+  p.window.shift = p.Mkv - p.Mq;
+  p.window.Mq = p.Mq;
+  p.window.Mkv = p.Mkv;
+  return p;
+}
+
+std::tuple<at::Tensor, at::Tensor> sliding_window_attention_forward(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    int64_t window_left,
+    int64_t window_right,
+    double scale,
+    bool compute_logsumexp) {
+  const Problem p =
+      check_inputs(query, key, value, window_left, window_right);
+  const Window& w = p.window;
+
+  at::Tensor out = at::empty({p.B, p.Mq, p.H, p.Kv}, query.options());
+  at::Tensor lse =
+      at::empty({p.B, p.H, p.Mq}, query.options().dtype(at::kFloat));
+  float* lse_ = lse.data_ptr<float>();
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      query.scalar_type(),
+      "sliding_window_attention_forward",
+      [&] {
+        const BMHK<scalar_t> q_(query), k_(key), v_(value), o_(out);
+        at::parallel_for(
+            0, p.B * p.H * p.q_blocks, 1, [&](int64_t start, int64_t end) {
+              std::vector<float> q(kBlock * p.K), k(kBlock * p.K);
+              std::vector<float> v(kBlock * p.Kv), acc(kBlock * p.Kv);
+              std::vector<float> s(kBlock), m(kBlock), l(kBlock);
+              for (int64_t task = start; task < end; ++task) {
+                const int64_t qb = task % p.q_blocks;
+                const int64_t h = (task / p.q_blocks) % p.H;
+                const int64_t b = task / (p.q_blocks * p.H);
+                const int64_t q0 = qb * kBlock;
+                const int64_t qn = std::min(kBlock, p.Mq - q0);
+                q_.load(b, h, q0, qn, q.data());
+                for (auto& x : q) {
+                  x *= float(scale);
+                }
+                std::fill(acc.begin(), acc.end(), 0.f);
+                std::fill(m.begin(), m.end(), kNegInf);
+                std::fill(l.begin(), l.end(), 0.f);
+
+                // The windows of the block span these keys
+                const int64_t span_end = w.key_end(q0 + qn - 1);
+                for (int64_t k0 = w.key_begin(q0); k0 < span_end;
+                     k0 += kBlock) {
+                  const int64_t kn = std::min(kBlock, span_end - k0);
+                  k_.load(b, h, k0, kn, k.data());
+                  v_.load(b, h, k0, kn, v.data());
+                  for (int64_t i = 0; i < qn; ++i) {
+                    const int64_t j0 =
+                        std::max<int64_t>(w.key_begin(q0 + i) - k0, 0);
+                    const int64_t j1 =
+                        std::min<int64_t>(w.key_end(q0 + i) - k0, kn);
+                    if (j0 >= j1) {
+                      continue;
+                    }
+                    float tile_max = kNegInf;
+                    for (int64_t j = j0; j < j1; ++j) {
+                      s[j] = dot(&q[i * p.K], &k[j * p.K], p.K);
+                      tile_max = std::max(tile_max, s[j]);
+                    }
+                    // Rescale what was accumulated with the previous max
+                    const float new_max = std::max(m[i], tile_max);
+                    const float alpha = std::exp(m[i] - new_max);
+                    float* acc_i = &acc[i * p.Kv];
+                    l[i] *= alpha;
+                    for (int64_t d = 0; d < p.Kv; ++d) {
+                      acc_i[d] *= alpha;
+                    }
+                    for (int64_t j = j0; j < j1; ++j) {
+                      const float prob = std::exp(s[j] - new_max);
+                      l[i] += prob;
+                      axpy(prob, &v[j * p.Kv], acc_i, p.Kv);
+                    }
+                    m[i] = new_max;
+                  }
+                }
+
+                // Queries which can't attend any key get a zero output
+                for (int64_t i = 0; i < qn; ++i) {
+                  const float inv = l[i] > 0 ? 1.f / l[i] : 0.f;
+                  for (int64_t d = 0; d < p.Kv; ++d) {
+                    acc[i * p.Kv + d] *= inv;
+                  }
+                  lse_[(b * p.H + h) * p.Mq + q0 + i] =
+                      l[i] > 0 ? m[i] + std::log(l[i]) : kNegInf;
+                }
+                o_.store(b, h, q0, qn, acc.data());
+              }
+            });
+      });
+  if (!compute_logsumexp) {
+    lse = at::empty({0}, lse.options());
+  }
+  return std::make_tuple(out, lse);
+}
+
+/*
+ * The gradient of the queries is computed per query block like the forward,
+ * and the gradients of the keys / values per key block, visiting the queries
+ * whose window contains them. The probabilities are recomputed from the
+ * logsumexp in both passes, so that no thread needs to reduce into the
+ * output of another one.
+ */
+std::tuple<at::Tensor, at::Tensor, at::Tensor>
+sliding_window_attention_backward(
+    const at::Tensor& grad_out,
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const at::Tensor& out,
+    const at::Tensor& lse,
+    int64_t window_left,
+    int64_t window_right,
+    double scale) {
+  const Problem p =
+      check_inputs(query, key, value, window_left, window_right);
+  const Window& w = p.window;
+  TORCH_CHECK(grad_out.sizes() == out.sizes(), "grad_out and out don't match");
+  TORCH_CHECK(
+      out.size(0) == p.B && out.size(1) == p.Mq && out.size(2) == p.H &&
+          out.size(3) == p.Kv,
+      "out must be [B, Mq, H, Kv]");
+  TORCH_CHECK(
+      lse.dim() == 3 && lse.size(0) == p.B && lse.size(1) == p.H &&
+          lse.size(2) >= p.Mq,
+      "lse must be [B, H, Mq]");
+
+  at::Tensor grad_q = at::empty({p.B, p.Mq, p.H, p.K}, query.options());
+  at::Tensor grad_k = at::empty({p.B, p.Mkv, p.H, p.K}, query.options());
+  at::Tensor grad_v = at::empty({p.B, p.Mkv, p.H, p.Kv}, query.options());
+  const auto lse_f = lse.to(at::kFloat).narrow(2, 0, p.Mq).contiguous();
+  const float* lse_ = lse_f.data_ptr<float>();
+  // delta[b, h, i] = <grad_out[b, i, h], out[b, i, h]>
+  at::Tensor delta = at::empty({p.B, p.H, p.Mq}, lse_f.options());
+  float* delta_ = delta.data_ptr<float>();
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      query.scalar_type(),
+      "sliding_window_attention_backward",
+      [&] {
+        const auto out_t = out.to(query.scalar_type());
+        const auto grad_out_t = grad_out.to(query.scalar_type());
+        const BMHK<scalar_t> q_(query), k_(key), v_(value);
+        const BMHK<scalar_t> o_(out_t), do_(grad_out_t);
+        const BMHK<scalar_t> dq_(grad_q), dk_(grad_k), dv_(grad_v);
+        const int64_t num_tasks = p.B * p.H * p.q_blocks;
+
+        at::parallel_for(0, num_tasks, 1, [&](int64_t start, int64_t end) {
+          std::vector<float> o(kBlock * p.Kv), d_o(kBlock * p.Kv);
+          for (int64_t task = start; task < end; ++task) {
+            const int64_t qb = task % p.q_blocks;
+            const int64_t bh = task / p.q_blocks;
+            const int64_t q0 = qb * kBlock;
+            const int64_t qn = std::min(kBlock, p.Mq - q0);
+            o_.load(bh / p.H, bh % p.H, q0, qn, o.data());
+            do_.load(bh / p.H, bh % p.H, q0, qn, d_o.data());
+            for (int64_t i = 0; i < qn; ++i) {
+              delta_[bh * p.Mq + q0 + i] =
+                  dot(&o[i * p.Kv], &d_o[i * p.Kv], p.Kv);
+            }
+          }
+        });
+
+        // Calls `fn(i, j, prob, grad_score)` for every visible pair of the
+        // queries [q0, q0 + qn) and the keys [k0, k0 + kn)
+        auto for_each_score = [&](int64_t b,
+                                  int64_t h,
+                                  int64_t q0,
+                                  int64_t qn,
+                                  int64_t k0,
+                                  int64_t kn,
+                                  const float* q,
+                                  const float* k,
+                                  const float* v,
+                                  const float* d_o,
+                                  auto&& fn) {
+          for (int64_t i = 0; i < qn; ++i) {
+            const float row_lse = lse_[(b * p.H + h) * p.Mq + q0 + i];
+            if (row_lse == kNegInf) {
+              continue;
+            }
+            const float row_delta = delta_[(b * p.H + h) * p.Mq + q0 + i];
+            const int64_t j0 = std::max<int64_t>(w.key_begin(q0 + i) - k0, 0);
+            const int64_t j1 = std::min<int64_t>(w.key_end(q0 + i) - k0, kn);
+            for (int64_t j = j0; j < j1; ++j) {
+              const float score =
+                  float(scale) * dot(&q[i * p.K], &k[j * p.K], p.K);
+              const float prob = std::exp(score - row_lse);
+              const float grad_prob = dot(&d_o[i * p.Kv], &v[j * p.Kv], p.Kv);
+              fn(i, j, prob, prob * (grad_prob - row_delta));
+            }
+          }
+        };
+
+        // dQ, per query block
+        at::parallel_for(0, num_tasks, 1, [&](int64_t start, int64_t end) {
+          std::vector<float> q(kBlock * p.K), k(kBlock * p.K);
+          std::vector<float> v(kBlock * p.Kv), d_o(kBlock * p.Kv);
+          std::vector<float> dq(kBlock * p.K);
+          for (int64_t task = start; task < end; ++task) {
+            const int64_t qb = task % p.q_blocks;
+            const int64_t h = (task / p.q_blocks) % p.H;
+            const int64_t b = task / (p.q_blocks * p.H);
+            const int64_t q0 = qb * kBlock;
+            const int64_t qn = std::min(kBlock, p.Mq - q0);
+            q_.load(b, h, q0, qn, q.data());
+            do_.load(b, h, q0, qn, d_o.data());
+            std::fill(dq.begin(), dq.end(), 0.f);
+            const int64_t span_end = w.key_end(q0 + qn - 1);
+            for (int64_t k0 = w.key_begin(q0); k0 < span_end; k0 += kBlock) {
+              const int64_t kn = std::min(kBlock, span_end - k0);
+              k_.load(b, h, k0, kn, k.data());
+              v_.load(b, h, k0, kn, v.data());
+              for_each_score(
+                  b,
+                  h,
+                  q0,
+                  qn,
+                  k0,
+                  kn,
+                  q.data(),
+                  k.data(),
+                  v.data(),
+                  d_o.data(),
+                  [&](int64_t i, int64_t j, float, float grad_score) {
+                    axpy(grad_score, &k[j * p.K], &dq[i * p.K], p.K);
+                  });
+            }
+            for (auto& x : dq) {
+              x *= float(scale);
+            }
+            dq_.store(b, h, q0, qn, dq.data());
+          }
+        });
+
+        // dK and dV, per key block
+        at::parallel_for(
+            0, p.B * p.H * p.kv_blocks, 1, [&](int64_t start, int64_t end) {
+              std::vector<float> q(kBlock * p.K), k(kBlock * p.K);
+              std::vector<float> v(kBlock * p.Kv), d_o(kBlock * p.Kv);
+              std::vector<float> dk(kBlock * p.K), dv(kBlock * p.Kv);
+              for (int64_t task = start; task < end; ++task) {
+                const int64_t kb = task % p.kv_blocks;
+                const int64_t h = (task / p.kv_blocks) % p.H;
+                const int64_t b = task / (p.kv_blocks * p.H);
+                const int64_t k0 = kb * kBlock;
+                const int64_t kn = std::min(kBlock, p.Mkv - k0);
+                k_.load(b, h, k0, kn, k.data());
+                v_.load(b, h, k0, kn, v.data());
+                std::fill(dk.begin(), dk.end(), 0.f);
+                std::fill(dv.begin(), dv.end(), 0.f);
+                // The queries whose windows contain the keys of the block
+                const int64_t span_end = w.query_end(k0 + kn - 1);
+                for (int64_t q0 = w.query_begin(k0); q0 < span_end;
+                     q0 += kBlock) {
+                  const int64_t qn = std::min(kBlock, span_end - q0);
+                  q_.load(b, h, q0, qn, q.data());
+                  do_.load(b, h, q0, qn, d_o.data());
+                  for_each_score(
+                      b,
+                      h,
+                      q0,
+                      qn,
+                      k0,
+                      kn,
+                      q.data(),
+                      k.data(),
+                      v.data(),
+                      d_o.data(),
+                      [&](int64_t i, int64_t j, float prob, float grad_score) {
+                        axpy(prob, &d_o[i * p.Kv], &dv[j * p.Kv], p.Kv);
+                        axpy(grad_score, &q[i * p.K], &dk[j * p.K], p.K);
+                      });
+                }
+                for (auto& x : dk) {
+                  x *= float(scale);
+                }
+                dk_.store(b, h, k0, kn, dk.data());
+                dv_.store(b, h, k0, kn, dv.data());
+              }
+            });
+      });
+  return std::make_tuple(grad_q, grad_k, grad_v);
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::sliding_window_attention_forward"),
+      TORCH_FN(sliding_window_attention_forward));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::sliding_window_attention_backward"),
+      TORCH_FN(sliding_window_attention_backward));
+}
@@ -8,8 +8,15 @@
 #include <ATen/ATen.h>
 #include <torch/types.h>
 
+#include <vector>
+
+#include "csr_partition.h"
+
 namespace {
 
+// Runs in parallel over chunks of nonzeros of the same size (see
+// `CsrPartition`): the max and the normalization constant of the rows split
+// across chunks are reduced from the partial results of each chunk.
 void SparseSoftmax(
     int m,
     int n,
@@ -20,32 +27,55 @@ void SparseSoftmax(
     const int* column_indices,
     float* output_values,
     int batch_size) {
-  for (int b = 0; b < batch_size; b++) {
-    for (int i = 0; i < m; ++i) {
-      // find the max in a row
-      float max = -INFINITY;
-      for (int j = row_offsets[i]; j < row_offsets[i + 1]; ++j) {
-        float x = values[b * nonzeros + j];
-        max = x > max ? x : max;
-      }
-      // compute the normalization constant
-      float norm = 0.0f;
-      for (int j = row_offsets[i]; j < row_offsets[i + 1]; ++j) {
-        float x = values[b * nonzeros + j];
-        norm += expf(x - max);
-      }
-      norm = 1.0f / norm;
-
-      // step 3: Normalize the exponentials of the input and store the
-      // results.
-      for (int j = row_offsets[i]; j < row_offsets[i + 1]; ++j) {
-        int offset = b * nonzeros + j;
-        float x = values[offset];
-        float res = expf(x - max) * norm;
-        output_values[offset] = res;
-      }
-    }
-  }
+  const xformers::cpu::CsrPartition partition(row_offsets, m, batch_size, 1);
+  const int64_t num_chunks = partition.num_chunks();
+  std::vector<float> row_max(batch_size * m), row_norm(batch_size * m);
+  std::vector<float> head_max(batch_size * num_chunks);
+  std::vector<float> head_norm(batch_size * num_chunks);
+
+  // step 1: find the max in each segment of a row, and compute the
+  // normalization constant relative to it
+  partition.parallel_for(batch_size, [&](int64_t b, int64_t chunk) {
+    partition.for_each_segment(
+        chunk, [&](int64_t i, int64_t begin, int64_t end, bool is_head) {
+          const float* x = values + b * nonzeros;
+          float max = -INFINITY;
+          for (int64_t j = begin; j < end; ++j) {
+            max = x[j] > max ? x[j] : max;
+          }
+          float norm = 0.0f;
+          for (int64_t j = begin; j < end; ++j) {
+            norm += expf(x[j] - max);
+          }
+          const int64_t index = is_head ? b * num_chunks + chunk : b * m + i;
+          (is_head ? head_max : row_max)[index] = max;
+          (is_head ? head_norm : row_norm)[index] = norm;
+        });
+  });
+
+  // step 2: reduce the segments of the rows split across chunks
+  partition.for_each_head(batch_size, [&](int64_t b, int64_t chunk, int64_t i) {
+    const float max_a = row_max[b * m + i];
+    const float max_b = head_max[b * num_chunks + chunk];
+    const float max = max_a > max_b ? max_a : max_b;
+    row_norm[b * m + i] = row_norm[b * m + i] * expf(max_a - max) +
+        head_norm[b * num_chunks + chunk] * expf(max_b - max);
+    row_max[b * m + i] = max;
+  });
+
+  // step 3: Normalize the exponentials of the input and store the
+  // results.
+  partition.parallel_for(batch_size, [&](int64_t b, int64_t chunk) {
+    partition.for_each_segment(
+        chunk, [&](int64_t i, int64_t begin, int64_t end, bool) {
+          const float max = row_max[b * m + i];
+          const float norm = 1.0f / row_norm[b * m + i];
+          for (int64_t j = begin; j < end; ++j) {
+            const int64_t offset = b * nonzeros + j;
+            output_values[offset] = expf(values[offset] - max) * norm;
+          }
+        });
+  });
 }
 
 void SparseSoftmaxBackwardKernel(
@@ -59,25 +89,41 @@ void SparseSoftmaxBackwardKernel(
     float* output_values,
     int nonzeros,
     int batch_size) {
-  for (int b = 0; b < batch_size; b++) {
-    for (int i = 0; i < m; ++i) {
-      // Step 1: Compute the intermediate sum used for the gradient
-      float sum = 0.0f;
-      for (int j = row_offsets[i]; j < row_offsets[i + 1]; ++j) {
-        float x = values[b * nonzeros + j];
-        float g = gradient[b * nonzeros + j];
-        sum += x * g;
-      }
-
-      // step 2: Compute the gradients
-      for (int j = row_offsets[i]; j < row_offsets[i + 1]; ++j) {
-        float x = values[b * nonzeros + j];
-        float g = gradient[b * nonzeros + j];
-        float res = x * (g - sum);
-        output_values[b * nonzeros + j] = res;
-      }
-    }
-  }
+  const xformers::cpu::CsrPartition partition(row_offsets, m, batch_size, 1);
+  const int64_t num_chunks = partition.num_chunks();
+  std::vector<float> row_sum(batch_size * m);
+  std::vector<float> head_sum(batch_size * num_chunks);
+
+  // Step 1: Compute the intermediate sum used for the gradient
+  partition.parallel_for(batch_size, [&](int64_t b, int64_t chunk) {
+    partition.for_each_segment(
+        chunk, [&](int64_t i, int64_t begin, int64_t end, bool is_head) {
+          float sum = 0.0f;
+          for (int64_t j = begin; j < end; ++j) {
+            sum += values[b * nonzeros + j] * gradient[b * nonzeros + j];
+          }
+          if (is_head) {
+            head_sum[b * num_chunks + chunk] = sum;
+          } else {
+            row_sum[b * m + i] = sum;
+          }
+        });
+  });
+  partition.for_each_head(batch_size, [&](int64_t b, int64_t chunk, int64_t i) {
+    row_sum[b * m + i] += head_sum[b * num_chunks + chunk];
+  });
+
+  // step 2: Compute the gradients
+  partition.parallel_for(batch_size, [&](int64_t b, int64_t chunk) {
+    partition.for_each_segment(
+        chunk, [&](int64_t i, int64_t begin, int64_t end, bool) {
+          const float sum = row_sum[b * m + i];
+          for (int64_t j = begin; j < end; ++j) {
+            const int64_t offset = b * nonzeros + j;
+            output_values[offset] = values[offset] * (gradient[offset] - sum);
+          }
+        });
+  });
 }
 
 at::Tensor sparse_softmax_sputnik(
@@ -1,11 +1,17 @@
 #include <ATen/ATen.h>
 #include <torch/types.h>
 
+#include <algorithm>
+#include <vector>
+
+#include "csr_partition.h"
+
 namespace {
 // taken from
 // https://github.com/google-research/google-research/blob/master/sgk/sparse/ops/cc/spmm_launcher.cc
-// with slight modifications to add batch support
-// Simple CPU kernel launcher.
+// with slight modifications to add batch support, and to run in parallel
+// over chunks of nonzeros of the same size (see `CsrPartition`). The rows
+// split across chunks are summed at the end.
 void LaunchSpmm(
     int m,
     int k,
@@ -18,19 +24,34 @@ void LaunchSpmm(
     const float* dense_matrix,
     float* output_matrix,
     int batch_size) {
-  for (int b = 0; b < batch_size; b++) {
-    for (int i = 0; i < m; ++i) {
-      for (int j = 0; j < n; ++j) {
-        float accumulator = 0.0f;
-        for (int l = row_offsets[i]; l < row_offsets[i + 1]; ++l) {
-          int column_index = column_indices[l];
-          accumulator += values[b * nonzeros + l] *
-              dense_matrix[b * k * n + column_index * n + j];
-        }
-        output_matrix[b * m * n + i * n + j] = accumulator;
-      }
+  const xformers::cpu::CsrPartition partition(row_offsets, m, batch_size, n);
+  const int64_t num_chunks = partition.num_chunks();
+  // Sum of the head of each chunk
+  std::vector<float> heads(batch_size * num_chunks * n);
+  partition.parallel_for(batch_size, [&](int64_t b, int64_t chunk) {
+    partition.for_each_segment(
+        chunk, [&](int64_t i, int64_t begin, int64_t end, bool is_head) {
+          float* accumulator = is_head
+              ? heads.data() + (b * num_chunks + chunk) * n
+              : output_matrix + b * m * n + i * n;
+          std::fill(accumulator, accumulator + n, 0.0f);
+          for (int64_t l = begin; l < end; ++l) {
+            const float value = values[b * nonzeros + l];
+            const float* dense =
+                dense_matrix + b * k * n + column_indices[l] * n;
+            for (int j = 0; j < n; ++j) {
+              accumulator[j] += value * dense[j];
+            }
+          }
+        });
+  });
+  partition.for_each_head(batch_size, [&](int64_t b, int64_t chunk, int64_t i) {
+    const float* head = heads.data() + (b * num_chunks + chunk) * n;
+    float* output = output_matrix + b * m * n + i * n;
+    for (int j = 0; j < n; ++j) {
+      output[j] += head[j];
     }
-  }
+  });
 }
 
 at::Tensor spmm_sputnik(
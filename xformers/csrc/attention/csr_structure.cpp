@@ -0,0 +1,22 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <torch/types.h>
+
+TORCH_LIBRARY_FRAGMENT(xformers, m) {
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::csr_transpose_info(int m, int n, Tensor row_offsets, Tensor column_indices) -> (Tensor, Tensor, Tensor, Tensor)"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::csr_rows_by_length(Tensor row_offsets) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::csr_to_coo_rows(Tensor row_offsets) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::coo_rows_to_csr(Tensor row_indices, int m) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::csr_merge(Tensor row_offsets_a, Tensor column_indices_a, Tensor row_offsets_b, Tensor column_indices_b, int mode) -> (Tensor, Tensor, Tensor, Tensor)"));
+}
@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include "process_group.h"
+
+#include <ATen/ATen.h>
+#include <torch/library.h>
+#include <array>
+
+namespace {
+
+using xformers::distributed::CommStats;
+using xformers::distributed::RingExchange;
+
+at::Tensor stats_to_tensor(const CommStats& stats) {
+  return at::tensor(
+      {stats.overlapped_s, stats.exposed_s},
+      at::TensorOptions().dtype(at::kDouble));
+}
+
+/*
+ * Computes `all_gather(scattered_input) @ w.T` for each `w` in `weights`.
+ * The all-gather is split in `world_size` chunks sent around the ring: while
+ * the chunk of rank `rank - i` is multiplied with the weights, the one of
+ * rank `rank - i - 1` is in flight. Chunks are gathered along the first
+ * dimension, and multiplied straight into their rows of the outputs.
+ *
+ * Returns the outputs [world_size * M, ..., N_i] and the host-side timings
+ * of the communication (see `CommStats`).
+ */
+std::tuple<std::vector<at::Tensor>, at::Tensor> fused_allgather_and_linear(
+    const at::Tensor& scattered_input,
+    at::TensorList weights,
+    const c10::intrusive_ptr<c10d::ProcessGroup>& process_group) {
+  TORCH_CHECK(scattered_input.dim() >= 2);
+  TORCH_CHECK(!weights.empty(), "weights must not be empty");
+  const int64_t world_size = process_group->getSize();
+  const int64_t rank = process_group->getRank();
+  const int64_t k = scattered_input.size(-1);
+  for (const auto& w : weights) {
+    TORCH_CHECK(w.dim() == 2, "weights must be [N, K]");
+    TORCH_CHECK(w.size(1) == k, "weights and input have different K");
+    TORCH_CHECK(w.scalar_type() == scattered_input.scalar_type());
+  }
+
+  // [M, ..., K] -> [M', K], keeping the chunk of each rank contiguous
+  at::Tensor chunk = scattered_input.contiguous().view({-1, k});
+  at::Tensor chunk_next = at::empty_like(chunk);
+  const int64_t rows = chunk.size(0);
+
+  std::vector<at::Tensor> outputs;
+  outputs.reserve(weights.size());
+  for (const auto& w : weights) {
+    outputs.push_back(
+        at::empty({world_size * rows, w.size(0)}, chunk.options()));
+  }
+
+  CommStats stats;
+  for (int64_t step = 0; step < world_size; ++step) {
+    c10::optional<RingExchange> exchange;
+    if (step + 1 < world_size) {
+      exchange.emplace(process_group, chunk, chunk_next, step);
+    }
+    const int64_t src_rank = (rank - step + world_size) % world_size;
+    for (size_t i = 0; i < weights.size(); ++i) {
+      auto out = outputs[i].narrow(0, src_rank * rows, rows);
+      at::mm_out(out, chunk, weights[i].t());
+    }
+    if (exchange.has_value()) {
+      exchange->wait(&stats);
+      std::swap(chunk, chunk_next);
+    }
+  }
+
+  auto out_shape = scattered_input.sizes().vec();
+  out_shape[0] *= world_size;
+  for (size_t i = 0; i < weights.size(); ++i) {
+    out_shape.back() = weights[i].size(0);
+    outputs[i] = outputs[i].view(out_shape);
+  }
+  return std::make_tuple(outputs, stats_to_tensor(stats));
+}
+
+/*
+ * Computes `reduce_scatter(gathered_input @ weight.T)`, scattered along the
+ * first dimension. The reduce-scatter goes around the ring: at step `i`, a
+ * rank computes the partial product of the chunk owned by `rank - i - 1`
+ * while the partial sum of the previous step is in flight, then adds the
+ * partial sum received from the previous rank before forwarding it. After
+ * `world_size` steps, each rank holds the fully reduced chunk it owns.
+ *
+ * Returns the output [M / world_size, ..., N] and the host-side timings of
+ * the communication (see `CommStats`).
+ */
+std::tuple<at::Tensor, at::Tensor> fused_linear_and_reducescatter(
+    const at::Tensor& gathered_input,
+    const at::Tensor& weight,
+    const c10::intrusive_ptr<c10d::ProcessGroup>& process_group) {
+  TORCH_CHECK(gathered_input.dim() >= 2);
+  TORCH_CHECK(weight.dim() == 2, "weight must be [N, K]");
+  TORCH_CHECK(weight.size(1) == gathered_input.size(-1));
+  TORCH_CHECK(weight.scalar_type() == gathered_input.scalar_type());
+  const int64_t world_size = process_group->getSize();
+  const int64_t rank = process_group->getRank();
+  TORCH_CHECK(
+      gathered_input.size(0) % world_size == 0,
+      "the first dimension of the input must be divisible by the world size");
+
+  const int64_t k = gathered_input.size(-1);
+  at::Tensor input = gathered_input.contiguous().view({-1, k});
+  const int64_t rows = input.size(0) / world_size;
+
+  // Partial sums are double-buffered: the one computed at step `i` is
+  // forwarded while the one of step `i + 1` is being computed
+  std::array<at::Tensor, 2> partial = {
+      at::empty({rows, weight.size(0)}, input.options()),
+      at::empty({rows, weight.size(0)}, input.options())};
+  at::Tensor received = at::empty_like(partial[0]);
+
+  CommStats stats;
+  c10::optional<RingExchange> exchange;
+  for (int64_t step = 0; step < world_size; ++step) {
+    const int64_t dst_rank = (rank - step - 1 + 2 * world_size) % world_size;
+    auto& out = partial[step % 2];
+    at::mm_out(out, input.narrow(0, dst_rank * rows, rows), weight.t());
+    if (exchange.has_value()) {
+      exchange->wait(&stats);
+      out.add_(received);
+    }
+    if (step + 1 < world_size) {
+      exchange.emplace(process_group, out, received, step);
+    } else {
+      exchange.reset();
+    }
+  }
+
+  auto out_shape = gathered_input.sizes().vec();
+  out_shape[0] /= world_size;
+  out_shape.back() = weight.size(0);
+  return std::make_tuple(
+      partial[(world_size - 1) % 2].view(out_shape), stats_to_tensor(stats));
+}
+
+} // namespace
+
+TORCH_LIBRARY_FRAGMENT(xformers, m) {
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::fused_allgather_and_linear(Tensor scattered_input, Tensor[] weights, __torch__.torch.classes.c10d.ProcessGroup process_group) -> (Tensor[], Tensor)"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::fused_linear_and_reducescatter(Tensor gathered_input, Tensor weight, __torch__.torch.classes.c10d.ProcessGroup process_group) -> (Tensor, Tensor)"));
+}
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::fused_allgather_and_linear"),
+      TORCH_FN(fused_allgather_and_linear));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::fused_linear_and_reducescatter"),
+      TORCH_FN(fused_linear_and_reducescatter));
+}
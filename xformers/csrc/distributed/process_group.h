@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#pragma once
+
+// Must come first to load TORCH_VERSION_FOO.
+#include <torch/torch.h>
+
+#if TORCH_VERSION_MAJOR > 1 || \
+    (TORCH_VERSION_MAJOR == 1 && TORCH_VERSION_MINOR >= 13)
+#include <torch/csrc/distributed/c10d/ProcessGroup.hpp>
+#else
+#include <c10d/ProcessGroup.hpp>
+#endif
+
+#include <chrono>
+#include <vector>
+
+namespace xformers {
+namespace distributed {
+
+#if TORCH_VERSION_MAJOR >= 2
+using WorkHandle = c10::intrusive_ptr<c10d::Work>;
+#else
+using WorkHandle = c10::intrusive_ptr<c10d::ProcessGroup::Work>;
+#endif
+
+// Ranks of the neighbours of the current rank in a ring spanning the whole
+// process group.
+inline int next_rank(const c10::intrusive_ptr<c10d::ProcessGroup>& pg) {
+  return (pg->getRank() + 1) % pg->getSize();
+}
+
+inline int prev_rank(const c10::intrusive_ptr<c10d::ProcessGroup>& pg) {
+  return (pg->getRank() + pg->getSize() - 1) % pg->getSize();
+}
+
+// Host-side timings of the transfers waited on through `RingExchange`.
+// `overlapped_s` is the time spent between posting transfers and waiting on
+// them, ie the compute they ran behind; `exposed_s` is the time spent blocked
+// in `wait()`. When a transfer is not done by the time we wait on it, it ran
+// during the whole overlapped window, so the fraction of the communication
+// hidden behind compute is exactly `overlapped / (overlapped + exposed)`.
+struct CommStats {
+  double overlapped_s = 0.0;
+  double exposed_s = 0.0;
+};
+
+// Handle to a pair of point-to-point transfers issued together: `send` goes to
+// the next rank of the ring while `recv` is filled by the previous rank.
+// Both are asynchronous, so compute can run until `wait()` is called.
+class RingExchange {
+ public:
+  RingExchange(
+      const c10::intrusive_ptr<c10d::ProcessGroup>& pg,
+      const at::Tensor& send,
+      const at::Tensor& recv,
+      int tag) {
+    std::vector<at::Tensor> send_tensors = {send};
+    std::vector<at::Tensor> recv_tensors = {recv};
+    posted_ = std::chrono::steady_clock::now();
+    // Post the receive first, so that two ranks sending to each other
+    // (world_size == 2) never wait on a send that has no matching recv
+    recv_work_ = pg->recv(recv_tensors, prev_rank(pg), tag);
+    send_work_ = pg->send(send_tensors, next_rank(pg), tag);
+  }
+
+  void wait(CommStats* stats = nullptr) {
+    const auto wait_start = std::chrono::steady_clock::now();
+    if (recv_work_) {
+      recv_work_->wait();
+    }
+    if (send_work_) {
+      send_work_->wait();
+    }
+    recv_work_.reset();
+    send_work_.reset();
+    if (stats != nullptr) {
+      const auto wait_end = std::chrono::steady_clock::now();
+      stats->overlapped_s +=
+          std::chrono::duration<double>(wait_start - posted_).count();
+      stats->exposed_s +=
+          std::chrono::duration<double>(wait_end - wait_start).count();
+    }
+  }
+
+ private:
+  WorkHandle recv_work_;
+  WorkHandle send_work_;
+  std::chrono::steady_clock::time_point posted_;
+};
+
+} // namespace distributed
+} // namespace xformers
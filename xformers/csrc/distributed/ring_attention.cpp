@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include "process_group.h"
+
+#include <ATen/ATen.h>
+#include <torch/library.h>
+#include <cmath>
+#include <limits>
+
+namespace {
+
+using xformers::distributed::RingExchange;
+
+// Each rank holds a contiguous shard of the sequence: rank `r` owns queries
+// and keys [r * M, (r + 1) * M). With a causal mask, the queries of a rank
+// only see the key shards of the ranks before it, plus the lower triangle
+// of its own shard.
+enum class BlockMask { kFull, kCausal, kSkip };
+
+BlockMask get_block_mask(bool causal, int64_t q_rank, int64_t kv_rank) {
+  if (!causal || kv_rank < q_rank) {
+    return BlockMask::kFull;
+  }
+  return kv_rank == q_rank ? BlockMask::kCausal : BlockMask::kSkip;
+}
+
+// Scaled attention scores of a [B, H, M, K] query block against a
+// [B, H, N, K] key block, in fp32
+at::Tensor block_scores(
+    const at::Tensor& q,
+    const at::Tensor& k,
+    double scale,
+    BlockMask mask) {
+  auto s = at::matmul(q, k.transpose(-2, -1)).mul_(scale);
+  if (mask == BlockMask::kCausal) {
+    auto masked_out =
+        at::ones({s.size(-2), s.size(-1)}, s.options().dtype(at::kBool))
+            .triu(1);
+    s.masked_fill_(masked_out, -std::numeric_limits<float>::infinity());
+  }
+  return s;
+}
+
+// [B, M, H, K] -> [B, H, M, K] in fp32
+at::Tensor to_bhmk(const at::Tensor& x) {
+  return x.permute({0, 2, 1, 3}).to(at::kFloat);
+}
+
+void check_inputs(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    bool causal) {
+  TORCH_CHECK(query.dim() == 4, "query must be [B, M, H, K]");
+  TORCH_CHECK(key.dim() == 4, "key must be [B, M, H, K]");
+  TORCH_CHECK(key.sizes() == value.sizes(), "key and value shapes differ");
+  TORCH_CHECK(query.size(0) == key.size(0));
+  TORCH_CHECK(query.size(2) == key.size(2));
+  TORCH_CHECK(query.size(3) == key.size(3));
+  TORCH_CHECK(
+      !causal || query.size(1) == key.size(1),
+      "causal ring attention requires query and key shards of the same length");
+  TORCH_CHECK(key.scalar_type() == value.scalar_type());
+}
+
+/*
+ * Attention over a sequence sharded across the ranks of `process_group`.
+ * Key/value shards travel around the ring: at step `i`, the current rank
+ * attends to the shard of rank `rank - i` while sending it to the next rank
+ * and receiving the one of rank `rank - i - 1`, so the transfer is hidden
+ * behind the local attention block. Partial outputs are merged with their
+ * logsumexp, exactly like the split-k reduction of the decoder kernels.
+ *
+ * Returns the output of the local queries [B, M, H, K] and the logsumexp
+ * [B, H, M] needed by the backward.
+ */
+std::tuple<at::Tensor, at::Tensor> ring_attention_forward(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const c10::intrusive_ptr<c10d::ProcessGroup>& process_group,
+    bool causal,
+    c10::optional<double> scale) {
+  check_inputs(query, key, value, causal);
+  const int64_t world_size = process_group->getSize();
+  const int64_t rank = process_group->getRank();
+  const double softmax_scale =
+      scale.has_value() ? *scale : 1.0 / std::sqrt(double(query.size(3)));
+
+  auto q = to_bhmk(query);
+  // Keys and values are sent together, in their original dtype
+  at::Tensor kv = at::stack({key, value}).contiguous();
+  at::Tensor kv_next = at::empty_like(kv);
+
+  auto out = at::zeros_like(q);
+  auto lse = at::full(
+      {q.size(0), q.size(1), q.size(2)},
+      -std::numeric_limits<float>::infinity(),
+      q.options());
+
+  for (int64_t step = 0; step < world_size; ++step) {
+    c10::optional<RingExchange> exchange;
+    if (step + 1 < world_size) {
+      exchange.emplace(process_group, kv, kv_next, step);
+    }
+    const int64_t kv_rank = (rank - step + world_size) % world_size;
+    const auto mask = get_block_mask(causal, rank, kv_rank);
+    if (mask != BlockMask::kSkip) {
+      auto s = block_scores(q, to_bhmk(kv.select(0, 0)), softmax_scale, mask);
+      auto block_lse = at::logsumexp(s, -1);
+      auto block_out = at::matmul(
+          s.sub_(block_lse.unsqueeze(-1)).exp_(), to_bhmk(kv.select(0, 1)));
+      auto new_lse = at::logaddexp(lse, block_lse);
+      out.mul_((lse - new_lse).exp_().unsqueeze(-1))
+          .add_(block_out.mul_((block_lse - new_lse).exp_().unsqueeze(-1)));
+      lse = new_lse;
+    }
+    if (exchange.has_value()) {
+      exchange->wait();
+      std::swap(kv, kv_next);
+    }
+  }
+  return std::make_tuple(
+      out.permute({0, 2, 1, 3}).to(query.scalar_type()).contiguous(), lse);
+}
+
+/*
+ * Backward of `ring_attention_forward`. Keys and values go around the ring
+ * once more, and the gradients of each shard travel along with it: every
+ * rank adds the contribution of its local queries before forwarding them.
+ * After `world_size` hops, the accumulated dK/dV are back on their owner.
+ * The transfer of the gradients of step `i` overlaps the compute of step
+ * `i + 1`.
+ */
+std::tuple<at::Tensor, at::Tensor, at::Tensor> ring_attention_backward(
+    const at::Tensor& grad_out,
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const at::Tensor& out,
+    const at::Tensor& logsumexp,
+    const c10::intrusive_ptr<c10d::ProcessGroup>& process_group,
+    bool causal,
+    c10::optional<double> scale) {
+  check_inputs(query, key, value, causal);
+  TORCH_CHECK(grad_out.sizes() == query.sizes());
+  TORCH_CHECK(out.sizes() == query.sizes());
+  TORCH_CHECK(logsumexp.dim() == 3);
+  const int64_t world_size = process_group->getSize();
+  const int64_t rank = process_group->getRank();
+  const double softmax_scale =
+      scale.has_value() ? *scale : 1.0 / std::sqrt(double(query.size(3)));
+
+  auto q = to_bhmk(query);
+  auto dout = to_bhmk(grad_out);
+  auto delta = (dout * to_bhmk(out)).sum(-1, /*keepdim=*/true);
+  auto lse = logsumexp.to(at::kFloat).unsqueeze(-1);
+  auto dq = at::zeros_like(q);
+
+  at::Tensor kv = at::stack({key, value}).contiguous();
+  at::Tensor kv_next = at::empty_like(kv);
+  at::Tensor dkv = at::zeros(kv.sizes(), kv.options().dtype(at::kFloat));
+  at::Tensor dkv_next = at::empty_like(dkv);
+
+  c10::optional<RingExchange> grad_exchange;
+  for (int64_t step = 0; step < world_size; ++step) {
+    c10::optional<RingExchange> kv_exchange;
+    if (step + 1 < world_size) {
+      kv_exchange.emplace(process_group, kv, kv_next, 2 * step);
+    }
+    const int64_t kv_rank = (rank - step + world_size) % world_size;
+    const auto mask = get_block_mask(causal, rank, kv_rank);
+    at::Tensor dk_block, dv_block;
+    if (mask != BlockMask::kSkip) {
+      auto k = to_bhmk(kv.select(0, 0));
+      auto v = to_bhmk(kv.select(0, 1));
+      auto p = block_scores(q, k, softmax_scale, mask).sub_(lse).exp_();
+      dv_block = at::matmul(p.transpose(-2, -1), dout);
+      auto ds = p.mul_(at::matmul(dout, v.transpose(-2, -1)).sub_(delta));
+      dq.add_(at::matmul(ds, k), softmax_scale);
+      dk_block = at::matmul(ds.transpose(-2, -1), q).mul_(softmax_scale);
+    }
+    // Gradients of the current shard, accumulated by the previous ranks
+    if (grad_exchange.has_value()) {
+      grad_exchange->wait();
+      std::swap(dkv, dkv_next);
+    }
+    if (dk_block.defined()) {
+      dkv.select(0, 0).add_(dk_block.permute({0, 2, 1, 3}));
+      dkv.select(0, 1).add_(dv_block.permute({0, 2, 1, 3}));
+    }
+    if (world_size > 1) {
+      grad_exchange.emplace(process_group, dkv, dkv_next, 2 * step + 1);
+    }
+    if (kv_exchange.has_value()) {
+      kv_exchange->wait();
+      std::swap(kv, kv_next);
+    }
+  }
+  // Last hop: the gradients of the local shard come back to their owner
+  if (grad_exchange.has_value()) {
+    grad_exchange->wait();
+    std::swap(dkv, dkv_next);
+  }
+  return std::make_tuple(
+      dq.permute({0, 2, 1, 3}).to(query.scalar_type()).contiguous(),
+      dkv.select(0, 0).to(key.scalar_type()),
+      dkv.select(0, 1).to(value.scalar_type()));
+}
+
+} // namespace
+
+TORCH_LIBRARY_FRAGMENT(xformers, m) {
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::ring_attention_forward(Tensor query, Tensor key, Tensor value, __torch__.torch.classes.c10d.ProcessGroup process_group, bool causal, float? scale) -> (Tensor, Tensor)"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::ring_attention_backward(Tensor grad_out, Tensor query, Tensor key, Tensor value, Tensor out, Tensor logsumexp, __torch__.torch.classes.c10d.ProcessGroup process_group, bool causal, float? scale) -> (Tensor, Tensor, Tensor)"));
+}
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::ring_attention_forward"),
+      TORCH_FN(ring_attention_forward));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::ring_attention_backward"),
+      TORCH_FN(ring_attention_backward));
+}
+
+TORCH_LIBRARY_IMPL(xformers, CUDA, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::ring_attention_forward"),
+      TORCH_FN(ring_attention_forward));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::ring_attention_backward"),
+      TORCH_FN(ring_attention_backward));
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#pragma once
+
+#include <c10/util/Exception.h>
+
+#include <cmath>
+#include <cstdint>
+#include <type_traits>
+
+/*
+ * The activations of `xformers/triton/k_activations.py`, for the CPU
+ * kernels. The indices are the ones of `get_triton_activation_index`.
+ * GeLU is the exact (erf) one of `nn.GELU`, as in the eager CPU path which
+ * these kernels replace, not the tanh approximation of the Triton kernels.
+ */
+
+namespace xformers {
+namespace cpu {
+
+enum class Activation : int64_t {
+  kNone = 0,
+  kReLU = 1,
+  kLeakyReLU = 2,
+  kGeLU = 3,
+  kSquaredReLU = 4,
+  kSmeLU = 5,
+  kStarReLU = 6,
+};
+
+inline Activation to_activation(int64_t index) {
+  TORCH_CHECK(0 <= index && index <= 6, "Unknown activation ", index);
+  return Activation(index);
+}
+
+template <Activation act>
+inline float activation(float x) {
+  constexpr float kSqrt1_2 = 0.7071067811865476f; // 1 / sqrt(2)
+  constexpr float kBeta = 2.0f; // SmeLU
+  switch (act) {
+    case Activation::kNone:
+      return x;
+    case Activation::kReLU:
+      return x >= 0 ? x : 0.f;
+    case Activation::kLeakyReLU:
+      return x >= 0 ? x : 0.01f * x;
+    case Activation::kGeLU:
+      return 0.5f * x * (1 + std::erf(x * kSqrt1_2));
+    case Activation::kSquaredReLU:
+      return x > 0 ? x * x : 0.f;
+    case Activation::kSmeLU:
+      if (std::abs(x) <= kBeta) {
+        return (x + kBeta) * (x + kBeta) / (4.0f * kBeta);
+      }
+      return x >= kBeta ? x : 0.f;
+    case Activation::kStarReLU:
+      return 0.8944f * (x > 0 ? x * x : 0.f) - 0.4472f;
+  }
+  return x;
+}
+
+// Derivative of the activation, given its input
+template <Activation act>
+inline float activation_grad(float x) {
+  constexpr float kSqrt1_2 = 0.7071067811865476f; // 1 / sqrt(2)
+  constexpr float kInvSqrt2Pi = 0.3989422804014327f; // 1 / sqrt(2 pi)
+  constexpr float kBeta = 2.0f;
+  switch (act) {
+    case Activation::kNone:
+      return 1.f;
+    case Activation::kReLU:
+      return x >= 0 ? 1.f : 0.f;
+    case Activation::kLeakyReLU:
+      return x >= 0 ? 1.f : 0.01f;
+    case Activation::kGeLU:
+      // cdf(x) + x * pdf(x)
+      return 0.5f * (1 + std::erf(x * kSqrt1_2)) +
+          x * kInvSqrt2Pi * std::exp(-0.5f * x * x);
+    case Activation::kSquaredReLU:
+      return x >= 0 ? 2 * x : 0.f;
+    case Activation::kSmeLU:
+      if (std::abs(x) <= kBeta) {
+        return (kBeta + x) / (2.0f * kBeta);
+      }
+      return x >= kBeta ? 1.f : 0.f;
+    case Activation::kStarReLU:
+      return x >= 0 ? 1.7888f * x : 0.f;
+  }
+  return 1.f;
+}
+
+// Calls `fn` with the activation as a compile-time constant, so that the
+// inner loops are specialized for it
+template <typename Fn>
+inline void dispatch_activation(Activation act, Fn fn) {
+  switch (act) {
+    case Activation::kNone:
+      return fn(std::integral_constant<Activation, Activation::kNone>());
+    case Activation::kReLU:
+      return fn(std::integral_constant<Activation, Activation::kReLU>());
+    case Activation::kLeakyReLU:
+      return fn(std::integral_constant<Activation, Activation::kLeakyReLU>());
+    case Activation::kGeLU:
+      return fn(std::integral_constant<Activation, Activation::kGeLU>());
+    case Activation::kSquaredReLU:
+      return fn(std::integral_constant<Activation, Activation::kSquaredReLU>());
+    case Activation::kSmeLU:
+      return fn(std::integral_constant<Activation, Activation::kSmeLU>());
+    case Activation::kStarReLU:
+      return fn(std::integral_constant<Activation, Activation::kStarReLU>());
+  }
+}
+
+} // namespace cpu
+} // namespace xformers
@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <ATen/Dispatch.h>
+#include <ATen/Parallel.h>
+#include <torch/library.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "activations.h"
+#include "philox.h"
+
+/*
+ * CPU version of the fused kernels of `xformers/triton/k_dropout.py`:
+ *   y = dropout(activation(x + bias))
+ * in a single pass over each row of `x` [M, N].
+ * The dropout mask comes from a counter-based generator (Philox), keyed by
+ * the seed and indexed by the position of the element, so that the
+ * backward regenerates it instead of storing it.
+ */
+
+namespace {
+
+using xformers::cpu::Activation;
+using xformers::cpu::for_each_keep;
+using xformers::cpu::Philox;
+
+// Rows per task, so that a task has some work even when the rows are short
+inline int64_t row_grain(int64_t N) {
+  return std::max<int64_t>(1, 32768 / std::max<int64_t>(N, 1));
+}
+
+void check_bias(const c10::optional<at::Tensor>& bias, const at::Tensor& x) {
+  if (bias.has_value()) {
+    TORCH_CHECK(
+        bias->dim() == 1 && bias->size(0) == x.size(-1),
+        "bias must be [N], with N the last dimension of x");
+    TORCH_CHECK(bias->scalar_type() == x.scalar_type());
+    TORCH_CHECK(!bias->is_cuda(), "bias must be a CPU tensor");
+  }
+}
+
+at::Tensor dropout_bias_act(
+    const at::Tensor& x,
+    const c10::optional<at::Tensor>& bias,
+    double p,
+    int64_t activation,
+    int64_t seed) {
+  TORCH_CHECK(!x.is_cuda(), "x must be a CPU tensor");
+  TORCH_CHECK(0 <= p && p < 1, "p must be in [0, 1)");
+  check_bias(bias, x);
+  const Activation act = xformers::cpu::to_activation(activation);
+  const int64_t N = x.size(-1);
+  const int64_t M = N == 0 ? 0 : x.numel() / N;
+  const auto x_ = x.contiguous();
+  const auto bias_ = bias.has_value() ? bias->contiguous() : at::Tensor();
+  at::Tensor y = at::empty_like(x_);
+  const Philox rng(seed);
+  const float p_ = float(p);
+  const float scale = 1.0f / (1.0f - p_);
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      x.scalar_type(),
+      "dropout_bias_act",
+      [&] {
+        const scalar_t* x_data = x_.data_ptr<scalar_t>();
+        const scalar_t* b_data =
+            bias_.defined() ? bias_.data_ptr<scalar_t>() : nullptr;
+        scalar_t* y_data = y.data_ptr<scalar_t>();
+        xformers::cpu::dispatch_activation(act, [&](auto act_t) {
+          constexpr Activation kAct = decltype(act_t)::value;
+          at::parallel_for(0, M, row_grain(N), [&](int64_t start, int64_t end) {
+            for (int64_t row = start; row < end; ++row) {
+              const scalar_t* x_row = x_data + row * N;
+              scalar_t* y_row = y_data + row * N;
+              for_each_keep(rng, row, N, p_, [&](int64_t col, bool keep) {
+                float v = float(x_row[col]);
+                if (b_data != nullptr) {
+                  v += float(b_data[col]);
+                }
+                v = xformers::cpu::activation<kAct>(v);
+                y_row[col] = scalar_t(keep ? v * scale : 0.f);
+              });
+            }
+          });
+        });
+      });
+  return y.view(x.sizes());
+}
+
+/*
+ * grad_in = grad_out * keep / (1 - p) * activation'(x + bias), and with
+ * `trainable_bias` its sum over the rows. Each thread reduces its rows in
+ * a partial sum, and the partial sums are added at the end.
+ */
+std::tuple<at::Tensor, at::Tensor> dropout_bias_act_backward(
+    const at::Tensor& grad_out,
+    const c10::optional<at::Tensor>& x,
+    const c10::optional<at::Tensor>& bias,
+    double p,
+    int64_t activation,
+    int64_t seed,
+    bool trainable_bias) {
+  TORCH_CHECK(!grad_out.is_cuda(), "grad_out must be a CPU tensor");
+  TORCH_CHECK(0 <= p && p < 1, "p must be in [0, 1)");
+  check_bias(bias, grad_out);
+  const Activation act = xformers::cpu::to_activation(activation);
+  TORCH_CHECK(
+      act == Activation::kNone || x.has_value(),
+      "x is needed for the gradient of the activation");
+  TORCH_CHECK(!trainable_bias || bias.has_value(), "trainable_bias needs bias");
+  if (x.has_value()) {
+    TORCH_CHECK(x->sizes() == grad_out.sizes(), "x and grad_out don't match");
+  }
+  const int64_t N = grad_out.size(-1);
+  const int64_t M = N == 0 ? 0 : grad_out.numel() / N;
+  const auto grad_out_ = grad_out.contiguous();
+  const auto x_ = x.has_value() ? x->to(grad_out.scalar_type()).contiguous()
+                                : at::Tensor();
+  const auto bias_ = bias.has_value() ? bias->contiguous() : at::Tensor();
+  at::Tensor grad_in = at::empty_like(grad_out_);
+  const Philox rng(seed);
+  const float p_ = float(p);
+  const float scale = 1.0f / (1.0f - p_);
+
+  // One partial sum of the bias gradient per range of rows
+  const int64_t num_parts = trainable_bias
+      ? std::max<int64_t>(1, std::min<int64_t>(at::get_num_threads(), M))
+      : 0;
+  std::vector<float> partial_grad_bias(num_parts * N, 0.f);
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      grad_out.scalar_type(),
+      "dropout_bias_act_backward",
+      [&] {
+        const scalar_t* go_data = grad_out_.data_ptr<scalar_t>();
+        const scalar_t* x_data =
+            x_.defined() ? x_.data_ptr<scalar_t>() : nullptr;
+        const scalar_t* b_data =
+            bias_.defined() ? bias_.data_ptr<scalar_t>() : nullptr;
+        scalar_t* gi_data = grad_in.data_ptr<scalar_t>();
+        xformers::cpu::dispatch_activation(act, [&](auto act_t) {
+          constexpr Activation kAct = decltype(act_t)::value;
+          auto process_rows = [&](int64_t start, int64_t end, float* acc) {
+            for (int64_t row = start; row < end; ++row) {
+              const scalar_t* go_row = go_data + row * N;
+              scalar_t* gi_row = gi_data + row * N;
+              for_each_keep(rng, row, N, p_, [&](int64_t col, bool keep) {
+                float g = keep ? float(go_row[col]) * scale : 0.f;
+                if (kAct != Activation::kNone && keep) {
+                  float v = float(x_data[row * N + col]);
+                  if (b_data != nullptr) {
+                    v += float(b_data[col]);
+                  }
+                  g *= xformers::cpu::activation_grad<kAct>(v);
+                }
+                gi_row[col] = scalar_t(g);
+                if (acc != nullptr) {
+                  acc[col] += g;
+                }
+              });
+            }
+          };
+          if (!trainable_bias) {
+            at::parallel_for(
+                0, M, row_grain(N), [&](int64_t start, int64_t end) {
+                  process_rows(start, end, nullptr);
+                });
+            return;
+          }
+          at::parallel_for(0, num_parts, 1, [&](int64_t start, int64_t end) {
+            for (int64_t part = start; part < end; ++part) {
+              process_rows(
+                  M * part / num_parts,
+                  M * (part + 1) / num_parts,
+                  partial_grad_bias.data() + part * N);
+            }
+          });
+        });
+      });
+
+  at::Tensor grad_bias;
+  if (trainable_bias) {
+    grad_bias = at::zeros({N}, grad_out.options().dtype(at::kFloat));
+    float* gb_data = grad_bias.data_ptr<float>();
+    for (int64_t part = 0; part < num_parts; ++part) {
+      for (int64_t col = 0; col < N; ++col) {
+        gb_data[col] += partial_grad_bias[part * N + col];
+      }
+    }
+    grad_bias = grad_bias.to(bias->scalar_type());
+  } else {
+    grad_bias = at::empty({0}, grad_out.options());
+  }
+  return std::make_tuple(grad_in.view(grad_out.sizes()), grad_bias);
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::dropout_bias_act"),
+      TORCH_FN(dropout_bias_act));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::dropout_bias_act_backward"),
+      TORCH_FN(dropout_bias_act_backward));
+}
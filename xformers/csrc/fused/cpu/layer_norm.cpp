@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <ATen/Dispatch.h>
+#include <ATen/Parallel.h>
+#include <torch/library.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+/*
+ * CPU version of `xformers/triton/k_layer_norm.py`, normalizing the rows of
+ * x [M, N]. The forward computes the statistics of a row in a single pass
+ * with Welford's algorithm and saves them for the backward, which computes
+ * dx row by row while accumulating dW/dB in a partial sum per thread.
+ */
+
+namespace {
+
+// Rows per task, so that a task has some work even when the rows are short
+inline int64_t row_grain(int64_t N) {
+  return std::max<int64_t>(1, 32768 / std::max<int64_t>(N, 1));
+}
+
+void check_affine(const c10::optional<at::Tensor>& t, const at::Tensor& x) {
+  if (t.has_value()) {
+    TORCH_CHECK(
+        t->dim() == 1 && t->size(0) == x.size(-1),
+        "weight and bias must be [N], with N the last dimension of x");
+    TORCH_CHECK(t->scalar_type() == x.scalar_type());
+  }
+}
+
+std::tuple<at::Tensor, at::Tensor, at::Tensor> layer_norm_forward(
+    const at::Tensor& x,
+    const c10::optional<at::Tensor>& weight,
+    const c10::optional<at::Tensor>& bias,
+    double eps) {
+  TORCH_CHECK(!x.is_cuda(), "x must be a CPU tensor");
+  check_affine(weight, x);
+  check_affine(bias, x);
+  const int64_t N = x.size(-1);
+  const auto x_ = x.reshape({-1, N}).contiguous();
+  const int64_t M = x_.size(0);
+  const auto w_ = weight.has_value() ? weight->contiguous() : at::Tensor();
+  const auto b_ = bias.has_value() ? bias->contiguous() : at::Tensor();
+  at::Tensor y = at::empty_like(x_);
+  at::Tensor mean = at::empty({M}, x.options().dtype(at::kFloat));
+  at::Tensor rstd = at::empty({M}, x.options().dtype(at::kFloat));
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      x.scalar_type(),
+      "layer_norm_forward",
+      [&] {
+        const scalar_t* x_data = x_.data_ptr<scalar_t>();
+        const scalar_t* w_data =
+            w_.defined() ? w_.data_ptr<scalar_t>() : nullptr;
+        const scalar_t* b_data =
+            b_.defined() ? b_.data_ptr<scalar_t>() : nullptr;
+        scalar_t* y_data = y.data_ptr<scalar_t>();
+        float* mean_data = mean.data_ptr<float>();
+        float* rstd_data = rstd.data_ptr<float>();
+        at::parallel_for(0, M, row_grain(N), [&](int64_t start, int64_t end) {
+          for (int64_t row = start; row < end; ++row) {
+            const scalar_t* x_row = x_data + row * N;
+            scalar_t* y_row = y_data + row * N;
+            // Welford's running mean and sum of the squared deviations
+            double mu = 0, m2 = 0;
+            for (int64_t j = 0; j < N; ++j) {
+              const double v = double(x_row[j]);
+              const double delta = v - mu;
+              mu += delta / double(j + 1);
+              m2 += delta * (v - mu);
+            }
+            const float row_mean = float(mu);
+            const float row_rstd =
+                float(1.0 / std::sqrt(m2 / double(std::max<int64_t>(N, 1)) +
+                                      eps));
+            mean_data[row] = row_mean;
+            rstd_data[row] = row_rstd;
+            for (int64_t j = 0; j < N; ++j) {
+              float v = (float(x_row[j]) - row_mean) * row_rstd;
+              if (w_data != nullptr) {
+                v *= float(w_data[j]);
+              }
+              if (b_data != nullptr) {
+                v += float(b_data[j]);
+              }
+              y_row[j] = scalar_t(v);
+            }
+          }
+        });
+      });
+  return std::make_tuple(y.view(x.sizes()), mean, rstd);
+}
+
+std::tuple<at::Tensor, at::Tensor, at::Tensor> layer_norm_backward(
+    const at::Tensor& dy,
+    const at::Tensor& x,
+    const c10::optional<at::Tensor>& weight,
+    const at::Tensor& mean,
+    const at::Tensor& rstd,
+    bool compute_affine_grads) {
+  TORCH_CHECK(!x.is_cuda(), "x must be a CPU tensor");
+  TORCH_CHECK(dy.sizes() == x.sizes(), "dy and x don't match");
+  check_affine(weight, x);
+  const int64_t N = x.size(-1);
+  const auto x_ = x.reshape({-1, N}).contiguous();
+  const auto dy_ = dy.to(x.scalar_type()).reshape({-1, N}).contiguous();
+  const int64_t M = x_.size(0);
+  TORCH_CHECK(mean.numel() == M && rstd.numel() == M, "mean and rstd are [M]");
+  const auto mean_ = mean.to(at::kFloat).contiguous();
+  const auto rstd_ = rstd.to(at::kFloat).contiguous();
+  const auto w_ = weight.has_value() ? weight->contiguous() : at::Tensor();
+  at::Tensor dx = at::empty_like(x_);
+
+  // One partial sum of dW and dB per range of rows, reduced at the end
+  const int64_t num_parts = compute_affine_grads
+      ? std::max<int64_t>(1, std::min<int64_t>(at::get_num_threads(), M))
+      : 0;
+  std::vector<float> partial_dw(num_parts * N, 0.f);
+  std::vector<float> partial_db(num_parts * N, 0.f);
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      x.scalar_type(),
+      "layer_norm_backward",
+      [&] {
+        const scalar_t* x_data = x_.data_ptr<scalar_t>();
+        const scalar_t* dy_data = dy_.data_ptr<scalar_t>();
+        const scalar_t* w_data =
+            w_.defined() ? w_.data_ptr<scalar_t>() : nullptr;
+        const float* mean_data = mean_.data_ptr<float>();
+        const float* rstd_data = rstd_.data_ptr<float>();
+        scalar_t* dx_data = dx.data_ptr<scalar_t>();
+
+        auto process_rows = [&](int64_t start, int64_t end, int64_t part) {
+          float* dw = part >= 0 ? partial_dw.data() + part * N : nullptr;
+          float* db = part >= 0 ? partial_db.data() + part * N : nullptr;
+          for (int64_t row = start; row < end; ++row) {
+            const scalar_t* x_row = x_data + row * N;
+            const scalar_t* dy_row = dy_data + row * N;
+            scalar_t* dx_row = dx_data + row * N;
+            const float row_mean = mean_data[row];
+            const float row_rstd = rstd_data[row];
+            // dx = rstd * (w * dy - mean(w * dy * xhat) * xhat - mean(w * dy))
+            float c1 = 0.f, c2 = 0.f;
+            for (int64_t j = 0; j < N; ++j) {
+              const float xhat = (float(x_row[j]) - row_mean) * row_rstd;
+              float wdy = float(dy_row[j]);
+              if (dw != nullptr) {
+                dw[j] += wdy * xhat;
+                db[j] += wdy;
+              }
+              if (w_data != nullptr) {
+                wdy *= float(w_data[j]);
+              }
+              c1 += wdy * xhat;
+              c2 += wdy;
+            }
+            c1 /= float(N);
+            c2 /= float(N);
+            for (int64_t j = 0; j < N; ++j) {
+              const float xhat = (float(x_row[j]) - row_mean) * row_rstd;
+              float wdy = float(dy_row[j]);
+              if (w_data != nullptr) {
+                wdy *= float(w_data[j]);
+              }
+              dx_row[j] = scalar_t((wdy - (xhat * c1 + c2)) * row_rstd);
+            }
+          }
+        };
+
+        if (!compute_affine_grads) {
+          at::parallel_for(
+              0, M, row_grain(N), [&](int64_t start, int64_t end) {
+                process_rows(start, end, -1);
+              });
+          return;
+        }
+        at::parallel_for(0, num_parts, 1, [&](int64_t start, int64_t end) {
+          for (int64_t part = start; part < end; ++part) {
+            process_rows(
+                M * part / num_parts, M * (part + 1) / num_parts, part);
+          }
+        });
+      });
+
+  at::Tensor dw, db;
+  if (compute_affine_grads) {
+    dw = at::zeros({N}, x.options().dtype(at::kFloat));
+    db = at::zeros({N}, x.options().dtype(at::kFloat));
+    float* dw_data = dw.data_ptr<float>();
+    float* db_data = db.data_ptr<float>();
+    // The reduction of the partial sums, in parallel over the features
+    at::parallel_for(0, N, 1024, [&](int64_t start, int64_t end) {
+      for (int64_t part = 0; part < num_parts; ++part) {
+        for (int64_t j = start; j < end; ++j) {
+          dw_data[j] += partial_dw[part * N + j];
+          db_data[j] += partial_db[part * N + j];
+        }
+      }
+    });
+    dw = dw.to(x.scalar_type());
+    db = db.to(x.scalar_type());
+  } else {
+    dw = at::empty({0}, x.options());
+    db = at::empty({0}, x.options());
+  }
+  return std::make_tuple(dx.view(x.sizes()), dw, db);
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::layer_norm_forward"),
+      TORCH_FN(layer_norm_forward));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::layer_norm_backward"),
+      TORCH_FN(layer_norm_backward));
+}
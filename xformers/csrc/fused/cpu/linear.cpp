@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <ATen/Dispatch.h>
+#include <ATen/Parallel.h>
+#include <torch/library.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "activations.h"
+
+/*
+ * CPU version of `xformers/triton/k_fused_matmul_fw.py` and
+ * `k_fused_matmul_bw.py`: y = activation(x @ weight^T + bias).
+ * The GEMM is computed by tiles of the output, and the bias and activation
+ * are applied to each tile right after it is computed, while it is still in
+ * cache, instead of in separate passes over the whole output.
+ */
+
+namespace {
+
+using xformers::cpu::Activation;
+
+// Output tiles are [kBlockM, kBlockN], small enough to stay in L2
+constexpr int64_t kBlockM = 64;
+constexpr int64_t kBlockN = 256;
+
+int64_t ceil_div(int64_t a, int64_t b) {
+  return (a + b - 1) / b;
+}
+
+void check_inputs(
+    const at::Tensor& x,
+    const at::Tensor& weight,
+    const c10::optional<at::Tensor>& bias) {
+  TORCH_CHECK(!x.is_cuda(), "x must be a CPU tensor");
+  TORCH_CHECK(weight.dim() == 2, "weight must be [N, K]");
+  TORCH_CHECK(x.size(-1) == weight.size(1), "x and weight don't match");
+  TORCH_CHECK(x.scalar_type() == weight.scalar_type());
+  if (bias.has_value()) {
+    TORCH_CHECK(
+        bias->dim() == 1 && bias->size(0) == weight.size(0),
+        "bias must be [N]");
+    TORCH_CHECK(bias->scalar_type() == x.scalar_type());
+  }
+}
+
+std::tuple<at::Tensor, at::Tensor> fused_linear_act(
+    const at::Tensor& x,
+    const at::Tensor& weight,
+    const c10::optional<at::Tensor>& bias,
+    int64_t activation,
+    bool save_activation_inputs) {
+  check_inputs(x, weight, bias);
+  const Activation act = xformers::cpu::to_activation(activation);
+  const auto x_ = x.reshape({-1, x.size(-1)}).contiguous();
+  const auto weight_t = weight.t();
+  const auto bias_ = bias.has_value() ? bias->contiguous() : at::Tensor();
+  const int64_t M = x_.size(0);
+  const int64_t N = weight.size(0);
+  at::Tensor y = at::empty({M, N}, x.options());
+  at::Tensor act_inputs = save_activation_inputs
+      ? at::empty({M, N}, x.options())
+      : at::empty({0}, x.options());
+  const bool epilogue = bias_.defined() || act != Activation::kNone;
+
+  const int64_t tiles_n = ceil_div(N, kBlockN);
+  const int64_t num_tiles = ceil_div(M, kBlockM) * tiles_n;
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      x.scalar_type(),
+      "fused_linear_act",
+      [&] {
+        const scalar_t* b_data =
+            bias_.defined() ? bias_.data_ptr<scalar_t>() : nullptr;
+        xformers::cpu::dispatch_activation(act, [&](auto act_t) {
+          constexpr Activation kAct = decltype(act_t)::value;
+          at::parallel_for(0, num_tiles, 1, [&](int64_t start, int64_t end) {
+            for (int64_t tile = start; tile < end; ++tile) {
+              const int64_t m0 = (tile / tiles_n) * kBlockM;
+              const int64_t n0 = (tile % tiles_n) * kBlockN;
+              const int64_t m1 = std::min(M, m0 + kBlockM);
+              const int64_t n1 = std::min(N, n0 + kBlockN);
+              auto y_tile = y.slice(0, m0, m1).slice(1, n0, n1);
+              at::mm_out(
+                  y_tile, x_.slice(0, m0, m1), weight_t.slice(1, n0, n1));
+              if (!epilogue) {
+                continue;
+              }
+              // Epilogue: bias, saving the activation inputs, activation
+              for (int64_t i = m0; i < m1; ++i) {
+                scalar_t* y_row = y.data_ptr<scalar_t>() + i * N;
+                scalar_t* a_row = save_activation_inputs
+                    ? act_inputs.data_ptr<scalar_t>() + i * N
+                    : nullptr;
+                for (int64_t j = n0; j < n1; ++j) {
+                  float v = float(y_row[j]);
+                  if (b_data != nullptr) {
+                    v += float(b_data[j]);
+                  }
+                  if (a_row != nullptr) {
+                    a_row[j] = scalar_t(v);
+                  }
+                  y_row[j] = scalar_t(xformers::cpu::activation<kAct>(v));
+                }
+              }
+            }
+          });
+        });
+      });
+
+  auto out_shape = x.sizes().vec();
+  out_shape.back() = N;
+  return std::make_tuple(
+      y.view(out_shape),
+      save_activation_inputs ? act_inputs.view(out_shape) : act_inputs);
+}
+
+/*
+ * The gradient of the activation is applied to the tiles of `grad_out` as
+ * they are loaded, and the bias gradient is summed at the same time in a
+ * partial sum per thread. The resulting rows are multiplied by the weight
+ * while still in cache for the input gradient.
+ */
+std::tuple<at::Tensor, at::Tensor, at::Tensor> fused_linear_act_backward(
+    const at::Tensor& grad_out,
+    const at::Tensor& x,
+    const at::Tensor& weight,
+    const c10::optional<at::Tensor>& activation_inputs,
+    int64_t activation,
+    bool trainable_weight,
+    bool trainable_bias) {
+  check_inputs(x, weight, c10::nullopt);
+  const Activation act = xformers::cpu::to_activation(activation);
+  TORCH_CHECK(
+      act == Activation::kNone || activation_inputs.has_value(),
+      "activation_inputs are needed for the gradient of the activation");
+  const int64_t N = weight.size(0);
+  TORCH_CHECK(grad_out.size(-1) == N, "grad_out and weight don't match");
+  const auto x_ = x.reshape({-1, x.size(-1)}).contiguous();
+  const auto grad_out_ =
+      grad_out.to(x.scalar_type()).reshape({-1, N}).contiguous();
+  const int64_t M = grad_out_.size(0);
+  TORCH_CHECK(x_.size(0) == M, "x and grad_out don't match");
+  const auto act_in = activation_inputs.has_value()
+      ? activation_inputs->reshape({-1, N}).contiguous()
+      : at::Tensor();
+  if (act_in.defined()) {
+    TORCH_CHECK(act_in.size(0) == M, "activation_inputs don't match");
+    TORCH_CHECK(act_in.scalar_type() == x.scalar_type());
+  }
+
+  // Gradient wrt. the activation inputs
+  at::Tensor grad_act =
+      act == Activation::kNone ? grad_out_ : at::empty_like(grad_out_);
+  at::Tensor grad_in = at::empty({M, weight.size(1)}, x.options());
+
+  const int64_t blocks_m = ceil_div(M, kBlockM);
+  const int64_t num_parts = std::max<int64_t>(
+      1, std::min<int64_t>(at::get_num_threads(), blocks_m));
+  std::vector<float> partial_grad_bias(trainable_bias ? num_parts * N : 0);
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      x.scalar_type(),
+      "fused_linear_act_backward",
+      [&] {
+        xformers::cpu::dispatch_activation(act, [&](auto act_t) {
+          constexpr Activation kAct = decltype(act_t)::value;
+          at::parallel_for(0, num_parts, 1, [&](int64_t start, int64_t end) {
+            for (int64_t part = start; part < end; ++part) {
+              float* acc = trainable_bias
+                  ? partial_grad_bias.data() + part * N
+                  : nullptr;
+              for (int64_t block = blocks_m * part / num_parts;
+                   block < blocks_m * (part + 1) / num_parts;
+                   ++block) {
+                const int64_t m0 = block * kBlockM;
+                const int64_t m1 = std::min(M, m0 + kBlockM);
+                for (int64_t i = m0; i < m1; ++i) {
+                  const scalar_t* go_row =
+                      grad_out_.data_ptr<scalar_t>() + i * N;
+                  scalar_t* ga_row = grad_act.data_ptr<scalar_t>() + i * N;
+                  const scalar_t* a_row = act_in.defined()
+                      ? act_in.data_ptr<scalar_t>() + i * N
+                      : nullptr;
+                  for (int64_t j = 0; j < N; ++j) {
+                    float g = float(go_row[j]);
+                    if (kAct != Activation::kNone) {
+                      g *= xformers::cpu::activation_grad<kAct>(
+                          float(a_row[j]));
+                      ga_row[j] = scalar_t(g);
+                    }
+                    if (acc != nullptr) {
+                      acc[j] += g;
+                    }
+                  }
+                }
+                auto grad_in_block = grad_in.slice(0, m0, m1);
+                at::mm_out(grad_in_block, grad_act.slice(0, m0, m1), weight);
+              }
+            }
+          });
+        });
+      });
+
+  at::Tensor grad_weight = trainable_weight
+      ? at::mm(grad_act.t(), x_)
+      : at::empty({0}, x.options());
+  at::Tensor grad_bias;
+  if (trainable_bias) {
+    grad_bias = at::zeros({N}, x.options().dtype(at::kFloat));
+    float* gb_data = grad_bias.data_ptr<float>();
+    for (int64_t part = 0; part < num_parts; ++part) {
+      for (int64_t j = 0; j < N; ++j) {
+        gb_data[j] += partial_grad_bias[part * N + j];
+      }
+    }
+    grad_bias = grad_bias.to(x.scalar_type());
+  } else {
+    grad_bias = at::empty({0}, x.options());
+  }
+  return std::make_tuple(grad_in.view(x.sizes()), grad_weight, grad_bias);
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::fused_linear_act"),
+      TORCH_FN(fused_linear_act));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::fused_linear_act_backward"),
+      TORCH_FN(fused_linear_act_backward));
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+namespace xformers {
+namespace cpu {
+
+/*
+ * Philox4x32-10 counter-based random number generator (Salmon et al., "Parallel
+ * random numbers: as easy as 1, 2, 3", 2011).
+ * The random numbers are a pure function of (seed, counter): any element can
+ * be regenerated independently, eg to recompute a dropout mask in the
+ * backward instead of storing it, whatever the threads processing it.
+ */
+class Philox {
+ public:
+  explicit Philox(uint64_t seed)
+      : key_{uint32_t(seed), uint32_t(seed >> 32)} {}
+
+  // 4 random 32-bit integers for the given counter
+  std::array<uint32_t, 4> operator()(uint64_t counter) const {
+    std::array<uint32_t, 4> ctr = {
+        uint32_t(counter), uint32_t(counter >> 32), 0, 0};
+    std::array<uint32_t, 2> key = key_;
+    for (int round = 0; round < 10; ++round) {
+      if (round > 0) {
+        key[0] += kWeyl0;
+        key[1] += kWeyl1;
+      }
+      const uint64_t p0 = uint64_t(kMul0) * ctr[0];
+      const uint64_t p1 = uint64_t(kMul1) * ctr[2];
+      ctr = {
+          uint32_t(p1 >> 32) ^ ctr[1] ^ key[0],
+          uint32_t(p1),
+          uint32_t(p0 >> 32) ^ ctr[3] ^ key[1],
+          uint32_t(p0)};
+    }
+    return ctr;
+  }
+
+  // Uniform float in [0, 1) from 32 random bits
+  static float uniform(uint32_t bits) {
+    return float(bits >> 8) * (1.0f / 16777216.0f);
+  }
+
+ private:
+  static constexpr uint32_t kMul0 = 0xD2511F53;
+  static constexpr uint32_t kMul1 = 0xCD9E8D57;
+  static constexpr uint32_t kWeyl0 = 0x9E3779B9;
+  static constexpr uint32_t kWeyl1 = 0xBB67AE85;
+
+  std::array<uint32_t, 2> key_;
+};
+
+// Each call of the generator gives the randoms of 4 consecutive elements
+constexpr int64_t kRandomsPerCall = 4;
+
+/*
+ * Calls `fn(col, keep)` for every element of the row of a [M, N] matrix,
+ * with the dropout mask of probability `p`. Kernels which share this
+ * indexing of the counter draw the same mask for the same seed.
+ */
+template <typename Fn>
+inline void for_each_keep(
+    const Philox& rng,
+    int64_t row,
+    int64_t N,
+    float p,
+    Fn fn) {
+  const int64_t calls_per_row = (N + kRandomsPerCall - 1) / kRandomsPerCall;
+  for (int64_t call = 0; call < calls_per_row; ++call) {
+    const auto bits = rng(uint64_t(row * calls_per_row + call));
+    const int64_t begin = call * kRandomsPerCall;
+    const int64_t end = std::min(N, begin + kRandomsPerCall);
+    for (int64_t col = begin; col < end; ++col) {
+      fn(col, Philox::uniform(bits[col - begin]) > p);
+    }
+  }
+}
+
+} // namespace cpu
+} // namespace xformers
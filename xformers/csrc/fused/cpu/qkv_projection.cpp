@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <ATen/Dispatch.h>
+#include <ATen/Parallel.h>
+#include <torch/library.h>
+
+#include <algorithm>
+#include <array>
+
+/*
+ * Packed QKV projection: x [B, M, D] @ weight^T, with weight
+ * [(Hq + 2 * Hkv) * K, D] holding the rows of the Q, K and V projections.
+ * Each output tile of the GEMM is written straight into the Q [B, M, Hq, K],
+ * K or V [B, M, Hkv, K] buffer which it belongs to, so that there is no
+ * packed intermediate to split and make contiguous.
+ */
+
+namespace {
+
+constexpr int64_t kBlockM = 64;
+constexpr int64_t kBlockN = 256;
+
+int64_t ceil_div(int64_t a, int64_t b) {
+  return (a + b - 1) / b;
+}
+
+std::tuple<at::Tensor, at::Tensor, at::Tensor> qkv_projection(
+    const at::Tensor& x,
+    const at::Tensor& weight,
+    const c10::optional<at::Tensor>& bias,
+    int64_t num_heads,
+    int64_t num_kv_heads) {
+  TORCH_CHECK(!x.is_cuda(), "x must be a CPU tensor");
+  TORCH_CHECK(x.dim() == 3, "x must be [B, M, D]");
+  TORCH_CHECK(weight.dim() == 2 && weight.size(1) == x.size(2));
+  TORCH_CHECK(weight.scalar_type() == x.scalar_type());
+  TORCH_CHECK(num_heads > 0 && num_kv_heads > 0);
+  const int64_t total_heads = num_heads + 2 * num_kv_heads;
+  TORCH_CHECK(
+      weight.size(0) % total_heads == 0,
+      "weight must be [(num_heads + 2 * num_kv_heads) * K, D]");
+  const int64_t K = weight.size(0) / total_heads;
+  if (bias.has_value()) {
+    TORCH_CHECK(bias->dim() == 1 && bias->size(0) == weight.size(0));
+    TORCH_CHECK(bias->scalar_type() == x.scalar_type());
+  }
+  const int64_t B = x.size(0);
+  const int64_t M = x.size(1);
+  const int64_t rows = B * M;
+  const auto x_ = x.reshape({rows, x.size(2)}).contiguous();
+  const auto weight_t = weight.t();
+  const auto bias_ = bias.has_value() ? bias->contiguous() : at::Tensor();
+
+  at::Tensor q = at::empty({B, M, num_heads, K}, x.options());
+  at::Tensor k = at::empty({B, M, num_kv_heads, K}, x.options());
+  at::Tensor v = at::empty({B, M, num_kv_heads, K}, x.options());
+  // The outputs as [rows, columns], and their first column in the weight
+  const std::array<at::Tensor, 3> outs = {
+      q.view({rows, num_heads * K}),
+      k.view({rows, num_kv_heads * K}),
+      v.view({rows, num_kv_heads * K})};
+  const std::array<int64_t, 3> first_column = {
+      0, num_heads * K, (num_heads + num_kv_heads) * K};
+
+  const int64_t tiles_m = ceil_div(rows, kBlockM);
+  std::array<int64_t, 4> first_tile = {0, 0, 0, 0};
+  for (int i = 0; i < 3; ++i) {
+    first_tile[i + 1] = first_tile[i] + ceil_div(outs[i].size(1), kBlockN);
+  }
+  const int64_t num_tiles = tiles_m * first_tile[3];
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      x.scalar_type(),
+      "qkv_projection",
+      [&] {
+        const scalar_t* b_data =
+            bias_.defined() ? bias_.data_ptr<scalar_t>() : nullptr;
+        at::parallel_for(0, num_tiles, 1, [&](int64_t start, int64_t end) {
+          for (int64_t tile = start; tile < end; ++tile) {
+            const int64_t tile_n = tile % first_tile[3];
+            const int out_idx = tile_n < first_tile[1] ? 0
+                : tile_n < first_tile[2]               ? 1
+                                                       : 2;
+            const at::Tensor& out = outs[out_idx];
+            const int64_t N = out.size(1);
+            const int64_t m0 = (tile / first_tile[3]) * kBlockM;
+            const int64_t m1 = std::min(rows, m0 + kBlockM);
+            const int64_t n0 = (tile_n - first_tile[out_idx]) * kBlockN;
+            const int64_t n1 = std::min(N, n0 + kBlockN);
+            const int64_t w0 = first_column[out_idx] + n0;
+            auto out_tile = out.slice(0, m0, m1).slice(1, n0, n1);
+            at::mm_out(
+                out_tile,
+                x_.slice(0, m0, m1),
+                weight_t.slice(1, w0, w0 + (n1 - n0)));
+            if (b_data == nullptr) {
+              continue;
+            }
+            // Bias of the tile, while it is still in cache
+            const scalar_t* b_out = b_data + first_column[out_idx];
+            for (int64_t i = m0; i < m1; ++i) {
+              scalar_t* out_row = out.data_ptr<scalar_t>() + i * N;
+              for (int64_t j = n0; j < n1; ++j) {
+                out_row[j] = scalar_t(float(out_row[j]) + float(b_out[j]));
+              }
+            }
+          }
+        });
+      });
+  return std::make_tuple(q, k, v);
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::qkv_projection"),
+      TORCH_FN(qkv_projection));
+}
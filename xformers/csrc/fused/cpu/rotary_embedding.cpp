@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <ATen/Dispatch.h>
+#include <ATen/Parallel.h>
+#include <torch/library.h>
+
+#include <algorithm>
+
+/*
+ * Rotary embeddings of `xformers/components/positional_embedding/rotary.py`
+ * for x [..., S, D], in a single pass and without temporaries:
+ *   out[:D/2] = x[:D/2] * cos[:D/2] - x[D/2:] * sin[:D/2]
+ *   out[D/2:] = x[D/2:] * cos[D/2:] + x[:D/2] * sin[D/2:]
+ * with the cos/sin tables [L, D] taken at the positions offset + s.
+ * Both halves of a pair are read before being written, so `out` can be `x`
+ * for an in-place rotation. `inverse` applies the transpose, which gives the
+ * backward: the sin halves are swapped and negated. With the usual tables,
+ * whose halves are equal, this is the rotation by the opposite angle.
+ */
+
+namespace {
+
+at::Tensor& rotary_embedding(
+    const at::Tensor& x,
+    const at::Tensor& cos,
+    const at::Tensor& sin,
+    int64_t offset,
+    bool inverse,
+    at::Tensor& out) {
+  TORCH_CHECK(!x.is_cuda(), "x must be a CPU tensor");
+  TORCH_CHECK(x.dim() >= 2, "x must be [..., S, D]");
+  TORCH_CHECK(x.is_contiguous() && out.is_contiguous());
+  TORCH_CHECK(out.sizes() == x.sizes() && out.scalar_type() == x.scalar_type());
+  const int64_t S = x.size(-2);
+  const int64_t D = x.size(-1);
+  TORCH_CHECK(D % 2 == 0, "The embedding dimension must be even");
+  const auto cos_ = cos.reshape({-1, cos.size(-1)});
+  const auto sin_ = sin.reshape({-1, sin.size(-1)});
+  TORCH_CHECK(cos_.sizes() == sin_.sizes(), "cos and sin don't match");
+  TORCH_CHECK(cos_.size(1) == D, "The tables must be [L, D]");
+  TORCH_CHECK(
+      offset >= 0 && offset + S <= cos_.size(0),
+      "The tables are too short for the positions");
+  TORCH_CHECK(
+      cos.scalar_type() == x.scalar_type() &&
+      sin.scalar_type() == x.scalar_type());
+  TORCH_CHECK(cos_.stride(1) == 1 && sin_.stride(1) == 1);
+  const int64_t half = D / 2;
+  const int64_t rows = D == 0 ? 0 : x.numel() / D;
+  const float sign = inverse ? -1.f : 1.f;
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      x.scalar_type(),
+      "rotary_embedding",
+      [&] {
+        const scalar_t* x_data = x.data_ptr<scalar_t>();
+        const scalar_t* cos_data = cos_.data_ptr<scalar_t>();
+        const scalar_t* sin_data = sin_.data_ptr<scalar_t>();
+        const int64_t cos_stride = cos_.stride(0);
+        const int64_t sin_stride = sin_.stride(0);
+        scalar_t* out_data = out.data_ptr<scalar_t>();
+        const int64_t grain =
+            std::max<int64_t>(1, 16384 / std::max<int64_t>(D, 1));
+        at::parallel_for(0, rows, grain, [&](int64_t start, int64_t end) {
+          for (int64_t row = start; row < end; ++row) {
+            const int64_t pos = offset + row % S;
+            const scalar_t* c = cos_data + pos * cos_stride;
+            const scalar_t* s = sin_data + pos * sin_stride;
+            const scalar_t* x_row = x_data + row * D;
+            scalar_t* out_row = out_data + row * D;
+            // Sines of the first and second output halves
+            const scalar_t* s1 = inverse ? s + half : s;
+            const scalar_t* s2 = inverse ? s : s + half;
+            for (int64_t j = 0; j < half; ++j) {
+              const float x1 = float(x_row[j]);
+              const float x2 = float(x_row[j + half]);
+              const float c1 = float(c[j]);
+              const float c2 = float(c[j + half]);
+              out_row[j] = scalar_t(x1 * c1 - x2 * sign * float(s1[j]));
+              out_row[j + half] = scalar_t(x2 * c2 + x1 * sign * float(s2[j]));
+            }
+          }
+        });
+      });
+  return out;
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::rotary_embedding"),
+      TORCH_FN(rotary_embedding));
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <ATen/Dispatch.h>
+#include <ATen/Parallel.h>
+#include <torch/library.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+/*
+ * CPU version of `xformers/triton/k_softmax.py`: softmax or log-softmax
+ * over the last dimension of x [B, R, K], with an optional additive mask
+ * [R, K] shared by all the batch elements.
+ * With `causal`, row `r` only reads its first r + 1 elements, and the ones
+ * past the diagonal are written as 0 (or -inf for log-softmax) without
+ * being computed. On square attention matrices this skips half of the work,
+ * both in the forward and the backward.
+ */
+
+namespace {
+
+constexpr float kNegInf = -std::numeric_limits<float>::infinity();
+
+// Rows per task, so that a task has some work even when the rows are short
+inline int64_t row_grain(int64_t K) {
+  return std::max<int64_t>(1, 32768 / std::max<int64_t>(K, 1));
+}
+
+// Number of elements of row `r` which are read
+inline int64_t row_length(int64_t r, int64_t K, bool causal) {
+  return causal ? std::min(r + 1, K) : K;
+}
+
+at::Tensor fused_softmax(
+    const at::Tensor& x,
+    const c10::optional<at::Tensor>& mask,
+    bool log,
+    bool causal) {
+  TORCH_CHECK(!x.is_cuda(), "x must be a CPU tensor");
+  TORCH_CHECK(x.dim() >= 2, "x must be [..., R, K]");
+  const int64_t R = x.size(-2);
+  const int64_t K = x.size(-1);
+  const auto x_ = x.reshape({-1, R, K}).contiguous();
+  const int64_t B = x_.size(0);
+  at::Tensor mask_;
+  if (mask.has_value()) {
+    TORCH_CHECK(
+        mask->dim() == 2 && mask->size(0) == R && mask->size(1) == K,
+        "mask must be [R, K], with x [..., R, K]");
+    mask_ = mask->to(x.scalar_type()).contiguous();
+  }
+  at::Tensor y = at::empty_like(x_);
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      x.scalar_type(),
+      "fused_softmax",
+      [&] {
+        const scalar_t* x_data = x_.data_ptr<scalar_t>();
+        const scalar_t* m_data =
+            mask_.defined() ? mask_.data_ptr<scalar_t>() : nullptr;
+        scalar_t* y_data = y.data_ptr<scalar_t>();
+        const float fill = log ? kNegInf : 0.f;
+        at::parallel_for(
+            0, B * R, row_grain(K), [&](int64_t start, int64_t end) {
+              for (int64_t row = start; row < end; ++row) {
+                const int64_t r = row % R;
+                const int64_t len = row_length(r, K, causal);
+                const scalar_t* x_row = x_data + row * K;
+                const scalar_t* m_row = m_data ? m_data + r * K : nullptr;
+                scalar_t* y_row = y_data + row * K;
+                auto value = [&](int64_t j) {
+                  return m_row ? float(x_row[j]) + float(m_row[j])
+                               : float(x_row[j]);
+                };
+                // The mask is applied while looking for the max...
+                float row_max = kNegInf;
+                for (int64_t j = 0; j < len; ++j) {
+                  row_max = std::max(row_max, value(j));
+                }
+                if (row_max == kNegInf) {
+                  // Fully masked row, NaN like PyTorch
+                  std::fill(
+                      y_row,
+                      y_row + K,
+                      scalar_t(std::numeric_limits<float>::quiet_NaN()));
+                  continue;
+                }
+                // ... and again when summing
+                float sum = 0.f;
+                for (int64_t j = 0; j < len; ++j) {
+                  sum += std::exp(value(j) - row_max);
+                }
+                if (log) {
+                  const float offset = row_max + std::log(sum);
+                  for (int64_t j = 0; j < len; ++j) {
+                    y_row[j] = scalar_t(value(j) - offset);
+                  }
+                } else {
+                  const float inv_sum = 1.f / sum;
+                  for (int64_t j = 0; j < len; ++j) {
+                    y_row[j] = scalar_t(std::exp(value(j) - row_max) * inv_sum);
+                  }
+                }
+                std::fill(y_row + len, y_row + K, scalar_t(fill));
+              }
+            });
+      });
+  return y.view(x.sizes());
+}
+
+/*
+ * softmax:     dx = y * (g - sum(g * y))
+ * log-softmax: dx = g - exp(y) * sum(g)
+ * The elements past the diagonal of a causal row get a zero gradient.
+ */
+at::Tensor fused_softmax_backward(
+    const at::Tensor& grad_out,
+    const at::Tensor& out,
+    bool log,
+    bool causal) {
+  TORCH_CHECK(!out.is_cuda(), "out must be a CPU tensor");
+  TORCH_CHECK(grad_out.sizes() == out.sizes(), "grad_out and out don't match");
+  const int64_t R = out.size(-2);
+  const int64_t K = out.size(-1);
+  const auto out_ = out.reshape({-1, R, K}).contiguous();
+  const auto grad_out_ =
+      grad_out.to(out.scalar_type()).reshape({-1, R, K}).contiguous();
+  const int64_t B = out_.size(0);
+  at::Tensor grad_in = at::empty_like(out_);
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      out.scalar_type(),
+      "fused_softmax_backward",
+      [&] {
+        const scalar_t* y_data = out_.data_ptr<scalar_t>();
+        const scalar_t* g_data = grad_out_.data_ptr<scalar_t>();
+        scalar_t* gi_data = grad_in.data_ptr<scalar_t>();
+        at::parallel_for(
+            0, B * R, row_grain(K), [&](int64_t start, int64_t end) {
+              for (int64_t row = start; row < end; ++row) {
+                const int64_t len = row_length(row % R, K, causal);
+                const scalar_t* y_row = y_data + row * K;
+                const scalar_t* g_row = g_data + row * K;
+                scalar_t* gi_row = gi_data + row * K;
+                float dot = 0.f;
+                for (int64_t j = 0; j < len; ++j) {
+                  dot += log ? float(g_row[j])
+                             : float(g_row[j]) * float(y_row[j]);
+                }
+                if (log) {
+                  for (int64_t j = 0; j < len; ++j) {
+                    gi_row[j] = scalar_t(
+                        float(g_row[j]) - std::exp(float(y_row[j])) * dot);
+                  }
+                } else {
+                  for (int64_t j = 0; j < len; ++j) {
+                    gi_row[j] =
+                        scalar_t(float(y_row[j]) * (float(g_row[j]) - dot));
+                  }
+                }
+                std::fill(gi_row + len, gi_row + K, scalar_t(0));
+              }
+            });
+      });
+  return grad_in.view(out.sizes());
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::fused_softmax"),
+      TORCH_FN(fused_softmax));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::fused_softmax_backward"),
+      TORCH_FN(fused_softmax_backward));
+}
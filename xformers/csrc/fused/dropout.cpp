@@ -0,0 +1,16 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <torch/types.h>
+
+TORCH_LIBRARY_FRAGMENT(xformers, m) {
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::dropout_bias_act(Tensor x, Tensor? bias, float p, int activation, int seed) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::dropout_bias_act_backward(Tensor grad_out, Tensor? x, Tensor? bias, float p, int activation, int seed, bool trainable_bias) -> (Tensor, Tensor)"));
+}
@@ -0,0 +1,16 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <torch/types.h>
+
+TORCH_LIBRARY_FRAGMENT(xformers, m) {
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::fused_linear_act(Tensor x, Tensor weight, Tensor? bias, int activation, bool save_activation_inputs) -> (Tensor, Tensor)"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::fused_linear_act_backward(Tensor grad_out, Tensor x, Tensor weight, Tensor? activation_inputs, int activation, bool trainable_weight, bool trainable_bias) -> (Tensor, Tensor, Tensor)"));
+}
@@ -0,0 +1,16 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <torch/types.h>
+
+TORCH_LIBRARY_FRAGMENT(xformers, m) {
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::fused_softmax(Tensor x, Tensor? mask, bool log, bool causal) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::fused_softmax_backward(Tensor grad_out, Tensor out, bool log, bool causal) -> Tensor"));
+}
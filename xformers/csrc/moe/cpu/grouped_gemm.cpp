@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <ATen/Parallel.h>
+#include <torch/library.h>
+#include <algorithm>
+#include <vector>
+
+namespace {
+
+// Work is cut into tiles of at most this many rows (tokens) or columns
+// (output features), so that large experts are spread over several threads
+constexpr int64_t kTileSize = 64;
+
+// A range [begin, end) of the rows or columns handled by an expert
+struct Tile {
+  int64_t expert;
+  int64_t begin;
+  int64_t end;
+};
+
+/*
+ * Runs `fn(tile)` on every tile, in parallel. Tiles are split in contiguous
+ * ranges of equal total cost (`cost(tile)`, eg the number of tokens times
+ * the number of columns), one range per thread. This keeps the threads busy
+ * when a few experts receive most of the tokens.
+ */
+template <typename Cost, typename Fn>
+void parallel_for_tiles(const std::vector<Tile>& tiles, Cost cost, Fn fn) {
+  const int64_t num_tiles = tiles.size();
+  if (num_tiles == 0) {
+    return;
+  }
+  std::vector<int64_t> cumulative_cost(num_tiles + 1, 0);
+  for (int64_t i = 0; i < num_tiles; ++i) {
+    cumulative_cost[i + 1] = cumulative_cost[i] + cost(tiles[i]);
+  }
+  const int64_t total_cost = cumulative_cost.back();
+  const int64_t num_parts = std::min<int64_t>(at::get_num_threads(), num_tiles);
+  std::vector<int64_t> part_begin(num_parts + 1, num_tiles);
+  part_begin[0] = 0;
+  for (int64_t p = 1; p < num_parts; ++p) {
+    const int64_t target = total_cost * p / num_parts;
+    // Last tile starting at or before `target`
+    const auto it = std::upper_bound(
+        cumulative_cost.begin(), cumulative_cost.end(), target);
+    part_begin[p] =
+        std::max<int64_t>(it - cumulative_cost.begin() - 1, part_begin[p - 1]);
+  }
+  at::parallel_for(0, num_parts, 1, [&](int64_t start, int64_t end) {
+    for (int64_t p = start; p < end; ++p) {
+      for (int64_t i = part_begin[p]; i < part_begin[p + 1]; ++i) {
+        fn(tiles[i]);
+      }
+    }
+  });
+}
+
+std::vector<Tile> make_tiles(const std::vector<int64_t>& sizes) {
+  std::vector<Tile> tiles;
+  for (int64_t e = 0; e < int64_t(sizes.size()); ++e) {
+    for (int64_t begin = 0; begin < sizes[e]; begin += kTileSize) {
+      tiles.push_back({e, begin, std::min(sizes[e], begin + kTileSize)});
+    }
+  }
+  return tiles;
+}
+
+std::vector<int64_t> get_offsets(const at::Tensor& expert_offsets, int64_t n) {
+  TORCH_CHECK(expert_offsets.dim() == 1, "expert_offsets must be [E + 1]");
+  TORCH_CHECK(!expert_offsets.is_cuda(), "expert_offsets must be on CPU");
+  auto offsets_ = expert_offsets.to(at::kLong).contiguous();
+  std::vector<int64_t> offsets(
+      offsets_.data_ptr<int64_t>(),
+      offsets_.data_ptr<int64_t>() + offsets_.numel());
+  TORCH_CHECK(offsets.front() == 0, "expert_offsets must start at 0");
+  TORCH_CHECK(
+      offsets.back() == n, "expert_offsets must end at the number of rows");
+  for (size_t e = 1; e < offsets.size(); ++e) {
+    TORCH_CHECK(offsets[e] >= offsets[e - 1], "expert_offsets must be sorted");
+  }
+  return offsets;
+}
+
+void check_inputs(const at::Tensor& x, const at::Tensor& w, int64_t experts) {
+  TORCH_CHECK(x.dim() == 2, "x must be [N, K]");
+  TORCH_CHECK(w.dim() == 3, "w must be [E, M, K]");
+  TORCH_CHECK(w.size(0) == experts, "w and expert_offsets don't match");
+  TORCH_CHECK(w.size(2) == x.size(1), "w and x have different K");
+  TORCH_CHECK(w.scalar_type() == x.scalar_type());
+  TORCH_CHECK(!x.is_cuda(), "x must be a CPU tensor");
+  TORCH_CHECK(!w.is_cuda(), "w must be a CPU tensor");
+}
+
+/*
+ * Applies a different linear layer to each group of rows of `x` [N, K]:
+ * rows `expert_offsets[e]:expert_offsets[e + 1]` are multiplied by
+ * `w[e].T` [K, M] and offset by `b[e]` [M].
+ * This runs all the experts of a MoE layer in a single call, with the
+ * work spread over the threads according to the number of tokens of
+ * each expert.
+ */
+at::Tensor grouped_gemm(
+    const at::Tensor& x,
+    const at::Tensor& w,
+    const c10::optional<at::Tensor>& b,
+    const at::Tensor& expert_offsets) {
+  const auto offsets = get_offsets(expert_offsets, x.size(0));
+  const int64_t num_experts = offsets.size() - 1;
+  check_inputs(x, w, num_experts);
+  if (b.has_value()) {
+    TORCH_CHECK(b->dim() == 2, "b must be [E, M]");
+    TORCH_CHECK(b->size(0) == num_experts && b->size(1) == w.size(1));
+  }
+
+  at::Tensor y = at::empty({x.size(0), w.size(1)}, x.options());
+  std::vector<int64_t> rows(num_experts);
+  for (int64_t e = 0; e < num_experts; ++e) {
+    rows[e] = offsets[e + 1] - offsets[e];
+  }
+  parallel_for_tiles(
+      make_tiles(rows),
+      [&](const Tile& tile) { return tile.end - tile.begin; },
+      [&](const Tile& tile) {
+        const int64_t begin = offsets[tile.expert] + tile.begin;
+        const int64_t count = tile.end - tile.begin;
+        auto out = y.narrow(0, begin, count);
+        auto w_t = w[tile.expert].t();
+        if (b.has_value()) {
+          at::addmm_out(
+              out,
+              (*b)[tile.expert].expand({count, w.size(1)}),
+              x.narrow(0, begin, count),
+              w_t);
+        } else {
+          at::mm_out(out, x.narrow(0, begin, count), w_t);
+        }
+      });
+  return y;
+}
+
+/*
+ * Backward of `grouped_gemm`. The input gradient is tiled over the rows
+ * like the forward. The weight gradient of an expert is a reduction over
+ * all its rows, so it is tiled over its output features instead: each tile
+ * computes `grad_w[e][cols] = grad_y[rows of e, cols].T @ x[rows of e]`
+ * without any cross-thread reduction, and the bias gradient of these
+ * columns along with it.
+ */
+std::tuple<at::Tensor, at::Tensor, at::Tensor> grouped_gemm_backward(
+    const at::Tensor& grad_y,
+    const at::Tensor& x,
+    const at::Tensor& w,
+    const at::Tensor& expert_offsets) {
+  const auto offsets = get_offsets(expert_offsets, x.size(0));
+  const int64_t num_experts = offsets.size() - 1;
+  check_inputs(x, w, num_experts);
+  TORCH_CHECK(grad_y.dim() == 2);
+  TORCH_CHECK(grad_y.size(0) == x.size(0) && grad_y.size(1) == w.size(1));
+  const int64_t out_features = w.size(1);
+
+  auto grad_y_ = grad_y.to(x.scalar_type());
+  at::Tensor grad_x = at::empty_like(x);
+  at::Tensor grad_w = at::empty_like(w);
+  at::Tensor grad_b = at::empty({num_experts, out_features}, w.options());
+
+  std::vector<int64_t> rows(num_experts);
+  for (int64_t e = 0; e < num_experts; ++e) {
+    rows[e] = offsets[e + 1] - offsets[e];
+  }
+  parallel_for_tiles(
+      make_tiles(rows),
+      [&](const Tile& tile) { return tile.end - tile.begin; },
+      [&](const Tile& tile) {
+        const int64_t begin = offsets[tile.expert] + tile.begin;
+        const int64_t count = tile.end - tile.begin;
+        auto out = grad_x.narrow(0, begin, count);
+        at::mm_out(out, grad_y_.narrow(0, begin, count), w[tile.expert]);
+      });
+
+  std::vector<int64_t> cols(num_experts, out_features);
+  parallel_for_tiles(
+      make_tiles(cols),
+      // Experts without tokens still need their gradients zeroed
+      [&](const Tile& tile) {
+        return std::max<int64_t>(rows[tile.expert], 1) *
+            (tile.end - tile.begin);
+      },
+      [&](const Tile& tile) {
+        const int64_t e = tile.expert;
+        const int64_t count = tile.end - tile.begin;
+        auto out_w = grad_w[e].narrow(0, tile.begin, count);
+        auto out_b = grad_b[e].narrow(0, tile.begin, count);
+        if (rows[e] == 0) {
+          out_w.zero_();
+          out_b.zero_();
+          return;
+        }
+        auto dy = grad_y_.narrow(0, offsets[e], rows[e])
+                      .narrow(1, tile.begin, count);
+        at::mm_out(out_w, dy.t(), x.narrow(0, offsets[e], rows[e]));
+        at::sum_out(out_b, dy, at::IntArrayRef{0});
+      });
+  return std::make_tuple(grad_x, grad_w, grad_b);
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(TORCH_SELECTIVE_NAME("xformers::grouped_gemm"), TORCH_FN(grouped_gemm));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::grouped_gemm_backward"),
+      TORCH_FN(grouped_gemm_backward));
+}
@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <ATen/AccumulateType.h>
+#include <ATen/Dispatch.h>
+#include <ATen/Parallel.h>
+#include <torch/library.h>
+#include <algorithm>
+#include <vector>
+
+namespace {
+
+// Tokens are processed in chunks of this size when counting the tokens
+// routed to each expert
+constexpr int64_t kTokensPerChunk = 1024;
+
+template <typename scalar_t>
+void topk_experts_kernel(
+    const scalar_t* logits,
+    int64_t num_tokens,
+    int64_t num_experts,
+    int64_t k,
+    int64_t* experts) {
+  at::parallel_for(0, num_tokens, 64, [&](int64_t start, int64_t end) {
+    std::vector<float> best(k);
+    for (int64_t s = start; s < end; ++s) {
+      const scalar_t* row = logits + s * num_experts;
+      int64_t* row_experts = experts + s * k;
+      int64_t found = 0;
+      // Insertion into a sorted list of the `k` best experts so far.
+      // On ties, the expert with the lowest index wins.
+      for (int64_t e = 0; e < num_experts; ++e) {
+        const float v = static_cast<float>(row[e]);
+        if (found == k && !(v > best[k - 1])) {
+          continue;
+        }
+        int64_t i = found < k ? found++ : k - 1;
+        for (; i > 0 && v > best[i - 1]; --i) {
+          best[i] = best[i - 1];
+          row_experts[i] = row_experts[i - 1];
+        }
+        best[i] = v;
+        row_experts[i] = e;
+      }
+    }
+  });
+}
+
+/*
+ * Top-k routing of `num_tokens` tokens to `num_experts` experts, each
+ * accepting at most `capacity` tokens. Choices are served in priority order:
+ * all the first choices in token order, then all the second choices, etc.
+ * Tokens that do not fit in the capacity of an expert are dropped.
+ *
+ * Returns, for each token and choice, the expert [S, k] and the row in the
+ * packed per-expert buffer [S, k] (-1 for dropped tokens), as well as the
+ * offsets of the rows of each expert in that buffer [E + 1].
+ * Memory is O(S * k), independent of the capacity.
+ */
+std::tuple<at::Tensor, at::Tensor, at::Tensor> moe_topk_route(
+    const at::Tensor& logits,
+    int64_t k,
+    int64_t capacity) {
+  TORCH_CHECK(logits.dim() == 2, "logits must be [S, E]");
+  TORCH_CHECK(!logits.is_cuda(), "logits must be a CPU tensor");
+  TORCH_CHECK(!logits.is_sparse(), "logits must be a dense tensor");
+  const int64_t num_tokens = logits.size(0);
+  const int64_t num_experts = logits.size(1);
+  TORCH_CHECK(k >= 1 && k <= num_experts, "invalid k: ", k);
+  TORCH_CHECK(capacity >= 0, "capacity must be non-negative");
+
+  auto logits_ = logits.contiguous();
+  auto long_options = logits.options().dtype(at::kLong);
+  at::Tensor experts = at::empty({num_tokens, k}, long_options);
+  at::Tensor positions = at::empty({num_tokens, k}, long_options);
+  at::Tensor expert_offsets = at::empty({num_experts + 1}, long_options);
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      logits_.scalar_type(),
+      "moe_topk_route",
+      [&] {
+        topk_experts_kernel<scalar_t>(
+            logits_.data_ptr<scalar_t>(),
+            num_tokens,
+            num_experts,
+            k,
+            experts.data_ptr<int64_t>());
+      });
+
+  // Count the tokens of each (choice, chunk) going to each expert. A
+  // sequential scan over these counts, in priority order, gives the first
+  // slot of each (choice, chunk) in the buffer of each expert.
+  const int64_t num_chunks = std::max<int64_t>(
+      1, (num_tokens + kTokensPerChunk - 1) / kTokensPerChunk);
+  const int64_t* experts_ptr = experts.data_ptr<int64_t>();
+  std::vector<int64_t> slots(k * num_chunks * num_experts, 0);
+  at::parallel_for(0, k * num_chunks, 1, [&](int64_t start, int64_t end) {
+    for (int64_t block = start; block < end; ++block) {
+      const int64_t choice = block / num_chunks;
+      const int64_t chunk = block % num_chunks;
+      int64_t* counts = slots.data() + block * num_experts;
+      const int64_t chunk_end =
+          std::min(num_tokens, (chunk + 1) * kTokensPerChunk);
+      for (int64_t s = chunk * kTokensPerChunk; s < chunk_end; ++s) {
+        counts[experts_ptr[s * k + choice]] += 1;
+      }
+    }
+  });
+  std::vector<int64_t> totals(num_experts, 0);
+  for (int64_t block = 0; block < k * num_chunks; ++block) {
+    int64_t* counts = slots.data() + block * num_experts;
+    for (int64_t e = 0; e < num_experts; ++e) {
+      const int64_t count = counts[e];
+      counts[e] = totals[e];
+      totals[e] += count;
+    }
+  }
+  int64_t* offsets_ptr = expert_offsets.data_ptr<int64_t>();
+  offsets_ptr[0] = 0;
+  for (int64_t e = 0; e < num_experts; ++e) {
+    offsets_ptr[e + 1] = offsets_ptr[e] + std::min(totals[e], capacity);
+  }
+
+  int64_t* positions_ptr = positions.data_ptr<int64_t>();
+  at::parallel_for(0, k * num_chunks, 1, [&](int64_t start, int64_t end) {
+    for (int64_t block = start; block < end; ++block) {
+      const int64_t choice = block / num_chunks;
+      const int64_t chunk = block % num_chunks;
+      int64_t* next_slot = slots.data() + block * num_experts;
+      const int64_t chunk_end =
+          std::min(num_tokens, (chunk + 1) * kTokensPerChunk);
+      for (int64_t s = chunk * kTokensPerChunk; s < chunk_end; ++s) {
+        const int64_t e = experts_ptr[s * k + choice];
+        const int64_t slot = next_slot[e]++;
+        positions_ptr[s * k + choice] =
+            slot < capacity ? offsets_ptr[e] + slot : -1;
+      }
+    }
+  });
+  return std::make_tuple(experts, positions, expert_offsets);
+}
+
+void check_positions(const at::Tensor& positions, int64_t num_tokens) {
+  TORCH_CHECK(positions.dim() == 2, "positions must be [S, k]");
+  TORCH_CHECK(positions.size(0) == num_tokens);
+  TORCH_CHECK(positions.scalar_type() == at::kLong);
+  TORCH_CHECK(!positions.is_cuda(), "positions must be a CPU tensor");
+}
+
+/*
+ * Gathers the tokens into a packed buffer where the tokens of each expert
+ * are contiguous: out[positions[s, j]] = x[s]
+ */
+at::Tensor moe_permute_tokens(
+    const at::Tensor& x,
+    const at::Tensor& positions,
+    int64_t num_rows) {
+  TORCH_CHECK(x.dim() == 2, "x must be [S, D]");
+  TORCH_CHECK(!x.is_cuda(), "x must be a CPU tensor");
+  check_positions(positions, x.size(0));
+  const int64_t num_tokens = x.size(0);
+  const int64_t dim = x.size(1);
+  const int64_t k = positions.size(1);
+
+  auto x_ = x.contiguous();
+  auto positions_ = positions.contiguous();
+  at::Tensor out = at::empty({num_rows, dim}, x.options());
+  const int64_t* positions_ptr = positions_.data_ptr<int64_t>();
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      x_.scalar_type(),
+      "moe_permute_tokens",
+      [&] {
+        const scalar_t* x_ptr = x_.data_ptr<scalar_t>();
+        scalar_t* out_ptr = out.data_ptr<scalar_t>();
+        at::parallel_for(0, num_tokens, 16, [&](int64_t start, int64_t end) {
+          for (int64_t s = start; s < end; ++s) {
+            for (int64_t j = 0; j < k; ++j) {
+              const int64_t p = positions_ptr[s * k + j];
+              if (p < 0) {
+                continue;
+              }
+              TORCH_CHECK(p < num_rows, "position out of range");
+              std::copy(
+                  x_ptr + s * dim, x_ptr + (s + 1) * dim, out_ptr + p * dim);
+            }
+          }
+        });
+      });
+  return out;
+}
+
+/*
+ * Combines the outputs of the experts back into token order, weighted by
+ * the gates: out[s] = sum_j gates[s, j] * y[positions[s, j]].
+ * Dropped tokens get a zero output. Without `gates`, this is the backward of
+ * `moe_permute_tokens`.
+ */
+at::Tensor moe_unpermute_tokens(
+    const at::Tensor& y,
+    const at::Tensor& positions,
+    const c10::optional<at::Tensor>& gates) {
+  TORCH_CHECK(y.dim() == 2, "y must be [N, D]");
+  TORCH_CHECK(!y.is_cuda(), "y must be a CPU tensor");
+  const int64_t num_tokens = positions.size(0);
+  check_positions(positions, num_tokens);
+  const int64_t num_rows = y.size(0);
+  const int64_t dim = y.size(1);
+  const int64_t k = positions.size(1);
+
+  auto y_ = y.contiguous();
+  auto positions_ = positions.contiguous();
+  at::Tensor gates_;
+  if (gates.has_value()) {
+    TORCH_CHECK(gates->sizes() == positions.sizes());
+    gates_ = gates->to(at::kFloat).contiguous();
+  }
+  at::Tensor out = at::empty({num_tokens, dim}, y.options());
+  const int64_t* positions_ptr = positions_.data_ptr<int64_t>();
+  const float* gates_ptr =
+      gates_.defined() ? gates_.data_ptr<float>() : nullptr;
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      y_.scalar_type(),
+      "moe_unpermute_tokens",
+      [&] {
+        using acc_t = at::acc_type<scalar_t, /*is_cuda=*/false>;
+        const scalar_t* y_ptr = y_.data_ptr<scalar_t>();
+        scalar_t* out_ptr = out.data_ptr<scalar_t>();
+        at::parallel_for(0, num_tokens, 16, [&](int64_t start, int64_t end) {
+          std::vector<acc_t> acc(dim);
+          for (int64_t s = start; s < end; ++s) {
+            std::fill(acc.begin(), acc.end(), acc_t(0));
+            for (int64_t j = 0; j < k; ++j) {
+              const int64_t p = positions_ptr[s * k + j];
+              if (p < 0) {
+                continue;
+              }
+              TORCH_CHECK(p < num_rows, "position out of range");
+              const acc_t g = gates_ptr != nullptr
+                  ? acc_t(gates_ptr[s * k + j])
+                  : acc_t(1);
+              const scalar_t* row = y_ptr + p * dim;
+              for (int64_t d = 0; d < dim; ++d) {
+                acc[d] += g * acc_t(row[d]);
+              }
+            }
+            for (int64_t d = 0; d < dim; ++d) {
+              out_ptr[s * dim + d] = scalar_t(acc[d]);
+            }
+          }
+        });
+      });
+  return out;
+}
+
+/*
+ * Backward of `moe_unpermute_tokens` with gates. Each row of `y` is used by
+ * exactly one (token, choice), so both gradients are computed without any
+ * reduction across threads.
+ */
+std::tuple<at::Tensor, at::Tensor> moe_unpermute_tokens_backward(
+    const at::Tensor& grad_out,
+    const at::Tensor& y,
+    const at::Tensor& positions,
+    const at::Tensor& gates) {
+  TORCH_CHECK(grad_out.dim() == 2 && y.dim() == 2);
+  TORCH_CHECK(grad_out.size(1) == y.size(1));
+  TORCH_CHECK(!grad_out.is_cuda(), "grad_out must be a CPU tensor");
+  TORCH_CHECK(!y.is_cuda(), "y must be a CPU tensor");
+  const int64_t num_tokens = grad_out.size(0);
+  check_positions(positions, num_tokens);
+  TORCH_CHECK(gates.sizes() == positions.sizes());
+  const int64_t num_rows = y.size(0);
+  const int64_t dim = y.size(1);
+  const int64_t k = positions.size(1);
+
+  auto grad_out_ = grad_out.contiguous().to(y.scalar_type());
+  auto y_ = y.contiguous();
+  auto positions_ = positions.contiguous();
+  auto gates_ = gates.to(at::kFloat).contiguous();
+  // Rows of `y` coming from dropped tokens, if any, have a zero gradient
+  at::Tensor grad_y = at::zeros_like(y_);
+  at::Tensor grad_gates = at::empty({num_tokens, k}, gates_.options());
+  const int64_t* positions_ptr = positions_.data_ptr<int64_t>();
+  const float* gates_ptr = gates_.data_ptr<float>();
+  float* grad_gates_ptr = grad_gates.data_ptr<float>();
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      y_.scalar_type(),
+      "moe_unpermute_tokens_backward",
+      [&] {
+        using acc_t = at::acc_type<scalar_t, /*is_cuda=*/false>;
+        const scalar_t* grad_out_ptr = grad_out_.data_ptr<scalar_t>();
+        const scalar_t* y_ptr = y_.data_ptr<scalar_t>();
+        scalar_t* grad_y_ptr = grad_y.data_ptr<scalar_t>();
+        at::parallel_for(0, num_tokens, 16, [&](int64_t start, int64_t end) {
+          for (int64_t s = start; s < end; ++s) {
+            const scalar_t* go = grad_out_ptr + s * dim;
+            for (int64_t j = 0; j < k; ++j) {
+              const int64_t p = positions_ptr[s * k + j];
+              if (p < 0) {
+                grad_gates_ptr[s * k + j] = 0.0f;
+                continue;
+              }
+              TORCH_CHECK(p < num_rows, "position out of range");
+              const acc_t g = acc_t(gates_ptr[s * k + j]);
+              const scalar_t* row = y_ptr + p * dim;
+              scalar_t* grad_row = grad_y_ptr + p * dim;
+              acc_t dot = 0;
+              for (int64_t d = 0; d < dim; ++d) {
+                dot += acc_t(go[d]) * acc_t(row[d]);
+                grad_row[d] = scalar_t(g * acc_t(go[d]));
+              }
+              grad_gates_ptr[s * k + j] = float(dot);
+            }
+          }
+        });
+      });
+  return std::make_tuple(grad_y, grad_gates);
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::moe_topk_route"),
+      TORCH_FN(moe_topk_route));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::moe_permute_tokens"),
+      TORCH_FN(moe_permute_tokens));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::moe_unpermute_tokens"),
+      TORCH_FN(moe_unpermute_tokens));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::moe_unpermute_tokens_backward"),
+      TORCH_FN(moe_unpermute_tokens_backward));
+}
@@ -0,0 +1,16 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <torch/types.h>
+
+TORCH_LIBRARY_FRAGMENT(xformers, m) {
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::grouped_gemm(Tensor x, Tensor w, Tensor? b, Tensor expert_offsets) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::grouped_gemm_backward(Tensor grad_y, Tensor x, Tensor w, Tensor expert_offsets) -> (Tensor, Tensor, Tensor)"));
+}
@@ -0,0 +1,20 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+#include <ATen/ATen.h>
+#include <torch/types.h>
+
+TORCH_LIBRARY_FRAGMENT(xformers, m) {
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::moe_topk_route(Tensor logits, int k, int capacity) -> (Tensor, Tensor, Tensor)"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::moe_permute_tokens(Tensor x, Tensor positions, int num_rows) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::moe_unpermute_tokens(Tensor y, Tensor positions, Tensor? gates) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::moe_unpermute_tokens_backward(Tensor grad_out, Tensor y, Tensor positions, Tensor gates) -> (Tensor, Tensor)"));
+}
@@ -30,3 +30,30 @@ def init_torch_distributed_local():
         world_size=1,
         init_method=init_url,
     )
+
+
+def _gloo_worker(rank, world_size, init_url, fn, args):
+    torch.distributed.init_process_group(
+        backend=torch.distributed.Backend.GLOO,
+        rank=rank,
+        world_size=world_size,
+        init_method=init_url,
+    )
+    try:
+        fn(*args)
+    finally:
+        torch.distributed.destroy_process_group()
+
+
+def spawn_gloo_workers(fn, world_size: int, *args):
+    """
+    Runs ``fn(*args)`` in ``world_size`` CPU processes, each of them part
+    of the same default ``gloo`` process group
+    """
+    init_url = "file://" + tempfile.mkstemp()[1]
+    torch.multiprocessing.spawn(
+        _gloo_worker,
+        args=(world_size, init_url, fn, args),
+        nprocs=world_size,
+        join=True,
+    )
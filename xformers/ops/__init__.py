@@ -17,6 +17,8 @@ from .fmha import (
     MemoryEfficientAttentionOp,
     MemoryEfficientAttentionTritonFwdFlashBwOp,
     TritonFlashAttentionOp,
+    MemoryEfficientAttentionBlockSparseOp,
+    MemoryEfficientAttentionSlidingWindowOp,
     MemoryEfficientAttentionCkOp,
     memory_efficient_attention,
     memory_efficient_attention_backward,
@@ -24,8 +26,14 @@ from .fmha import (
     memory_efficient_attention_forward_requires_grad,
 )
 from .indexing import index_select_cat, scaled_index_add
+from .qkv_projection import qkv_projection
+from .ring_attention import ring_attention
 from .rmsnorm import RMSNorm
 from .rope_padded import rope_padded
+from .sequence_parallel_fused_ops import (
+    fused_allgather_and_linear,
+    fused_linear_and_reducescatter,
+)
 from .swiglu_op import (
     SwiGLU,
     SwiGLUEagerOp,
@@ -76,11 +84,14 @@ __all__ = [
     "MemoryEfficientAttentionFlashAttentionOp",
     "MemoryEfficientAttentionOp",
     "MemoryEfficientAttentionTritonFwdFlashBwOp",
+    "MemoryEfficientAttentionBlockSparseOp",
+    "MemoryEfficientAttentionSlidingWindowOp",
     "MemoryEfficientAttentionCkOp",
     "memory_efficient_attention_backward",
     "memory_efficient_attention_forward",
     "memory_efficient_attention_forward_requires_grad",
     "RMSNorm",
+    "ring_attention",
     "SwiGLU",
     "SwiGLUEagerOp",
     "SwiGLUFusedOp",
@@ -96,5 +107,8 @@ __all__ = [
     "scaled_index_add",
     "index_select_cat",
     "rope_padded",
+    "qkv_projection",
+    "fused_allgather_and_linear",
+    "fused_linear_and_reducescatter",
     "attn_bias",
 ]
@@ -89,6 +89,13 @@ def make_pytorch_operator_for_dispatch_key(dispatch_key: str) -> Callable[[ClsT]
     return decorator
 
 
+def _box_process_group(process_group: torch.distributed.ProcessGroup) -> Any:
+    """Converts a ProcessGroup into a value that can be passed to C++ ops"""
+    from .._C import box_process_group
+
+    return box_process_group(process_group)
+
+
 def turn_into_pytorch_op(fn: ClsT, dispatch_key: str) -> ClsT:
     from .. import get_python_lib
 
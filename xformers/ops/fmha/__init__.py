@@ -7,7 +7,7 @@ from typing import Any, Optional, Sequence, Tuple, Type, Union
 
 import torch
 
-from . import attn_bias, cutlass, decoder, flash, small_k, triton, triton_splitk, ck, ck_decoder
+from . import attn_bias, blocksparse, cutlass, decoder, flash, sliding_window, small_k, triton, triton_splitk, ck, ck_decoder
 from .attn_bias import AttentionBias, BlockDiagonalMask, LowerTriangularMask
 from .common import (
     AttentionBwOpBase,
@@ -20,7 +20,12 @@ from .common import (
     Inputs,
     bmk2bmhk,
 )
-from .dispatch import _dispatch_bw, _dispatch_fw, _ensure_op_supports_or_raise
+from .dispatch import (
+    _autotuned_bw,
+    _dispatch_bw,
+    _dispatch_fw,
+    _ensure_op_supports_or_raise,
+)
 
 MemoryEfficientAttentionCutlassOp = (cutlass.FwOp, cutlass.BwOp)
 MemoryEfficientAttentionCutlassFwdFlashBwOp = (cutlass.FwOp, flash.BwOp)
@@ -31,6 +36,8 @@ MemoryEfficientAttentionOp = (small_k.FwOp, small_k.BwOp)
 TritonFlashAttentionOp = (triton.FwOp, cutlass.BwOp if torch.version.cuda else ck.BwOp)
 MemoryEfficientAttentionCkOp = (ck.FwOp, ck.BwOp)
 MemoryEfficientAttentionCkDecoderOp = (ck_decoder.FwOp, ck.BwOp)
+MemoryEfficientAttentionBlockSparseOp = (blocksparse.FwOp, blocksparse.BwOp)
+MemoryEfficientAttentionSlidingWindowOp = (sliding_window.FwOp, sliding_window.BwOp)
 
 class _fMHA(torch.autograd.Function):
     @staticmethod
@@ -41,7 +48,7 @@ class _fMHA(torch.autograd.Function):
         op_bw = op[1] if op is not None else None
 
         out, op_ctx = _memory_efficient_attention_forward_requires_grad(
-            inp=inp, op=op_fw
+            inp=inp, op=op_fw, op_bw=op_bw
         )
 
         # Saving attn_bias is a bit complicated, as the
@@ -344,16 +351,22 @@ def _memory_efficient_attention_forward(
 
 
 def _memory_efficient_attention_forward_requires_grad(
-    inp: Inputs, op: Optional[Type[AttentionFwOpBase]]
+    inp: Inputs,
+    op: Optional[Type[AttentionFwOpBase]],
+    op_bw: Optional[Type[AttentionBwOpBase]] = None,
 ) -> Tuple[torch.Tensor, Context]:
     inp.validate_inputs()
     output_shape = inp.normalize_bmhk()
+    dispatched = op is None
     if op is None:
         op = _dispatch_fw(inp, True)
     else:
         _ensure_op_supports_or_raise(ValueError, "memory_efficient_attention", op, inp)
     out = op.apply(inp, needs_gradient=True)
     assert out[1] is not None
+    if dispatched and op_bw is None and out[1].op_bw is None:
+        # The backward operator which was autotuned together with this forward
+        out[1].op_bw = _autotuned_bw(inp, op)
     return (out[0].reshape(output_shape), out[1])
 
 
@@ -444,6 +457,8 @@ __all__ = [
     "memory_efficient_attention",
     "MemoryEfficientAttentionCkOp",
     "MemoryEfficientAttentionCkDecoderOp",
+    "MemoryEfficientAttentionBlockSparseOp",
+    "MemoryEfficientAttentionSlidingWindowOp",
     "ALL_FW_OPS",
     "ALL_BW_OPS",
     "attn_bias",
@@ -930,3 +930,65 @@ class BlockDiagonalCausalLocalAttentionFromBottomRightMask(
             window_size=self._window_size,
             from_bottomright=True,
         )
+
+
+@dataclass
+class BlockSparseMask(AttentionBias):
+    """
+    A mask defined block by block: the queries of the block ``i`` can attend
+    the keys of the block ``j`` iff ``layout[h, i, j]`` is nonzero.
+
+    The layout has the shape ``[H or 1, ceil(Mq / block_size), ceil(Mkv / block_size)]``,
+    like the layout of a :attr:`xformers.sparse.BlockSparseTensor` or the output of
+    :attr:`xformers.components.attention.attention_patterns.pattern_to_layout`.
+    Kernels supporting this bias skip the key blocks which are masked.
+
+    With ``causal``, a query Q additionally cannot attend to a key which is farther
+    from the initial key than Q is from the initial query.
+    """
+
+    layout: torch.Tensor
+    block_size: int
+    causal: bool = False
+
+    def __post_init__(self) -> None:
+        if self.layout.ndim == 2:
+            self.layout = self.layout[None]
+        if self.layout.ndim != 3:
+            raise ValueError(
+                f"Expected a layout of shape [H, Mq_blocks, Mkv_blocks], got {self.layout.shape}"
+            )
+        if self.block_size <= 0:
+            raise ValueError(f"Invalid block_size={self.block_size}")
+
+    @classmethod
+    def from_blocksparse_tensor(
+        cls, tensor: torch.Tensor, causal: bool = False
+    ) -> "BlockSparseMask":
+        """
+        Creates a mask with the layout of a :attr:`xformers.sparse.BlockSparseTensor`
+        """
+        return cls(tensor._blocksparse_layout, tensor.values().shape[-1], causal)
+
+    def materialize(
+        self,
+        shape: Tuple[int, ...],
+        dtype: torch.dtype = torch.float32,
+        device: Union[str, torch.device] = "cpu",
+    ) -> torch.Tensor:
+        num_queries, num_keys = shape[-2:]
+        mask = self.layout.to(device=device, dtype=torch.bool)
+        mask = mask.repeat_interleave(self.block_size, dim=-2)
+        mask = mask.repeat_interleave(self.block_size, dim=-1)
+        mask = mask[:, :num_queries, :num_keys]
+        if self.causal:
+            mask = mask.tril()
+        create_as = dtype if dtype is not torch.bfloat16 else torch.float32
+        tensor = torch.zeros(mask.shape, dtype=create_as, device=device)
+        tensor.masked_fill_(~mask, -math.inf)
+        if len(shape) >= 3:
+            # [H, Mq, Mkv] -> [..., H, Mq, Mkv]
+            tensor = tensor.expand(shape)
+        else:
+            tensor = tensor[0]
+        return tensor.to(dtype)
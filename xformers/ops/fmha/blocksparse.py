@@ -0,0 +1,130 @@
+# Copyright (c) Facebook, Inc. and its affiliates. All rights reserved.
+#
+# This source code is licensed under the BSD license found in the
+# LICENSE file in the root directory of this source tree.
+
+import math
+from typing import Any, List, Mapping, Optional, Set, Tuple
+
+import torch
+
+from ..common import get_xformers_operator, register_operator
+from .attn_bias import BlockSparseMask
+from .common import AttentionBwOpBase, AttentionFwOpBase, Context, Gradients, Inputs
+
+
+def _check_blocksparse_inputs(d: Inputs, reasons: List[str]) -> None:
+    if d.query.ndim != 4:
+        reasons.append("only supports BMHK inputs")
+        return
+    if d.key.shape[2] != d.query.shape[2]:
+        reasons.append("query and key must have the same number of heads")
+    attn_bias = d.attn_bias
+    if isinstance(attn_bias, BlockSparseMask):
+        block_size = attn_bias.block_size
+        expected = (
+            math.ceil(d.query.shape[1] / block_size),
+            math.ceil(d.key.shape[1] / block_size),
+        )
+        if tuple(attn_bias.layout.shape[1:]) != expected:
+            reasons.append(
+                f"layout of shape {tuple(attn_bias.layout.shape)} doesn't match the "
+                f"{expected} blocks of size {block_size}"
+            )
+        if attn_bias.layout.shape[0] not in (1, d.query.shape[2]):
+            reasons.append("layout must have 1 or H heads")
+
+
+@register_operator
+class FwOp(AttentionFwOpBase):
+    """Attention with a :attr:`xformers.ops.fmha.attn_bias.BlockSparseMask`, on CPU.
+
+    Each block of queries only visits the key blocks of its row of the layout,
+    with an online softmax: masked blocks are skipped, and the attention matrix
+    is never materialized.
+    """
+
+    OPERATOR = get_xformers_operator("blocksparse_attention_forward")
+    SUPPORTED_DEVICES: Set[str] = {"cpu"}
+    SUPPORTED_DTYPES: Set[torch.dtype] = {torch.float, torch.half}
+    SUPPORTED_MAX_K = math.inf
+    SUPPORTED_ATTN_BIAS_TYPES: Set[Any] = {BlockSparseMask}
+    SUPPORTS_DROPOUT = False
+    SUPPORTS_CUSTOM_SCALE = True
+    SUPPORTS_DIFFERENT_VALUE_EMBED = True
+    NAME = "blocksparseF"
+
+    ERROR_ATOL: Mapping[torch.dtype, float] = {
+        torch.float: 3e-4,
+        torch.half: 4e-3,
+    }
+
+    @classmethod
+    def not_supported_reasons(cls, d: Inputs) -> List[str]:
+        reasons = super(FwOp, cls).not_supported_reasons(d)
+        _check_blocksparse_inputs(d, reasons)
+        return reasons
+
+    @classmethod
+    def apply(
+        cls, inp: Inputs, needs_gradient: bool
+    ) -> Tuple[torch.Tensor, Optional[Context]]:
+        attn_bias = inp.attn_bias
+        assert isinstance(attn_bias, BlockSparseMask)
+        out, lse = cls.OPERATOR(
+            inp.query,
+            inp.key,
+            inp.value,
+            attn_bias.layout.to(device="cpu"),
+            attn_bias.block_size,
+            attn_bias.causal,
+            inp.scale_float,
+            needs_gradient,
+        )
+        if not needs_gradient:
+            return out, None
+        return out, Context(out=out, lse=lse)
+
+
+@register_operator
+class BwOp(AttentionBwOpBase):
+    __doc__ = FwOp.__doc__
+
+    OPERATOR = get_xformers_operator("blocksparse_attention_backward")
+    SUPPORTED_DEVICES = FwOp.SUPPORTED_DEVICES
+    SUPPORTED_DTYPES = FwOp.SUPPORTED_DTYPES
+    SUPPORTED_MAX_K = FwOp.SUPPORTED_MAX_K
+    SUPPORTED_ATTN_BIAS_TYPES = FwOp.SUPPORTED_ATTN_BIAS_TYPES
+    SUPPORTS_DROPOUT = FwOp.SUPPORTS_DROPOUT
+    SUPPORTS_CUSTOM_SCALE = FwOp.SUPPORTS_CUSTOM_SCALE
+    SUPPORTS_DIFFERENT_VALUE_EMBED = FwOp.SUPPORTS_DIFFERENT_VALUE_EMBED
+    NAME = "blocksparseB"
+
+    ERROR_ATOL: Mapping[torch.dtype, float] = {
+        torch.float: 5e-4,
+        torch.half: 1e-2,
+    }
+
+    @classmethod
+    def not_supported_reasons(cls, d: Inputs) -> List[str]:
+        reasons = super(BwOp, cls).not_supported_reasons(d)
+        _check_blocksparse_inputs(d, reasons)
+        return reasons
+
+    @classmethod
+    def apply(cls, ctx: Context, inp: Inputs, grad: torch.Tensor) -> Gradients:
+        attn_bias = inp.attn_bias
+        assert isinstance(attn_bias, BlockSparseMask)
+        dq, dk, dv = cls.OPERATOR(
+            grad,
+            inp.query,
+            inp.key,
+            inp.value,
+            ctx.out,
+            ctx.lse,
+            attn_bias.layout.to(device="cpu"),
+            attn_bias.block_size,
+            attn_bias.causal,
+            inp.scale_float,
+        )
+        return Gradients(dq=dq, dk=dk, dv=dv)
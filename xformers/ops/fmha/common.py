@@ -516,7 +516,7 @@ class AttentionOpDispatch:
         scale: Optional[float] = None,
     ) -> "AttentionOpDispatch":
         """Here for backward compatibility"""
-        from .dispatch import _dispatch_bw, _dispatch_fw
+        from .dispatch import _autotuned_bw, _dispatch_bw, _dispatch_fw
 
         inp = Inputs(
             query=query,
@@ -526,7 +526,9 @@ class AttentionOpDispatch:
             p=p,
             scale=scale,
         )
-        return AttentionOpDispatch(op=(_dispatch_fw(inp, True), _dispatch_bw(inp)))
+        op_fw = _dispatch_fw(inp, True)
+        op_bw = _autotuned_bw(inp, op_fw) or _dispatch_bw(inp)
+        return AttentionOpDispatch(op=(op_fw, op_bw))
 
 
 def bmk2bmhk(tensor, num_heads: int) -> torch.Tensor:
@@ -4,13 +4,25 @@
 # LICENSE file in the root directory of this source tree.
 
 
+import json
+import logging
+import math
+import os
+import platform
+import tempfile
 import textwrap
+import threading
+import time
 from collections import deque
-from typing import List, Sequence, Type, TypeVar
+from typing import Callable, Dict, List, Optional, Sequence, Type, TypeVar
 
-from . import attn_bias, cutlass, decoder, flash, small_k, triton, triton_splitk
+import torch
+
+from . import attn_bias, blocksparse, ck, cutlass, decoder, flash, sliding_window, small_k, triton, triton_splitk
 from .common import AttentionBwOpBase, AttentionFwOpBase, Inputs
 
+logger = logging.getLogger("xformers")
+
 
 def _is_cutlass_fwd_faster_than_flash(inp: Inputs) -> bool:
     return False
@@ -22,6 +34,7 @@ def _is_triton_fwd_fastest(inp: Inputs) -> bool:
 
 
 T = TypeVar("T", Type[AttentionFwOpBase], Type[AttentionBwOpBase])
+X = TypeVar("X")
 
 
 def _format_inputs_description(inp: Inputs) -> str:
@@ -63,6 +76,222 @@ def _run_priority_list(name: str, priority_list: Sequence[T], inp: Inputs) -> T:
     raise NotImplementedError(msg)
 
 
+# Autotuning: opt-in with XFORMERS_FMHA_AUTOTUNE=1. The first time a bucket of
+# inputs is seen, every supported operator is timed, and the fastest one is
+# stored in a json file (XFORMERS_FMHA_AUTOTUNE_CACHE), keyed by device, to be
+# reused by the next runs. When a gradient is needed, the forward and backward
+# operators are timed as pairs, as a backward can only run with the context of
+# a compatible forward.
+_AUTOTUNE_REPEATS = 3
+_autotune_lock = threading.Lock()
+_autotune_caches: Dict[str, Dict[str, str]] = {}
+
+
+def _autotune_enabled() -> bool:
+    return os.environ.get("XFORMERS_FMHA_AUTOTUNE", "0") == "1"
+
+
+def _autotune_cache_path() -> str:
+    path = os.environ.get("XFORMERS_FMHA_AUTOTUNE_CACHE")
+    if path:
+        return path
+    cache_dir = os.environ.get(
+        "XDG_CACHE_HOME", os.path.join(os.path.expanduser("~"), ".cache")
+    )
+    return os.path.join(cache_dir, "xformers", "fmha_autotune.json")
+
+
+def _load_autotune_cache(path: str) -> Dict[str, str]:
+    if path not in _autotune_caches:
+        cache: Dict[str, str] = {}
+        try:
+            with open(path) as f:
+                cache = json.load(f)
+        except FileNotFoundError:
+            pass
+        except (OSError, ValueError) as e:
+            logger.warning(f"Ignoring the fMHA autotuning cache {path}: {e}")
+        _autotune_caches[path] = cache
+    return _autotune_caches[path]
+
+
+def _save_autotune_cache(path: str, cache: Dict[str, str]) -> None:
+    # Written to a temporary file and renamed, so that concurrent processes
+    # never read a partial file
+    try:
+        os.makedirs(os.path.dirname(os.path.abspath(path)), exist_ok=True)
+        with tempfile.NamedTemporaryFile(
+            "w", dir=os.path.dirname(os.path.abspath(path)), delete=False
+        ) as f:
+            json.dump(cache, f, indent=1, sort_keys=True)
+        os.replace(f.name, path)
+    except OSError as e:
+        logger.warning(f"Could not save the fMHA autotuning cache {path}: {e}")
+
+
+def _device_key(device: torch.device) -> str:
+    if device.type == "cuda":
+        return f"cuda:{torch.cuda.get_device_name(device)}"
+    cpu = platform.processor() or platform.machine()
+    return f"{device.type}:{cpu}:{torch.get_num_threads()}"
+
+
+def _bucket(n: int) -> int:
+    return 1 << max(n - 1, 0).bit_length()
+
+
+def _autotune_key(kind: str, inp: Inputs) -> str:
+    """
+    Inputs of the same bucket share the same operator: same device, dtype,
+    head dims, bias type and GQA factor, and sequence lengths / batch rounded
+    up to a power of 2
+    """
+    q, k, v = inp.query, inp.key, inp.value
+    batch_heads = math.prod(q.shape[:1] + q.shape[2:-1])
+    gqa_factor = 1
+    if k.ndim == 5 and k.stride(-2) == 0:
+        gqa_factor = k.shape[-2]
+    fields = [
+        _device_key(q.device),
+        kind,
+        str(q.dtype),
+        f"K={q.shape[-1]}",
+        f"Kv={v.shape[-1]}",
+        f"Mq={_bucket(q.shape[1])}",
+        f"Mkv={_bucket(k.shape[1])}",
+        f"BH={_bucket(batch_heads)}",
+        f"bias={type(inp.attn_bias).__name__}",
+        f"gqa={gqa_factor}",
+        f"dropout={inp.p > 0}",
+    ]
+    return "|".join(fields)
+
+
+def _synchronize(device: torch.device) -> None:
+    if device.type == "cuda":
+        torch.cuda.synchronize(device)
+
+
+def _time_op(run: Callable[[], object], device: torch.device) -> float:
+    run()  # warmup
+    best = math.inf
+    for _ in range(_AUTOTUNE_REPEATS):
+        _synchronize(device)
+        start = time.perf_counter()
+        run()
+        _synchronize(device)
+        best = min(best, time.perf_counter() - start)
+    return best
+
+
+class _IncompatibleOps(Exception):
+    pass
+
+
+def _autotune(
+    kind: str,
+    candidates: Dict[str, X],
+    inp: Inputs,
+    run: Callable[[X], object],
+) -> Optional[X]:
+    """
+    The fastest of the ``candidates`` (by name) for these inputs, measured
+    with ``run(candidate)`` the first time their bucket is seen. Returns
+    ``None`` when there is nothing to choose from, to fall back to the
+    priority list.
+    """
+    if len(candidates) < 2:
+        return None
+    path = _autotune_cache_path()
+    key = _autotune_key(kind, inp)
+    with _autotune_lock:
+        cached = _load_autotune_cache(path).get(key)
+    if cached is not None:
+        # The bucket might contain shapes which this candidate doesn't support
+        return candidates.get(cached)
+
+    device = inp.query.device
+    timings: Dict[str, float] = {}
+    rng_devices = [device] if device.type == "cuda" else []
+    for name, candidate in candidates.items():
+        try:
+            with torch.random.fork_rng(devices=rng_devices), torch.no_grad():
+                timings[name] = _time_op(lambda: run(candidate), device)
+        except _IncompatibleOps as e:
+            logger.info(f"fMHA autotuning: skipping {name} for {key}: {e}")
+        except Exception as e:
+            logger.warning(f"fMHA autotuning: {name} failed for {key}: {e}")
+    if not timings:
+        return None
+    best = min(timings, key=lambda name: timings[name])
+    logger.info(f"fMHA autotuning: {best} for {key} ({timings})")
+
+    with _autotune_lock:
+        # Reloaded from the file, to keep the entries added by other processes
+        _autotune_caches.pop(path, None)
+        cache = _load_autotune_cache(path)
+        cache[key] = best
+        _save_autotune_cache(path, cache)
+    return candidates[best]
+
+
+def _pair_name(op_fw: Type[AttentionFwOpBase], op_bw: Type[AttentionBwOpBase]) -> str:
+    return f"{op_fw.NAME},{op_bw.NAME}"
+
+
+def _autotune_fw(
+    inp: Inputs, needs_gradient: bool, priority_list: Sequence[Type[AttentionFwOpBase]]
+) -> Optional[Type[AttentionFwOpBase]]:
+    ops_fw = [op for op in priority_list if not op.not_supported_reasons(inp)]
+    if not needs_gradient:
+        return _autotune(
+            "fw",
+            {op.NAME: op for op in ops_fw},
+            inp,
+            lambda op: op.apply(inp, needs_gradient=False),
+        )
+
+    # The backward depends on the context (lse layout, padding, random state)
+    # of the forward: the forward and backward operators are timed together,
+    # each backward with the context of its own forward
+    ops_bw = [
+        op for op in _dispatch_bw_priority_list(inp) if not op.not_supported_reasons(inp)
+    ]
+    pairs = {
+        _pair_name(op_fw, op_bw): (op_fw, op_bw) for op_fw in ops_fw for op_bw in ops_bw
+    }
+
+    def run(pair):
+        op_fw, op_bw = pair
+        out, ctx = op_fw.apply(inp, needs_gradient=True)
+        if ctx.op_bw is not None and ctx.op_bw is not op_bw:
+            raise _IncompatibleOps(f"{op_fw.NAME} requires {ctx.op_bw.NAME}")
+        # Any tensor of the shape of the output does for the gradient
+        op_bw.apply(ctx, inp, out)
+
+    best = _autotune("fw_bw", pairs, inp, run)
+    return best[0] if best is not None else None
+
+
+def _autotuned_bw(
+    inp: Inputs, op_fw: Type[AttentionFwOpBase]
+) -> Optional[Type[AttentionBwOpBase]]:
+    """
+    The backward operator timed with ``op_fw`` when it was autotuned for
+    these inputs, if any
+    """
+    if not _autotune_enabled():
+        return None
+    with _autotune_lock:
+        cached = _load_autotune_cache(_autotune_cache_path()).get(
+            _autotune_key("fw_bw", inp)
+        )
+    for op_bw in _dispatch_bw_priority_list(inp):
+        if cached == _pair_name(op_fw, op_bw) and not op_bw.not_supported_reasons(inp):
+            return op_bw
+    return None
+
+
 def _dispatch_fw_priority_list(
     inp: Inputs, needs_gradient: bool
 ) -> Sequence[Type[AttentionFwOpBase]]:
@@ -73,12 +302,16 @@ def _dispatch_fw_priority_list(
               triton.FwOp,
               cutlass.FwOp,
               small_k.FwOp,
+              blocksparse.FwOp,
+              sliding_window.FwOp,
            ])
     else:
         priority_list_ops = deque(
            [
               triton.FwOp,
               ck.FwOp,
+              blocksparse.FwOp,
+              sliding_window.FwOp,
            ])
     if _is_cutlass_fwd_faster_than_flash(inp):
         priority_list_ops.remove(cutlass.FwOp)
@@ -123,18 +356,19 @@ def _dispatch_fw(inp: Inputs, needs_gradient: bool) -> Type[AttentionFwOpBase]:
     Returns:
         AttentionOp: The best operator for the configuration
     """
-    return _run_priority_list(
-        "memory_efficient_attention_forward",
-        _dispatch_fw_priority_list(inp, needs_gradient),
-        inp,
-    )
+    priority_list = _dispatch_fw_priority_list(inp, needs_gradient)
+    if _autotune_enabled():
+        op = _autotune_fw(inp, needs_gradient, priority_list)
+        if op is not None:
+            return op
+    return _run_priority_list("memory_efficient_attention_forward", priority_list, inp)
 
 
 def _is_cutlassB_faster_than_flash(inp: Inputs) -> bool:
     return False
 
 
-def _dispatch_bw(inp: Inputs) -> Type[AttentionBwOpBase]:
+def _dispatch_bw_priority_list(inp: Inputs) -> List[Type[AttentionBwOpBase]]:
     priority_list_ops: List[Type[AttentionBwOpBase]] = [
         flash.BwOp,
         cutlass.BwOp,
@@ -142,10 +376,16 @@ def _dispatch_bw(inp: Inputs) -> Type[AttentionBwOpBase]:
         # triton.BwOp,
         # Deprecated
         small_k.BwOp,
+        blocksparse.BwOp,
+        sliding_window.BwOp,
     ]
     if _is_cutlassB_faster_than_flash(inp):
         priority_list_ops.remove(cutlass.BwOp)
         priority_list_ops.insert(0, cutlass.BwOp)
+    return priority_list_ops
+
+
+def _dispatch_bw(inp: Inputs) -> Type[AttentionBwOpBase]:
     return _run_priority_list(
-        "memory_efficient_attention_backward", priority_list_ops, inp
+        "memory_efficient_attention_backward", _dispatch_bw_priority_list(inp), inp
     )
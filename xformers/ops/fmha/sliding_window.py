@@ -0,0 +1,129 @@
+# Copyright (c) Facebook, Inc. and its affiliates. All rights reserved.
+#
+# This source code is licensed under the BSD license found in the
+# LICENSE file in the root directory of this source tree.
+
+import math
+from typing import Any, List, Mapping, Optional, Set, Tuple
+
+import torch
+
+from ..common import get_xformers_operator, register_operator
+from .attn_bias import (
+    LocalAttentionFromBottomRightMask,
+    LowerTriangularFromBottomRightLocalAttentionMask,
+)
+from .common import AttentionBwOpBase, AttentionFwOpBase, Context, Gradients, Inputs
+
+
+def _window(attn_bias: Any) -> Tuple[int, int]:
+    """Number of keys visible on the left and on the right of each query"""
+    if isinstance(attn_bias, LowerTriangularFromBottomRightLocalAttentionMask):
+        return attn_bias._window_size - 1, 0
+    assert isinstance(attn_bias, LocalAttentionFromBottomRightMask)
+    return attn_bias.window_left, attn_bias.window_right
+
+
+def _check_sliding_window_inputs(d: Inputs, reasons: List[str]) -> None:
+    if d.query.ndim != 4:
+        reasons.append("only supports BMHK inputs")
+        return
+    if d.key.shape[2] != d.query.shape[2]:
+        reasons.append("query and key must have the same number of heads")
+
+
+@register_operator
+class FwOp(AttentionFwOpBase):
+    """Attention with a band mask
+    (:attr:`xformers.ops.fmha.attn_bias.LocalAttentionFromBottomRightMask`
+    or :attr:`xformers.ops.fmha.attn_bias.LowerTriangularFromBottomRightLocalAttentionMask`),
+    on CPU.
+
+    Each block of queries only visits the keys within the windows of its
+    queries, with an online softmax: the cost is linear in the sequence length
+    and in the window size, and no mask is materialized.
+    """
+
+    OPERATOR = get_xformers_operator("sliding_window_attention_forward")
+    SUPPORTED_DEVICES: Set[str] = {"cpu"}
+    SUPPORTED_DTYPES: Set[torch.dtype] = {torch.float, torch.half}
+    SUPPORTED_MAX_K = math.inf
+    SUPPORTED_ATTN_BIAS_TYPES: Set[Any] = {
+        LocalAttentionFromBottomRightMask,
+        LowerTriangularFromBottomRightLocalAttentionMask,
+    }
+    SUPPORTS_DROPOUT = False
+    SUPPORTS_CUSTOM_SCALE = True
+    SUPPORTS_DIFFERENT_VALUE_EMBED = True
+    NAME = "slidingwindowF"
+
+    ERROR_ATOL: Mapping[torch.dtype, float] = {
+        torch.float: 3e-4,
+        torch.half: 4e-3,
+    }
+
+    @classmethod
+    def not_supported_reasons(cls, d: Inputs) -> List[str]:
+        reasons = super(FwOp, cls).not_supported_reasons(d)
+        _check_sliding_window_inputs(d, reasons)
+        return reasons
+
+    @classmethod
+    def apply(
+        cls, inp: Inputs, needs_gradient: bool
+    ) -> Tuple[torch.Tensor, Optional[Context]]:
+        window_left, window_right = _window(inp.attn_bias)
+        out, lse = cls.OPERATOR(
+            inp.query,
+            inp.key,
+            inp.value,
+            window_left,
+            window_right,
+            inp.scale_float,
+            needs_gradient,
+        )
+        if not needs_gradient:
+            return out, None
+        return out, Context(out=out, lse=lse)
+
+
+@register_operator
+class BwOp(AttentionBwOpBase):
+    __doc__ = FwOp.__doc__
+
+    OPERATOR = get_xformers_operator("sliding_window_attention_backward")
+    SUPPORTED_DEVICES = FwOp.SUPPORTED_DEVICES
+    SUPPORTED_DTYPES = FwOp.SUPPORTED_DTYPES
+    SUPPORTED_MAX_K = FwOp.SUPPORTED_MAX_K
+    SUPPORTED_ATTN_BIAS_TYPES = FwOp.SUPPORTED_ATTN_BIAS_TYPES
+    SUPPORTS_DROPOUT = FwOp.SUPPORTS_DROPOUT
+    SUPPORTS_CUSTOM_SCALE = FwOp.SUPPORTS_CUSTOM_SCALE
+    SUPPORTS_DIFFERENT_VALUE_EMBED = FwOp.SUPPORTS_DIFFERENT_VALUE_EMBED
+    NAME = "slidingwindowB"
+
+    ERROR_ATOL: Mapping[torch.dtype, float] = {
+        torch.float: 5e-4,
+        torch.half: 1e-2,
+    }
+
+    @classmethod
+    def not_supported_reasons(cls, d: Inputs) -> List[str]:
+        reasons = super(BwOp, cls).not_supported_reasons(d)
+        _check_sliding_window_inputs(d, reasons)
+        return reasons
+
+    @classmethod
+    def apply(cls, ctx: Context, inp: Inputs, grad: torch.Tensor) -> Gradients:
+        window_left, window_right = _window(inp.attn_bias)
+        dq, dk, dv = cls.OPERATOR(
+            grad,
+            inp.query,
+            inp.key,
+            inp.value,
+            ctx.out,
+            ctx.lse,
+            window_left,
+            window_right,
+            inp.scale_float,
+        )
+        return Gradients(dq=dq, dk=dk, dv=dv)
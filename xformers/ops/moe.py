@@ -0,0 +1,290 @@
+# Copyright (c) Facebook, Inc. and its affiliates. All rights reserved.
+#
+# This source code is licensed under the BSD license found in the
+# LICENSE file in the root directory of this source tree.
+
+from dataclasses import dataclass
+from typing import Optional
+
+import torch
+import torch.nn.functional as F
+
+from .common import BaseOperator, get_xformers_operator, register_operator
+
+
+@register_operator
+class MoETopkRouteOp(BaseOperator):
+    OPERATOR = get_xformers_operator("moe_topk_route")
+    OPERATOR_CATEGORY = "moe"
+    NAME = "moe_topk_route"
+
+
+@register_operator
+class MoEPermuteTokensOp(BaseOperator):
+    OPERATOR = get_xformers_operator("moe_permute_tokens")
+    OPERATOR_CATEGORY = "moe"
+    NAME = "moe_permute_tokens"
+
+
+@register_operator
+class MoEUnpermuteTokensOp(BaseOperator):
+    OPERATOR = get_xformers_operator("moe_unpermute_tokens")
+    OPERATOR_CATEGORY = "moe"
+    NAME = "moe_unpermute_tokens"
+
+
+@register_operator
+class MoEUnpermuteTokensBwOp(BaseOperator):
+    OPERATOR = get_xformers_operator("moe_unpermute_tokens_backward")
+    OPERATOR_CATEGORY = "moe"
+    NAME = "moe_unpermute_tokens_backward"
+
+
+@register_operator
+class GroupedGemmOp(BaseOperator):
+    OPERATOR = get_xformers_operator("grouped_gemm")
+    OPERATOR_CATEGORY = "moe"
+    NAME = "grouped_gemm"
+
+
+@register_operator
+class GroupedGemmBwOp(BaseOperator):
+    OPERATOR = get_xformers_operator("grouped_gemm_backward")
+    OPERATOR_CATEGORY = "moe"
+    NAME = "grouped_gemm_backward"
+
+
+def _use_cpu_kernel(op, *tensors: torch.Tensor) -> bool:
+    return op.is_available() and all(t.device.type == "cpu" for t in tensors)
+
+
+@dataclass
+class MoERouting:
+    """
+    Compact description of how tokens are dispatched to the experts.
+    The tokens routed to each expert are stored contiguously in a packed
+    buffer of ``num_rows`` rows.
+    """
+
+    #: Expert chosen by each token, for each of its ``k`` choices - ``[S, k]``
+    experts: torch.Tensor
+    #: Row of each (token, choice) in the packed buffer, -1 if it was dropped \
+    #: because the expert was full - ``[S, k]``
+    positions: torch.Tensor
+    #: Rows of the expert ``e`` in the packed buffer are \
+    #: ``expert_offsets[e]:expert_offsets[e + 1]`` - ``[E + 1]``
+    expert_offsets: torch.Tensor
+
+    @property
+    def num_experts(self) -> int:
+        return self.expert_offsets.shape[0] - 1
+
+    @property
+    def num_rows(self) -> int:
+        return int(self.expert_offsets[-1])
+
+    def tokens_per_expert(self) -> torch.Tensor:
+        return self.expert_offsets[1:] - self.expert_offsets[:-1]
+
+
+def _topk_route_torch(logits: torch.Tensor, k: int, capacity: int):
+    S, E = logits.shape
+    experts = logits.topk(k, dim=1).indices
+    # All the first choices come first, then the second choices, etc...
+    flat_experts = experts.t().reshape(-1)
+    counts = torch.bincount(flat_experts, minlength=E)
+    order = torch.sort(flat_experts, stable=True).indices
+    starts = torch.cumsum(counts, 0) - counts
+    slots = torch.empty_like(flat_experts)
+    slots[order] = (
+        torch.arange(S * k, device=logits.device) - starts[flat_experts[order]]
+    )
+    expert_offsets = torch.nn.functional.pad(
+        torch.cumsum(counts.clamp(max=capacity), 0), (1, 0)
+    )
+    positions = torch.where(
+        slots < capacity,
+        expert_offsets[flat_experts] + slots,
+        torch.full_like(slots, -1),
+    )
+    return experts, positions.view(k, S).t().contiguous(), expert_offsets
+
+
+def topk_route(logits: torch.Tensor, k: int, capacity: int) -> MoERouting:
+    """
+    Routes each token to the ``k`` experts with the highest ``logits``
+    ``[S, E]``, each expert accepting at most ``capacity`` tokens.
+
+    Choices are served in priority order: the first choice of every token,
+    in token order, then the second choices, etc. Tokens which do not fit
+    in their expert are dropped, like in GShard's top-2 gating.
+    Unlike a dense ``[S, E, capacity]`` dispatch mask, the routing takes
+    ``O(S * k)`` memory.
+    """
+    with torch.no_grad():
+        if _use_cpu_kernel(MoETopkRouteOp, logits):
+            experts, positions, expert_offsets = MoETopkRouteOp.OPERATOR(
+                logits, k, capacity
+            )
+        else:
+            experts, positions, expert_offsets = _topk_route_torch(
+                logits, k, capacity
+            )
+    return MoERouting(
+        experts=experts, positions=positions, expert_offsets=expert_offsets
+    )
+
+
+class _PermuteTokens(torch.autograd.Function):
+    @staticmethod
+    # type: ignore
+    def forward(ctx, x: torch.Tensor, positions: torch.Tensor, num_rows: int):
+        ctx.save_for_backward(positions)
+        return MoEPermuteTokensOp.OPERATOR(x, positions, num_rows)
+
+    @staticmethod
+    @torch.autograd.function.once_differentiable
+    def backward(ctx, grad):
+        (positions,) = ctx.saved_tensors
+        return MoEUnpermuteTokensOp.OPERATOR(grad, positions, None), None, None
+
+
+class _UnpermuteTokens(torch.autograd.Function):
+    @staticmethod
+    # type: ignore
+    def forward(
+        ctx, y: torch.Tensor, positions: torch.Tensor, gates: torch.Tensor
+    ):
+        ctx.save_for_backward(y, positions, gates)
+        return MoEUnpermuteTokensOp.OPERATOR(y, positions, gates)
+
+    @staticmethod
+    @torch.autograd.function.once_differentiable
+    def backward(ctx, grad):
+        y, positions, gates = ctx.saved_tensors
+        grad_y, grad_gates = MoEUnpermuteTokensBwOp.OPERATOR(
+            grad, y, positions, gates
+        )
+        return grad_y, None, grad_gates.to(gates.dtype)
+
+
+def permute_tokens(x: torch.Tensor, routing: MoERouting) -> torch.Tensor:
+    """
+    Gathers the tokens ``x`` ``[S, D]`` into a ``[routing.num_rows, D]``
+    buffer, where the tokens of each expert are contiguous
+    """
+    if _use_cpu_kernel(MoEPermuteTokensOp, x):
+        return _PermuteTokens.apply(x, routing.positions, routing.num_rows)
+    kept = routing.positions >= 0
+    k = routing.positions.shape[1]
+    out = x.new_empty([routing.num_rows, x.shape[1]])
+    return out.index_copy(
+        0,
+        routing.positions[kept],
+        x.unsqueeze(1).expand(-1, k, -1)[kept],
+    )
+
+
+def unpermute_tokens(
+    y: torch.Tensor, routing: MoERouting, gates: Optional[torch.Tensor] = None
+) -> torch.Tensor:
+    """
+    Combines the outputs of the experts ``y`` ``[routing.num_rows, D]`` back
+    in token order, weighted by the ``gates`` ``[S, k]``:
+    ``out[s] = sum_j gates[s, j] * y[routing.positions[s, j]]``.
+    Dropped tokens get a zero output.
+    """
+    if gates is None:
+        gates = torch.ones(
+            routing.positions.shape, dtype=y.dtype, device=y.device
+        )
+    if _use_cpu_kernel(MoEUnpermuteTokensOp, y):
+        return _UnpermuteTokens.apply(y, routing.positions, gates)
+    num_rows = y.shape[0]
+    # Dropped tokens read a row of zeros
+    y = torch.cat([y, y.new_zeros([1, y.shape[1]])])
+    positions = routing.positions.masked_fill(routing.positions < 0, num_rows)
+    return (y[positions] * gates.unsqueeze(-1).to(y.dtype)).sum(1)
+
+
+class _GroupedLinear(torch.autograd.Function):
+    @staticmethod
+    # type: ignore
+    def forward(
+        ctx,
+        x: torch.Tensor,
+        w: torch.Tensor,
+        b: Optional[torch.Tensor],
+        expert_offsets: torch.Tensor,
+    ):
+        ctx.save_for_backward(x, w, expert_offsets)
+        ctx.has_bias = b is not None
+        return GroupedGemmOp.OPERATOR(x, w, b, expert_offsets)
+
+    @staticmethod
+    @torch.autograd.function.once_differentiable
+    def backward(ctx, grad):
+        x, w, expert_offsets = ctx.saved_tensors
+        grad_x, grad_w, grad_b = GroupedGemmBwOp.OPERATOR(
+            grad, x, w, expert_offsets
+        )
+        return grad_x, grad_w, grad_b if ctx.has_bias else None, None
+
+
+def grouped_linear(
+    x: torch.Tensor,
+    w: torch.Tensor,
+    b: Optional[torch.Tensor],
+    expert_offsets: torch.Tensor,
+) -> torch.Tensor:
+    """
+    Applies the linear layer of each expert to its group of rows of the
+    packed buffer ``x`` ``[N, K]``, in a single call:
+    ``out[rows of e] = x[rows of e] @ w[e].T + b[e]``, where the rows of the
+    expert ``e`` are ``expert_offsets[e]:expert_offsets[e + 1]``.
+
+    The weights of all the experts are stacked: ``w`` is ``[E, M, K]`` and
+    ``b`` is ``[E, M]`` (or ``None``). Groups can have any size, including 0.
+    On CPU, the work is split over the threads according to the number of
+    tokens of each expert.
+    """
+    if _use_cpu_kernel(GroupedGemmOp, x, w, expert_offsets):
+        return _GroupedLinear.apply(x, w, b, expert_offsets)
+    offsets = expert_offsets.tolist()
+    return torch.cat(
+        [
+            F.linear(
+                x[offsets[e] : offsets[e + 1]],
+                w[e],
+                b[e] if b is not None else None,
+            )
+            for e in range(w.shape[0])
+        ]
+    )
+
+
+def grouped_swiglu(
+    x: torch.Tensor,
+    expert_offsets: torch.Tensor,
+    w12: torch.Tensor,
+    b12: Optional[torch.Tensor],
+    w3: torch.Tensor,
+    b3: Optional[torch.Tensor],
+) -> torch.Tensor:
+    """
+    Runs the SwiGLU (see :attr:`xformers.ops.swiglu`) of every expert on its
+    group of rows of ``x`` ``[N, D]``.
+    ``w12`` ``[E, 2 * H, D]`` stacks the ``w1`` and ``w2`` of each expert,
+    so that both projections are computed by a single grouped GEMM,
+    and ``w3`` is ``[E, D, H]``.
+
+    :Equivalent pytorch code (for the rows of the expert e):
+
+    .. code-block:: python
+
+        x1, x2 = F.linear(x, w12[e], b12[e]).chunk(2, dim=-1)
+        hidden = F.silu(x1) * x2
+        return F.linear(hidden, w3[e], b3[e])
+    """
+    x1, x2 = grouped_linear(x, w12, b12, expert_offsets).chunk(2, dim=-1)
+    return grouped_linear(F.silu(x1) * x2, w3, b3, expert_offsets)
@@ -0,0 +1,112 @@
+# Copyright (c) Facebook, Inc. and its affiliates. All rights reserved.
+#
+# This source code is licensed under the BSD license found in the
+# LICENSE file in the root directory of this source tree.
+
+from typing import Optional, Tuple
+
+import torch
+import torch.nn.functional as F
+
+from .common import BaseOperator, get_xformers_operator, register_operator
+
+
+@register_operator
+class QKVProjectionOp(BaseOperator):
+    OPERATOR = get_xformers_operator("qkv_projection")
+    OPERATOR_CATEGORY = "qkv_projection"
+    NAME = "qkv_projection"
+
+    @classmethod
+    # type: ignore
+    def operator_flop(cls, x: torch.Tensor, weight: torch.Tensor, *args) -> int:
+        return x.shape[0] * x.shape[1] * weight.shape[0] * weight.shape[1] * 2
+
+
+class _QKVProjection(torch.autograd.Function):
+    @staticmethod
+    # type: ignore
+    def forward(ctx, x, weight, bias, num_heads, num_kv_heads):
+        q, k, v = QKVProjectionOp.OPERATOR(x, weight, bias, num_heads, num_kv_heads)
+        ctx.save_for_backward(x, weight)
+        ctx.has_bias = bias is not None
+        ctx.out_shapes = (q.shape, k.shape, v.shape)
+        return q, k, v
+
+    @staticmethod
+    # type: ignore
+    def backward(ctx, grad_q, grad_k, grad_v):
+        x, weight = ctx.saved_tensors
+        B, M, _ = x.shape
+        # Back to the packed layout of the weight, for a single GEMM per gradient
+        grad_packed = torch.cat(
+            [
+                (x.new_zeros(shape) if grad is None else grad).reshape(B * M, -1)
+                for grad, shape in zip((grad_q, grad_k, grad_v), ctx.out_shapes)
+            ],
+            dim=1,
+        )
+        grad_x = grad_w = grad_b = None
+        if ctx.needs_input_grad[0]:
+            grad_x = (grad_packed @ weight).view_as(x)
+        if ctx.needs_input_grad[1]:
+            grad_w = grad_packed.t() @ x.reshape(B * M, -1)
+        if ctx.has_bias and ctx.needs_input_grad[2]:
+            grad_b = grad_packed.sum(0)
+        return grad_x, grad_w, grad_b, None, None
+
+
+def qkv_projection(
+    x: torch.Tensor,
+    weight: torch.Tensor,
+    bias: Optional[torch.Tensor],
+    num_heads: int,
+    num_kv_heads: Optional[int] = None,
+) -> Tuple[torch.Tensor, torch.Tensor, torch.Tensor]:
+    """
+    Projects x [B, M, D] into the queries, keys and values of the attention,
+    with a single GEMM on the packed weight [(num_heads + 2 * num_kv_heads) * K, D].
+
+    The outputs are directly in the layout of :attr:`xformers.ops.memory_efficient_attention`:
+
+    - BMHK, ie q, k and v [B, M, num_heads, K], when num_kv_heads == num_heads
+    - BMGHK otherwise (grouped or multi-query attention), with G = num_kv_heads groups:
+      q is [B, M, G, num_heads // G, K], and k and v are [B, M, G, 1, K] expanded
+      (without copy) over the heads of the group
+
+    On CPU the GEMM writes q, k and v into 3 separate buffers, on other devices q, k and v are
+    views of the packed GEMM output. In both cases there is no copy to get the per-head layout.
+    """
+    num_kv_heads = num_heads if num_kv_heads is None else num_kv_heads
+    assert x.ndim == 3, "x should be [B, M, D]"
+    assert (
+        num_heads % num_kv_heads == 0
+    ), "num_heads should be a multiple of num_kv_heads"
+    total_heads = num_heads + 2 * num_kv_heads
+    assert weight.shape[0] % total_heads == 0
+    K = weight.shape[0] // total_heads
+    B, M, _ = x.shape
+
+    if (
+        x.device.type == "cpu"
+        and weight.dtype == x.dtype
+        and (bias is None or bias.dtype == x.dtype)
+        and QKVProjectionOp.is_available()
+    ):
+        q, k, v = _QKVProjection.apply(x, weight, bias, num_heads, num_kv_heads)
+    else:
+        q, k, v = F.linear(x, weight, bias).split(
+            [num_heads * K, num_kv_heads * K, num_kv_heads * K], dim=-1
+        )
+        q = q.view(B, M, num_heads, K)
+        k = k.view(B, M, num_kv_heads, K)
+        v = v.view(B, M, num_kv_heads, K)
+
+    if num_kv_heads == num_heads:
+        return q, k, v
+
+    G, heads_per_group = num_kv_heads, num_heads // num_kv_heads
+    q = q.view(B, M, G, heads_per_group, K)
+    k = k.unsqueeze(3).expand(B, M, G, heads_per_group, K)
+    v = v.unsqueeze(3).expand(B, M, G, heads_per_group, K)
+    return q, k, v
@@ -0,0 +1,123 @@
+# Copyright (c) Facebook, Inc. and its affiliates. All rights reserved.
+#
+# This source code is licensed under the BSD license found in the
+# LICENSE file in the root directory of this source tree.
+
+from typing import Optional
+
+import torch
+
+from .common import (
+    BaseOperator,
+    _box_process_group,
+    get_xformers_operator,
+    register_operator,
+)
+
+
+@register_operator
+class RingAttentionFwOp(BaseOperator):
+    OPERATOR = get_xformers_operator("ring_attention_forward")
+    OPERATOR_CATEGORY = "distributed"
+    NAME = "ring_attentionF"
+
+
+@register_operator
+class RingAttentionBwOp(BaseOperator):
+    OPERATOR = get_xformers_operator("ring_attention_backward")
+    OPERATOR_CATEGORY = "distributed"
+    NAME = "ring_attentionB"
+
+
+class _RingAttention(torch.autograd.Function):
+    @staticmethod
+    # type: ignore
+    def forward(
+        ctx,
+        query: torch.Tensor,
+        key: torch.Tensor,
+        value: torch.Tensor,
+        process_group: torch.distributed.ProcessGroup,
+        causal: bool,
+        scale: Optional[float],
+    ) -> torch.Tensor:
+        boxed_process_group = _box_process_group(process_group)
+        out, lse = RingAttentionFwOp.OPERATOR(
+            query, key, value, boxed_process_group, causal, scale
+        )
+        ctx.save_for_backward(query, key, value, out, lse)
+        ctx.process_group = boxed_process_group
+        ctx.causal = causal
+        ctx.scale = scale
+        return out
+
+    @staticmethod
+    @torch.autograd.function.once_differentiable
+    def backward(ctx, grad_out):
+        query, key, value, out, lse = ctx.saved_tensors
+        grad_q, grad_k, grad_v = RingAttentionBwOp.OPERATOR(
+            grad_out.contiguous(),
+            query,
+            key,
+            value,
+            out,
+            lse,
+            ctx.process_group,
+            ctx.causal,
+            ctx.scale,
+        )
+        return grad_q, grad_k, grad_v, None, None, None
+
+
+def ring_attention(
+    query: torch.Tensor,
+    key: torch.Tensor,
+    value: torch.Tensor,
+    process_group: torch.distributed.ProcessGroup,
+    causal: bool = False,
+    scale: Optional[float] = None,
+) -> torch.Tensor:
+    """
+    Sequence-parallel attention, where each rank of ``process_group`` holds
+    a contiguous shard of the sequence.
+
+    Key/value shards rotate around the ring of ranks: each rank computes the
+    attention of its local queries against the shard it currently holds
+    while the next one is in flight, and merges the partial outputs with
+    their logsumexp. The full sequence never needs to fit on a single rank.
+
+    :Equivalent pytorch code:
+
+    .. code-block:: python
+
+        # Shards of all ranks, concatenated along the sequence
+        q, k, v = [torch.cat(all_gather(x), dim=1) for x in (query, key, value)]
+        out = memory_efficient_attention(
+            q, k, v, attn_bias=LowerTriangularMask() if causal else None
+        )
+        # Only keep the queries of the current rank
+        out = out.chunk(world_size, dim=1)[rank]
+
+    :Inputs shape:
+
+    - ``query``, ``key`` and ``value`` are the local shards, of shape \
+        ``[B, M, H, K]``. All ranks must hold shards of the same shape.
+
+    :Supported hardware:
+
+    Works with any backend supporting point-to-point ``send``/``recv``, \
+        including ``gloo`` on CPU.
+    """
+    if query.ndim != 4 or key.ndim != 4 or value.ndim != 4:
+        raise ValueError(
+            f"Expected [B, M, H, K] inputs, got query={query.shape}, "
+            f"key={key.shape}, value={value.shape}"
+        )
+    return _RingAttention.apply(
+        query.contiguous(),
+        key.contiguous(),
+        value.contiguous(),
+        process_group,
+        causal,
+        scale,
+    )
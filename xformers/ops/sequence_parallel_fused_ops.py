@@ -0,0 +1,130 @@
+# Copyright (c) Facebook, Inc. and its affiliates. All rights reserved.
+#
+# This source code is licensed under the BSD license found in the
+# LICENSE file in the root directory of this source tree.
+
+from dataclasses import dataclass
+from typing import List, Tuple, Union
+
+import torch
+
+from .common import (
+    BaseOperator,
+    _box_process_group,
+    get_xformers_operator,
+    register_operator,
+)
+
+
+@register_operator
+class FusedAllGatherAndLinearOp(BaseOperator):
+    OPERATOR = get_xformers_operator("fused_allgather_and_linear")
+    OPERATOR_CATEGORY = "distributed"
+    NAME = "fused_allgather_and_linear"
+
+
+@register_operator
+class FusedLinearAndReduceScatterOp(BaseOperator):
+    OPERATOR = get_xformers_operator("fused_linear_and_reducescatter")
+    OPERATOR_CATEGORY = "distributed"
+    NAME = "fused_linear_and_reducescatter"
+
+
+@dataclass
+class CommOverlapStats:
+    """
+    Host-side timings of the communications of a fused collective-matmul op
+    """
+
+    #: Time during which transfers were in flight behind the GEMMs (seconds)
+    overlapped: float
+    #: Time spent blocked waiting for transfers to complete (seconds)
+    exposed: float
+
+    @property
+    def hidden_fraction(self) -> float:
+        """Fraction of the communication time hidden behind compute"""
+        total = self.overlapped + self.exposed
+        if total == 0.0:
+            return 1.0
+        return self.overlapped / total
+
+    @classmethod
+    def from_tensor(cls, stats: torch.Tensor) -> "CommOverlapStats":
+        overlapped, exposed = stats.tolist()
+        return cls(overlapped=overlapped, exposed=exposed)
+
+
+def fused_allgather_and_linear(
+    scattered_input: torch.Tensor,
+    weight: Union[torch.Tensor, List[torch.Tensor]],
+    *,
+    process_group: torch.distributed.ProcessGroup,
+    return_stats: bool = False,
+):
+    """
+    Performs an all-gather of ``scattered_input`` along its first dimension,
+    followed by one matmul per weight, with the communication pipelined
+    against the GEMMs: the chunk of each rank is multiplied as soon as it
+    arrives, while the next one is in flight.
+
+    :Equivalent pytorch code:
+
+    .. code-block:: python
+
+        gathered_input = torch.cat(all_gather(scattered_input), dim=0)
+        out = [gathered_input @ w.t() for w in weight]
+
+    - Passing several weights (eg ``w1`` and ``w2`` of a SwiGLU, or the Q/K/V \
+        projections) reuses the same gathered chunks for all of them.
+    - With ``return_stats=True``, also returns a :attr:`CommOverlapStats` \
+        telling how much of the communication was hidden behind compute.
+
+    :Supported hardware:
+
+    Works with any backend supporting point-to-point ``send``/``recv``, \
+        including ``gloo`` on CPU. This is a forward-only building block.
+    """
+    weights = [weight] if isinstance(weight, torch.Tensor) else list(weight)
+    outputs, stats = FusedAllGatherAndLinearOp.OPERATOR(
+        scattered_input, weights, _box_process_group(process_group)
+    )
+    out = outputs[0] if isinstance(weight, torch.Tensor) else outputs
+    if return_stats:
+        return out, CommOverlapStats.from_tensor(stats)
+    return out
+
+
+def fused_linear_and_reducescatter(
+    gathered_input: torch.Tensor,
+    weight: torch.Tensor,
+    *,
+    process_group: torch.distributed.ProcessGroup,
+    return_stats: bool = False,
+) -> Union[torch.Tensor, Tuple[torch.Tensor, CommOverlapStats]]:
+    """
+    Performs a matmul followed by a reduce-scatter of the result along its
+    first dimension, with the communication pipelined against the GEMMs:
+    the partial product of each destination chunk is computed while the
+    partial sum of the previous one is in flight.
+
+    :Equivalent pytorch code:
+
+    .. code-block:: python
+
+        out = reduce_scatter((gathered_input @ weight.t()).chunk(world_size))
+
+    - With ``return_stats=True``, also returns a :attr:`CommOverlapStats` \
+        telling how much of the communication was hidden behind compute.
+
+    :Supported hardware:
+
+    Works with any backend supporting point-to-point ``send``/``recv``, \
+        including ``gloo`` on CPU. This is a forward-only building block.
+    """
+    out, stats = FusedLinearAndReduceScatterOp.OPERATOR(
+        gathered_input, weight, _box_process_group(process_group)
+    )
+    if return_stats:
+        return out, CommOverlapStats.from_tensor(stats)
+    return out
@@ -5,3 +5,4 @@
 
 from .blocksparse_tensor import BlockSparseTensor  # noqa: F401
 from .csr_tensor import SparseCSRTensor  # noqa: F401
+from .serialization import load_sparse, save_sparse  # noqa: F401
@@ -0,0 +1,179 @@
+# Copyright (c) Facebook, Inc. and its affiliates. All rights reserved.
+#
+# This source code is licensed under the BSD license found in the
+# LICENSE file in the root directory of this source tree.
+
+
+import weakref
+from typing import Dict, List, Tuple
+
+import torch
+
+from xformers.ops.common import BaseOperator, get_xformers_operator, register_operator
+
+
+@register_operator
+class BlockSparseLayoutInfoOp(BaseOperator):
+    OPERATOR = get_xformers_operator("blocksparse_layout_info")
+    OPERATOR_CATEGORY = "sparse"
+    NAME = "blocksparse_layout_info"
+
+
+@register_operator
+class BlockSparseSddmmOp(BaseOperator):
+    OPERATOR = get_xformers_operator("blocksparse_sddmm")
+    OPERATOR_CATEGORY = "sparse"
+    NAME = "blocksparse_sddmm"
+
+
+@register_operator
+class BlockSparseSpmmOp(BaseOperator):
+    OPERATOR = get_xformers_operator("blocksparse_spmm")
+    OPERATOR_CATEGORY = "sparse"
+    NAME = "blocksparse_spmm"
+
+
+@register_operator
+class BlockSparseSoftmaxOp(BaseOperator):
+    OPERATOR = get_xformers_operator("blocksparse_softmax")
+    OPERATOR_CATEGORY = "sparse"
+    NAME = "blocksparse_softmax"
+
+
+@register_operator
+class BlockSparseSoftmaxBwOp(BaseOperator):
+    OPERATOR = get_xformers_operator("blocksparse_softmax_backward")
+    OPERATOR_CATEGORY = "sparse"
+    NAME = "blocksparse_softmax_backward"
+
+
+def _has_cpu_kernels() -> bool:
+    return all(
+        op.is_available()
+        for op in [
+            BlockSparseLayoutInfoOp,
+            BlockSparseSddmmOp,
+            BlockSparseSpmmOp,
+            BlockSparseSoftmaxOp,
+            BlockSparseSoftmaxBwOp,
+        ]
+    )
+
+
+# Block-CSR structure of the layouts seen so far, keyed by their identity:
+# static attention layouts only pay for it once. The entries hold a weak
+# reference to their layout, which drops them.
+_LAYOUT_INFO_CACHE: Dict[int, Tuple[weakref.ref, int, List[torch.Tensor]]] = {}
+
+
+def _drop_layout_info(key: int, ref: weakref.ref) -> None:
+    cached = _LAYOUT_INFO_CACHE.get(key)
+    if cached is not None and cached[0] is ref:
+        del _LAYOUT_INFO_CACHE[key]
+
+
+def _layout_info(layout: torch.Tensor) -> List[torch.Tensor]:
+    cached = _LAYOUT_INFO_CACHE.get(id(layout))
+    # The layout must not have been modified in place since it was cached
+    if (
+        cached is not None
+        and cached[0]() is layout
+        and cached[1] == layout._version
+    ):
+        return cached[2]
+
+    info = BlockSparseLayoutInfoOp.OPERATOR(layout)
+    key = id(layout)
+    _LAYOUT_INFO_CACHE[key] = (
+        weakref.ref(layout, lambda ref: _drop_layout_info(key, ref)),
+        layout._version,
+        info,
+    )
+    return info
+
+
+class _BlockSparseSddmm(torch.autograd.Function):
+    @staticmethod
+    def forward(ctx, a, b, layout):
+        ctx.save_for_backward(a, b, layout)
+        return BlockSparseSddmmOp.OPERATOR(a, b, layout, _layout_info(layout))
+
+    @staticmethod
+    def backward(ctx, grad):
+        a, b, layout = ctx.saved_tensors
+        info = _layout_info(layout)
+        ga = BlockSparseSpmmOp.OPERATOR(grad, layout, info, b, False)
+        gb = BlockSparseSpmmOp.OPERATOR(grad, layout, info, a, True)
+        return ga, gb, None
+
+
+class _BlockSparseSpmm(torch.autograd.Function):
+    @staticmethod
+    def forward(ctx, values, layout, b):
+        ctx.save_for_backward(values, layout, b)
+        return BlockSparseSpmmOp.OPERATOR(
+            values, layout, _layout_info(layout), b, False
+        )
+
+    @staticmethod
+    def backward(ctx, grad):
+        values, layout, b = ctx.saved_tensors
+        info = _layout_info(layout)
+        gv = BlockSparseSddmmOp.OPERATOR(grad, b, layout, info)
+        gb = BlockSparseSpmmOp.OPERATOR(values, layout, info, grad, True)
+        return gv, None, gb
+
+
+class _BlockSparseSoftmax(torch.autograd.Function):
+    @staticmethod
+    def forward(ctx, values, layout, scale, causal):
+        out = BlockSparseSoftmaxOp.OPERATOR(
+            values, layout, _layout_info(layout), scale, causal
+        )
+        # note: save out and not values, as an optimization step
+        ctx.save_for_backward(out, layout)
+        ctx.scale = scale
+        return out
+
+    @staticmethod
+    def backward(ctx, grad):
+        out, layout = ctx.saved_tensors
+        ga = BlockSparseSoftmaxBwOp.OPERATOR(
+            out, grad, layout, _layout_info(layout), ctx.scale
+        )
+        return ga, None, None, None
+
+
+def blocksparse_sddmm(
+    a: torch.Tensor, b: torch.Tensor, layout: torch.Tensor
+) -> torch.Tensor:
+    """
+    Computes the blocks of ``a @ b.transpose(-2, -1)`` present in ``layout``,
+    with ``a`` ``[B, H, M, K]`` and ``b`` ``[B, H, N, K]``.
+    Returns the values ``[B, nnz, block_size, block_size]``, in the order of
+    ``layout.nonzero()``
+    """
+    return _BlockSparseSddmm.apply(a, b, layout)
+
+
+def blocksparse_spmm(
+    values: torch.Tensor, layout: torch.Tensor, b: torch.Tensor
+) -> torch.Tensor:
+    """
+    Multiplies the block-sparse matrix ``(values, layout)`` by the dense
+    ``b`` ``[B, H, N, D]``
+    """
+    return _BlockSparseSpmm.apply(values, layout, b)
+
+
+def blocksparse_softmax(
+    values: torch.Tensor,
+    layout: torch.Tensor,
+    scale: float = 1.0,
+    causal: bool = False,
+) -> torch.Tensor:
+    """
+    Softmax over the rows of the block-sparse matrix ``(values * scale, layout)``.
+    With ``causal``, the elements above the diagonal get a zero probability.
+    """
+    return _BlockSparseSoftmax.apply(values, layout, scale, causal)
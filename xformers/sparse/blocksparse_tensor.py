@@ -9,6 +9,7 @@ import torch
 
 from xformers import _is_triton_available
 from xformers.ops import masked_matmul
+from xformers.sparse import _blocksparse_ops
 
 logger = logging.getLogger("xformers")
 
@@ -37,6 +38,10 @@ def _can_use_triton(a):
     return True
 
 
+def _can_use_cpu_kernels(a):
+    return a.device.type == "cpu" and _blocksparse_ops._has_cpu_kernels()
+
+
 def _spmm(b, layout, values):
     N, nnz, _, block_size = values.shape
     br = b.reshape(
@@ -161,6 +166,10 @@ class BlockSparseTensor(torch.Tensor):
     def values(self):
         return self.__values
 
+    @property
+    def _blocksparse_layout(self):
+        return self.__layout
+
     @classmethod
     def _raw_wrap(cls, values, layout, sparse_dot_sdd, sparse_dot_dsd, sparse_softmax):
         matrix = cls.__new__(cls, values, layout)
@@ -187,6 +196,10 @@ class BlockSparseTensor(torch.Tensor):
             return NotImplemented
         if _can_use_triton(arg1):
             res = arg0.__sparse_dot_dsd(arg0.__values, arg1)
+        elif _can_use_cpu_kernels(arg1):
+            res = _blocksparse_ops.blocksparse_spmm(
+                arg0.__values, arg0.__layout, arg1
+            )
         else:
             res = _spmm(arg1, arg0.__layout, arg0.__values)
         return res
@@ -199,6 +212,8 @@ class BlockSparseTensor(torch.Tensor):
         assert b.is_contiguous()
         if _can_use_triton(a):
             res = mask.__sparse_dot_sdd(a, b)
+        elif _can_use_cpu_kernels(a):
+            res = _blocksparse_ops.blocksparse_sddmm(a, b, mask.__layout)
         else:
             res = _sddmm(a, b, mask.__layout)
         return cls._wrap(res, mask)
@@ -209,6 +224,8 @@ class BlockSparseTensor(torch.Tensor):
             return NotImplemented
         if _can_use_triton(arg0):
             res = arg0.__sparse_softmax(arg0.__values)
+        elif _can_use_cpu_kernels(arg0):
+            res = _blocksparse_ops.blocksparse_softmax(arg0.__values, arg0.__layout)
         else:
             res = _softmax(arg0.__layout, arg0.__values)
         return cls._wrap(res, arg0)
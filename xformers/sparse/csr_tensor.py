@@ -9,9 +9,14 @@ import torch
 from xformers.ops import masked_matmul
 from xformers.sparse import _csr_ops
 from xformers.sparse.utils import (
+    CSR_MERGE_INTERSECTION,
+    CSR_MERGE_LEFT,
+    CSR_MERGE_UNION,
+    _csr_merge,
     _csr_to_coo,
     _dense3d_to_sparse,
     _diffsort,
+    _gather_values,
     _get_transpose_info,
     _transpose_with_info,
 )
@@ -259,32 +264,94 @@ class SparseCSRTensor(torch.Tensor):
         matrix[b_idxs, row_coo, column_indices] = arg0.__values
         return matrix
 
+    def _same_structure(self, other):
+        return (
+            self.__row_offsets is other.__row_offsets
+            and self.__column_indices is other.__column_indices
+        )
+
+    def _merge_structure(self, other, mode):
+        _, m, n = self.shape
+        return _csr_merge(
+            m,
+            n,
+            self.__row_offsets,
+            self.__column_indices,
+            other.__row_offsets,
+            other.__column_indices,
+            mode,
+        )
+
+    def _sample_dense(self, matrix):
+        # Values of the dense `matrix` at the nonzeros of `self`
+        _, m, n = self.shape
+        row_coo, _ = _csr_to_coo(m, n, self.__row_offsets, self.__column_indices)
+        matrix = matrix.expand(self.shape)
+        return matrix[:, row_coo.long(), self.__column_indices.long()]
+
+    def _drop_zeros(self):
+        """
+        The same matrix without its explicit zeros (eg False values), which
+        are dropped from the pattern as by :meth:`from_dense`
+        """
+        keep = self.__values != 0
+        if not torch.all(keep == keep[0]):
+            raise ValueError(
+                "Expected the same sparsity pattern over the batch dimension"
+            )
+        index = keep[0].nonzero().squeeze(1)
+        if index.numel() == self.__column_indices.numel():
+            return self
+        _, m, n = self.shape
+        row_coo, _ = _csr_to_coo(m, n, self.__row_offsets, self.__column_indices)
+        row_offsets = self.__row_offsets.new_zeros(m + 1)
+        row_sizes = torch.bincount(row_coo[index].long(), minlength=m)
+        row_offsets[1:] = torch.cumsum(row_sizes, 0)
+        return type(self)(
+            row_offsets,
+            self.__column_indices[index],
+            self.__values[:, index],
+            self.shape,
+        )
+
     @classmethod
-    def _binary_op(cls, func, arg0, arg1):
+    def _binary_op(cls, func, arg0, arg1, mode=CSR_MERGE_UNION):
+        """
+        ``func`` applied to the values of the operands. When their sparsity
+        patterns differ, the result has the union of the patterns (eg for add)
+        or their intersection (eg for mul), depending on ``mode``.
+        A dense operand is only read at the nonzeros of the sparse one, which
+        is valid when ``func(0, x) == 0`` (eg for mul).
+        """
         if not (
-            isinstance(arg0, (cls, int, float)) and isinstance(arg1, (cls, int, float))
+            isinstance(arg0, (cls, int, float, torch.Tensor))
+            and isinstance(arg1, (cls, int, float, torch.Tensor))
         ):
             return NotImplemented
-        v0, v1 = arg0, arg1
-        if isinstance(arg0, cls):
-            v0 = arg0.__values
+        if not isinstance(arg0, cls):
+            return cls._binary_op(lambda x, y: func(y, x), arg1, arg0, mode)
+
         if isinstance(arg1, cls):
+            assert arg0.shape == arg1.shape
+            if not arg0._same_structure(arg1):
+                (
+                    row_offsets,
+                    column_indices,
+                    index_a,
+                    index_b,
+                ) = arg0._merge_structure(arg1, mode)
+                out = func(
+                    _gather_values(arg0.__values, index_a),
+                    _gather_values(arg1.__values, index_b),
+                )
+                return cls(row_offsets, column_indices, out, arg0.shape)
             v1 = arg1.__values
-        # assert arg0.shape == arg1.shape
-        if isinstance(arg0, cls) and isinstance(arg1, cls):
-            msg = f"arg0 and arg1 need to have the same sparsity pattern in {func} (for now)"
-            if not arg0.__row_offsets.shape == arg1.__row_offsets.shape:
-                raise NotImplementedError(msg)
-            if not arg0.__column_indices.shape == arg1.__column_indices.shape:
-                raise NotImplementedError(msg)
-            if not arg0.__values.shape == arg1.__values.shape:
-                raise NotImplementedError(msg)
-            # TODO this is not always true, but is a fast approximation for now
-            if arg0.__row_offsets is not arg1.__row_offsets:
-                raise NotImplementedError(msg)
-            if arg0.__column_indices is not arg1.__column_indices:
-                raise NotImplementedError(msg)
-        out = func(v0, v1)
+        elif isinstance(arg1, torch.Tensor) and arg1.ndim > 0:
+            assert mode == CSR_MERGE_INTERSECTION, f"{func} densifies {cls}"
+            v1 = arg0._sample_dense(arg1)
+        else:
+            v1 = arg1
+        out = func(arg0.__values, v1)
         return cls._wrap(
             arg0.shape,
             out,
@@ -295,15 +362,36 @@ class SparseCSRTensor(torch.Tensor):
         )
 
     @classmethod
-    def _binary_op_slow(cls, func, arg0, arg1):
-        # assert arg0.shape == arg1.shape
-        v0, v1 = arg0, arg1
-        if isinstance(arg0, cls):
-            v0 = arg0.to_dense()
-        if isinstance(arg1, cls):
-            v1 = arg1.to_dense()
-        out = func(v0, v1)
-        return cls.from_dense(out)
+    def _where(cls, condition, arg0, arg1):
+        """
+        Elementwise ``torch.where``, on the union of the patterns of ``arg0``
+        and ``arg1``. Positions missing from ``condition`` are False.
+        """
+        if not all(isinstance(x, cls) for x in (condition, arg0, arg1)):
+            return NotImplemented
+        assert condition.shape == arg0.shape == arg1.shape
+        if arg0._same_structure(arg1):
+            out = arg0
+            v0, v1 = arg0.__values, arg1.__values
+        else:
+            row_offsets, column_indices, index_a, index_b = arg0._merge_structure(
+                arg1, CSR_MERGE_UNION
+            )
+            v0 = _gather_values(arg0.__values, index_a)
+            v1 = _gather_values(arg1.__values, index_b)
+            out = cls(row_offsets, column_indices, v0, arg0.shape)
+        cond = condition.__values
+        if not out._same_structure(condition):
+            *_, index_cond = out._merge_structure(condition, CSR_MERGE_LEFT)
+            cond = _gather_values(cond, index_cond)
+        return cls._wrap(
+            out.shape,
+            torch.where(cond, v0, v1),
+            out.__row_indices,
+            out.__row_offsets,
+            out.__column_indices,
+            out.__transp_info,
+        )
 
     @classmethod
     def __torch_function__(cls, func, types, args=(), kwargs=None):
@@ -340,7 +428,19 @@ class SparseCSRTensor(torch.Tensor):
                 raise NotImplementedError(
                     f"{func} with {type(args[0])} and {type(args[1])} not implemented"
                 )
-            return cls._binary_op(func, args[0], args[1])
+            return cls._binary_op(func, args[0], args[1], CSR_MERGE_UNION)
+
+        if func in [
+            torch.Tensor.sub,
+            torch.sub,
+            torch.Tensor.__sub__,
+        ]:
+            assert len(args) == 2
+            if not (isinstance(args[0], cls) and isinstance(args[1], cls)):
+                raise NotImplementedError(
+                    f"{func} with {type(args[0])} and {type(args[1])} not implemented"
+                )
+            return cls._binary_op(func, args[0], args[1], CSR_MERGE_UNION)
 
         if func in [
             torch.Tensor.mul,
@@ -348,11 +448,21 @@ class SparseCSRTensor(torch.Tensor):
             torch.Tensor.__mul__,
         ]:
             assert len(args) == 2
-            return cls._binary_op(func, args[0], args[1])
+            return cls._binary_op(func, args[0], args[1], CSR_MERGE_INTERSECTION)
 
         if func in [torch.Tensor.logical_and, torch.logical_and, torch.Tensor.__and__]:
             assert len(args) == 2
-            return cls._binary_op_slow(func, args[0], args[1])
+            out = cls._binary_op(func, args[0], args[1], CSR_MERGE_INTERSECTION)
+            # A dense operand is sampled at the nonzeros, the positions where it
+            # is False must leave the pattern (eg for a key padding mask)
+            return out if out is NotImplemented else out._drop_zeros()
+
+        if func in [torch.Tensor.where, torch.where]:
+            assert len(args) == 3 and len(kwargs) == 0
+            if func is torch.Tensor.where:
+                # `x.where(condition, y)`
+                return cls._where(args[1], args[0], args[2])
+            return cls._where(args[0], args[1], args[2])
 
         if func in [torch.nn.functional.dropout, torch.dropout, torch.dropout_]:
             x = args[0]
@@ -0,0 +1,177 @@
+# Copyright (c) Facebook, Inc. and its affiliates. All rights reserved.
+#
+# This source code is licensed under the BSD license found in the
+# LICENSE file in the root directory of this source tree.
+
+"""
+On-disk format for the sparse matrices of `xformers.sparse`, typically large
+static attention masks.
+
+Along with the values, the file stores everything which is otherwise
+computed when building the matrix (for :class:`SparseCSRTensor`, the row
+ordering and the transpose info), so that loading it does no work at all.
+With ``mmap=True`` the tensors are views of a copy-on-write memory mapping
+of the file: processes loading the same file share its pages.
+
+Layout of a file, all integers being little-endian:
+
+- ``b"XFSPARSE"``
+- the size of the header, as a uint64
+- the header, a utf-8 JSON dictionary with the kind of matrix, its shape,
+  and the dtype / shape / offset in the file of each of its tensors
+- the data of each tensor, contiguous, at an offset aligned to 64 bytes
+"""
+
+import json
+import os
+import struct
+import sys
+from typing import Dict, Optional, Tuple, Union
+
+import numpy as np
+import torch
+
+from .blocksparse_tensor import BlockSparseTensor
+from .csr_tensor import SparseCSRTensor
+
+_MAGIC = b"XFSPARSE"
+_VERSION = 1
+_ALIGNMENT = 64
+
+_CSR_TENSORS = (
+    "values",
+    "row_indices",
+    "row_offsets",
+    "column_indices",
+    "row_indices_t",
+    "row_offsets_t",
+    "column_indices_t",
+    "perm",
+)
+
+
+def _align(offset: int) -> int:
+    return (offset + _ALIGNMENT - 1) // _ALIGNMENT * _ALIGNMENT
+
+
+def _dtype_name(dtype: torch.dtype) -> str:
+    return str(dtype).split(".")[-1]
+
+
+def save_sparse(
+    path: Union[str, os.PathLike], matrix: Union[SparseCSRTensor, BlockSparseTensor]
+) -> None:
+    """
+    Saves a :class:`SparseCSRTensor` or a :class:`BlockSparseTensor` in a
+    format which :func:`load_sparse` can memory-map
+    """
+    assert sys.byteorder == "little", "Only little-endian hosts are supported"
+    tensors: Dict[str, torch.Tensor]
+    if isinstance(matrix, SparseCSRTensor):
+        kind = "csr"
+        tensors = dict(
+            zip(
+                _CSR_TENSORS,
+                (
+                    matrix.values(),
+                    matrix._csr_row_indices,
+                    matrix._csr_row_offsets,
+                    matrix._csr_column_indices,
+                    *matrix._csr_transp_info,
+                ),
+            )
+        )
+    elif isinstance(matrix, BlockSparseTensor):
+        kind = "blocksparse"
+        tensors = {"values": matrix.values(), "layout": matrix._blocksparse_layout}
+    else:
+        raise ValueError(f"Can't serialize a {type(matrix)}")
+
+    shapes = {name: list(t.shape) for name, t in tensors.items()}
+    tensors = {
+        name: t.detach().cpu().contiguous().reshape(-1)
+        for name, t in tensors.items()
+    }
+
+    # Offsets are relative to the start of the data, right after the header
+    meta = {}
+    offset = 0
+    for name, t in tensors.items():
+        meta[name] = {
+            "dtype": _dtype_name(t.dtype),
+            "shape": shapes[name],
+            "offset": offset,
+        }
+        offset = _align(offset + t.numel() * t.element_size())
+    header = json.dumps(
+        {
+            "version": _VERSION,
+            "kind": kind,
+            "shape": list(matrix.shape),
+            "tensors": meta,
+        }
+    ).encode("utf-8")
+    data_start = _align(len(_MAGIC) + 8 + len(header))
+
+    with open(path, "wb") as f:
+        f.write(_MAGIC)
+        f.write(struct.pack("<Q", len(header)))
+        f.write(header)
+        for name, t in tensors.items():
+            f.write(b"\0" * (data_start + meta[name]["offset"] - f.tell()))
+            f.write(t.view(torch.uint8).numpy().tobytes())
+
+
+def _read_header(f) -> Tuple[dict, int]:
+    if f.read(len(_MAGIC)) != _MAGIC:
+        raise ValueError("Not a serialized xformers sparse matrix")
+    (header_size,) = struct.unpack("<Q", f.read(8))
+    header = json.loads(f.read(header_size).decode("utf-8"))
+    if header["version"] > _VERSION:
+        raise ValueError(f"Unsupported sparse matrix version {header['version']}")
+    return header, _align(len(_MAGIC) + 8 + header_size)
+
+
+def load_sparse(
+    path: Union[str, os.PathLike],
+    device: Optional[Union[str, torch.device]] = None,
+    mmap: bool = True,
+) -> Union[SparseCSRTensor, BlockSparseTensor]:
+    """
+    Loads a matrix saved with :func:`save_sparse`. On CPU and with ``mmap``,
+    the tensors of the matrix are zero-copy views of the file.
+    """
+    assert sys.byteorder == "little", "Only little-endian hosts are supported"
+    with open(path, "rb") as f:
+        header, data_start = _read_header(f)
+        if not mmap:
+            f.seek(0)
+            data = np.frombuffer(bytearray(f.read()), dtype=np.uint8)
+    if mmap:
+        # Copy-on-write: the pages are shared until a tensor is modified
+        data = np.memmap(path, dtype=np.uint8, mode="c")
+    buffer = torch.from_numpy(data)
+
+    tensors = {}
+    for name, meta in header["tensors"].items():
+        dtype = getattr(torch, meta["dtype"])
+        numel = int(np.prod(meta["shape"]))
+        nbytes = numel * torch.empty([], dtype=dtype).element_size()
+        start = data_start + meta["offset"]
+        t = buffer[start : start + nbytes].view(dtype).view(meta["shape"])
+        if device is not None:
+            t = t.to(device)
+        tensors[name] = t
+
+    if header["kind"] == "csr":
+        return SparseCSRTensor._wrap(
+            torch.Size(header["shape"]),
+            tensors["values"],
+            tensors["row_indices"],
+            tensors["row_offsets"],
+            tensors["column_indices"],
+            tuple(tensors[name] for name in _CSR_TENSORS[4:]),
+        )
+    if header["kind"] == "blocksparse":
+        return BlockSparseTensor(tensors["values"], tensors["layout"])
+    raise ValueError(f"Unknown sparse matrix kind {header['kind']}")
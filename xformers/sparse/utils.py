@@ -4,18 +4,71 @@
 # LICENSE file in the root directory of this source tree.
 
 
+import weakref
+from typing import Dict, Tuple
+
 import torch
 
+from xformers.ops.common import BaseOperator, get_xformers_operator, register_operator
+
+
+@register_operator
+class CSRTransposeInfoOp(BaseOperator):
+    OPERATOR = get_xformers_operator("csr_transpose_info")
+    OPERATOR_CATEGORY = "sparse"
+    NAME = "csr_transpose_info"
+
+
+@register_operator
+class CSRRowsByLengthOp(BaseOperator):
+    OPERATOR = get_xformers_operator("csr_rows_by_length")
+    OPERATOR_CATEGORY = "sparse"
+    NAME = "csr_rows_by_length"
+
+
+@register_operator
+class CSRToCOORowsOp(BaseOperator):
+    OPERATOR = get_xformers_operator("csr_to_coo_rows")
+    OPERATOR_CATEGORY = "sparse"
+    NAME = "csr_to_coo_rows"
+
+
+@register_operator
+class COORowsToCSROp(BaseOperator):
+    OPERATOR = get_xformers_operator("coo_rows_to_csr")
+    OPERATOR_CATEGORY = "sparse"
+    NAME = "coo_rows_to_csr"
+
+
+@register_operator
+class CSRMergeOp(BaseOperator):
+    OPERATOR = get_xformers_operator("csr_merge")
+    OPERATOR_CATEGORY = "sparse"
+    NAME = "csr_merge"
+
+
+def _use_cpu_kernel(op, *indices) -> bool:
+    return (
+        op.is_available()
+        and all(t.device.type == "cpu" for t in indices)
+        and all(t.dtype in (torch.int32, torch.int64) for t in indices)
+        and all(t.ndim == 1 and t.is_contiguous() for t in indices)
+    )
+
 
 def _coo_to_csr(m, n, row_indices, column_indices):
     # assumes coalesced coo
-    row_offsets = row_indices.bincount(minlength=n).cumsum(0, dtype=row_indices.dtype)
+    if _use_cpu_kernel(COORowsToCSROp, row_indices):
+        return COORowsToCSROp.OPERATOR(row_indices, m), column_indices
+    row_offsets = row_indices.bincount(minlength=m).cumsum(0, dtype=row_indices.dtype)
     row_offsets = torch.nn.functional.pad(row_offsets, (1, 0))
     return row_offsets, column_indices
 
 
 def _csr_to_coo(m, n, row_offsets, column_indices):
     # convert from compressed rows to uncompressed
+    if _use_cpu_kernel(CSRToCOORowsOp, row_offsets):
+        return CSRToCOORowsOp.OPERATOR(row_offsets), column_indices
     indices = torch.arange(m, dtype=row_offsets.dtype, device=row_offsets.device)
     row_sizes = torch.diff(row_offsets)
     row_coo = torch.repeat_interleave(indices, row_sizes.long())
@@ -23,10 +76,60 @@ def _csr_to_coo(m, n, row_offsets, column_indices):
 
 
 def _diffsort(a):
+    if _use_cpu_kernel(CSRRowsByLengthOp, a):
+        return CSRRowsByLengthOp.OPERATOR(a)
     return torch.argsort(torch.diff(a), dim=0, descending=True)
 
 
+# Transpose info of the structures seen so far, keyed by the identity of
+# their `column_indices`: static attention masks only pay for it once.
+# Tensors compare elementwise, so they can't be the keys of a (weak) dict:
+# the entries hold a weak reference to their key instead, which drops them.
+_TRANSPOSE_INFO_CACHE: Dict[int, Tuple[weakref.ref, weakref.ref, Tuple, Tuple]] = {}
+
+
+def _drop_transpose_info(key: int, ref: weakref.ref) -> None:
+    cached = _TRANSPOSE_INFO_CACHE.get(key)
+    if cached is not None and cached[0] is ref:
+        del _TRANSPOSE_INFO_CACHE[key]
+
+
 def _get_transpose_info(m, n, row_indices, row_offsets, column_indices):
+    # The structure must not have been modified in place since it was cached
+    key = (m, n, row_offsets._version, column_indices._version)
+    cached = _TRANSPOSE_INFO_CACHE.get(id(column_indices))
+    if cached is not None:
+        cached_column_indices, cached_row_offsets, cached_key, transpose_info = cached
+        if (
+            cached_column_indices() is column_indices
+            and cached_row_offsets() is row_offsets
+            and cached_key == key
+        ):
+            return transpose_info
+
+    transpose_info = _compute_transpose_info(
+        m, n, row_indices, row_offsets, column_indices
+    )
+    cache_key = id(column_indices)
+    column_indices_ref = weakref.ref(
+        column_indices, lambda ref: _drop_transpose_info(cache_key, ref)
+    )
+    _TRANSPOSE_INFO_CACHE[cache_key] = (
+        column_indices_ref,
+        weakref.ref(row_offsets),
+        key,
+        transpose_info,
+    )
+    return transpose_info
+
+
+def _compute_transpose_info(m, n, row_indices, row_offsets, column_indices):
+    if (
+        _use_cpu_kernel(CSRTransposeInfoOp, row_offsets, column_indices)
+        and row_offsets.dtype == column_indices.dtype
+    ):
+        return CSRTransposeInfoOp.OPERATOR(m, n, row_offsets, column_indices)
+
     # strategy:
     # - uncompress the rows to have data in COO format
     # - get permutation for stable sort of the columns to get the rows for the transposed matrix
@@ -39,7 +142,7 @@ def _get_transpose_info(m, n, row_indices, row_offsets, column_indices):
     row_offsets_t, perm = column_indices.sort(dim=0, stable=True)
     column_indices_t = row_coo[perm]
 
-    row_offsets_t, _ = _coo_to_csr(m, n, row_offsets_t, column_indices)
+    row_offsets_t, _ = _coo_to_csr(n, m, row_offsets_t, column_indices)
     row_indices_t = _diffsort(row_offsets_t).int()
 
     return row_indices_t, row_offsets_t, column_indices_t, perm
@@ -58,6 +161,60 @@ def _transpose(m, n, row_indices, values, row_offsets, column_indices):
     return _transpose_with_info(values, _transpose_info)
 
 
+# Structure of the result of `_csr_merge`
+CSR_MERGE_UNION = 0
+CSR_MERGE_INTERSECTION = 1
+CSR_MERGE_LEFT = 2
+
+
+def _csr_merge(
+    m, n, row_offsets_a, column_indices_a, row_offsets_b, column_indices_b, mode
+):
+    """
+    Structure of an elementwise op between two CSR matrices with different
+    sparsity patterns: the union, intersection or the pattern of ``a``
+    (``mode``), and for each of its nonzeros the index of the value in ``a``
+    and in ``b``, -1 for an implicit zero.
+    """
+    indices = (row_offsets_a, column_indices_a, row_offsets_b, column_indices_b)
+    if _use_cpu_kernel(CSRMergeOp, *indices) and all(
+        t.dtype == row_offsets_a.dtype for t in indices
+    ):
+        return CSRMergeOp.OPERATOR(*indices, mode)
+
+    # The nonzeros are sorted by (row, column)
+    def _keys(row_offsets, column_indices):
+        row_coo, _ = _csr_to_coo(m, n, row_offsets, column_indices)
+        return row_coo.long() * n + column_indices.long()
+
+    def _find(keys, queries):
+        if keys.shape[0] == 0:
+            return torch.full_like(queries, -1)
+        pos = torch.searchsorted(keys, queries).clamp_(max=keys.shape[0] - 1)
+        return torch.where(keys[pos] == queries, pos, -1)
+
+    keys_a = _keys(row_offsets_a, column_indices_a)
+    keys_b = _keys(row_offsets_b, column_indices_b)
+    if mode == CSR_MERGE_UNION:
+        keys = torch.cat([keys_a, keys_b]).unique()
+    elif mode == CSR_MERGE_INTERSECTION:
+        keys = keys_a[torch.isin(keys_a, keys_b)]
+    else:
+        keys = keys_a
+    index_dtype = row_offsets_a.dtype
+    row_offsets, _ = _coo_to_csr(m, n, (keys // n).to(index_dtype), None)
+    column_indices = (keys % n).to(index_dtype)
+    return row_offsets, column_indices, _find(keys_a, keys), _find(keys_b, keys)
+
+
+def _gather_values(values, index):
+    """
+    ``values[:, index]``, with zeros where ``index`` is -1
+    """
+    values = torch.cat([values, values.new_zeros([values.shape[0], 1])], dim=1)
+    return values[:, index]
+
+
 def _nonzero_mask_to_sparse_csr_indices(mask, device):
     """Converts dense 2d matrix to a csr sparse matrix."""
 
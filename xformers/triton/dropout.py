@@ -14,6 +14,7 @@ import triton
 from torch.cuda.amp import custom_bwd, custom_fwd
 
 from xformers.components.activations import Activation, build_activation
+from xformers.ops.common import BaseOperator, get_xformers_operator, register_operator
 from xformers.triton.k_activations import get_triton_activation_index
 from xformers.triton.k_dropout import k_dropout_bw, k_dropout_fw
 
@@ -21,6 +22,68 @@ BLOCK_M = 32
 BLOCK_N = 64  # NOTE: This should ideally be GPU dependent, big impact on perf
 
 
+@register_operator
+class DropoutBiasActOp(BaseOperator):
+    OPERATOR = get_xformers_operator("dropout_bias_act")
+    OPERATOR_CATEGORY = "dropout"
+    NAME = "dropout_bias_act"
+
+
+@register_operator
+class DropoutBiasActBwOp(BaseOperator):
+    OPERATOR = get_xformers_operator("dropout_bias_act_backward")
+    OPERATOR_CATEGORY = "dropout"
+    NAME = "dropout_bias_act_backward"
+
+
+def _use_cpu_kernel(x: torch.Tensor) -> bool:
+    return (
+        x.device.type == "cpu"
+        and DropoutBiasActOp.is_available()
+        and DropoutBiasActBwOp.is_available()
+    )
+
+
+# CPU counterpart of `_dropout`, the mask is regenerated from the seed in the backward
+class _dropout_cpu(torch.autograd.Function):
+    @staticmethod
+    # type: ignore
+    def forward(ctx, x, p, bias, activation, trainable_bias):
+        assert bias is None or (bias.dtype == x.dtype and bias.shape[0] == x.shape[-1])
+        assert p > 0.0
+
+        seed = int(torch.randint(2**62, (1,)).item())
+        y = DropoutBiasActOp.OPERATOR(x, bias, p, activation, seed)
+
+        ctx.save_for_backward(x if activation != 0 else None, bias)
+        ctx.trainable_bias = bias is not None and trainable_bias
+        ctx.activation = activation
+        ctx.seed = seed
+        ctx.p = p
+        return y
+
+    @staticmethod
+    # type: ignore
+    def backward(ctx, grad_out):
+        (inputs, bias) = ctx.saved_tensors
+        grad_in, grad_bias = DropoutBiasActBwOp.OPERATOR(
+            grad_out,
+            inputs,
+            bias,
+            ctx.p,
+            ctx.activation,
+            ctx.seed,
+            ctx.trainable_bias,
+        )
+        return (
+            grad_in,
+            None,
+            grad_bias if ctx.trainable_bias else None,
+            None,
+            None,
+        )
+
+
 # Helper to handle the SPMD launch grid and error cases
 class _dropout(torch.autograd.Function):
     @staticmethod
@@ -176,8 +239,17 @@ def dropout(
             return activation_fn(x)
         return x
 
-    # The normal triton enabled codepath
     activation_index = get_triton_activation_index(activation)
+    if _use_cpu_kernel(x):
+        return _dropout_cpu.apply(
+            x,
+            float(p),
+            bias,
+            activation_index,
+            bias is not None and bias.requires_grad,
+        )
+
+    # The normal triton enabled codepath
     return _dropout.apply(
         x,
         float(p),
@@ -190,7 +262,7 @@ def dropout(
 class FusedDropoutBias(torch.nn.Module):
     """
     A layer which fuses the computation of Dropout(Activation(x))
-    in a single GPU kernel
+    in a single GPU kernel, or a single pass over the inputs on CPU
     """
 
     def __init__(
@@ -230,6 +302,10 @@ class FusedDropoutBias(torch.nn.Module):
         # Train/inference
         p = self.p if self.training else 0.0
 
+        # The CPU kernel saves the intermediate buffers and the mask of the eager path
+        if p > 0.0 and _use_cpu_kernel(x):
+            return _dropout_cpu.apply(x, p, self.bias, self.activation, True)
+
         # This kernel is slower than pytorch for small buffers, bypassing it in that case
         perf_check = x.shape[-1] > 512
 
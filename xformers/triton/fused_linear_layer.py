@@ -11,11 +11,76 @@ import torch.nn as nn
 from torch.cuda.amp import custom_bwd, custom_fwd
 
 from xformers.components.activations import Activation
+from xformers.ops.common import BaseOperator, get_xformers_operator, register_operator
 from xformers.triton.k_activations import get_triton_activation_index
 from xformers.triton.k_fused_matmul_bw import fused_matmul_backward
 from xformers.triton.k_fused_matmul_fw import fused_matmul
 
 
+@register_operator
+class FusedLinearActOp(BaseOperator):
+    OPERATOR = get_xformers_operator("fused_linear_act")
+    OPERATOR_CATEGORY = "fused_linear"
+    NAME = "fused_linear_act"
+
+
+@register_operator
+class FusedLinearActBwOp(BaseOperator):
+    OPERATOR = get_xformers_operator("fused_linear_act_backward")
+    OPERATOR_CATEGORY = "fused_linear"
+    NAME = "fused_linear_act_backward"
+
+
+def _use_cpu_kernel(x: torch.Tensor) -> bool:
+    return (
+        x.device.type == "cpu"
+        and FusedLinearActOp.is_available()
+        and FusedLinearActBwOp.is_available()
+    )
+
+
+class _fused_linear_cpu(torch.autograd.Function):
+    @staticmethod
+    # type: ignore
+    def forward(ctx, x, weight, bias, activation, trainable_weight, trainable_bias):
+        # The activation inputs are only needed for its gradient
+        needs_grad = any(ctx.needs_input_grad[:3])
+        y, activation_inputs = FusedLinearActOp.OPERATOR(
+            x, weight, bias, activation, needs_grad and activation > 0
+        )
+
+        ctx.activation = activation
+        ctx.trainable_weight = trainable_weight
+        ctx.trainable_bias = bias is not None and trainable_bias
+        if needs_grad:
+            ctx.save_for_backward(
+                weight, activation_inputs if activation > 0 else None, x
+            )
+        return y
+
+    @staticmethod
+    # type: ignore
+    def backward(ctx, grad_out):
+        (weight, activation_inputs, x) = ctx.saved_tensors
+        grad_input, grad_weight, grad_bias = FusedLinearActBwOp.OPERATOR(
+            grad_out,
+            x,
+            weight,
+            activation_inputs,
+            ctx.activation,
+            ctx.trainable_weight,
+            ctx.trainable_bias,
+        )
+        return (
+            grad_input,
+            grad_weight if ctx.trainable_weight else None,
+            grad_bias if ctx.trainable_bias else None,
+            None,
+            None,
+            None,
+        )
+
+
 class _fused_linear_triton(torch.autograd.Function):
     @staticmethod
     @custom_fwd(cast_inputs=torch.float16)
@@ -72,6 +137,7 @@ class FusedLinear(nn.Module):
     """
     Handle a linear transform, like torch.nn.Linear_, and a given activation, in a single kernel.
     The whole transform: is :math:`y = activation(xA^T + b)`.
+    On CPU, the bias and activation are applied to each tile of the matrix multiply as it is computed.
 
     This is typically significantly faster than PyTorch while using fp16 and non-sigmoid activations,
     as of September 2021.
@@ -108,6 +174,16 @@ class FusedLinear(nn.Module):
             torch.nn.init.uniform_(self.bias, -bound, bound)
 
     def forward(self, x):
+        if _use_cpu_kernel(x) and x.dtype == self.weight.dtype:
+            return _fused_linear_cpu.apply(
+                x,
+                self.weight,
+                self.bias,
+                self._activation_index,
+                self.weight.requires_grad,
+                self.bias.requires_grad if self.bias is not None else False,
+            )
+
         return _fused_linear_triton.apply(
             x,
             self.weight,
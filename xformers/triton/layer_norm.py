@@ -14,6 +14,7 @@ import torch.nn as nn
 import triton
 from torch.cuda.amp import custom_bwd, custom_fwd
 
+from xformers.ops.common import BaseOperator, get_xformers_operator, register_operator
 from xformers.triton.k_layer_norm import (
     layer_norm_bwd_dwdb,
     layer_norm_bwd_dx_fused,
@@ -27,6 +28,48 @@ _triton_layernorm_fp16_enabled = False  # NOTE: PyTorch keeps layernorm as fp32
 _triton_registered_warnings = False
 
 
+@register_operator
+class LayerNormFwOp(BaseOperator):
+    OPERATOR = get_xformers_operator("layer_norm_forward")
+    OPERATOR_CATEGORY = "layer_norm"
+    NAME = "layer_norm_forward"
+
+
+@register_operator
+class LayerNormBwOp(BaseOperator):
+    OPERATOR = get_xformers_operator("layer_norm_backward")
+    OPERATOR_CATEGORY = "layer_norm"
+    NAME = "layer_norm_backward"
+
+
+def _use_cpu_kernel(x: torch.Tensor, *params: Optional[torch.Tensor]) -> bool:
+    return (
+        x.device.type == "cpu"
+        and all(p is None or p.dtype == x.dtype for p in params)
+        and LayerNormFwOp.is_available()
+        and LayerNormBwOp.is_available()
+    )
+
+
+class _LayerNormCPU(torch.autograd.Function):
+    @staticmethod
+    # type: ignore
+    def forward(ctx, x, weight, bias, eps):
+        y, mean, rstd = LayerNormFwOp.OPERATOR(x, weight, bias, eps)
+        ctx.save_for_backward(x, mean, rstd, weight)
+        return y
+
+    @staticmethod
+    # type: ignore
+    def backward(ctx, dy):
+        x, mean, rstd, weight = ctx.saved_tensors
+        _, dw_needed, db_needed, _ = ctx.needs_input_grad
+        dx, dw, db = LayerNormBwOp.OPERATOR(
+            dy, x, weight, mean, rstd, dw_needed or db_needed
+        )
+        return dx, dw if dw_needed else None, db if db_needed else None, None
+
+
 class _LayerNorm(torch.autograd.Function):
     @staticmethod
     @custom_fwd(cast_inputs=torch.float16 if _triton_layernorm_fp16_enabled else None)
@@ -171,7 +214,7 @@ class FusedLayerNorm(nn.Module):
     Handle a layer normalization, like torch.nn.LayerNorm_.
 
     This implementation should be measurably faster than the default PyTorch layernorm (as of PyTorch 1.9),
-    both for training and inference worloads.
+    both for training and inference worloads. CPU inputs use a fused C++ kernel when it is available.
 
     .. NOTE: Computations under Torch AMP are kept as float32 by default, one can change this to be float16
         by setting the flag `xformers.triton.k_layer_norm._triton_layernorm_fp16_enabled = True`
@@ -212,6 +255,9 @@ def layer_norm(
 
     r"""Applies normalization over a mini batch of inputs"""
 
+    if _use_cpu_kernel(x, weight, bias):
+        return _LayerNormCPU.apply(x, weight, bias, eps)
+
     try:
         if (
             not _triton_registered_warnings
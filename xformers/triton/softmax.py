@@ -11,6 +11,7 @@ import torch
 import triton
 from torch.cuda.amp import custom_bwd, custom_fwd
 
+from xformers.ops.common import BaseOperator, get_xformers_operator, register_operator
 from xformers.triton.k_softmax import _softmax, _softmax_backward
 
 # CREDITS: This is adapted from the vanilla Triton example. See https://openai.com/blog/triton/
@@ -24,6 +25,50 @@ _triton_softmax_fp16_enabled = False  # NOTE: PyTorch keeps softmax as fp32
 _triton_registered_warnings = False
 
 
+@register_operator
+class FusedSoftmaxOp(BaseOperator):
+    OPERATOR = get_xformers_operator("fused_softmax")
+    OPERATOR_CATEGORY = "softmax"
+    NAME = "fused_softmax"
+
+
+@register_operator
+class FusedSoftmaxBwOp(BaseOperator):
+    OPERATOR = get_xformers_operator("fused_softmax_backward")
+    OPERATOR_CATEGORY = "softmax"
+    NAME = "fused_softmax_backward"
+
+
+def _use_cpu_kernel(x: torch.Tensor, mask: Optional[torch.Tensor]) -> bool:
+    return (
+        x.device.type == "cpu"
+        and x.ndim >= 2
+        and (mask is None or (mask.ndim == 2 and mask.shape == x.shape[-2:]))
+        and FusedSoftmaxOp.is_available()
+        and FusedSoftmaxBwOp.is_available()
+    )
+
+
+class _softmax_cpu(torch.autograd.Function):
+    @staticmethod
+    # type: ignore
+    def forward(ctx, x, mask, log_outputs, causal):
+        y = FusedSoftmaxOp.OPERATOR(x, mask, log_outputs, causal)
+        ctx.save_for_backward(y)
+        ctx.log_outputs = log_outputs
+        ctx.causal = causal
+        return y
+
+    @staticmethod
+    # type: ignore
+    def backward(ctx, grad_out):
+        (out,) = ctx.saved_tensors
+        grad_in = FusedSoftmaxBwOp.OPERATOR(
+            grad_out, out, ctx.log_outputs, ctx.causal
+        )
+        return grad_in, None, None, None
+
+
 # Helper to handle the SPMD launch grid and error cases
 class _softmax_triton(torch.autograd.Function):
     @staticmethod
@@ -175,9 +220,13 @@ def _softmax_dispatch(
     # - CUDA
     # - there's enough data to make it faster than pytorch. This could change over time, Triton is improving
     # - there was no previous failure
+    # On CPU, a C++ kernel fuses the mask and skips the causal part of the rows
 
     global _triton_registered_warnings
 
+    if _use_cpu_kernel(x, mask):
+        return _softmax_cpu.apply(x, mask, log, causal)
+
     try:
         if torch.cuda.is_available() and x.is_cuda and not _triton_registered_warnings:
             return _softmax_triton.apply(x, mask, log, causal)